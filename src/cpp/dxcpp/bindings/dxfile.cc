@@ -100,8 +100,6 @@ namespace dx {
   void DXFile::reset_data_processing_() {
     flush(); // flush will call reset_buffer_() as well
     stopLinearQuery();
-    countThreadsWaitingOnConsume = 0;
-    countThreadsNotWaitingOnConsume = 0;
   }
 
   void DXFile::reset_everything_() {
@@ -320,21 +318,10 @@ namespace dx {
     /* This function ensures that all pending requests are executed and all
      * worker thread are closed after that
      * Brief notes about functioning:
-     * --> uploadPartRequestsQueue.size() == 0, ensures that request queue is empty, i.e.,
-     *     some worker has picked the last request (note we use term "pick", because
-     *     the request might still be executing the request).
-     * --> Once we know that request queue is empty, we issue interrupt() to all threads
-     *     Note: interrupt() will only terminate threads, which are waiting on new request.
-     *           So only threads which are blocked by .consume() operation will be terminated
-     *           immediately.
-     * --> Now we use a condition based on two interleaved counters to wait until all the
-     *     threads have finished the execution. (see writeChunk_() for understanding their usage)
-     * --> Once we are sure that all threads have finished the requests, we join() them.
-     *     Since interrupt() was already issued, thus join() terminates them instantly.
-     *     Note: Most of them would have been already terminated (since after issuing
-     *           interrupt(), they will be terminated when they start waiting on consume()).
-     *           It's ok to join() terminated threads.
-     * --> We clear the thread pool (vector), and reset the counters.
+     * --> close() the request queue: worker threads keep picking requests from it
+     *     until it is empty, and then exit (consume() throws QueueClosed).
+     * --> Once they have all exited, we join() them, clear the thread pool (vector),
+     *     and reopen() the queue for the next series of requests.
      */
 
     if (writeThreads.size() == 0) {
@@ -342,78 +329,33 @@ namespace dx {
       assert(uploadPartRequestsQueue.size() == 0);
       return; // Nothing to do (no thread has been started)
     }
-    // To avoid race condition
-    // particularly the case when produce() has been called, but thread is still waiting on consume()
-    // we don't want to incorrectly issue interrupt() that time
-    while (uploadPartRequestsQueue.size() != 0) {
-#if !WINDOWS_BUILD
-      usleep(100);
-#else
-      boost::this_thread::sleep(boost::posix_time::microseconds(100));
-#endif
-    }
-
-    for (unsigned i = 0; i < writeThreads.size(); ++i)
-      writeThreads[i].interrupt();
-
-    boost::mutex::scoped_lock cl(countThreadsMutex);
-    cl.unlock();
-    while (true) {
-      cl.lock();
-      if ((countThreadsNotWaitingOnConsume == 0) &&
-          (countThreadsWaitingOnConsume == (int) writeThreads.size())) {
-        cl.unlock();
-        break;
-      }
-      cl.unlock();
-#if !WINDOWS_BUILD
-      usleep(100);
-#else
-      boost::this_thread::sleep(boost::posix_time::microseconds(100));
-#endif
-    }
-
+    uploadPartRequestsQueue.close();
     for (unsigned i = 0; i < writeThreads.size(); ++i)
       writeThreads[i].join();
 
     writeThreads.clear();
-    // Reset the counts
-    countThreadsWaitingOnConsume = 0;
-    countThreadsNotWaitingOnConsume = 0;
+    uploadPartRequestsQueue.reopen();
   }
 
   // This function is what each of the worker thread executes
   void DXFile::writeChunk_() {
     try {
-      boost::mutex::scoped_lock cl(countThreadsMutex);
-      cl.unlock();
       /* This function is executed throughout the lifetime of an addRows worker thread
        * Brief note about various constructs used in the function:
        * --> uploadPartRequestsQueue.consume() will block if no pending requests to be
-       *     executed are available.
+       *     executed are available, and throw QueueClosed once the queue is closed and
+       *     empty (see joinAllWriteThreads_()).
        * --> uploadPart() does the actual upload of rows.
-       * --> We use two interleaved counters (countThread{NOT}WaitingOnConsume) to
-       *     know when it is safe to terminate the threads (see joinAllWriteThreads_()).
-       *     We want to terminate only when thread is waiting on .consume(), and not
-       *     when gtableAddRows() is being executed.
        */
-       // See C++11 working draft for details about atomics (used for counters)
-       // http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2012/n3337.pdf
       while (true) {
-        cl.lock();
-        countThreadsWaitingOnConsume++;
-        cl.unlock();
         pair<string, int> elem = uploadPartRequestsQueue.consume();
-        cl.lock();
-        countThreadsNotWaitingOnConsume++;
-        countThreadsWaitingOnConsume--;
-        cl.unlock();
         uploadPart(elem.first.data(), elem.first.size(), elem.second);
-        cl.lock();
-        countThreadsNotWaitingOnConsume--;
-        cl.unlock();
       }
     }
+    catch (const QueueClosed &qc)
+    {
+      return;
+    }
     catch (const boost::thread_interrupted &ti)
     {
       return;
@@ -428,9 +370,6 @@ namespace dx {
    */
   void DXFile::createWriteThreads_() {
     if (writeThreads.size() == 0) {
-      //reset counters if no previous threads exist
-      countThreadsWaitingOnConsume = 0;
-      countThreadsNotWaitingOnConsume = 0;
       uploadPartRequestsQueue.setCapacity(max_write_threads_);
       for (int i = 0; i < max_write_threads_; ++i) {
         writeThreads.push_back(boost::thread(boost::bind(&DXFile::writeChunk_, this)));
@@ -492,7 +431,10 @@ namespace dx {
       input_params["index"] = index;
   
     int MAX_TRIES = 5;
-    
+
+    // Computed once, rather than on every try
+    const string contentMD5 = getHexifiedMD5(reinterpret_cast<const unsigned char*>(ptr), n);
+
     for (int tries = 1; true; ++tries) {
       // we exit this loop in one of the two cases:
       //  1) Total number of tries are exhausted (in which case we "throw")
@@ -506,7 +448,7 @@ namespace dx {
       
       req_headers["Content-Length"] = boost::lexical_cast<string>(n);
       req_headers["Content-Type"] = ""; // this is necessary because libcurl otherwise adds "Content-Type: application/x-www-form-urlencoded"
-      req_headers["Content-MD5"] = getHexifiedMD5(reinterpret_cast<const unsigned char*>(ptr), n); // Add the content MD5 header 
+      req_headers["Content-MD5"] = contentMD5; // Add the content MD5 header
       HttpRequest resp2;
       try {
         DXLOG(logDEBUG) << "In uploadPart(), index = " << index << ", calling makeHTTPRequestForFileReadAndWrite() ...";
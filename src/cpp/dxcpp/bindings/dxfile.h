@@ -166,13 +166,6 @@ namespace dx {
     int64_t max_buf_size_;
     int max_write_threads_;
 
-    // To allow interleaving (without compiler optimization possibly changing order)
-    // we use std::atomic (a c++11 feature)
-    // Ref https://parasol.tamu.edu/bjarnefest/program/boehm-slides.pdf (page 7)
-    // Update: Since CLang does not support atomics yet, we are using locking 
-    //         mechanism with alongwith volatile
-    volatile int countThreadsWaitingOnConsume, countThreadsNotWaitingOnConsume;
-    boost::mutex countThreadsMutex;
     std::vector<boost::thread> writeThreads;
     static const int DEFAULT_WRITE_THREADS = 5;
     static const int64_t DEFAULT_BUFFER_MAXSIZE = 100 * 1024 * 1024; // 100 MB
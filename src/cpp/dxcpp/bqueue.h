@@ -17,89 +17,439 @@
 #ifndef UA_BQUEUE_H
 #define UA_BQUEUE_H
 
-#include <queue>
+#include <algorithm>
+#include <cstddef>
+#include <stdint.h>
+#include <stdexcept>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
+#include <boost/utility.hpp>
 
 namespace dx {
   /**
-   * A synchronized, blocking queue of chunks. This provides a way for chunks to be passed between
-   * worker threads.
+   * Statistics of a BlockingQueue (see BlockingQueue::enableStats())
+   */
+  struct BlockingQueueStats {
+    /* Chunks produced, and consumed, since the statistics were enabled */
+    uint64_t produced;
+    uint64_t consumed;
+
+    /* Largest number of chunks in the queue at once */
+    size_t highWater;
+
+    /*
+     * Total time (in microseconds, summed over all threads) spent blocked by
+     * producers because the queue was full, and by consumers because it was
+     * empty, and how many times they blocked
+     */
+    int64_t producersBlockedUs;
+    int64_t consumersBlockedUs;
+    uint64_t producerBlocks;
+    uint64_t consumerBlocks;
+
+    /* Time since the statistics were enabled (microseconds) */
+    int64_t elapsedUs;
+
+    BlockingQueueStats() : produced(0), consumed(0), highWater(0), producersBlockedUs(0), consumersBlockedUs(0),
+                           producerBlocks(0), consumerBlocks(0), elapsedUs(0) {
+    }
+  };
+
+  /**
+   * Thrown by BlockingQueue operations once the queue is closed: by produce()
+   * right away, and by consume() once the items left in the queue have all
+   * been consumed.
+   */
+  class QueueClosed : public std::runtime_error {
+  public:
+    QueueClosed() : std::runtime_error("The queue is closed") {
+    }
+  };
+
+  /**
+   * A synchronized, blocking queue of chunks, for any number of producers and
+   * consumers. This provides a way for chunks to be passed between worker
+   * threads.
    *
    * The 'produce' operation is used to insert a chunk into the queue. This operation blocks if the
    * capacity of the queue has been reached.
    *
    * The 'consume' operation is used to obtain a remove a chunk from the queue, returning it to the
-   * consumer. This operation blocks if there are no chunks in the queue.
+   * consumer. This operation blocks if there are no chunks in the queue; 'tryConsume' is its
+   * non-blocking variant, which returns false if the queue is empty, and 'consumeFor' its timed
+   * variant. 'produceAll' and 'consumeBatch' move several chunks at once.
+   *
+   * 'close' ends the stream of chunks: further produce operations throw QueueClosed, and consume
+   * operations return the chunks left in the queue, then throw QueueClosed (so that consumers
+   * drain the queue, and then exit); 'reopen' undoes it.
+   *
+   * The chunks are kept in a ring buffer: a fixed one if the queue is bounded (no allocation once
+   * the capacity is set), or one which grows as needed otherwise. Each operation holds the lock for
+   * a few instructions only, and wakes up a single waiting thread (and only if one is waiting), so
+   * that a chunk does not wake up every worker thread blocked on the queue. All the blocking
+   * operations are interruption points (boost::thread::interrupt()).
+   *
+   * 'enableStats' makes the queue count the chunks passed through it, and the time producers and
+   * consumers spend blocked (see BlockingQueueStats); the clock is only read when a thread
+   * actually blocks, and nothing is counted until then.
    */
   template<typename T>
-  class BlockingQueue {
+  class BlockingQueue : boost::noncopyable {
   public:
 
-    BlockingQueue(int capacity_ = -1) : capacity(capacity_) {
+    BlockingQueue(int capacity_ = -1) : capacity(-1), head(0), count(0), closed(false),
+                                        waitingProducers(0), waitingConsumers(0), waitingUntilEmpty(0), statsEnabled(false) {
+      setCapacity(capacity_);
     }
 
+    /* Sets the capacity (-1 for an unbounded queue); not to be called while the queue is in use */
     void setCapacity(int capacity_);
     int getCapacity() const;
+
     void produce(T chunk);
+    void produceAll(const std::vector<T> &chunks);
+
     T consume();
+    bool tryConsume(T &chunk);
+    bool consumeFor(T &chunk, const boost::posix_time::time_duration &timeout);
+    size_t consumeBatch(std::vector<T> &chunks, size_t maxChunks);
+
+    void close();
+    void reopen();
+    bool isClosed() const;
+
+    /* Blocks until the queue is empty (all the chunks in it have been consumed) */
+    void waitUntilEmpty();
 
     size_t size() const;
     bool empty() const;
-    
+
+    /* Starts (or restarts) counting statistics, and returns them */
+    void enableStats();
+    BlockingQueueStats getStats() const;
+
   private:
 
+    bool full() const {
+      return (capacity != -1 && count >= (size_t) capacity);
+    }
+
+    /* The following are called with "mut" locked (wake*() unlock it) */
+    void push(const T &chunk);
+    T pop();
+    void wakeProducers(boost::unique_lock<boost::mutex> &lock, size_t n);
+    void wakeConsumers(boost::unique_lock<boost::mutex> &lock, size_t n);
+    void wait(boost::condition_variable &cond, int &waiters, boost::unique_lock<boost::mutex> &lock);
+    void blocked(boost::condition_variable &cond, const boost::posix_time::ptime &since);
+    void produced(size_t n);
+    void consumed(size_t n);
+    void waitToProduce(boost::unique_lock<boost::mutex> &lock);
+
     /* The capacity of the queue, or -1 if the capacity is unbounded. */
     int capacity;
 
-    /* The underlying queue. */
-    std::queue<T> chunks;
-    
-    boost::mutex mut;
+    /* The ring buffer: "count" chunks, starting at index "head" */
+    std::vector<T> ring;
+    size_t head;
+    size_t count;
+
+    bool closed;
+
+    int waitingProducers;
+    int waitingConsumers;
+    int waitingUntilEmpty;
+
+    bool statsEnabled;
+    boost::posix_time::ptime statsStart;
+    BlockingQueueStats stats;
+
+    mutable boost::mutex mut;
     boost::condition_variable canProduce;
     boost::condition_variable canConsume;
+    boost::condition_variable isEmpty;
   };
 
   template<typename T> void BlockingQueue<T>::setCapacity(int capacity_) {
+    boost::unique_lock<boost::mutex> lock(mut);
+    std::vector<T> chunks;
+    chunks.reserve(count);
+    while (count > 0) {
+      chunks.push_back(pop());
+    }
     capacity = capacity_;
+    ring.assign((capacity != -1) ? std::max<size_t>(capacity, 1) : 16, T());
+    head = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      push(chunks[i]);
+    }
   }
 
   template<typename T> int BlockingQueue<T>::getCapacity() const {
+    boost::unique_lock<boost::mutex> lock(mut);
     return capacity;
   }
 
+  template<typename T> void BlockingQueue<T>::push(const T &chunk) {
+    if (count == ring.size()) {
+      // Unbounded queue (or a bounded one filled by setCapacity()): make room
+      std::vector<T> larger(ring.size() * 2);
+      for (size_t i = 0; i < count; ++i) {
+        larger[i] = ring[(head + i) % ring.size()];
+      }
+      ring.swap(larger);
+      head = 0;
+    }
+    ring[(head + count) % ring.size()] = chunk;
+    ++count;
+  }
+
+  template<typename T> T BlockingQueue<T>::pop() {
+    T chunk = ring[head];
+    ring[head] = T();
+    head = (head + 1) % ring.size();
+    --count;
+    return chunk;
+  }
+
+  /*
+   * Wakes up as many producers as there is room for n more chunks, after
+   * unlocking "lock" (so that they do not wake up only to wait for it)
+   */
+  template<typename T> void BlockingQueue<T>::wakeProducers(boost::unique_lock<boost::mutex> &lock, size_t n) {
+    const size_t toWake = std::min(n, (size_t) waitingProducers);
+    const bool wakeUntilEmpty = (count == 0 && waitingUntilEmpty > 0);
+    lock.unlock();
+    for (size_t i = 0; i < toWake; ++i) {
+      canProduce.notify_one();
+    }
+    if (wakeUntilEmpty) {
+      isEmpty.notify_all();
+    }
+  }
+
+  /* Wakes up as many consumers as there are n new chunks, after unlocking "lock" */
+  template<typename T> void BlockingQueue<T>::wakeConsumers(boost::unique_lock<boost::mutex> &lock, size_t n) {
+    const size_t toWake = std::min(n, (size_t) waitingConsumers);
+    lock.unlock();
+    for (size_t i = 0; i < toWake; ++i) {
+      canConsume.notify_one();
+    }
+  }
+
+  template<typename T> void BlockingQueue<T>::wait(boost::condition_variable &cond, int &waiters,
+                                                    boost::unique_lock<boost::mutex> &lock) {
+    const boost::posix_time::ptime since = (statsEnabled) ? boost::posix_time::microsec_clock::universal_time()
+                                                          : boost::posix_time::ptime();
+    ++waiters;
+    try {
+      cond.wait(lock);
+    } catch (...) {
+      // Interrupted: pass on the notification this thread may have received
+      --waiters;
+      cond.notify_one();
+      throw;
+    }
+    --waiters;
+    if (statsEnabled) {
+      blocked(cond, since);
+    }
+  }
+
+  /* Accounts for a thread blocked on "cond" since "since" (called with "mut" locked) */
+  template<typename T> void BlockingQueue<T>::blocked(boost::condition_variable &cond, const boost::posix_time::ptime &since) {
+    if (since.is_not_a_date_time()) {
+      return;  // stats were enabled while the thread was waiting
+    }
+    const int64_t us = (boost::posix_time::microsec_clock::universal_time() - since).total_microseconds();
+    if (&cond == &canProduce) {
+      stats.producersBlockedUs += us;
+      ++stats.producerBlocks;
+    } else if (&cond == &canConsume) {
+      stats.consumersBlockedUs += us;
+      ++stats.consumerBlocks;
+    }
+  }
+
+  template<typename T> void BlockingQueue<T>::produced(size_t n) {
+    if (statsEnabled) {
+      stats.produced += n;
+      stats.highWater = std::max(stats.highWater, count);
+    }
+  }
+
+  template<typename T> void BlockingQueue<T>::consumed(size_t n) {
+    if (statsEnabled) {
+      stats.consumed += n;
+    }
+  }
+
+  template<typename T> void BlockingQueue<T>::waitToProduce(boost::unique_lock<boost::mutex> &lock) {
+    while (full() && !closed) {
+      wait(canProduce, waitingProducers, lock);
+    }
+    if (closed) {
+      throw QueueClosed();
+    }
+  }
+
   template<typename T> void BlockingQueue<T>::produce(T chunk) {
-    {
-      boost::unique_lock<boost::mutex> lock(mut);
-      if (capacity != -1) {
-        while (chunks.size() == (size_t) capacity) {
-          canProduce.wait(lock);
-        }
+    boost::unique_lock<boost::mutex> lock(mut);
+    waitToProduce(lock);
+    push(chunk);
+    produced(1);
+    wakeConsumers(lock, 1);
+  }
+
+  template<typename T> void BlockingQueue<T>::produceAll(const std::vector<T> &chunks) {
+    boost::unique_lock<boost::mutex> lock(mut);
+    size_t i = 0;
+    while (i < chunks.size()) {
+      if (!lock.owns_lock()) {
+        lock.lock();
+      }
+      waitToProduce(lock);
+      size_t n = 0;
+      for (; i < chunks.size() && !full(); ++i, ++n) {
+        push(chunks[i]);
       }
-      chunks.push(chunk);
+      produced(n);
+      wakeConsumers(lock, n);
     }
-    canConsume.notify_all();
   }
 
   template<typename T> T BlockingQueue<T>::consume() {
-    T chunk;
-    {
-      boost::unique_lock<boost::mutex> lock(mut);
-      while (chunks.empty()) {
-        canConsume.wait(lock);
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (count == 0) {
+      if (closed) {
+        throw QueueClosed();
       }
-      chunk = chunks.front();
-      chunks.pop();
+      wait(canConsume, waitingConsumers, lock);
     }
-    canProduce.notify_all();
+    T chunk = pop();
+    consumed(1);
+    wakeProducers(lock, 1);
     return chunk;
   }
 
+  template<typename T> bool BlockingQueue<T>::tryConsume(T &chunk) {
+    boost::unique_lock<boost::mutex> lock(mut);
+    if (count == 0) {
+      return false;
+    }
+    chunk = pop();
+    consumed(1);
+    wakeProducers(lock, 1);
+    return true;
+  }
+
+  /*
+   * Same as consume(), but gives up after "timeout": returns false if no
+   * chunk could be consumed by then
+   */
+  template<typename T> bool BlockingQueue<T>::consumeFor(T &chunk, const boost::posix_time::time_duration &timeout) {
+    const boost::system_time deadline = boost::get_system_time() + timeout;
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (count == 0) {
+      if (closed) {
+        throw QueueClosed();
+      }
+      const boost::posix_time::ptime since = (statsEnabled) ? boost::posix_time::microsec_clock::universal_time()
+                                                            : boost::posix_time::ptime();
+      ++waitingConsumers;
+      bool notified;
+      try {
+        notified = canConsume.timed_wait(lock, deadline);
+      } catch (...) {
+        --waitingConsumers;
+        canConsume.notify_one();
+        throw;
+      }
+      --waitingConsumers;
+      if (statsEnabled) {
+        blocked(canConsume, since);
+      }
+      if (!notified && count == 0) {
+        return false;
+      }
+    }
+    chunk = pop();
+    consumed(1);
+    wakeProducers(lock, 1);
+    return true;
+  }
+
+  /*
+   * Blocks until the queue is not empty, then consumes (appends to "chunks")
+   * as many chunks as are in the queue, up to maxChunks (at least 1); returns
+   * how many were consumed
+   */
+  template<typename T> size_t BlockingQueue<T>::consumeBatch(std::vector<T> &chunks, size_t maxChunks) {
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (count == 0) {
+      if (closed) {
+        throw QueueClosed();
+      }
+      wait(canConsume, waitingConsumers, lock);
+    }
+    size_t n = 0;
+    for (; n < std::max<size_t>(maxChunks, 1) && count > 0; ++n) {
+      chunks.push_back(pop());
+    }
+    consumed(n);
+    wakeProducers(lock, n);
+    return n;
+  }
+
+  template<typename T> void BlockingQueue<T>::close() {
+    boost::unique_lock<boost::mutex> lock(mut);
+    closed = true;
+    canProduce.notify_all();
+    canConsume.notify_all();
+  }
+
+  template<typename T> void BlockingQueue<T>::reopen() {
+    boost::unique_lock<boost::mutex> lock(mut);
+    closed = false;
+  }
+
+  template<typename T> bool BlockingQueue<T>::isClosed() const {
+    boost::unique_lock<boost::mutex> lock(mut);
+    return closed;
+  }
+
+  template<typename T> void BlockingQueue<T>::waitUntilEmpty() {
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (count > 0) {
+      wait(isEmpty, waitingUntilEmpty, lock);
+    }
+  }
+
   template<typename T> size_t BlockingQueue<T>::size() const {
-    return chunks.size();
+    boost::unique_lock<boost::mutex> lock(mut);
+    return count;
   }
 
   template<typename T> bool BlockingQueue<T>::empty() const {
-    return chunks.empty();
+    boost::unique_lock<boost::mutex> lock(mut);
+    return (count == 0);
+  }
+
+  template<typename T> void BlockingQueue<T>::enableStats() {
+    boost::unique_lock<boost::mutex> lock(mut);
+    stats = BlockingQueueStats();
+    stats.highWater = count;
+    statsStart = boost::posix_time::microsec_clock::universal_time();
+    statsEnabled = true;
+  }
+
+  template<typename T> BlockingQueueStats BlockingQueue<T>::getStats() const {
+    boost::unique_lock<boost::mutex> lock(mut);
+    BlockingQueueStats current = stats;
+    if (statsEnabled) {
+      current.elapsedUs = (boost::posix_time::microsec_clock::universal_time() - statsStart).total_microseconds();
+    }
+    return current;
   }
 }
 
@@ -0,0 +1,239 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#if !WINDOWS_BUILD
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/resource.h>
+#endif
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include "file_reader.h"
+
+using namespace std;
+
+namespace dx {
+  // Bounds on the default number of cached descriptors (the UA also needs
+  // descriptors for its sockets, so we only take a fraction of RLIMIT_NOFILE)
+  const unsigned MIN_OPEN_FILES = 4;
+  const unsigned MAX_OPEN_FILES = 256;
+
+  static unsigned defaultMaxOpenFiles() {
+#if !WINDOWS_BUILD
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+      rlim_t n = rl.rlim_cur / 4;
+      if (n < MIN_OPEN_FILES) return MIN_OPEN_FILES;
+      if (n > MAX_OPEN_FILES) return MAX_OPEN_FILES;
+      return (unsigned) n;
+    }
+#endif
+    return MAX_OPEN_FILES;
+  }
+
+  FileReader::FileReader(unsigned maxOpenFiles_)
+    : maxOpenFiles((maxOpenFiles_ > 0) ? maxOpenFiles_ : defaultMaxOpenFiles()) {
+  }
+
+  FileReader::~FileReader() {
+#if !WINDOWS_BUILD
+    for (map<string, OpenFile>::iterator it = openFiles.begin(); it != openFiles.end(); ++it) {
+      ::close(it->second.fd);
+    }
+#endif
+  }
+
+#if WINDOWS_BUILD
+  void FileReader::read(const string &path, int64_t offset, int64_t len, char *buf, int64_t, bool) {
+    if (len <= 0) {
+      return;
+    }
+    // For windows we use fseeko64() & fread(): since we
+    // compile a 32bit UA version, and standard library functions
+    // do not allow to read > 2GB locations in file
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+      ostringstream msg;
+      msg << "file('" << path << "') cannot be opened for reading (errno=" << errno << ")";
+      throw runtime_error(msg.str());
+    }
+    if (fseeko64(fp, off64_t(offset), SEEK_SET) != 0) {
+      ostringstream msg;
+      msg << "unable to seek to location '" << off64_t(offset) << "' in the file '" << path
+          << "' (errno=" << errno << ")";
+      fclose(fp);
+      throw runtime_error(msg.str());
+    }
+    size_t bytesRead = fread(buf, 1, len, fp);
+    int errflg = ferror(fp); // get error status before we close the file handler
+    fclose(fp);
+    if (errflg || int64_t(bytesRead) != len) {
+      ostringstream msg;
+      msg << "unable to read '" << len << "' bytes from location '" << off64_t(offset) << "' in the file '"
+          << path << "' (errno=" << errno << ", bytes read=" << bytesRead << ")";
+      throw runtime_error(msg.str());
+    }
+  }
+
+  void FileReader::close(const string &) {
+  }
+
+  int FileReader::acquireFd(const string &) {
+    throw runtime_error("FileReader::acquireFd() is not supported on Windows");
+  }
+
+  void FileReader::releaseFd(const string &) {
+  }
+
+  void FileReader::dropPageCache(int, int64_t, int64_t) {
+  }
+#else
+  void FileReader::read(const string &path, int64_t offset, int64_t len, char *buf, int64_t readAhead, bool keepCached) {
+    if (len <= 0) {
+      return;
+    }
+    const int fd = acquireFd(path);
+    int64_t done = 0;
+    int err = 0;
+    while (done < len) {
+      ssize_t n = pread(fd, buf + done, len - done, off_t(offset + done));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        err = errno;
+        break;
+      }
+      if (n == 0) {
+        break; // unexpected end of file
+      }
+      done += n;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    if (done == len) {
+      if (readAhead > 0) {
+        posix_fadvise(fd, off_t(offset + len), off_t(readAhead), POSIX_FADV_WILLNEED);
+      }
+      if (!keepCached) {
+        posix_fadvise(fd, off_t(offset), off_t(len), POSIX_FADV_DONTNEED);
+      }
+    }
+#else
+    (void) readAhead;
+    (void) keepCached;
+#endif
+    releaseFd(path);
+    if (done != len) {
+      ostringstream msg;
+      msg << "unable to read '" << len << "' bytes from location '" << offset << "' in the file '"
+          << path << "' (errno=" << err << ", bytes read=" << done << ")";
+      throw runtime_error(msg.str());
+    }
+  }
+
+  void FileReader::close(const string &path) {
+    boost::mutex::scoped_lock lock(mut);
+    map<string, OpenFile>::iterator it = openFiles.find(path);
+    if (it != openFiles.end() && it->second.readers == 0) {
+      ::close(it->second.fd);
+      lru.erase(it->second.lruPos);
+      openFiles.erase(it);
+    }
+  }
+
+  int FileReader::acquireFd(const string &path) {
+    {
+      boost::mutex::scoped_lock lock(mut);
+      map<string, OpenFile>::iterator it = openFiles.find(path);
+      if (it != openFiles.end()) {
+        it->second.readers++;
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return it->second.fd;
+      }
+    }
+
+    // Open the file without holding the lock (open() can be slow, e.g., on NFS)
+    int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+    flags |= O_CLOEXEC;
+#endif
+    int fd;
+    do {
+      fd = ::open(path.c_str(), flags);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+      ostringstream msg;
+      msg << "file('" << path << "') cannot be opened for reading (errno=" << errno << ")";
+      throw runtime_error(msg.str());
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    boost::mutex::scoped_lock lock(mut);
+    map<string, OpenFile>::iterator it = openFiles.find(path);
+    if (it != openFiles.end()) {
+      // Another thread opened the file in the meantime: use its descriptor
+      ::close(fd);
+      it->second.readers++;
+      lru.splice(lru.begin(), lru, it->second.lruPos);
+      return it->second.fd;
+    }
+    evictIdle(maxOpenFiles - 1);
+    lru.push_front(path);
+    OpenFile &f = openFiles[path];
+    f.fd = fd;
+    f.readers = 1;
+    f.lruPos = lru.begin();
+    return fd;
+  }
+
+  void FileReader::releaseFd(const string &path) {
+    boost::mutex::scoped_lock lock(mut);
+    map<string, OpenFile>::iterator it = openFiles.find(path);
+    if (it != openFiles.end() && it->second.readers > 0) {
+      it->second.readers--;
+    }
+    evictIdle(maxOpenFiles);
+  }
+
+  void FileReader::dropPageCache(int fd, int64_t offset, int64_t len) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, off_t(offset), off_t(len), POSIX_FADV_DONTNEED);
+#else
+    (void) fd; (void) offset; (void) len;
+#endif
+  }
+
+  // Closes least recently used descriptors (which no thread is reading from),
+  // until at most "keep" remain open. Must be called with "mut" held.
+  void FileReader::evictIdle(size_t keep) {
+    list<string>::iterator pos = lru.end();
+    while (openFiles.size() > keep && pos != lru.begin()) {
+      --pos;
+      map<string, OpenFile>::iterator it = openFiles.find(*pos);
+      if (it->second.readers > 0) {
+        continue;
+      }
+      ::close(it->second.fd);
+      openFiles.erase(it);
+      pos = lru.erase(pos);
+    }
+  }
+#endif
+}
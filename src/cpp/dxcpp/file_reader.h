@@ -0,0 +1,97 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef __DXCPP_FILE_READER_H__
+#define __DXCPP_FILE_READER_H__
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace dx {
+  /** @internal
+   *
+   * Reads byte ranges of local files (used by the chunk readers of the
+   * Upload Agent, and dx-verify-file).
+   *
+   * File descriptors are cached, and shared by all the threads, so that a
+   * file is opened once rather than once per chunk; reads are positional
+   * (pread), so threads never contend on a shared file offset. At most
+   * maxOpenFiles descriptors are kept open: when the limit is reached, the
+   * least recently used ones (which are not being read from) are closed.
+   *
+   * Where posix_fadvise() is available, files are marked for sequential
+   * access, the range following each read is prefetched (WILLNEED), and the
+   * pages just read are dropped from the page cache (DONTNEED), since we
+   * never read them again (so that uploading a huge file does not evict
+   * everything else from the page cache).
+   *
+   * On Windows, every read opens the file with fopen() (no caching).
+   */
+  class FileReader : boost::noncopyable {
+  public:
+
+    // maxOpenFiles_ = 0 picks a limit based on RLIMIT_NOFILE
+    explicit FileReader(unsigned maxOpenFiles_ = 0);
+    ~FileReader();
+
+    // Reads exactly "len" bytes at "offset" of the file "path" into "buf", and
+    // hints the kernel that the next "readAhead" bytes will be read soon. If
+    // "keepCached" is true, the range is not dropped from the page cache (for
+    // callers which read it again shortly).
+    // Throws std::runtime_error on failure (including a short read).
+    void read(const std::string &path, int64_t offset, int64_t len, char *buf, int64_t readAhead = 0, bool keepCached = false);
+
+    // Closes the cached descriptor of "path" (if it is not being read from)
+    void close(const std::string &path);
+
+    unsigned getMaxOpenFiles() const { return maxOpenFiles; }
+
+    // Returns the (cached) descriptor of "path", which stays open at least
+    // until the matching releaseFd(path) call; for callers doing their own
+    // I/O on the descriptor (e.g., asynchronous reads). Not supported on Windows.
+    int acquireFd(const std::string &path);
+    void releaseFd(const std::string &path);
+
+    // Drops a range of a file, which was read using a descriptor returned by
+    // acquireFd(), from the page cache (where supported)
+    void dropPageCache(int fd, int64_t offset, int64_t len);
+
+  private:
+
+    struct OpenFile {
+      int fd;
+      unsigned readers;
+      std::list<std::string>::iterator lruPos;
+    };
+
+    void evictIdle(size_t keep);
+
+    unsigned maxOpenFiles;
+
+    // Cached descriptors, and their paths ordered from most to least recently used
+    std::map<std::string, OpenFile> openFiles;
+    std::list<std::string> lru;
+
+    boost::mutex mut;
+  };
+}
+
+#endif
@@ -0,0 +1,413 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "md5_multi.h"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+// The SIMD engines are written with the vector extensions of GCC (and
+// clang), and compiled for each instruction set with target attributes, so
+// that the rest of the code base does not need to be built with -mavx2 etc.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  #define DX_MD5_SIMD 1
+#endif
+
+namespace dx {
+
+#ifdef DX_MD5_SIMD
+
+  typedef uint32_t u32x4 __attribute__((vector_size(16)));
+  typedef uint32_t u32x8 __attribute__((vector_size(32)));
+  typedef uint32_t u32x16 __attribute__((vector_size(64)));
+
+  static const size_t MD5_BLOCK_SIZE = 64;
+
+  static const uint32_t MD5_INIT[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+  #define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+  #define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+  #define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+  #define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+  #define MD5_STEP(f, a, b, c, d, k, t, s) \
+    a += f(b, c, d) + X[k] + (uint32_t) t; \
+    a = ((a << s) | (a >> (32 - s))) + b;
+
+  /*
+   * Runs the MD5 compression function on one block per lane: blocks[j] is
+   * the 64-byte block of lane j, and state[i][j] word i of its state. V is
+   * a vector of L 32-bit words (or uint32_t itself, with L = 1).
+   *
+   * Always inlined, so that it is compiled for the instruction set of the
+   * engine it is called from (see md5Sse2() etc.)
+   */
+  template <typename V, unsigned L>
+  static inline __attribute__((always_inline))
+  void md5Blocks(uint32_t (*state)[L], const unsigned char * const *blocks) {
+    // Transpose the blocks, so that X[k] holds word k of every lane
+    uint32_t words[16][L] __attribute__((aligned(64)));
+    for (unsigned j = 0; j < L; ++j) {
+      uint32_t block[16];
+      memcpy(block, blocks[j], MD5_BLOCK_SIZE);
+      for (unsigned k = 0; k < 16; ++k) {
+        words[k][j] = block[k];
+      }
+    }
+    V X[16];
+    for (unsigned k = 0; k < 16; ++k) {
+      memcpy(&X[k], words[k], sizeof(V));
+    }
+    V a, b, c, d;
+    memcpy(&a, state[0], sizeof(V));
+    memcpy(&b, state[1], sizeof(V));
+    memcpy(&c, state[2], sizeof(V));
+    memcpy(&d, state[3], sizeof(V));
+    const V a0 = a, b0 = b, c0 = c, d0 = d;
+
+    MD5_STEP(MD5_F, a, b, c, d, 0, 0xd76aa478, 7)
+    MD5_STEP(MD5_F, d, a, b, c, 1, 0xe8c7b756, 12)
+    MD5_STEP(MD5_F, c, d, a, b, 2, 0x242070db, 17)
+    MD5_STEP(MD5_F, b, c, d, a, 3, 0xc1bdceee, 22)
+    MD5_STEP(MD5_F, a, b, c, d, 4, 0xf57c0faf, 7)
+    MD5_STEP(MD5_F, d, a, b, c, 5, 0x4787c62a, 12)
+    MD5_STEP(MD5_F, c, d, a, b, 6, 0xa8304613, 17)
+    MD5_STEP(MD5_F, b, c, d, a, 7, 0xfd469501, 22)
+    MD5_STEP(MD5_F, a, b, c, d, 8, 0x698098d8, 7)
+    MD5_STEP(MD5_F, d, a, b, c, 9, 0x8b44f7af, 12)
+    MD5_STEP(MD5_F, c, d, a, b, 10, 0xffff5bb1, 17)
+    MD5_STEP(MD5_F, b, c, d, a, 11, 0x895cd7be, 22)
+    MD5_STEP(MD5_F, a, b, c, d, 12, 0x6b901122, 7)
+    MD5_STEP(MD5_F, d, a, b, c, 13, 0xfd987193, 12)
+    MD5_STEP(MD5_F, c, d, a, b, 14, 0xa679438e, 17)
+    MD5_STEP(MD5_F, b, c, d, a, 15, 0x49b40821, 22)
+
+    MD5_STEP(MD5_G, a, b, c, d, 1, 0xf61e2562, 5)
+    MD5_STEP(MD5_G, d, a, b, c, 6, 0xc040b340, 9)
+    MD5_STEP(MD5_G, c, d, a, b, 11, 0x265e5a51, 14)
+    MD5_STEP(MD5_G, b, c, d, a, 0, 0xe9b6c7aa, 20)
+    MD5_STEP(MD5_G, a, b, c, d, 5, 0xd62f105d, 5)
+    MD5_STEP(MD5_G, d, a, b, c, 10, 0x02441453, 9)
+    MD5_STEP(MD5_G, c, d, a, b, 15, 0xd8a1e681, 14)
+    MD5_STEP(MD5_G, b, c, d, a, 4, 0xe7d3fbc8, 20)
+    MD5_STEP(MD5_G, a, b, c, d, 9, 0x21e1cde6, 5)
+    MD5_STEP(MD5_G, d, a, b, c, 14, 0xc33707d6, 9)
+    MD5_STEP(MD5_G, c, d, a, b, 3, 0xf4d50d87, 14)
+    MD5_STEP(MD5_G, b, c, d, a, 8, 0x455a14ed, 20)
+    MD5_STEP(MD5_G, a, b, c, d, 13, 0xa9e3e905, 5)
+    MD5_STEP(MD5_G, d, a, b, c, 2, 0xfcefa3f8, 9)
+    MD5_STEP(MD5_G, c, d, a, b, 7, 0x676f02d9, 14)
+    MD5_STEP(MD5_G, b, c, d, a, 12, 0x8d2a4c8a, 20)
+
+    MD5_STEP(MD5_H, a, b, c, d, 5, 0xfffa3942, 4)
+    MD5_STEP(MD5_H, d, a, b, c, 8, 0x8771f681, 11)
+    MD5_STEP(MD5_H, c, d, a, b, 11, 0x6d9d6122, 16)
+    MD5_STEP(MD5_H, b, c, d, a, 14, 0xfde5380c, 23)
+    MD5_STEP(MD5_H, a, b, c, d, 1, 0xa4beea44, 4)
+    MD5_STEP(MD5_H, d, a, b, c, 4, 0x4bdecfa9, 11)
+    MD5_STEP(MD5_H, c, d, a, b, 7, 0xf6bb4b60, 16)
+    MD5_STEP(MD5_H, b, c, d, a, 10, 0xbebfbc70, 23)
+    MD5_STEP(MD5_H, a, b, c, d, 13, 0x289b7ec6, 4)
+    MD5_STEP(MD5_H, d, a, b, c, 0, 0xeaa127fa, 11)
+    MD5_STEP(MD5_H, c, d, a, b, 3, 0xd4ef3085, 16)
+    MD5_STEP(MD5_H, b, c, d, a, 6, 0x04881d05, 23)
+    MD5_STEP(MD5_H, a, b, c, d, 9, 0xd9d4d039, 4)
+    MD5_STEP(MD5_H, d, a, b, c, 12, 0xe6db99e5, 11)
+    MD5_STEP(MD5_H, c, d, a, b, 15, 0x1fa27cf8, 16)
+    MD5_STEP(MD5_H, b, c, d, a, 2, 0xc4ac5665, 23)
+
+    MD5_STEP(MD5_I, a, b, c, d, 0, 0xf4292244, 6)
+    MD5_STEP(MD5_I, d, a, b, c, 7, 0x432aff97, 10)
+    MD5_STEP(MD5_I, c, d, a, b, 14, 0xab9423a7, 15)
+    MD5_STEP(MD5_I, b, c, d, a, 5, 0xfc93a039, 21)
+    MD5_STEP(MD5_I, a, b, c, d, 12, 0x655b59c3, 6)
+    MD5_STEP(MD5_I, d, a, b, c, 3, 0x8f0ccc92, 10)
+    MD5_STEP(MD5_I, c, d, a, b, 10, 0xffeff47d, 15)
+    MD5_STEP(MD5_I, b, c, d, a, 1, 0x85845dd1, 21)
+    MD5_STEP(MD5_I, a, b, c, d, 8, 0x6fa87e4f, 6)
+    MD5_STEP(MD5_I, d, a, b, c, 15, 0xfe2ce6e0, 10)
+    MD5_STEP(MD5_I, c, d, a, b, 6, 0xa3014314, 15)
+    MD5_STEP(MD5_I, b, c, d, a, 13, 0x4e0811a1, 21)
+    MD5_STEP(MD5_I, a, b, c, d, 4, 0xf7537e82, 6)
+    MD5_STEP(MD5_I, d, a, b, c, 11, 0xbd3af235, 10)
+    MD5_STEP(MD5_I, c, d, a, b, 2, 0x2ad7d2bb, 15)
+    MD5_STEP(MD5_I, b, c, d, a, 9, 0xeb86d391, 21)
+
+    a += a0;
+    b += b0;
+    c += c0;
+    d += d0;
+    memcpy(state[0], &a, sizeof(V));
+    memcpy(state[1], &b, sizeof(V));
+    memcpy(state[2], &c, sizeof(V));
+    memcpy(state[3], &d, sizeof(V));
+  }
+
+  /*
+   * A buffer being hashed by a lane: the whole blocks are read in place,
+   * and the last (partial) block, padding and length are copied to "tail".
+   */
+  struct MD5Lane {
+    size_t job;
+    const unsigned char *data;
+    size_t dataBlocks;
+    unsigned char tail[2 * MD5_BLOCK_SIZE];
+    size_t tailBlocks;
+    size_t tailNext;
+
+    void start(size_t job_, const unsigned char *buf, size_t len) {
+      job = job_;
+      data = buf;
+      dataBlocks = len / MD5_BLOCK_SIZE;
+      const size_t rest = len % MD5_BLOCK_SIZE;
+      tailBlocks = (rest < MD5_BLOCK_SIZE - 8) ? 1 : 2;
+      tailNext = 0;
+      memset(tail, 0, sizeof(tail));
+      if (rest > 0) {
+        memcpy(tail, buf + dataBlocks * MD5_BLOCK_SIZE, rest);
+      }
+      tail[rest] = 0x80;
+      const uint64_t bits = (uint64_t) len * 8;
+      for (int i = 0; i < 8; ++i) {
+        tail[tailBlocks * MD5_BLOCK_SIZE - 8 + i] = (unsigned char) (bits >> (8 * i));
+      }
+    }
+
+    size_t remaining() const {
+      return dataBlocks + tailBlocks - tailNext;
+    }
+
+    const unsigned char *nextBlock() {
+      if (dataBlocks > 0) {
+        const unsigned char *block = data;
+        data += MD5_BLOCK_SIZE;
+        --dataBlocks;
+        return block;
+      }
+      return tail + (tailNext++) * MD5_BLOCK_SIZE;
+    }
+  };
+
+  static const unsigned char IDLE_BLOCK[MD5_BLOCK_SIZE] = {0};
+
+  /*
+   * Hashes the buffers L at a time, refilling lanes as they finish. Once a
+   * single buffer is left, it is finished with the scalar code (idle lanes
+   * would only make it slower).
+   */
+  template <typename V, unsigned L>
+  static inline __attribute__((always_inline))
+  void md5Lanes(const unsigned char * const *bufs, const size_t *lens, size_t n, unsigned char (*digests)[MD5_DIGEST_LENGTH]) {
+    MD5Lane lanes[L];
+    bool active[L];
+    uint32_t state[4][L] __attribute__((aligned(64)));
+    size_t next = 0;
+    for (unsigned j = 0; j < L; ++j) {
+      active[j] = (next < n);
+      if (active[j]) {
+        lanes[j].start(next, bufs[next], lens[next]);
+        ++next;
+      }
+      for (int i = 0; i < 4; ++i) {
+        state[i][j] = MD5_INIT[i];
+      }
+    }
+
+    while (true) {
+      unsigned numActive = 0, last = 0;
+      for (unsigned j = 0; j < L; ++j) {
+        if (active[j]) {
+          ++numActive;
+          last = j;
+        }
+      }
+      if (numActive == 0) {
+        break;
+      }
+      if (numActive == 1 && next == n) {
+        uint32_t single[4][1] = {{state[0][last]}, {state[1][last]}, {state[2][last]}, {state[3][last]}};
+        while (lanes[last].remaining() > 0) {
+          const unsigned char *block = lanes[last].nextBlock();
+          md5Blocks<uint32_t, 1>(single, &block);
+        }
+        for (int i = 0; i < 4; ++i) {
+          memcpy(digests[lanes[last].job] + 4 * i, &single[i][0], 4);
+        }
+        break;
+      }
+
+      const unsigned char *blocks[L];
+      for (unsigned j = 0; j < L; ++j) {
+        blocks[j] = (active[j]) ? lanes[j].nextBlock() : IDLE_BLOCK;
+      }
+      md5Blocks<V, L>(state, blocks);
+
+      for (unsigned j = 0; j < L; ++j) {
+        if (!active[j] || lanes[j].remaining() > 0) {
+          continue;
+        }
+        for (int i = 0; i < 4; ++i) {
+          memcpy(digests[lanes[j].job] + 4 * i, &state[i][j], 4);
+          state[i][j] = MD5_INIT[i];
+        }
+        active[j] = (next < n);
+        if (active[j]) {
+          lanes[j].start(next, bufs[next], lens[next]);
+          ++next;
+        }
+      }
+    }
+  }
+
+  __attribute__((target("sse2")))
+  static void md5Sse2(const unsigned char * const *bufs, const size_t *lens, size_t n, unsigned char (*digests)[MD5_DIGEST_LENGTH]) {
+    md5Lanes<u32x4, 4>(bufs, lens, n, digests);
+  }
+
+  __attribute__((target("avx2")))
+  static void md5Avx2(const unsigned char * const *bufs, const size_t *lens, size_t n, unsigned char (*digests)[MD5_DIGEST_LENGTH]) {
+    md5Lanes<u32x8, 8>(bufs, lens, n, digests);
+  }
+
+  __attribute__((target("avx512f")))
+  static void md5Avx512(const unsigned char * const *bufs, const size_t *lens, size_t n, unsigned char (*digests)[MD5_DIGEST_LENGTH]) {
+    md5Lanes<u32x16, 16>(bufs, lens, n, digests);
+  }
+
+#endif
+
+  bool md5EngineSupported(MD5Engine engine) {
+#ifdef DX_MD5_SIMD
+    __builtin_cpu_init();
+    switch (engine) {
+      case MD5_ENGINE_SSE2: return __builtin_cpu_supports("sse2");
+      case MD5_ENGINE_AVX2: return __builtin_cpu_supports("avx2");
+      case MD5_ENGINE_AVX512: return __builtin_cpu_supports("avx512f");
+      default: break;
+    }
+#endif
+    return (engine == MD5_ENGINE_SCALAR);
+  }
+
+  MD5Engine bestMD5Engine() {
+    static const MD5Engine best =
+      md5EngineSupported(MD5_ENGINE_AVX512) ? MD5_ENGINE_AVX512 :
+      md5EngineSupported(MD5_ENGINE_AVX2) ? MD5_ENGINE_AVX2 :
+      md5EngineSupported(MD5_ENGINE_SSE2) ? MD5_ENGINE_SSE2 : MD5_ENGINE_SCALAR;
+    return best;
+  }
+
+  unsigned md5EngineLanes(MD5Engine engine) {
+    switch (engine) {
+      case MD5_ENGINE_SSE2: return 4;
+      case MD5_ENGINE_AVX2: return 8;
+      case MD5_ENGINE_AVX512: return 16;
+      default: return 1;
+    }
+  }
+
+  const char *md5EngineName(MD5Engine engine) {
+    switch (engine) {
+      case MD5_ENGINE_SSE2: return "sse2";
+      case MD5_ENGINE_AVX2: return "avx2";
+      case MD5_ENGINE_AVX512: return "avx512";
+      default: return "scalar";
+    }
+  }
+
+  void md5MultiBuffer(const unsigned char * const *bufs, const size_t *lens, size_t n,
+                      unsigned char (*digests)[MD5_DIGEST_LENGTH], MD5Engine engine) {
+    if (n == 0) {
+      return;
+    }
+    if (!md5EngineSupported(engine)) {
+      throw runtime_error(string("MD5 engine not supported by this CPU: ") + md5EngineName(engine));
+    }
+#ifdef DX_MD5_SIMD
+    if (n > 1) {
+      switch (engine) {
+        case MD5_ENGINE_SSE2: md5Sse2(bufs, lens, n, digests); return;
+        case MD5_ENGINE_AVX2: md5Avx2(bufs, lens, n, digests); return;
+        case MD5_ENGINE_AVX512: md5Avx512(bufs, lens, n, digests); return;
+        default: break;
+      }
+    }
+#endif
+    for (size_t i = 0; i < n; ++i) {
+      MD5(bufs[i], lens[i], digests[i]);
+    }
+  }
+
+  void md5MultiBuffer(const unsigned char * const *bufs, const size_t *lens, size_t n,
+                      unsigned char (*digests)[MD5_DIGEST_LENGTH]) {
+    md5MultiBuffer(bufs, lens, n, digests, bestMD5Engine());
+  }
+
+  MD5Service::MD5Service(MD5Engine engine_, unsigned maxCombiners_)
+    : engine(engine_), lanes(md5EngineLanes(engine_)), maxCombiners(maxCombiners_), combiners(0) {
+    if (maxCombiners == 0) {
+      maxCombiners = max(1u, boost::thread::hardware_concurrency());
+    }
+  }
+
+  void MD5Service::digest(const unsigned char *ptr, size_t len, unsigned char *md5) {
+    // "request" must stay queued until it is done (which does not take long)
+    boost::this_thread::disable_interruption di;
+    Request request = {ptr, len, md5, false};
+    boost::unique_lock<boost::mutex> lock(mut);
+    pending.push_back(&request);
+    while (!request.done) {
+      if (combiners == maxCombiners || pending.empty()) {
+        requestsDone.wait(lock);
+        continue;
+      }
+      // Hash a batch of the queued requests (not necessarily including ours)
+      vector<Request *> batch;
+      while (!pending.empty() && batch.size() < lanes) {
+        batch.push_back(pending.front());
+        pending.pop_front();
+      }
+      ++combiners;
+      lock.unlock();
+
+      vector<const unsigned char *> bufs(batch.size());
+      vector<size_t> lens(batch.size());
+      vector<unsigned char> digests(batch.size() * MD5_DIGEST_LENGTH);
+      for (size_t i = 0; i < batch.size(); ++i) {
+        bufs[i] = batch[i]->ptr;
+        lens[i] = batch[i]->len;
+      }
+      md5MultiBuffer(&bufs[0], &lens[0], batch.size(), reinterpret_cast<unsigned char (*)[MD5_DIGEST_LENGTH]>(&digests[0]), engine);
+
+      lock.lock();
+      --combiners;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        memcpy(batch[i]->md5, &digests[i * MD5_DIGEST_LENGTH], MD5_DIGEST_LENGTH);
+        batch[i]->done = true;
+      }
+      requestsDone.notify_all();
+    }
+  }
+
+  MD5Service &md5Service() {
+    static MD5Service service;
+    return service;
+  }
+}
@@ -0,0 +1,113 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef __DXCPP_MD5_MULTI_H__
+#define __DXCPP_MD5_MULTI_H__
+
+#include <cstddef>
+#include <deque>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <openssl/md5.h>
+
+namespace dx {
+  /** @internal
+   *
+   * Multi-buffer MD5: MD5 is a serial chain of dependent operations, so a
+   * single buffer cannot be hashed any faster than one 32-bit operation at a
+   * time; but several independent buffers can be hashed together, one per
+   * lane of a SIMD register (4 with SSE2, 8 with AVX2, 16 with AVX-512), for
+   * a throughput several times that of the scalar code on the same core.
+   *
+   * The engine is picked at runtime, based on what the CPU supports; the
+   * scalar engine (OpenSSL's MD5) is used where no SIMD engine is available
+   * (including on non-x86 platforms).
+   */
+  enum MD5Engine {
+    MD5_ENGINE_SCALAR,
+    MD5_ENGINE_SSE2,
+    MD5_ENGINE_AVX2,
+    MD5_ENGINE_AVX512
+  };
+
+  // Returns the fastest engine supported by this CPU
+  MD5Engine bestMD5Engine();
+
+  bool md5EngineSupported(MD5Engine engine);
+
+  // Number of buffers hashed together by an engine
+  unsigned md5EngineLanes(MD5Engine engine);
+
+  const char *md5EngineName(MD5Engine engine);
+
+  // Computes the MD5 digests of the "n" buffers bufs[i] (of lens[i] bytes)
+  // into digests[i]. Any number of buffers can be passed: as soon as a lane
+  // is done with a buffer, it moves on to the next one. "engine" must be
+  // supported by this CPU.
+  void md5MultiBuffer(const unsigned char * const *bufs, const size_t *lens, size_t n,
+                      unsigned char (*digests)[MD5_DIGEST_LENGTH], MD5Engine engine);
+  void md5MultiBuffer(const unsigned char * const *bufs, const size_t *lens, size_t n,
+                      unsigned char (*digests)[MD5_DIGEST_LENGTH]);
+
+  /** @internal
+   *
+   * Computes MD5 digests on behalf of threads which each have a single
+   * buffer to hash (e.g., the part being uploaded by an upload thread),
+   * hashing the buffers of concurrent callers together, in lanes.
+   *
+   * Requests are queued, and the calling threads take turns at hashing
+   * queued requests (their own, and other threads'), up to a batch of
+   * md5EngineLanes() at a time; at most maxCombiners threads do so at the
+   * same time, so buffers get hashed together once there are more callers
+   * than that (a lone caller simply hashes its own buffer).
+   */
+  class MD5Service : boost::noncopyable {
+  public:
+
+    // maxCombiners_ = 0 uses the number of cores
+    explicit MD5Service(MD5Engine engine_ = bestMD5Engine(), unsigned maxCombiners_ = 0);
+
+    // Computes the MD5 digest (MD5_DIGEST_LENGTH bytes) of "len" bytes at "ptr"
+    void digest(const unsigned char *ptr, size_t len, unsigned char *md5);
+
+    MD5Engine getEngine() const { return engine; }
+
+  private:
+
+    struct Request {
+      const unsigned char *ptr;
+      size_t len;
+      unsigned char *md5;
+      bool done;
+    };
+
+    const MD5Engine engine;
+    const unsigned lanes;
+    unsigned maxCombiners;
+
+    boost::mutex mut;
+    boost::condition_variable requestsDone;
+    std::deque<Request *> pending;
+    unsigned combiners;
+  };
+
+  // The MD5Service shared by the whole process (used by getHexifiedMD5())
+  MD5Service &md5Service();
+}
+
+#endif
@@ -0,0 +1,118 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+#include "stage_stats.h"
+
+using namespace std;
+using namespace boost::posix_time;
+
+namespace dx {
+  // A stage whose threads are busy more than this fraction of the time is
+  // saturated; thread counts are suggested so as to bring it to TARGET_UTILIZATION
+  const double SATURATED_UTILIZATION = 0.8;
+  const double IDLE_UTILIZATION = 0.25;
+  const double TARGET_UTILIZATION = 0.75;
+
+  StageStats::StageStats(const string &name_) : name(name_), slots(0), busyUs(0) {
+  }
+
+  void StageStats::start(int slots_, const string &option_) {
+    boost::mutex::scoped_lock lock(mut);
+    slots = slots_;
+    option = option_;
+    busyUs = 0;
+    started = microsec_clock::universal_time();
+  }
+
+  void StageStats::addBusy(int64_t us) {
+    boost::mutex::scoped_lock lock(mut);
+    busyUs += us;
+  }
+
+  int64_t StageStats::getBusyUs() const {
+    boost::mutex::scoped_lock lock(mut);
+    return busyUs;
+  }
+
+  int64_t StageStats::getElapsedUs() const {
+    boost::mutex::scoped_lock lock(mut);
+    return (started.is_not_a_date_time()) ? 0 : (microsec_clock::universal_time() - started).total_microseconds();
+  }
+
+  // Fraction of the time of the stage's threads (over "elapsed" us) represented by "us"
+  static double fraction(int64_t us, int slots, int64_t elapsedUs) {
+    return (slots > 0 && elapsedUs > 0) ? (double) us / ((double) slots * elapsedUs) : 0.0;
+  }
+
+  void writeStageReport(ostream &out, const vector<StageReport> &stages) {
+    out << "Pipeline stages:" << endl
+        << "  " << left << setw(10) << "stage" << right << setw(8) << "threads" << setw(8) << "busy"
+        << setw(10) << "starved" << setw(10) << "blocked" << setw(12) << "queue max" << setw(12) << "chunks/s" << endl;
+    int limiting = -1;
+    double limitingUtilization = 0;
+    vector<double> utilization(stages.size(), 0.0);
+    for (size_t i = 0; i < stages.size(); ++i) {
+      const StageStats &s = *stages[i].stage;
+      const int64_t elapsedUs = s.getElapsedUs();
+      utilization[i] = min(1.0, fraction(s.getBusyUs(), s.getSlots(), elapsedUs));
+      const double starved = (stages[i].input != NULL) ? fraction(stages[i].input->consumersBlockedUs, s.getSlots(), elapsedUs) : 0.0;
+      const double blocked = (stages[i].output != NULL) ? fraction(stages[i].output->producersBlockedUs, s.getSlots(), elapsedUs) : 0.0;
+      out << "  " << left << setw(10) << s.getName() << right << setw(8) << s.getSlots()
+          << fixed << setprecision(0)
+          << setw(7) << (utilization[i] * 100) << "%"
+          << setw(9) << (starved * 100) << "%"
+          << setw(9) << (blocked * 100) << "%";
+      if (stages[i].input != NULL) {
+        out << setw(12) << stages[i].input->highWater
+            << setw(12) << setprecision(2) << ((elapsedUs > 0) ? stages[i].input->consumed * 1e6 / elapsedUs : 0.0);
+      }
+      out << endl;
+      if (limiting < 0 || utilization[i] > limitingUtilization) {
+        limiting = i;
+        limitingUtilization = utilization[i];
+      }
+    }
+    if (limiting < 0) {
+      return;
+    }
+
+    const StageStats &l = *stages[limiting].stage;
+    out << setprecision(0);
+    if (limitingUtilization < SATURATED_UTILIZATION) {
+      out << "No stage is saturated (the busiest one, " << l.getName() << ", is busy " << (limitingUtilization * 100)
+          << "% of the time): throughput is limited by something else (e.g., throttling, or memory)" << endl;
+    } else {
+      const int suggested = max(l.getSlots() + 1, (int) ceil(l.getSlots() * limitingUtilization / TARGET_UTILIZATION));
+      out << "Limiting stage: " << l.getName() << " (busy " << (limitingUtilization * 100) << "% of the time)";
+      if (!l.getOption().empty()) {
+        out << ": consider raising " << l.getOption() << " from " << l.getSlots() << " to " << suggested;
+      }
+      out << endl;
+    }
+    for (size_t i = 0; i < stages.size(); ++i) {
+      const StageStats &s = *stages[i].stage;
+      if ((int) i != limiting && s.getSlots() > 1 && !s.getOption().empty() && utilization[i] < IDLE_UTILIZATION) {
+        const int suggested = max(1, (int) ceil(s.getSlots() * utilization[i] / TARGET_UTILIZATION));
+        out << "Stage " << s.getName() << " is busy only " << (utilization[i] * 100) << "% of the time: "
+            << s.getOption() << " could be lowered from " << s.getSlots() << " to " << suggested << endl;
+      }
+    }
+  }
+}
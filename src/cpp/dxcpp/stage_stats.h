@@ -0,0 +1,99 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef __DXCPP_STAGE_STATS_H__
+#define __DXCPP_STAGE_STATS_H__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include "bqueue.h"
+
+namespace dx {
+  /** @internal
+   *
+   * Busy time of a stage of a pipeline of worker threads (used by the Upload
+   * Agent, and dx-verify-file): the threads (or other "slots", e.g.,
+   * connections) of the stage add the time they spend working on chunks,
+   * as opposed to waiting for them, or for room in the next stage's queue.
+   */
+  class StageStats : boost::noncopyable {
+  public:
+
+    explicit StageStats(const std::string &name_);
+
+    // Starts measuring, for "slots" threads; "option" is the command-line
+    // option which sets their number (for the suggestions of writeStageReport())
+    void start(int slots_, const std::string &option_);
+
+    void addBusy(int64_t us);
+
+    const std::string &getName() const { return name; }
+    const std::string &getOption() const { return option; }
+    int getSlots() const { return slots; }
+    int64_t getBusyUs() const;
+    int64_t getElapsedUs() const;
+
+  private:
+
+    std::string name;
+    std::string option;
+    int slots;
+    int64_t busyUs;
+    boost::posix_time::ptime started;
+    mutable boost::mutex mut;
+  };
+
+  // Adds the time from its construction to its destruction to a stage's busy time
+  class BusyTimer : boost::noncopyable {
+  public:
+    explicit BusyTimer(StageStats &stage_)
+      : stage(stage_), started(boost::posix_time::microsec_clock::universal_time()) {
+    }
+    ~BusyTimer() {
+      stage.addBusy((boost::posix_time::microsec_clock::universal_time() - started).total_microseconds());
+    }
+
+  private:
+    StageStats &stage;
+    boost::posix_time::ptime started;
+  };
+
+  // A stage, with the statistics of the queue it consumes from, and of the one
+  // it produces to (NULL if none)
+  struct StageReport {
+    const StageStats *stage;
+    const BlockingQueueStats *input;
+    const BlockingQueueStats *output;
+
+    StageReport(const StageStats *stage_, const BlockingQueueStats *input_, const BlockingQueueStats *output_)
+      : stage(stage_), input(input_), output(output_) {
+    }
+  };
+
+  // Writes, for each stage, how busy its threads were, how long they waited for
+  // chunks (starved) or for room downstream (blocked), and its throughput; then
+  // names the limiting (busiest) stage, and suggests thread counts
+  void writeStageReport(std::ostream &out, const std::vector<StageReport> &stages);
+}
+
+#endif
@@ -26,6 +26,7 @@
 #include <iomanip>
 #include <ctime>
 #include "utils.h"
+#include "md5_multi.h"
 
 using namespace std;
 
@@ -69,15 +70,25 @@ namespace dx {
     return result;
   }
 
+  // Buffers at least this large are hashed by the shared MD5Service (so that
+  // the parts of concurrent threads get hashed together, in SIMD lanes)
+  static const unsigned long MD5_SERVICE_MIN_SIZE = 1024 * 1024;
+
   std::string getHexifiedMD5(const unsigned char *ptr, const unsigned long size) {
     unsigned char md5[MD5_DIGEST_LENGTH];
-    MD5(ptr, size, md5);
-    
-    // convert to hex string & return
+    if (size >= MD5_SERVICE_MIN_SIZE) {
+      md5Service().digest(ptr, size, md5);
+    } else {
+      MD5(ptr, size, md5);
+    }
+    return hexifyMD5Digest(md5);
+  }
+
+  std::string hexifyMD5Digest(const unsigned char *digest) {
     std::ostringstream oss; 
     oss << std::setfill('0');    
-    for (unsigned i = 0; i < sizeof(md5)/sizeof(md5[0]); ++i) {   
-      oss << std::setw(2) << std::hex << static_cast<int>(md5[i]);
+    for (unsigned i = 0; i < MD5_DIGEST_LENGTH; ++i) {   
+      oss << std::setw(2) << std::hex << static_cast<int>(digest[i]);
     }
     return oss.str();
   }
@@ -35,6 +35,9 @@ namespace dx {
   std::string getHexifiedMD5(const unsigned char *ptr, const unsigned long size);
   std::string getHexifiedMD5(const std::string &inp);
 
+  // Returns the hex string of an MD5 digest (MD5_DIGEST_LENGTH bytes), e.g., as computed by MD5_Final()
+  std::string hexifyMD5Digest(const unsigned char *digest);
+
   namespace _internal {
     // Sleep for "duration" seconds using nanosleep (for posix systems)
     // and using boost::this_thread::sleep() on windows
@@ -0,0 +1,193 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+// Contention benchmark of dx::BlockingQueue (see dxcpp/bqueue.h).
+//
+// Passes items from P producer threads to P consumer threads through a
+// queue, for several numbers of threads, and reports the throughput in
+// millions of items per second for:
+//  - "legacy": a std::queue behind a mutex, which wakes up every waiting
+//    thread on each operation (the previous implementation of BlockingQueue),
+//    with a capacity of P, and without a capacity,
+//  - "bounded": BlockingQueue with a capacity of P,
+//  - "unbounded": BlockingQueue without a capacity,
+//  - "batch": BlockingQueue with a capacity of P, consumers taking up to 16
+//    items at once (consumeBatch).
+// Every consumer exits once the queue is closed and drained; the sum of the
+// items consumed is checked. Each result is followed by the number of
+// context switches per 1000 items (threads woken up, or blocked, in vain show
+// up there even on a single core).
+//
+// Usage: bqueue_bench [items-per-producer (100000)] [max-threads (16)]
+
+#include <stdint.h>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <sys/resource.h>
+
+#include "dxcpp/bqueue.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+/* The previous BlockingQueue, for reference (with the same close() semantics) */
+class LegacyQueue {
+public:
+  LegacyQueue(int capacity_) : capacity(capacity_), closed(false) {
+  }
+
+  void produce(int64_t item) {
+    {
+      boost::unique_lock<boost::mutex> lock(mut);
+      while (capacity != -1 && items.size() == (size_t) capacity) {
+        canProduce.wait(lock);
+      }
+      items.push(item);
+    }
+    canConsume.notify_all();
+  }
+
+  int64_t consume() {
+    int64_t item;
+    {
+      boost::unique_lock<boost::mutex> lock(mut);
+      while (items.empty()) {
+        if (closed) {
+          throw QueueClosed();
+        }
+        canConsume.wait(lock);
+      }
+      item = items.front();
+      items.pop();
+    }
+    canProduce.notify_all();
+    return item;
+  }
+
+  void close() {
+    boost::unique_lock<boost::mutex> lock(mut);
+    closed = true;
+    canConsume.notify_all();
+  }
+
+private:
+  int capacity;
+  bool closed;
+  std::queue<int64_t> items;
+  boost::mutex mut;
+  boost::condition_variable canProduce;
+  boost::condition_variable canConsume;
+};
+
+template<typename Q> void produceItems(Q *queue, int64_t first, int64_t n) {
+  for (int64_t i = first; i < first + n; ++i) {
+    queue->produce(i);
+  }
+}
+
+template<typename Q> void consumeItems(Q *queue, int64_t *sum) {
+  try {
+    while (true) {
+      *sum += queue->consume();
+    }
+  } catch (QueueClosed &e) {
+  }
+}
+
+void consumeBatches(BlockingQueue<int64_t> *queue, int64_t *sum) {
+  vector<int64_t> batch;
+  try {
+    while (true) {
+      batch.clear();
+      queue->consumeBatch(batch, 16);
+      for (size_t i = 0; i < batch.size(); ++i) {
+        *sum += batch[i];
+      }
+    }
+  } catch (QueueClosed &e) {
+  }
+}
+
+int64_t contextSwitches() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/* Runs one configuration; returns "<millions of items per second> (<context switches per 1000 items>)" */
+template<typename Q> string run(Q &queue, int threads, int64_t itemsPerProducer, void (*consumer)(Q *, int64_t *)) {
+  vector<int64_t> sums(threads, 0);
+  const int64_t startSwitches = contextSwitches();
+  const ptime start = microsec_clock::universal_time();
+  boost::thread_group consumers, producers;
+  for (int i = 0; i < threads; ++i) {
+    consumers.create_thread(boost::bind(consumer, &queue, &sums[i]));
+  }
+  for (int i = 0; i < threads; ++i) {
+    producers.create_thread(boost::bind(&produceItems<Q>, &queue, i * itemsPerProducer, itemsPerProducer));
+  }
+  producers.join_all();
+  queue.close();
+  consumers.join_all();
+  const double seconds = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+  const int64_t switches = contextSwitches() - startSwitches;
+
+  const int64_t total = threads * itemsPerProducer;
+  int64_t sum = 0;
+  for (int i = 0; i < threads; ++i) {
+    sum += sums[i];
+  }
+  if (sum != total * (total - 1) / 2) {
+    cerr << "Wrong sum of the items consumed: " << sum << endl;
+    exit(1);
+  }
+  ostringstream result;
+  result << fixed << setprecision(2) << (total / seconds / 1e6) << " (" << setprecision(0) << (switches * 1000.0 / total) << ")";
+  return result.str();
+}
+
+int main(int argc, char *argv[]) {
+  const int64_t itemsPerProducer = (argc > 1) ? boost::lexical_cast<int64_t>(argv[1]) : 100000;
+  const int maxThreads = (argc > 2) ? boost::lexical_cast<int>(argv[2]) : 16;
+  if (itemsPerProducer <= 0 || maxThreads <= 0) {
+    cerr << "Usage: " << argv[0] << " [items-per-producer (100000)] [max-threads (16)]" << endl;
+    return 1;
+  }
+
+  cout << "Millions of items per second, with P producers and P consumers" << endl;
+  cout << setw(4) << "P" << setw(18) << "legacy-bounded" << setw(18) << "bounded"
+       << setw(18) << "legacy-unbounded" << setw(18) << "unbounded" << setw(18) << "batch" << endl;
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    LegacyQueue legacyBounded(threads), legacyUnbounded(-1);
+    BlockingQueue<int64_t> bounded(threads), unbounded, batched(threads);
+    cout << setw(4) << threads
+         << setw(18) << run(legacyBounded, threads, itemsPerProducer, &consumeItems<LegacyQueue>)
+         << setw(18) << run(bounded, threads, itemsPerProducer, &consumeItems<BlockingQueue<int64_t> >)
+         << setw(18) << run(legacyUnbounded, threads, itemsPerProducer, &consumeItems<LegacyQueue>)
+         << setw(18) << run(unbounded, threads, itemsPerProducer, &consumeItems<BlockingQueue<int64_t> >)
+         << setw(18) << run(batched, threads, itemsPerProducer, &consumeBatches) << endl;
+  }
+  return 0;
+}
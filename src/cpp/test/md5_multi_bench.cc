@@ -0,0 +1,95 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+// Benchmark of the multi-buffer MD5 engines (see dxcpp/md5_multi.h).
+//
+// Hashes a set of buffers (in memory, so that the numbers reflect the CPU
+// rather than the storage) with every engine supported by this CPU, on a
+// single thread, and reports the throughput in GB/s per core; the digests
+// are checked against OpenSSL's.
+//
+// Usage: md5_multi_bench [buffers (16)] [buffer-size-MB (8)] [rounds (4)]
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dxcpp/md5_multi.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+int main(int argc, char *argv[]) {
+  const size_t numBuffers = (argc > 1) ? boost::lexical_cast<size_t>(argv[1]) : 16;
+  const size_t bufferSize = ((argc > 2) ? boost::lexical_cast<size_t>(argv[2]) : 8) * 1024 * 1024;
+  const int rounds = (argc > 3) ? boost::lexical_cast<int>(argv[3]) : 4;
+  if (numBuffers == 0) {
+    cerr << "Usage: " << argv[0] << " [buffers (16)] [buffer-size-MB (8)] [rounds (4)]" << endl;
+    return 1;
+  }
+
+  // Buffers of slightly different sizes, so that lanes do not all finish at once
+  vector<vector<unsigned char> > data(numBuffers);
+  vector<const unsigned char *> bufs(numBuffers);
+  vector<size_t> lens(numBuffers);
+  size_t totalBytes = 0;
+  srand(42);
+  for (size_t i = 0; i < numBuffers; ++i) {
+    data[i].resize(bufferSize - (i * 4099) % (bufferSize / 8 + 1));
+    for (size_t j = 0; j < data[i].size(); ++j) {
+      data[i][j] = (unsigned char) rand();
+    }
+    bufs[i] = &data[i][0];
+    lens[i] = data[i].size();
+    totalBytes += lens[i];
+  }
+
+  vector<unsigned char> expected(numBuffers * MD5_DIGEST_LENGTH);
+  for (size_t i = 0; i < numBuffers; ++i) {
+    MD5(bufs[i], lens[i], &expected[i * MD5_DIGEST_LENGTH]);
+  }
+
+  cout << numBuffers << " buffers, " << totalBytes << " bytes in total; best engine: "
+       << md5EngineName(bestMD5Engine()) << endl;
+  const MD5Engine engines[] = {MD5_ENGINE_SCALAR, MD5_ENGINE_SSE2, MD5_ENGINE_AVX2, MD5_ENGINE_AVX512};
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+    if (!md5EngineSupported(engines[e])) {
+      cout << md5EngineName(engines[e]) << ": not supported by this CPU" << endl;
+      continue;
+    }
+    vector<unsigned char> digests(numBuffers * MD5_DIGEST_LENGTH);
+    unsigned char (*d)[MD5_DIGEST_LENGTH] = reinterpret_cast<unsigned char (*)[MD5_DIGEST_LENGTH]>(&digests[0]);
+    md5MultiBuffer(&bufs[0], &lens[0], numBuffers, d, engines[e]);  // warm-up
+    ptime t0 = microsec_clock::universal_time();
+    for (int r = 0; r < rounds; ++r) {
+      md5MultiBuffer(&bufs[0], &lens[0], numBuffers, d, engines[e]);
+    }
+    const double seconds = (microsec_clock::universal_time() - t0).total_microseconds() / 1e6;
+    const bool ok = (memcmp(&digests[0], &expected[0], digests.size()) == 0);
+    cout << md5EngineName(engines[e]) << " (" << md5EngineLanes(engines[e]) << " lanes): "
+         << (totalBytes * (double) rounds / seconds / 1e9) << " GB/s per core"
+         << (ok ? "" : "  ** DIGEST MISMATCH **") << endl;
+    if (!ok) {
+      return 1;
+    }
+  }
+  return 0;
+}
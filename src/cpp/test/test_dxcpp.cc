@@ -21,6 +21,9 @@
 #include <gtest/gtest.h>
 #include "dxjson/dxjson.h"
 #include "dxcpp.h"
+#include "dxcpp/bqueue.h"
+#include "dxcpp/md5_multi.h"
+#include "dxcpp/utils.h"
 
 using namespace std;
 using namespace dx;
@@ -108,6 +111,146 @@ TEST(NonceGeneration, updateInput) {
   ASSERT_TRUE(nonce.size() <= 128);
 }
 
+//////////////////////
+// Multi-buffer MD5 //
+//////////////////////
+
+TEST(MD5MultiBuffer, matchesOpenSSL) {
+  // Lengths around the padding boundaries, and buffers of different sizes
+  // (so that lanes finish, and get refilled, at different times)
+  vector<string> data;
+  for (size_t len = 0; len < 200; ++len) {
+    data.push_back(string(len, (char) ('a' + len % 26)));
+  }
+  data.push_back(string(100000, 'x'));
+  data.push_back(string(65536, '\0'));
+  vector<const unsigned char *> bufs;
+  vector<size_t> lens;
+  for (size_t i = 0; i < data.size(); ++i) {
+    bufs.push_back(reinterpret_cast<const unsigned char *>(data[i].data()));
+    lens.push_back(data[i].size());
+  }
+  const MD5Engine engines[] = {MD5_ENGINE_SCALAR, MD5_ENGINE_SSE2, MD5_ENGINE_AVX2, MD5_ENGINE_AVX512};
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+    if (!md5EngineSupported(engines[e])) {
+      continue;
+    }
+    vector<unsigned char> digests(data.size() * MD5_DIGEST_LENGTH);
+    md5MultiBuffer(&bufs[0], &lens[0], data.size(), reinterpret_cast<unsigned char (*)[MD5_DIGEST_LENGTH]>(&digests[0]), engines[e]);
+    for (size_t i = 0; i < data.size(); ++i) {
+      ASSERT_EQ(getHexifiedMD5(data[i]), hexifyMD5Digest(&digests[i * MD5_DIGEST_LENGTH])) << md5EngineName(engines[e]) << ", length " << lens[i];
+    }
+  }
+  ASSERT_EQ(getHexifiedMD5(string("")), "d41d8cd98f00b204e9800998ecf8427e");
+  ASSERT_EQ(getHexifiedMD5(string("The quick brown fox jumps over the lazy dog")), "9e107d9d372bb6826bd81d3542a419d6");
+}
+
+////////////////////
+// Blocking queue //
+////////////////////
+
+void consumeAll(BlockingQueue<int> *queue, int64_t *sum) {
+  try {
+    while (true) {
+      *sum += queue->consume();
+    }
+  } catch (QueueClosed &qc) {
+  }
+}
+
+TEST(BlockingQueueTest, ProduceConsumeInOrder) {
+  BlockingQueue<int> bounded(3), unbounded;
+  for (int i = 0; i < 3; ++i) {
+    bounded.produce(i);
+  }
+  vector<int> many;
+  for (int i = 0; i < 100; ++i) {
+    many.push_back(i);
+  }
+  unbounded.produceAll(many);
+  ASSERT_EQ(bounded.size(), 3u);
+  ASSERT_EQ(unbounded.size(), 100u);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(bounded.consume(), i);
+  }
+  vector<int> batch;
+  ASSERT_EQ(unbounded.consumeBatch(batch, 60), 60u);
+  ASSERT_EQ(unbounded.consumeBatch(batch, 60), 40u);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(batch[i], i);
+  }
+  int x;
+  ASSERT_FALSE(bounded.tryConsume(x));
+  ASSERT_TRUE(bounded.empty());
+}
+
+TEST(BlockingQueueTest, TimedConsume) {
+  BlockingQueue<int> queue(1);
+  int x = 0;
+  ASSERT_FALSE(queue.consumeFor(x, boost::posix_time::milliseconds(50)));
+  queue.produce(7);
+  ASSERT_TRUE(queue.consumeFor(x, boost::posix_time::milliseconds(50)));
+  ASSERT_EQ(x, 7);
+}
+
+TEST(BlockingQueueTest, CloseDrainsTheQueue) {
+  // Bounded, so that producers block on a full queue
+  BlockingQueue<int> queue(2);
+  vector<int64_t> sums(4, 0);
+  boost::thread_group consumers;
+  for (int i = 0; i < 4; ++i) {
+    consumers.create_thread(boost::bind(&consumeAll, &queue, &sums[i]));
+  }
+  for (int i = 1; i <= 1000; ++i) {
+    queue.produce(i);
+  }
+  queue.close();
+  consumers.join_all();
+  ASSERT_EQ(sums[0] + sums[1] + sums[2] + sums[3], 500500);
+  ASSERT_THROW(queue.produce(1), QueueClosed);
+  ASSERT_THROW(queue.consume(), QueueClosed);
+  queue.reopen();
+  queue.produce(1);
+  ASSERT_EQ(queue.consume(), 1);
+}
+
+TEST(BlockingQueueTest, ConsumeIsAnInterruptionPoint) {
+  BlockingQueue<int> queue;
+  int64_t sum = 0;
+  boost::thread consumer(boost::bind(&consumeAll, &queue, &sum));
+  consumer.interrupt();
+  ASSERT_TRUE(consumer.timed_join(boost::posix_time::seconds(10)));
+  // The queue is still usable after a waiting consumer was interrupted
+  queue.produce(1);
+  ASSERT_EQ(queue.consume(), 1);
+}
+
+TEST(BlockingQueueTest, Stats) {
+  BlockingQueue<int> queue(2);
+  queue.produce(0);  // not counted: before enableStats()
+  queue.enableStats();
+  queue.produce(1);
+  ASSERT_EQ(queue.consume(), 0);
+  ASSERT_EQ(queue.consume(), 1);
+  // A consumer blocks until a chunk is produced
+  int64_t sum = 0;
+  boost::thread consumer(boost::bind(&consumeAll, &queue, &sum));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  queue.produce(5);
+  queue.close();
+  ASSERT_TRUE(consumer.timed_join(boost::posix_time::seconds(10)));
+  ASSERT_EQ(sum, 5);
+
+  const BlockingQueueStats stats = queue.getStats();
+  ASSERT_EQ(stats.produced, 2u);
+  ASSERT_EQ(stats.consumed, 3u);
+  ASSERT_EQ(stats.highWater, 2u);
+  ASSERT_EQ(stats.producerBlocks, 0u);
+  ASSERT_GE(stats.consumerBlocks, 1u);
+  ASSERT_GE(stats.consumersBlockedUs, 100000);
+  ASSERT_GE(stats.elapsedUs, stats.consumersBlockedUs);
+}
+
 /////////////////
 // Idempotency //
 /////////////////
@@ -17,7 +17,6 @@
 #include "chunk.h"
 
 #include <stdexcept>
-#include <fstream>
 #include <sstream>
 
 #include <boost/thread.hpp>
@@ -26,6 +25,7 @@
 #include "dxjson/dxjson.h"
 #include "dxcpp/dxcpp.h"
 #include "dxcpp/utils.h"
+#include "dxcpp/md5_multi.h"
 
 #include "log.h"
 
@@ -39,64 +39,38 @@ void Chunk::read() {
     // For empty file case (empty chunk)
     return;
   }
-#if WINDOWS_BUILD
-  // For windows we use fseeko64() & fread(): since we
-  // compile a 32bit UA version, and standard library functions
-  // do not allow to read > 2GB locations in file
-  FILE *fp = fopen(localFile.c_str(), "rb");
-  if (!fp) {
+  try {
+    // Hint that the next chunk of the file (of the same size) will be read soon
+    chunkFileReader.read(localFile, start, len, &(data[0]), len);
+  } catch (runtime_error &e) {
     ostringstream msg;
-    msg << "file('" << localFile.c_str() << "') cannot be opened for reading (errno=" << errno
-        << ")... readdata failed on chunk " << (*this);
+    msg << e.what() << "... readdata failed on chunk " << (*this);
     throw runtime_error(msg.str());
   }
-  if(fseeko64(fp, off64_t(start), SEEK_SET) != 0) {
-    ostringstream msg;
-    msg << "unable to seek to location '" << off64_t(start) << "' in the file '" << localFile.c_str()
-        << "' (errno=" << errno << ")... readdata failed on chunk " << (*this);
-    fclose(fp);
-    throw runtime_error(msg.str());
-  }
-  fread(&(data[0]), 1, len, fp);
-  int errflg = ferror(fp); // get error status before we close the file handler
-  fclose(fp);
-  if (errflg) {
-    ostringstream msg;
-    msg << "unable to read '" << len << "' bytes from location '" << off64_t(start) << "' in the file '"
-        << localFile.c_str() << "' (errno=" << errno << ")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-#else
-  ifstream in(localFile.c_str(), ifstream::in | ifstream::binary);
-  if (!in) {
-    ostringstream msg;
-    msg << "file('" << localFile.c_str() << "') cannot be opened for reading..." <<
-           "readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-  in.seekg(start);
-  if (!in.good()) {
-    ostringstream msg;
-    msg << "unable to seek to location '" << start << "' in the file '" << localFile.c_str()
-        << "' (fail bit = " << in.fail() << ", bad bit = " << in.bad() << ", eofbit = "
-        << in.eof() <<")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-  in.read(&(data[0]), len);
-  if (!in.good()) {
-    ostringstream msg;
-    msg << "unable to read '" << len << "' bytes from location '" << start << "' in the file '" 
-        << localFile.c_str() << "' (fail bit = " << in.fail() << ", bad bit = " << in.bad() 
-        << ", eofbit = " << in.eof() <<")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-#endif
 }
 
 string Chunk::computeMD5() {
   return dx::getHexifiedMD5(data); 
 }
 
+void Chunk::computeMD5(const vector<Chunk *> &chunks, vector<string> &md5s) {
+  const size_t n = chunks.size();
+  vector<const unsigned char *> bufs(n);
+  vector<size_t> lens(n);
+  for (size_t i = 0; i < n; ++i) {
+    bufs[i] = reinterpret_cast<const unsigned char *>(chunks[i]->data.empty() ? "" : &(chunks[i]->data[0]));
+    lens[i] = chunks[i]->data.size();
+  }
+  vector<unsigned char> digests(n * MD5_DIGEST_LENGTH);
+  if (n > 0) {
+    dx::md5MultiBuffer(&bufs[0], &lens[0], n, reinterpret_cast<unsigned char (*)[MD5_DIGEST_LENGTH]>(&digests[0]));
+  }
+  md5s.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    md5s[i] = dx::hexifyMD5Digest(&digests[i * MD5_DIGEST_LENGTH]);
+  }
+}
+
 void Chunk::clear() {
   // A trick for forcing a vector's contents to be deallocated: swap the
   // memory from data into v; v will be destroyed when this function exits.
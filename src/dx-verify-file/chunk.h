@@ -25,6 +25,11 @@
 #include <queue>
 #include <boost/thread.hpp>
 
+#include "dxcpp/file_reader.h"
+
+/* Shared (cached) descriptors of the local files, for reading chunks (definition in main.cpp) */
+extern dx::FileReader chunkFileReader;
+
 class Chunk {
 public:
 
@@ -55,6 +60,12 @@ public:
   std::string computeMD5();
   void clear();
 
+  /*
+   * Computes the MD5 of several chunks at once (hashed together, in SIMD
+   * lanes, where the CPU supports it) into md5s[i], for chunks[i].
+   */
+  static void computeMD5(const std::vector<Chunk *> &chunks, std::vector<std::string> &md5s);
+
   void log(const std::string &message) const;
   
   friend std::ostream &operator<<(std::ostream &out, const Chunk &chunk);
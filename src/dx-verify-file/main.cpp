@@ -27,6 +27,8 @@
 #include "File.h"
 #include "log.h"
 #include "dxcpp/dxcpp.h"
+#include "dxcpp/md5_multi.h"
+#include "dxcpp/stage_stats.h"
 //#include "import_apps.h"
 
 #include <boost/filesystem.hpp>
@@ -63,9 +65,15 @@ BlockingQueue<Chunk*> chunksFinished;
 BlockingQueue<Chunk*> chunksFailed;
 BlockingQueue<Chunk*> chunksSkipped;
 
+FileReader chunkFileReader; // definition (declared in chunk.h)
+
 vector<boost::thread> readThreads;
 vector<boost::thread> md5Threads;
 
+// Busy time of the threads of each stage (--stage-stats)
+StageStats readStage("read");
+StageStats md5Stage("md5");
+
 bool finished() {
   return (chunksFinished.size() + chunksFailed.size() + chunksSkipped.size() == totalChunks);
 }
@@ -80,7 +88,10 @@ void readChunks(const vector<File> &files) {
         chunksSkipped.produce(c);
       } else {
         c->log("Reading...");
-        c->read();
+        {
+          BusyTimer busy(readStage);
+          c->read();
+        }
 
         c->log("Finished reading");
         chunksToComputeMD5.produce(c);
@@ -92,17 +103,34 @@ void readChunks(const vector<File> &files) {
 }
 
 void verifyChunkMD5(vector<File> &files) {
+  const unsigned lanes = md5EngineLanes(bestMD5Engine());
   try {
     while (true) {
-      Chunk * c = chunksToComputeMD5.consume();
-      if (files[c->parentFileIndex].matchStatus == File::Status::FAILED_TO_MATCH_REMOTE_FILE) {
-        // We have already marked file as a non-match, don't waste time reading more chunks from it
-        c->log("File status == FAILED_TO_MATCH_REMOTE_FILE, Skipping the MD5 compute...");
-        c->clear();
-        chunksSkipped.produce(c);
-      } else {
-        c->log("Computing MD5...");
-        string computedMD5 = c->computeMD5();
+      // Take every chunk waiting in the queue (up to one per SIMD lane), so
+      // that they are hashed together
+      vector<Chunk *> batch;
+      chunksToComputeMD5.consumeBatch(batch, lanes);
+      vector<Chunk *> chunks;
+      for (unsigned i = 0; i < batch.size(); ++i) {
+        Chunk *c = batch[i];
+        if (files[c->parentFileIndex].matchStatus == File::Status::FAILED_TO_MATCH_REMOTE_FILE) {
+          // We have already marked file as a non-match, don't waste time reading more chunks from it
+          c->log("File status == FAILED_TO_MATCH_REMOTE_FILE, Skipping the MD5 compute...");
+          c->clear();
+          chunksSkipped.produce(c);
+        } else {
+          c->log("Computing MD5...");
+          chunks.push_back(c);
+        }
+      }
+      vector<string> computedMD5s;
+      {
+        BusyTimer busy(md5Stage);
+        Chunk::computeMD5(chunks, computedMD5s);
+      }
+      for (unsigned i = 0; i < chunks.size(); ++i) {
+        Chunk *c = chunks[i];
+        const string &computedMD5 = computedMD5s[i];
         c->clear();
         if (c->expectedMD5 != computedMD5) {
           c->log("MISMATCH between expected MD5 '" + c->expectedMD5 + "', and computed MD5 '" + computedMD5 + "' ... marking the file as Mismatch");
@@ -239,6 +267,12 @@ int main(int argc, char * argv[]) {
 
     LOG << "Created " << totalChunks << " chunks." << endl;
     
+    if (opt.stageStats) {
+      chunksToRead.enableStats();
+      chunksToComputeMD5.enableStats();
+      readStage.start(opt.readThreads, "--read-threads");
+      md5Stage.start(opt.md5Threads, "--md5-threads");
+    }
     createWorkerThreads(files);
 
     LOG << "Creating monitor thread.." << endl;
@@ -251,6 +285,15 @@ int main(int argc, char * argv[]) {
     interruptWorkerThreads();
     joinWorkerThreads();
 
+    if (opt.stageStats) {
+      const BlockingQueueStats toRead = chunksToRead.getStats();
+      const BlockingQueueStats toComputeMD5 = chunksToComputeMD5.getStats();
+      vector<StageReport> stages;
+      stages.push_back(StageReport(&readStage, &toRead, &toComputeMD5));
+      stages.push_back(StageReport(&md5Stage, &toComputeMD5, NULL));
+      writeStageReport(cerr, stages);
+    }
+
     for (unsigned int i = 0; i < files.size(); ++i) {
       if (files[i].matchStatus != File::Status::FAILED_TO_MATCH_REMOTE_FILE) {
         cout << "identical" << endl;
@@ -50,6 +50,7 @@ Options::Options() {
     ("read-threads", po::value<int>(&readThreads)->default_value(1), "Number of parallel disk read threads")
     ("md5-threads", po::value<int>(&md5Threads)->default_value(defaultMD5threads), "Number of parallel MD5 compute threads")
     ("verbose,v", po::bool_switch(&verbose), "Verbose logging")
+    ("stage-stats", po::bool_switch(&stageStats), "Print how busy the read and MD5 threads were at exit, and which of them limited the verification")
     ;
 
   hidden_opts = new po::options_description();
@@ -290,6 +291,7 @@ ostream &operator<<(ostream &out, const Options &opt) {
     out << "  read threads: " << opt.readThreads << endl
         << "  md5 threads: " << opt.md5Threads << endl
         << "  verbose: " << opt.verbose << endl
+        << "  stage stats: " << opt.stageStats << endl
       ;
   }
   return out;
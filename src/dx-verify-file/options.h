@@ -49,6 +49,7 @@ public:
   int readThreads;
   int md5Threads;
   bool verbose;
+  bool stageStats;
   
 private:
   std::string apiserverProtocol;
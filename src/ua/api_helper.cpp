@@ -299,23 +299,36 @@ string getProjectName(const string &projectID) {
 }
 
 /*
- * Returns output["results"] array from /findDataObjects call, to search for
- * all files in "project" with the given file signature. Describe output
- * is also returned.
+ * Query of /findDataObjects for the files in "folder" (not in its
+ * subfolders) of "project" which have a file signature property: any
+ * signature, if "signature" is empty. Describe output (including properties,
+ * and parts) is also returned.
  * Note: Hidden files are searched as well.
  */
-JSON findResumableFileObject(string project, string signature) {
+static JSON resumableFileObjectsQuery(const string &project, const string &folder, const string &signature) {
   JSON query(JSON_OBJECT);
   query["class"] = "file";
   query["properties"] = JSON(JSON_OBJECT);
-  query["properties"][FILE_SIGNATURE_PROPERTY] = signature;
+  if (signature.empty()) {
+    query["properties"][FILE_SIGNATURE_PROPERTY] = true;
+  } else {
+    query["properties"][FILE_SIGNATURE_PROPERTY] = signature;
+  }
   query["scope"] = JSON(JSON_OBJECT);
   query["scope"]["project"] = project;
-  query["scope"]["folder"] = "/";
-  query["scope"]["recurse"] = true;
+  query["scope"]["folder"] = folder;
+  query["scope"]["recurse"] = false;
   query["visibility"] = "either";
-  query["describe"] = JSON::parse("{\"project\": \"" + project + "\"}");
+  query["describe"] = JSON::parse("{\"project\": \"" + project + "\", \"properties\": true}");
+  return query;
+}
 
+/*
+ * Returns output["results"] array from /findDataObjects call, to search for
+ * all files in "folder" of "project" with the given file signature.
+ */
+JSON findResumableFileObject(const string &project, const string &folder, const string &signature) {
+  const JSON query = resumableFileObjectsQuery(project, folder, signature);
   JSON output;
   try {
     output = systemFindDataObjects(query);
@@ -326,6 +339,33 @@ JSON findResumableFileObject(string project, string signature) {
   return output["results"];
 }
 
+/*
+ * Returns the results of /findDataObjects calls (following "next", until all
+ * pages are returned) for all files in "folder" of "project" which have a
+ * file signature.
+ */
+JSON findResumableFileObjects(const string &project, const string &folder) {
+  JSON query = resumableFileObjectsQuery(project, folder, "");
+  JSON results(JSON_ARRAY);
+  while (true) {
+    JSON output;
+    try {
+      output = systemFindDataObjects(query);
+    } catch (exception &e) {
+      DXLOG(logINFO) << " failure while running findDataObjects with this input query: " << query.toString();
+      throw;
+    }
+    for (unsigned i = 0; i < output["results"].size(); ++i) {
+      results.push_back(output["results"][i]);
+    }
+    if (!output.has("next") || output["next"].type() == JSON_NULL) {
+      break;
+    }
+    query["starting"] = output["next"];
+  }
+  return results;
+}
+
 void closeFileObject(const string &fileID) {
   fileClose(fileID);
 }
@@ -34,7 +34,9 @@ void closeFileObject(const std::string &fileID);
 
 std::string getFileState(const std::string &fileID);
 
-dx::JSON findResumableFileObject(std::string project, std::string signature);
+dx::JSON findResumableFileObject(const std::string &project, const std::string &folder, const std::string &signature);
+
+dx::JSON findResumableFileObjects(const std::string &project, const std::string &folder);
 
 void removeFromProject(const std::string &projID, const std::string &objID);
 
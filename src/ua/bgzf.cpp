@@ -0,0 +1,181 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "bgzf.h"
+
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <zlib.h>
+
+using namespace std;
+
+/* Gzip header with the "BC" extra field (BSIZE, the last 2 bytes, is filled in per block) */
+static const size_t BGZF_HEADER_SIZE = 18;
+static const unsigned char BGZF_HEADER[BGZF_HEADER_SIZE] = {
+  037, 0213, 010, 4, 0, 0, 0, 0, 0, 0377, 6, 0, 'B', 'C', 2, 0,
+  0, 0 // BSIZE
+};
+static const size_t BGZF_TRAILER_SIZE = 8;
+
+/* The empty block (end-of-file marker) */
+static const char BGZF_EMPTY_BLOCK[] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+/* A block of input, and the region of the output it is compressed into */
+struct BgzfTask {
+  const char *in;
+  size_t inLen;
+  int level;
+  char *out;
+  size_t outLen;
+  int status;
+};
+
+static void putLE16(char *p, unsigned v) {
+  p[0] = (char) (v & 0xff);
+  p[1] = (char) ((v >> 8) & 0xff);
+}
+
+static void putLE32(char *p, uLong v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (char) ((v >> (8 * i)) & 0xff);
+  }
+}
+
+static void putLE64(char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (char) ((v >> (8 * i)) & 0xff);
+  }
+}
+
+/* Deflates the input into a raw deflate stream; returns its size, or 0 if it does not fit. */
+static size_t deflateInto(const char *in, size_t inLen, char *out, size_t outCapacity, int level, int &status) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  status = deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  if (status != Z_OK) {
+    return 0;
+  }
+  stream.next_in = (Bytef *) in;
+  stream.avail_in = (uInt) inLen;
+  stream.next_out = (Bytef *) out;
+  stream.avail_out = (uInt) outCapacity;
+  int err = deflate(&stream, Z_FINISH);
+  const size_t len = stream.total_out;
+  deflateEnd(&stream);
+  if (err == Z_STREAM_END) {
+    status = Z_OK;
+    return len;
+  }
+  status = (err == Z_OK) ? Z_BUF_ERROR : err;
+  return 0;
+}
+
+static void compressBgzfBlock(BgzfTask *t) {
+  const size_t capacity = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_TRAILER_SIZE;
+  char *data = t->out + BGZF_HEADER_SIZE;
+  size_t len = deflateInto(t->in, t->inLen, data, capacity, t->level, t->status);
+  if (t->status == Z_BUF_ERROR) {
+    // Incompressible data: stored blocks always fit (the input is smaller than 64 KB)
+    len = deflateInto(t->in, t->inLen, data, capacity, 0, t->status);
+  }
+  if (t->status != Z_OK) {
+    return;
+  }
+  t->outLen = BGZF_HEADER_SIZE + len + BGZF_TRAILER_SIZE;
+  memcpy(t->out, BGZF_HEADER, BGZF_HEADER_SIZE);
+  putLE16(t->out + 16, (unsigned) (t->outLen - 1));
+  putLE32(data + len, crc32(crc32(0L, Z_NULL, 0), (const Bytef *) t->in, (uInt) t->inLen));
+  putLE32(data + len + 4, (uLong) t->inLen);
+}
+
+size_t bgzfCompressBound(size_t sourceLen) {
+  return ((sourceLen + BGZF_BLOCK_INPUT_SIZE - 1) / BGZF_BLOCK_INPUT_SIZE) * BGZF_MAX_BLOCK_SIZE;
+}
+
+int bgzfCompress(CompressionPool &pool, char *dest, size_t &destLen,
+                 const char *source, size_t sourceLen, int level, vector<BgzfBlock> &blocks, MD5_CTX *md5) {
+  if (destLen < bgzfCompressBound(sourceLen)) {
+    return Z_BUF_ERROR;
+  }
+  const size_t numBlocks = (sourceLen + BGZF_BLOCK_INPUT_SIZE - 1) / BGZF_BLOCK_INPUT_SIZE;
+  vector<BgzfTask> bt(numBlocks);
+  vector<boost::function<void ()> > tasks(numBlocks);
+  for (size_t i = 0; i < numBlocks; ++i) {
+    const size_t offset = i * BGZF_BLOCK_INPUT_SIZE;
+    bt[i].in = source + offset;
+    bt[i].inLen = min(BGZF_BLOCK_INPUT_SIZE, sourceLen - offset);
+    bt[i].level = level;
+    // Every block is compressed into its own 64 KB region of "dest"; the
+    // regions are then moved back to back (see below)
+    bt[i].out = dest + i * BGZF_MAX_BLOCK_SIZE;
+    bt[i].outLen = 0;
+    bt[i].status = Z_OK;
+    tasks[i] = boost::bind(compressBgzfBlock, &bt[i]);
+  }
+  pool.run(tasks);
+
+  size_t pos = 0;
+  for (size_t i = 0; i < numBlocks; ++i) {
+    if (bt[i].status != Z_OK) {
+      return bt[i].status;
+    }
+    memmove(dest + pos, bt[i].out, bt[i].outLen);
+    if (md5 != NULL) {
+      MD5_Update(md5, dest + pos, bt[i].outLen);
+    }
+    pos += bt[i].outLen;
+    BgzfBlock b;
+    b.compressedSize = (uint32_t) bt[i].outLen;
+    b.uncompressedSize = (uint32_t) bt[i].inLen;
+    blocks.push_back(b);
+  }
+  destLen = pos;
+  return Z_OK;
+}
+
+void getBgzfEmptyBlock(vector<char> &dest) {
+  dest.assign(BGZF_EMPTY_BLOCK, BGZF_EMPTY_BLOCK + BGZF_EMPTY_BLOCK_SIZE);
+}
+
+/*
+ * The .gzi format (see bgzf_index_dump() in htslib): the number of entries,
+ * followed by one (compressed offset, uncompressed offset) pair per block
+ * (but the first one, which always starts at 0, 0), all as little-endian
+ * 64-bit integers.
+ */
+void buildGziIndex(const map<unsigned int, BgzfChunkIndex> &chunks, vector<char> &dest) {
+  vector<pair<uint64_t, uint64_t> > entries;
+  uint64_t compressedOffset = 0, uncompressedOffset = 0;
+  for (map<unsigned int, BgzfChunkIndex>::const_iterator it = chunks.begin(); it != chunks.end(); ++it) {
+    uint64_t offsetInChunk = 0;
+    for (size_t i = 0; i < it->second.blocks.size(); ++i) {
+      if (compressedOffset + offsetInChunk > 0) {
+        entries.push_back(make_pair(compressedOffset + offsetInChunk, uncompressedOffset));
+      }
+      offsetInChunk += it->second.blocks[i].compressedSize;
+      uncompressedOffset += it->second.blocks[i].uncompressedSize;
+    }
+    // Skip the padding (and end-of-file marker) at the end of the chunk
+    compressedOffset += it->second.size;
+  }
+  dest.resize(8 + 16 * entries.size());
+  putLE64(&dest[0], entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    putLE64(&dest[8 + 16 * i], entries[i].first);
+    putLE64(&dest[16 + 16 * i], entries[i].second);
+  }
+}
@@ -0,0 +1,84 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_BGZF_H
+#define UA_BGZF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "compression_pool.h"
+
+/*
+ * BGZF (blocked gzip, as produced by bgzip/htslib): a series of gzip
+ * members, each holding at most 64 KB of compressed data, and recording its
+ * own size in a "BC" extra field, so that readers can seek to any member
+ * and decompress members in parallel. A chunk compressed with --bgzf is a
+ * whole number of BGZF blocks, so parts concatenate into a valid BGZF file.
+ */
+
+/* Maximum number of bytes of input in a block (as in htslib) */
+const size_t BGZF_BLOCK_INPUT_SIZE = 0xff00;
+
+/* Maximum size of a block (the BSIZE field holds the size minus 1, on 16 bits) */
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+/* Size of the empty block (see getBgzfEmptyBlock()) */
+const size_t BGZF_EMPTY_BLOCK_SIZE = 28;
+
+/* Sizes of a block, as recorded in the .gzi index */
+struct BgzfBlock {
+  uint32_t compressedSize;
+  uint32_t uncompressedSize;
+};
+
+/* BGZF blocks of a chunk, and total size of its (compressed) data, padding included */
+struct BgzfChunkIndex {
+  BgzfChunkIndex() : size(0) {}
+  uint64_t size;
+  std::vector<BgzfBlock> blocks;
+};
+
+/*
+ * Compresses "source" into "dest" as a series of BGZF blocks, compressed in
+ * parallel on "pool"; appends the sizes of every block to "blocks".
+ *
+ * Same contract as gzCompress(): destLen is the size of "dest" on entry,
+ * and the size of the compressed data on exit; returns a zlib status code.
+ * "dest" must have room for at least bgzfCompressBound(sourceLen) bytes.
+ * If md5 is not NULL, it is updated with the output, block by block.
+ */
+int bgzfCompress(CompressionPool &pool, char *dest, size_t &destLen,
+                 const char *source, size_t sourceLen, int level, std::vector<BgzfBlock> &blocks, MD5_CTX *md5);
+
+/* Upper bound on the size of the output of bgzfCompress() */
+size_t bgzfCompressBound(size_t sourceLen);
+
+/*
+ * Replaces contents of "dest" with the empty BGZF block (which also serves
+ * as BGZF end-of-file marker).
+ */
+void getBgzfEmptyBlock(std::vector<char> &dest);
+
+/*
+ * Replaces contents of "dest" with the .gzi index (as written by
+ * "bgzip -i") of a file made of the given chunks, in order.
+ */
+void buildGziIndex(const std::map<unsigned int, BgzfChunkIndex> &chunks, std::vector<char> &dest);
+
+#endif
@@ -0,0 +1,247 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "buffer_pool.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#if WINDOWS_BUILD
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+
+// Transparent huge pages are 2MB on all architectures we build UA for
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static size_t getPageSize() {
+#if WINDOWS_BUILD
+  return 4096;
+#else
+  long pageSize = sysconf(_SC_PAGE_SIZE);
+  return (pageSize > 0) ? size_t(pageSize) : 4096;
+#endif
+}
+
+BufferPool::BufferPool()
+  : blockSize(0), maxBytes(0), alignment(getPageSize()), useHugePages(false), allocatedBytes(0), dedicatedBytes(0), inUseBytes(0) {
+}
+
+BufferPool::~BufferPool() {
+  for (unsigned i = 0; i < freeBlocks.size(); ++i) {
+    freeBlock(freeBlocks[i]);
+  }
+}
+
+void BufferPool::init(size_t blockSize_, size_t maxBytes_, bool useHugePages_) {
+  boost::mutex::scoped_lock lock(mut);
+  // Drop all the cached blocks, since they might have a different size now
+  for (unsigned i = 0; i < freeBlocks.size(); ++i) {
+    freeBlock(freeBlocks[i]);
+    allocatedBytes -= blockSize;
+  }
+  freeBlocks.clear();
+
+  useHugePages = useHugePages_;
+#if LINUX_BUILD && defined(MADV_HUGEPAGE)
+  alignment = (useHugePages) ? HUGE_PAGE_SIZE : getPageSize();
+#else
+  if (useHugePages) {
+    DXLOG(logWARNING) << "Transparent huge pages are not supported on this platform, will use regular pages for chunk buffers";
+  }
+  alignment = getPageSize();
+#endif
+  blockSize = roundUp(blockSize_);
+  maxBytes = maxBytes_;
+  DXLOG(logINFO) << "Chunk buffer pool: block size = " << blockSize << " bytes, maximum size = " << maxBytes
+                 << " bytes, alignment = " << alignment << " bytes";
+}
+
+size_t BufferPool::roundUp(size_t size) const {
+  if (size == 0) {
+    size = 1;
+  }
+  return ((size + alignment - 1) / alignment) * alignment;
+}
+
+char *BufferPool::allocateBlock(size_t size) {
+  void *ptr = NULL;
+#if WINDOWS_BUILD
+  ptr = _aligned_malloc(size, alignment);
+#else
+  if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = NULL;
+  }
+#endif
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+#if LINUX_BUILD && defined(MADV_HUGEPAGE)
+  if (useHugePages && madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+    DXLOG(logDEBUG) << "madvise(MADV_HUGEPAGE) failed for a chunk buffer (errno=" << errno << "), will use regular pages";
+  }
+#endif
+  return static_cast<char *>(ptr);
+}
+
+void BufferPool::freeBlock(char *ptr) {
+#if WINDOWS_BUILD
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+char *BufferPool::acquire(size_t size, size_t &capacity) {
+  const bool regular = (blockSize > 0 && size <= blockSize);
+  const size_t toAllocate = capacityFor(size);
+
+  boost::unique_lock<boost::mutex> lock(mut);
+  if (regular) {
+    while (true) {
+      if (!freeBlocks.empty()) {
+        char *ptr = freeBlocks.back();
+        freeBlocks.pop_back();
+        inUseBytes += blockSize;
+        capacity = blockSize;
+        return ptr;
+      }
+      // No block is cached here, so allocatedBytes are all in use
+      if (maxBytes == 0 || allocatedBytes + blockSize <= maxBytes || allocatedBytes == 0) {
+        break;
+      }
+      // Note: wait() is an interruption point, so worker threads can still be stopped here
+      canAcquire.wait(lock);
+    }
+    allocatedBytes += blockSize;
+  } else {
+    // Make room for a dedicated allocation by dropping cached blocks, if needed
+    while (maxBytes > 0 && !freeBlocks.empty() && allocatedBytes + dedicatedBytes + toAllocate > maxBytes) {
+      freeBlock(freeBlocks.back());
+      freeBlocks.pop_back();
+      allocatedBytes -= blockSize;
+    }
+    dedicatedBytes += toAllocate;
+  }
+  // Account for the block before allocating (without holding the lock), so
+  // that concurrent callers see the correct number of allocated bytes.
+  inUseBytes += toAllocate;
+  lock.unlock();
+
+  char *ptr;
+  try {
+    ptr = allocateBlock(toAllocate);
+  } catch (...) {
+    lock.lock();
+    if (regular) {
+      allocatedBytes -= toAllocate;
+    } else {
+      dedicatedBytes -= toAllocate;
+    }
+    inUseBytes -= toAllocate;
+    lock.unlock();
+    canAcquire.notify_all();
+    throw;
+  }
+  capacity = toAllocate;
+  return ptr;
+}
+
+void BufferPool::release(char *ptr, size_t capacity) {
+  if (ptr == NULL) {
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(mut);
+    inUseBytes -= capacity;
+    if (blockSize > 0 && capacity == blockSize) {
+      freeBlocks.push_back(ptr);
+      ptr = NULL;
+    } else {
+      // A dedicated allocation (always larger than blockSize)
+      dedicatedBytes -= capacity;
+    }
+  }
+  if (ptr != NULL) {
+    freeBlock(ptr);
+  }
+  canAcquire.notify_all();
+}
+
+size_t BufferPool::capacityFor(size_t size) const {
+  return (blockSize > 0 && size <= blockSize) ? blockSize : roundUp(size);
+}
+
+size_t BufferPool::getBlockSize() const {
+  return blockSize;
+}
+
+size_t BufferPool::getMaxBytes() const {
+  return maxBytes;
+}
+
+size_t BufferPool::getBytesInUse() {
+  boost::mutex::scoped_lock lock(mut);
+  return inUseBytes;
+}
+
+void PooledBuffer::allocate(BufferPool &pool_, size_t size) {
+  release();
+  ptr = pool_.acquire(size, cap);
+  pool = &pool_;
+  len = size;
+}
+
+void PooledBuffer::resize(size_t size) {
+  if (size > cap) {
+    throw runtime_error("PooledBuffer::resize(): requested size is larger than the capacity of the buffer");
+  }
+  len = size;
+}
+
+void PooledBuffer::append(const char *src, size_t n) {
+  if (len + n > cap) {
+    throw runtime_error("PooledBuffer::append(): not enough capacity in the buffer");
+  }
+  memcpy(ptr + len, src, n);
+  len += n;
+}
+
+void PooledBuffer::release() {
+  if (pool != NULL) {
+    pool->release(ptr, cap);
+  }
+  pool = NULL;
+  ptr = NULL;
+  len = cap = 0;
+}
+
+void PooledBuffer::swap(PooledBuffer &other) {
+  std::swap(pool, other.pool);
+  std::swap(ptr, other.ptr);
+  std::swap(len, other.len);
+  std::swap(cap, other.cap);
+}
@@ -0,0 +1,158 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_BUFFER_POOL_H
+#define UA_BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * A pool of page-aligned memory blocks, used for holding chunk data while
+ * it moves through the read -> compress -> upload stages.
+ *
+ * All regular blocks have the same size (blockSize), and are recycled
+ * (rather than returned to the OS) when released, so that we do not pay
+ * for page faults, zero-filling and heap fragmentation on every chunk.
+ * Requests larger than blockSize are served by dedicated allocations, which
+ * are freed on release.
+ *
+ * The total number of bytes allocated for regular blocks (in use, plus the
+ * ones cached for reuse) never exceeds maxBytes: acquire() blocks until
+ * enough memory has been released. The only exception is a request made
+ * while no regular block is in use, which is always served (otherwise it
+ * could never be). Dedicated allocations are not counted against maxBytes,
+ * and never wait (the callers bound them, see Chunk::memoryNeeded()), so
+ * that they cannot starve the regular blocks; cached blocks are dropped to
+ * make room for them, though.
+ *
+ * A default constructed pool (i.e., before init() is called) has no cap,
+ * and serves every request with a dedicated allocation.
+ */
+class BufferPool : boost::noncopyable {
+public:
+
+  BufferPool();
+  ~BufferPool();
+
+  /*
+   * Sets the block size and the cap on total allocated bytes (0 means
+   * "no cap"). If useHugePages_ is true, blocks are aligned to (and
+   * advised as) transparent huge pages, where supported.
+   */
+  void init(size_t blockSize_, size_t maxBytes_, bool useHugePages_);
+
+  /*
+   * Returns a block of at least "size" bytes (contents are NOT initialized);
+   * the actual capacity of the block is returned in "capacity".
+   * Blocks until the request fits in the cap.
+   */
+  char *acquire(size_t size, size_t &capacity);
+
+  /* Returns a block obtained by acquire() to the pool. */
+  void release(char *ptr, size_t capacity);
+
+  /* Capacity of the block acquire() returns for a request of "size" bytes */
+  size_t capacityFor(size_t size) const;
+
+  size_t getBlockSize() const;
+  size_t getMaxBytes() const;
+  size_t getBytesInUse();
+
+private:
+
+  char *allocateBlock(size_t size);
+  void freeBlock(char *ptr);
+  size_t roundUp(size_t size) const;
+
+  /* Size of regular (recycled) blocks, 0 if not initialized yet */
+  size_t blockSize;
+
+  /* Maximum number of bytes allocated by the pool at any time, 0 for no cap */
+  size_t maxBytes;
+
+  /* Alignment of every block (page size, or huge page size) */
+  size_t alignment;
+
+  bool useHugePages;
+
+  /* Bytes currently allocated for regular blocks (both in use, and cached in freeBlocks) */
+  size_t allocatedBytes;
+
+  /* Bytes of dedicated allocations currently in use */
+  size_t dedicatedBytes;
+
+  /* Bytes currently handed out to callers */
+  size_t inUseBytes;
+
+  /* Regular blocks which are not in use, ready to be handed out again */
+  std::vector<char *> freeBlocks;
+
+  boost::mutex mut;
+  boost::condition_variable canAcquire;
+};
+
+/*
+ * A byte buffer backed by a block of a BufferPool. It behaves like a
+ * (minimal) std::vector<char>, except that resize() never initializes
+ * memory, and the size can never grow past the capacity of the block.
+ * The block is returned to the pool on release(), or on destruction.
+ */
+class PooledBuffer : boost::noncopyable {
+public:
+
+  PooledBuffer() : pool(NULL), ptr(NULL), len(0), cap(0) {
+  }
+
+  ~PooledBuffer() {
+    release();
+  }
+
+  /* Acquires a block of at least "size" bytes from pool_, and sets size() to "size" */
+  void allocate(BufferPool &pool_, size_t size);
+
+  /* Changes size(); "size" must not exceed capacity() */
+  void resize(size_t size);
+
+  /* Copies n bytes from src to the end of the buffer (must fit in capacity()) */
+  void append(const char *src, size_t n);
+
+  /* Returns the block to the pool (if any); size() and capacity() become 0 */
+  void release();
+
+  void swap(PooledBuffer &other);
+
+  char *data() { return ptr; }
+  const char *data() const { return ptr; }
+  size_t size() const { return len; }
+  size_t capacity() const { return cap; }
+  bool empty() const { return (len == 0); }
+
+  char &operator[](size_t i) { return ptr[i]; }
+  const char &operator[](size_t i) const { return ptr[i]; }
+
+private:
+
+  BufferPool *pool;
+  char *ptr;
+  size_t len;
+  size_t cap;
+};
+
+#endif
@@ -17,9 +17,10 @@
 
 #include "chunk.h"
 
-#include <fstream>
+#include <sstream>
 
 #include <boost/regex.hpp>
+#include <openssl/md5.h>
 
 #include "dxcpp/utils.h"
 #include "dxcpp/dxcpp.h"
@@ -29,8 +30,11 @@ extern "C" {
 }
 
 #include "round_robin_dns.h"
+#include "chunk_stream.h"
 
 using namespace std;
+using boost::posix_time::ptime;
+using boost::posix_time::microsec_clock;
 
 #define TCP_TUNNEL_HOSTNAME "ul.cn.dnanexus.com"
 #define AWS_HOSTNAME "s3.amazonaws.com"
@@ -49,6 +53,20 @@ const size_t MAX_QUEUE_SIZE = 5000;
 
 static string extractPortFromURL(const string &url);
 
+// A prefetched upload URL is not used if it expires in less than this (ms)
+const int64_t UPLOAD_URL_MIN_VALIDITY_MS = 60 * 1000;
+
+// Memory held by a streamed chunk in flight: the input and output blocks of
+// its ChunkStream (see chunk_stream.cpp), and the state of zlib
+const int64_t STREAMED_CHUNK_MEMORY = 1536 * 1024;
+
+// Minimum size of a part (except the last one of a file)
+const size_t MIN_CHUNK_SIZE = 5 * 1024 * 1024;
+
+static int64_t millisecondsSinceEpoch() {
+  return (microsec_clock::universal_time() - ptime(boost::gregorian::date(1970, 1, 1))).total_milliseconds();
+}
+
 // Replace contents of "dest" with gzip of empty string
 void get_empty_string_gzip(vector<char> &dest) {
   DXLOG(dx::logINFO) << "Computing gzip of zero length string...";
@@ -72,80 +90,110 @@ void get_empty_string_gzip(vector<char> &dest) {
   DXLOG(dx::logINFO) << "Gzip of zero length string computed to be " << dest.size() << "bytes long";
 }
 
+/* Size of the slices in which data is added to the md5, as it is produced */
+const size_t MD5_SLICE_SIZE = 4 * 1024 * 1024;
+
+static string finalizeMD5(MD5_CTX &md5) {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5_Final(digest, &md5);
+  return dx::hexifyMD5Digest(digest);
+}
+
+static void updateMD5(void *md5, const Bytef *data, uLong len) {
+  MD5_Update(static_cast<MD5_CTX *>(md5), data, len);
+}
+
 void Chunk::read() {
   const uint64_t len = end - start;
-  data.clear();
-  data.resize(len);
+  data.release();
+  attempt().expectedMD5.clear();
+  if (streamed) {
+    // The data is produced from the local file while uploading (see ChunkStream)
+    return;
+  }
   if (len == 0) {
     // For empty file case (empty chunk)
     return;
   }
-#if WINDOWS_BUILD
-  // For windows we use fseeko64() & fread(): since we
-  // compile a 32bit UA version, and standard library functions
-  // do not allow to read > 2GB locations in file
-  FILE *fp = fopen(localFile.c_str(), "rb");
-  if (!fp) {
-    ostringstream msg;
-    msg << "file('" << localFile.c_str() << "') cannot be opened for reading (errno=" << errno
-        << ")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-  if(fseeko64(fp, off64_t(start), SEEK_SET) != 0) {
-    ostringstream msg;
-    msg << "unable to seek to location '" << off64_t(start) << "' in the file '" << localFile.c_str()
-        << "' (errno=" << errno << ")... readdata failed on chunk " << (*this);
-    fclose(fp);
-    throw runtime_error(msg.str());
-  }
-  fread(&(data[0]), 1, len, fp);
-  int errflg = ferror(fp); // get error status before we close the file handler
-  fclose(fp);
-  if (errflg) {
-    ostringstream msg;
-    msg << "unable to read '" << len << "' bytes from location '" << off64_t(start) << "' in the file '"
-        << localFile.c_str() << "' (errno=" << errno << ")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
-  }
-#else
-  ifstream in(localFile.c_str(), ifstream::in | ifstream::binary);
-  if (!in) {
+  // Note: memory in the buffer is not initialized (we overwrite it right away)
+  data.allocate(chunkBufferPool, len);
+  try {
+    // The chunk is read a slice at a time, and (if it will be uploaded as
+    // is) each slice is added to the md5 right away, while still in the
+    // cache, so that upload threads do not need another pass over the data
+    MD5_CTX md5;
+    MD5_Init(&md5);
+    for (uint64_t offset = 0; offset < len; offset += MD5_SLICE_SIZE) {
+      const uint64_t sliceLen = min<uint64_t>(MD5_SLICE_SIZE, len - offset);
+      const bool lastSlice = (offset + sliceLen == len);
+      // Hint that the next chunk of the file (of the same size) will be read soon
+      chunkFileReader.read(localFile(), start + offset, sliceLen, data.data() + offset, (lastSlice) ? len : 0);
+      if (!toCompress) {
+        MD5_Update(&md5, data.data() + offset, sliceLen);
+      }
+    }
+    if (!toCompress) {
+      attempt().expectedMD5 = finalizeMD5(md5);
+    }
+  } catch (runtime_error &e) {
     ostringstream msg;
-    msg << "file('" << localFile.c_str() << "') cannot be opened for reading..." <<
-           "readdata failed on chunk " << (*this);
+    msg << e.what() << "... readdata failed on chunk " << (*this);
     throw runtime_error(msg.str());
   }
-  in.seekg(start);
-  if (!in.good()) {
-    ostringstream msg;
-    msg << "unable to seek to location '" << start << "' in the file '" << localFile.c_str()
-        << "' (fail bit = " << in.fail() << ", bad bit = " << in.bad() << ", eofbit = "
-        << in.eof() <<")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
+}
+
+size_t chunkCompressBound(size_t sourceLen) {
+  if (bgzfCompression) {
+    // Room for the end-of-file marker, which terminates the last chunk
+    return bgzfCompressBound(sourceLen) + BGZF_EMPTY_BLOCK_SIZE;
   }
-  in.read(&(data[0]), len);
-  if (!in.good()) {
-    ostringstream msg;
-    msg << "unable to read '" << len << "' bytes from location '" << start << "' in the file '"
-        << localFile.c_str() << "' (fail bit = " << in.fail() << ", bad bit = " << in.bad()
-        << ", eofbit = " << in.eof() <<")... readdata failed on chunk " << (*this);
-    throw runtime_error(msg.str());
+  if (compressBlockSize > 0) {
+    return gzCompressBlocksBound(sourceLen, compressBlockSize);
   }
-#endif
+  return gzCompressBound(sourceLen);
+}
+
+/*
+ * Size of the buffer compress() needs for "sourceLen" bytes of a chunk: the
+ * compressed data, or enough room for the (possible) padding with empty gzip
+ * streams (see below)
+ */
+static size_t compressedBufferSize(size_t sourceLen, bool lastChunk) {
+  return std::max<size_t>(chunkCompressBound(sourceLen), (lastChunk) ? 0 : MIN_CHUNK_SIZE + 1024);
 }
 
 void Chunk::compress() {
+  ChunkAttempt &a = attempt();
   int64_t sourceLen = data.size();
   if (sourceLen == 0) {
     // Empty file case (empty chunk)
     return;
   }
-  int64_t destLen = gzCompressBound(sourceLen);
-  vector<char> dest(destLen);
-
-  int compressStatus = gzCompress((Bytef *) (&(dest[0])), (uLongf *) &destLen,
-                                  (const Bytef *) (&(data[0])), (uLong) sourceLen,
-                                  Z_DEFAULT_COMPRESSION);  // use default compression level value from ZLIB (usually 6)
+  int64_t destLen = chunkCompressBound(sourceLen);
+  PooledBuffer dest;
+  dest.allocate(chunkBufferPool, compressedBufferSize(sourceLen, lastChunk));
+
+  // The md5 of the compressed data is computed as it is produced (see Chunk::read())
+  MD5_CTX md5;
+  MD5_Init(&md5);
+  int compressStatus;
+  if (bgzfCompression) {
+    size_t len = dest.capacity();
+    a.bgzfBlocks.clear();
+    compressStatus = bgzfCompress(compressionPool, dest.data(), len, data.data(), sourceLen,
+                                  Z_DEFAULT_COMPRESSION, a.bgzfBlocks, &md5);
+    destLen = len;
+  } else if (compressBlockSize > 0) {
+    size_t len = dest.capacity();
+    compressStatus = gzCompressParallel(compressionPool, dest.data(), len, data.data(), sourceLen,
+                                        compressBlockSize, Z_DEFAULT_COMPRESSION, &md5);
+    destLen = len;
+  } else {
+    compressStatus = gzCompressWindowed((Bytef *) dest.data(), (uLongf *) &destLen,
+                                        (const Bytef *) data.data(), (uLong) sourceLen,
+                                        Z_DEFAULT_COMPRESSION,  // use default compression level value from ZLIB (usually 6)
+                                        MD5_SLICE_SIZE, updateMD5, &md5);
+  }
 
   if (compressStatus == Z_MEM_ERROR) {
     throw runtime_error("compression failed: not enough memory");
@@ -155,31 +203,66 @@ void Chunk::compress() {
     throw runtime_error("compression failed: " + boost::lexical_cast<string>(compressStatus));
   }
 
-  if (destLen < (int64_t) dest.size()) {
-    dest.resize(destLen);
+  dest.resize(destLen);
+
+  if (bgzfCompression && lastChunk) {
+    vector<char> eofMarker;
+    getBgzfEmptyBlock(eofMarker);
+    dest.append(&eofMarker[0], eofMarker.size());
+    MD5_Update(&md5, &eofMarker[0], eofMarker.size());
   }
 
-  const size_t MIN_CHUNK_SIZE = 5 * 1024 * 1024;
   /* Special case: If the chunk is compressed below 5MB, append appropriate
-   *               number of chunks representing gzip of empty string.
+   *               number of chunks representing gzip of empty string
+   *               (with --bgzf: empty BGZF blocks, so that the file remains valid BGZF).
    */
   if (!lastChunk && dest.size() < MIN_CHUNK_SIZE) {
     log("Compression at level Z_DEFAULT_COMPRESSION (usually 6), resulted in data size = " + boost::lexical_cast<string>(dest.size()) + " bytes. " +
         "We cannot upload data less than 5MB in any chunk (except last). So will append approppriate number of gzipped chunks of empty string.", dx::logWARNING);
     vector<char> zeroLengthGzip;
-    get_empty_string_gzip(zeroLengthGzip);
+    if (bgzfCompression) {
+      getBgzfEmptyBlock(zeroLengthGzip);
+    } else {
+      get_empty_string_gzip(zeroLengthGzip);
+    }
     if (zeroLengthGzip.empty()) {
       throw runtime_error("Size of empty string's gzip is 0 bytes .. unexpected");
     }
-    dest.reserve(MIN_CHUNK_SIZE + zeroLengthGzip.size()); // Reserve memory in advance
     int count = 0;
     while (dest.size() < MIN_CHUNK_SIZE) {
       count++;
-      std::copy(zeroLengthGzip.begin(), zeroLengthGzip.end(), std::back_inserter(dest));
+      dest.append(&zeroLengthGzip[0], zeroLengthGzip.size());
+      MD5_Update(&md5, &zeroLengthGzip[0], zeroLengthGzip.size());
     }
     log ("Pushed empty string's gzip to 'dest' " + boost::lexical_cast<string>(count) + " number of times, Final length = " + boost::lexical_cast<string>(dest.size()) + " bytes");
   }
+  a.expectedMD5 = finalizeMD5(md5);
+  // The block holding uncompressed data is returned to the pool, and its share of
+  // memoryBudget (see memoryNeeded()) is released
   data.swap(dest);
+  const int64_t inputShare = min<int64_t>(memoryHeld, dest.capacity());
+  dest.release();
+  if (inputShare > 0) {
+    memoryBudget.release(inputShare);
+    memoryHeld -= inputShare;
+  }
+}
+
+void Chunk::computeMD5() {
+  attempt().expectedMD5 = (data.empty()) ? dx::getHexifiedMD5(string()) : dx::getHexifiedMD5(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+}
+
+/*
+ * First pass of --stream-compress mode: computes the size, and md5, of the
+ * data to upload (compressing the chunk, if needed), without keeping it.
+ */
+void Chunk::prepareStream() {
+  // Keep the chunk in the page cache, since upload() reads it again soon
+  ChunkStream stream(localFile(), start, end, toCompress, lastChunk, true);
+  stream.drain();
+  streamSize = stream.size();
+  attempt().expectedMD5 = stream.md5();
+  log("Data to stream: " + boost::lexical_cast<string>(streamSize) + " bytes, md5 = " + attempt().expectedMD5);
 }
 
 void checkConfigCURLcode(CURLcode code, char *errorBuffer) {
@@ -202,34 +285,65 @@ void checkPerformCURLcode(CURLcode code, char *errorBuffer) {
   }
 }
 
+/*
+ * Number of bytes (out of "wanted") which the read callback of "req" may
+ * hand over to libcurl now, as allowed by uploadRateLimiter; 0 if the
+ * request must be paused.
+ */
+static size_t allowedBytes(UploadRequest *req, size_t wanted) {
+  if (wanted == 0 || !uploadRateLimiter.isEnabled()) {
+    return wanted;
+  }
+  const size_t allowed = uploadRateLimiter.take(wanted, !req->pauseWhenThrottled);
+  if (allowed == 0) {
+    req->paused = true;
+  }
+  return allowed;
+}
+
 /*
  * This function is the callback invoked by libcurl when it needs more data
  * to send to the server (CURLOPT_READFUNCTION). userdata is a pointer to
- * the chunk; we copy at most size * nmemb bytes of its data into ptr and
- * return the amount of data copied.
+ * the UploadRequest; we copy at most size * nmemb bytes of the chunk's data
+ * into ptr and return the amount of data copied.
  */
 size_t curlReadFunction(void * ptr, size_t size, size_t nmemb, void * userdata) {
-  Chunk * chunk = (Chunk *) userdata;
-  int64_t bytesLeft = chunk->data.size() - chunk->uploadOffset;
-  size_t bytesToCopy = min<size_t>(bytesLeft, size * nmemb);
+  UploadRequest * req = (UploadRequest *) userdata;
+  Chunk * chunk = req->chunk;
+  ChunkAttempt &a = chunk->attempt();
+  int64_t bytesLeft = chunk->data.size() - a.uploadOffset;
+  size_t bytesToCopy = allowedBytes(req, min<size_t>(bytesLeft, size * nmemb));
+  if (req->paused) {
+    return CURL_READFUNC_PAUSE;
+  }
 
   if (bytesToCopy > 0) {
-    memcpy(ptr, &((chunk->data)[chunk->uploadOffset]), bytesToCopy);
-    chunk->uploadOffset += bytesToCopy;
+    memcpy(ptr, chunk->data.data() + a.uploadOffset, bytesToCopy);
+    a.uploadOffset += bytesToCopy;
   }
 
   return bytesToCopy;
 }
 
-// This structure is used for passing data to progress_func(),
-// via CURL's PROGRESSFUNCTION option.
-struct myProgressStruct {
-  int64_t uploadedBytes;
-  CURL *curl;
-};
+/*
+ * Same as curlReadFunction(), for streamed chunks (produced by req->stream).
+ */
+size_t curlStreamReadFunction(void * ptr, size_t size, size_t nmemb, void * userdata) {
+  UploadRequest * req = (UploadRequest *) userdata;
+  try {
+    const size_t n = allowedBytes(req, size * nmemb);
+    if (req->paused) {
+      return CURL_READFUNC_PAUSE;
+    }
+    return req->stream->read((char *) ptr, n);
+  } catch (exception &e) {
+    DXLOG(dx::logERROR) << "Error while producing data to upload: " << e.what();
+    return CURL_READFUNC_ABORT;
+  }
+}
 
 int progress_func(void* ptr, double UNUSED(TotalToDownload), double UNUSED(NowDownloaded), double UNUSED(TotalToUpload), double NowUploaded) {
-  myProgressStruct *myp = static_cast<myProgressStruct*>(ptr);
+  UploadRequest *req = static_cast<UploadRequest*>(ptr);
 
   boost::mutex::scoped_lock lock(instantaneousBytesMutex);
   if (instantaneousBytesAndTimestampQueue.size() >= MAX_QUEUE_SIZE) {
@@ -237,8 +351,8 @@ int progress_func(void* ptr, double UNUSED(TotalToDownload), double UNUSED(NowDo
     sumOfInstantaneousBytes -= elem.second;
     instantaneousBytesAndTimestampQueue.pop();
   }
-  int64_t uploadedThisTime = int64_t(NowUploaded) - myp->uploadedBytes;
-  myp->uploadedBytes = int64_t(NowUploaded);
+  int64_t uploadedThisTime = int64_t(NowUploaded) - req->uploadedBytes;
+  req->uploadedBytes = int64_t(NowUploaded);
   instantaneousBytesAndTimestampQueue.push(make_pair(std::time(0), uploadedThisTime));
   sumOfInstantaneousBytes += uploadedThisTime;
 
@@ -258,189 +372,304 @@ static size_t write_callback(void *buffer, size_t size, size_t nmemb, void *user
   return result;
 }
 
-void upload_cleanup(CURL **curl, curl_slist **l1, curl_slist **l2) {
-  if (*curl != NULL) {
-    curl_easy_cleanup(*curl);
-    *curl = NULL;
+UploadRequest::UploadRequest()
+  : curl(NULL), resolveList(NULL), headers(NULL), reuseHandle(false), uploadedBytes(0), urlPrefetched(false),
+    chunk(NULL), pauseWhenThrottled(false), paused(false) {
+  // setting to zero (since it can be the case that despite an error, nothing is written to the buffer)
+  memset(errorBuffer, 0, sizeof(errorBuffer));
+}
+
+UploadRequest::~UploadRequest() {
+  if (curl != NULL) {
+    uploadHandles.release(curl, reuseHandle);
   }
-  if (*l1 != NULL) {
-    curl_slist_free_all(*l1);
-    *l1 = NULL;
+  if (resolveList != NULL) {
+    curl_slist_free_all(resolveList);
   }
-  if (*l2 != NULL) {
-    curl_slist_free_all(*l2);
-    *l2 = NULL;
+  if (headers != NULL) {
+    curl_slist_free_all(headers);
   }
 }
 
 void Chunk::upload(Options &opt) {
-  CURL *curl = NULL;
-  struct curl_slist *slist_resolved_ip = NULL;
-  struct curl_slist *slist_headers = NULL;
-  long responseCode;
-  try {
-    uploadOffset = 0;
-    pair<string, dx::JSON> uploadResp = uploadURL(opt);
-    string &url = uploadResp.first;
-    const dx::JSON &headersToSend = uploadResp.second;
+  UploadRequest req;
+  startUpload(opt, req);
+  log("Starting curl_easy_perform...");
+  finishUpload(req, curl_easy_perform(req.curl));
+}
 
-    log("Upload URL: " + url);
+void Chunk::prefetchUploadURL(Options &opt) {
+  const ptime t0 = microsec_clock::universal_time();
+  pair<string, dx::JSON> uploadResp = uploadURL(opt);
+  ChunkAttempt &a = attempt();
+  a.urlFetchMs = (microsec_clock::universal_time() - t0).total_milliseconds();
+  uploadMetrics.observe(Metrics::URL_FETCH, a.urlFetchMs);
+  traceStage("url", chunkTracer.toUs(t0));
+  a.prefetchedURL = uploadResp.first;
+  a.prefetchedHeaders = uploadResp.second;
+}
 
-    curl = curl_easy_init();
-    if (curl == NULL) {
-      throw runtime_error("An error occurred when initializing the HTTP connection");
-    }
-    char errorBuffer[CURL_ERROR_SIZE + 1] = {0}; // setting to zero (since it can be the case that despite an error, nothing is written to the buffer)
-    // Set errorBuffer to recieve human readable error messages from libcurl
-    // http://curl.haxx.se/libcurl/c/curl_easy_setopt.html#CURLOPTERRORBUFFER
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer), errorBuffer);
-
-    if (!hostName.empty() && !resolvedIP.empty()) { // Will never be true when compiling on windows
-      log("Adding ip '" + resolvedIP + "' to resolve list for hostname '" + hostName + "'");
-      slist_resolved_ip = curl_slist_append(slist_resolved_ip, (hostName + ":443:" + resolvedIP).c_str());
-      slist_resolved_ip = curl_slist_append(slist_resolved_ip, (hostName + ":80:" + resolvedIP).c_str());
-      // Note: We don't remove this extra host name resolution info by setting "-HOST:PORT:IP" at the end,
-      // since we don't reuse the curl handle anyway
-    } else {
-      log("Not adding any explicit IP address using CURLOPT_RESOLVE. resolvedIP = '" + resolvedIP + "', hostName = '" + hostName + "'", dx::logWARNING);
+void Chunk::startUpload(Options &opt, UploadRequest &req) {
+  ChunkAttempt &a = attempt();
+  a.uploadOffset = 0;
+  a.failureCause = "upload_url";
+  pair<string, dx::JSON> uploadResp;
+  if (!a.prefetchedURL.empty() &&
+      (a.uploadURLExpires == 0 || a.uploadURLExpires - millisecondsSinceEpoch() > UPLOAD_URL_MIN_VALIDITY_MS)) {
+    uploadResp = make_pair(a.prefetchedURL, a.prefetchedHeaders);
+    req.urlPrefetched = true;
+  } else {
+    if (!a.prefetchedURL.empty()) {
+      log("Prefetched upload URL expires too soon, requesting a new one");
     }
+    const ptime t0 = microsec_clock::universal_time();
+    uploadResp = uploadURL(opt);
+    a.urlFetchMs = (microsec_clock::universal_time() - t0).total_milliseconds();
+    uploadMetrics.observe(Metrics::URL_FETCH, a.urlFetchMs);
+    traceStage("url", chunkTracer.toUs(t0));
+  }
+  a.failureCause = "setup";
+  // An upload URL is used by a single attempt
+  a.prefetchedURL.clear();
+  string &url = uploadResp.first;
+  const dx::JSON &headersToSend = uploadResp.second;
+
+  log("Upload URL: " + url);
+
+  req.curl = uploadHandles.acquire();
+  req.chunk = this;
+  CURL *curl = req.curl;
+  char *errorBuffer = req.errorBuffer;
+  // Set errorBuffer to recieve human readable error messages from libcurl
+  // http://curl.haxx.se/libcurl/c/curl_easy_setopt.html#CURLOPTERRORBUFFER
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer), errorBuffer);
+
+  if (!a.hostName.empty() && !a.resolvedIP.empty()) { // Will never be true when compiling on windows
+    log("Adding ip '" + a.resolvedIP + "' to resolve list for hostname '" + a.hostName + "'");
+    req.resolveList = curl_slist_append(req.resolveList, (a.hostName + ":443:" + a.resolvedIP).c_str());
+    req.resolveList = curl_slist_append(req.resolveList, (a.hostName + ":80:" + a.resolvedIP).c_str());
+    // Note: We don't remove this extra host name resolution info by setting "-HOST:PORT:IP" at the end:
+    // it stays in the (shared) DNS cache of the upload handles, until replaced by the next request's own
+    // entry. Concurrent requests thus overwrite each other's (there is a single entry per host and port),
+    // and a request on a reused (shared) connection ignores it altogether: the random IP only spreads
+    // the new connections across hosts, not the requests themselves.
+  } else {
+    log("Not adding any explicit IP address using CURLOPT_RESOLVE. resolvedIP = '" + a.resolvedIP + "', hostName = '" + a.hostName + "'", dx::logWARNING);
+  }
 
-    // If we are using the TCP tunnel, then we'll be tunneling to the normal
-    // AWS IP, receiving that certificate, and then raise a warning because
-    // the TCP tunnel URL won't appear on the AWS certificate.  We'll resolve
-    // the IP of the TCP tunnel here, put an entry into the CURLOPT_RESOLVE list
-    // so that the normal AWS URL will map to the TCP tunnel IP, and then the
-    // certificate will match the given URL.
-    // Note, we are not using extracHostFromURL because we'll need the index
-    // anyway to replace the hostname in the url.
-    size_t index = url.find(TCP_TUNNEL_HOSTNAME);
-    if (index != string::npos ) {
-      string ipAddr = getRandomIP(string(TCP_TUNNEL_HOSTNAME));
-      string port = extractPortFromURL(url);
-      if(port == "") {
-        port = DEFAULT_AWS_PORT;
-      }
+  // If we are using the TCP tunnel, then we'll be tunneling to the normal
+  // AWS IP, receiving that certificate, and then raise a warning because
+  // the TCP tunnel URL won't appear on the AWS certificate.  We'll resolve
+  // the IP of the TCP tunnel here, put an entry into the CURLOPT_RESOLVE list
+  // so that the normal AWS URL will map to the TCP tunnel IP, and then the
+  // certificate will match the given URL.
+  // Note, we are not using extracHostFromURL because we'll need the index
+  // anyway to replace the hostname in the url.
+  size_t index = url.find(TCP_TUNNEL_HOSTNAME);
+  if (index != string::npos ) {
+    string ipAddr = getRandomIP(string(TCP_TUNNEL_HOSTNAME));
+    string port = extractPortFromURL(url);
+    if(port == "") {
+      port = DEFAULT_AWS_PORT;
+    }
 
-      log(string("Substituting hostname ") + AWS_HOSTNAME + " for " + TCP_TUNNEL_HOSTNAME + ".");
-      log(string("Adding substitute ip '") + ipAddr + "' to resolve list for hostname '" + AWS_HOSTNAME + ":" + port + "'");
-      slist_resolved_ip = curl_slist_append(slist_resolved_ip, (string(AWS_HOSTNAME) + ":" + port + ":" + ipAddr).c_str());
+    log(string("Substituting hostname ") + AWS_HOSTNAME + " for " + TCP_TUNNEL_HOSTNAME + ".");
+    log(string("Adding substitute ip '") + ipAddr + "' to resolve list for hostname '" + AWS_HOSTNAME + ":" + port + "'");
+    req.resolveList = curl_slist_append(req.resolveList, (string(AWS_HOSTNAME) + ":" + port + ":" + ipAddr).c_str());
 
-      url.replace(index, strlen(TCP_TUNNEL_HOSTNAME), AWS_HOSTNAME);
-    }
+    url.replace(index, strlen(TCP_TUNNEL_HOSTNAME), AWS_HOSTNAME);
+  }
 
-    // Now, if we have added any URL's to the slist, call CURLOPT_RESOLVE.
-    if (slist_resolved_ip != NULL) {
-      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_RESOLVE, slist_resolved_ip), errorBuffer);
-    }
+  // Now, if we have added any URL's to the slist, call CURLOPT_RESOLVE.
+  if (req.resolveList != NULL) {
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_RESOLVE, req.resolveList), errorBuffer);
+  }
 
-    // g_DX_CA_CERT is set by dxcpp (from environment variable DX_CA_CERT)
-    if (dx::config::CA_CERT() == "NOVERIFY") {
-      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0), errorBuffer);
+  // g_DX_CA_CERT is set by dxcpp (from environment variable DX_CA_CERT)
+  if (dx::config::CA_CERT() == "NOVERIFY") {
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0), errorBuffer);
+  } else {
+    if (!dx::config::CA_CERT().empty()) {
+      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_CAINFO, dx::config::CA_CERT().c_str()), errorBuffer);
     } else {
-      if (!dx::config::CA_CERT().empty()) {
-        checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_CAINFO, dx::config::CA_CERT().c_str()), errorBuffer);
-      } else {
-        // Set verify on, and use default path for certificate
-        checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1), errorBuffer);
-      }
-    }
-
-    if (opt.throttle > 0) {
-      const int totalChunksRemaining = totalChunks - chunksFinished.size() + chunksFailed.size();
-      assert(totalChunksRemaining > 0);
-      curl_off_t tval = static_cast<curl_off_t>(double(opt.throttle) / std::min(opt.uploadThreads, totalChunksRemaining)) + 1;
-      log("Setting CURLOPT_MAX_SEND_SPEED_LARGE = " + boost::lexical_cast<string>(tval), dx::logINFO);
-      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, tval), errorBuffer);
+      // Set verify on, and use default path for certificate
+      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1), errorBuffer);
     }
+  }
 
-    // Abort if we cannot connect within 30 seconds
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30l), errorBuffer);
+  // Abort if we cannot connect within 30 seconds
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30l), errorBuffer);
 
-    // Time out after 30 minutes. That should be plenty of time to upload a part
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1800l), errorBuffer);
+  // Time out after 30 minutes. That should be plenty of time to upload a part
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1800l), errorBuffer);
 
-    // If the average bytes per second is below 1 over a 60 second window, abort the request
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1l), errorBuffer);
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60l), errorBuffer);
+  // If the average bytes per second is below 1 over a 60 second window, abort the request
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1l), errorBuffer);
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60l), errorBuffer);
 
-    if (!dx::config::LIBCURL_VERBOSE().empty() && dx::config::LIBCURL_VERBOSE() != "0") {
-      checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_VERBOSE, 1), errorBuffer);
-    }
+  if (!dx::config::LIBCURL_VERBOSE().empty() && dx::config::LIBCURL_VERBOSE() != "0") {
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_VERBOSE, 1), errorBuffer);
+  }
 
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgentString.c_str()), errorBuffer);
-    // Internal CURL progressmeter must be disabled if we provide our own callback
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0), errorBuffer);
-    // Install the callback function
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, progress_func), errorBuffer);
-    myProgressStruct prog;
-    prog.curl = curl;
-    prog.uploadedBytes = 0;
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &prog), errorBuffer);
-
-    /* Setting this option, since libcurl fails in multi-threaded environment otherwise */
-    /* See: http://curl.haxx.se/libcurl/c/libcurl-tutorial.html#Multi-threading */
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1l), errorBuffer);
-
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_UPLOAD, 1), errorBuffer);
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_URL, url.c_str()), errorBuffer);
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgentString.c_str()), errorBuffer);
+  // Internal CURL progressmeter must be disabled if we provide our own callback
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0), errorBuffer);
+  // Install the callback function
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, progress_func), errorBuffer);
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &req), errorBuffer);
+
+  /* Setting this option, since libcurl fails in multi-threaded environment otherwise */
+  /* See: http://curl.haxx.se/libcurl/c/libcurl-tutorial.html#Multi-threading */
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1l), errorBuffer);
+
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_UPLOAD, 1), errorBuffer);
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_URL, url.c_str()), errorBuffer);
+  if (streamed) {
+    req.stream.reset(new ChunkStream(localFile(), start, end, toCompress, lastChunk, false));
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlStreamReadFunction), errorBuffer);
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_READDATA, &req), errorBuffer);
+  } else {
     checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlReadFunction), errorBuffer);
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_READDATA, this), errorBuffer);
-
-    // Set callback for recieving the response data
-    respData.clear();
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback) , errorBuffer);
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_WRITEDATA, &respData), errorBuffer);
-
-    // Remove the Content-Type header (libcurl sets "Content-Type: application/x-www-form-urlencoded" by default for POST)
-    slist_headers = curl_slist_append(slist_headers, "Content-Type:");
+    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_READDATA, &req), errorBuffer);
+  }
 
-    // Append additional headers requested by /file-xxxx/upload call
-    for (dx::JSON::const_object_iterator it = headersToSend.object_begin(); it != headersToSend.object_end(); ++it) {
-      ostringstream tempStream;
-      tempStream << it->first << ": " << it->second.get<string>();
-      slist_headers = curl_slist_append(slist_headers, tempStream.str().c_str());
-    }
+  // Set callback for recieving the response data
+  a.respData.clear();
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback) , errorBuffer);
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_WRITEDATA, &a.respData), errorBuffer);
 
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist_headers), errorBuffer);
+  // Remove the Content-Type header (libcurl sets "Content-Type: application/x-www-form-urlencoded" by default for POST)
+  req.headers = curl_slist_append(req.headers, "Content-Type:");
 
-    // curl wants to know this (otherwise it uses chunked transfer), even
-    // though we have set the content-length header above
-    checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)data.size()), errorBuffer);
+  // Append additional headers requested by /file-xxxx/upload call
+  for (dx::JSON::const_object_iterator it = headersToSend.object_begin(); it != headersToSend.object_end(); ++it) {
+    ostringstream tempStream;
+    tempStream << it->first << ": " << it->second.get<string>();
+    req.headers = curl_slist_append(req.headers, tempStream.str().c_str());
+  }
 
-    log("Starting curl_easy_perform...");
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req.headers), errorBuffer);
 
-    checkPerformCURLcode(curl_easy_perform(curl), errorBuffer);
+  // curl wants to know this (otherwise it uses chunked transfer), even
+  // though we have set the content-length header above
+  checkConfigCURLcode(curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)uploadSize()), errorBuffer);
 
-    checkPerformCURLcode(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode), errorBuffer);
-    log("Returned from curl_easy_perform; responseCode is " + boost::lexical_cast<string>(responseCode));
+  req.transferStart = microsec_clock::universal_time();
+}
 
-    upload_cleanup(&curl, &slist_headers, &slist_resolved_ip);
-  } catch (...) {
-    // This catch is only intended for cleanup (when checkPerformCURLcode() or checkConfigCURLcode() throw)
-    // We will rethrow the error again.
-    upload_cleanup(&curl, &slist_headers, &slist_resolved_ip);
-    throw;
-  }
+void Chunk::finishUpload(UploadRequest &req, CURLcode code) {
+  ChunkAttempt &a = attempt();
+  a.transferMs = (microsec_clock::universal_time() - req.transferStart).total_milliseconds();
+  uploadMetrics.observe(Metrics::PUT, a.transferMs);
+  traceStage("put", chunkTracer.toUs(req.transferStart));
+  a.failureCause = "curl_" + boost::lexical_cast<string>((int) code);
+  long responseCode;
+  checkPerformCURLcode(code, req.errorBuffer);
+  checkPerformCURLcode(curl_easy_getinfo(req.curl, CURLINFO_RESPONSE_CODE, &responseCode), req.errorBuffer);
+  log("Request finished; responseCode is " + boost::lexical_cast<string>(responseCode));
+  log("Latency: upload URL request " + boost::lexical_cast<string>(a.urlFetchMs) + " ms" + ((req.urlPrefetched) ? " (prefetched)" : "") +
+      ", transfer " + boost::lexical_cast<string>(a.transferMs) + " ms");
 
   if ((responseCode < 200) || (responseCode >= 300)) {
     log("Response code not in 2xx range ... throwing runtime_error", dx::logERROR);
     ostringstream msg;
     log("--- Server response body", dx::logERROR);
-    log(respData, dx::logERROR);
+    log(a.respData, dx::logERROR);
     log("---", dx::logERROR);
-    msg << "Request failed with HTTP status code " << responseCode << ", server Response: '" << respData << "'";
+    a.failureCause = "http_" + boost::lexical_cast<string>(responseCode);
+    msg << "Request failed with HTTP status code " << responseCode << ", server Response: '" << a.respData << "'";
     throw runtime_error(msg.str());
   }
 
-  assert(respData == "");
+  // The connection is in a known good state: keep it for the next part
+  req.reuseHandle = true;
+  uploadHandles.recordTransfer(req.curl);
+
+  assert(a.respData == "");
+
+  if (streamed) {
+    // The second pass must have produced exactly the data we declared in /file-xxxx/upload
+    // (it would not, e.g., if the local file was modified in the meantime)
+    req.stream->drain();
+    if (req.stream->size() != streamSize || req.stream->md5() != a.expectedMD5) {
+      a.failureCause = "stream_mismatch";
+      ostringstream msg;
+      msg << "Streamed data (" << req.stream->size() << " bytes, md5 = " << req.stream->md5() << ") does not match the first pass ("
+          << streamSize << " bytes, md5 = " << a.expectedMD5 << "): was the local file modified?";
+      throw runtime_error(msg.str());
+    }
+  }
+}
+
+uint64_t Chunk::uploadSize() const {
+  return (streamed) ? streamSize : data.size();
+}
+
+int64_t Chunk::memoryNeeded() const {
+  const int64_t len = end - start;
+  if (streamed) {
+    return min<int64_t>(len, STREAMED_CHUNK_MEMORY);
+  }
+  if (len == 0) {
+    return 0;
+  }
+  // The blocks of chunkBufferPool holding the data: those of both the
+  // uncompressed and the compressed data while compressing (compress()
+  // releases the share of the former)
+  int64_t bytes = chunkBufferPool.capacityFor(len);
+  if (toCompress) {
+    bytes += chunkBufferPool.capacityFor(compressedBufferSize(len, lastChunk));
+  }
+  return bytes;
+}
+
+void Chunk::acquireMemory(int64_t bytes) {
+  memoryBudget.acquire(bytes);
+  memoryHeld = bytes;
+}
+
+bool Chunk::tryAcquireMemory(int64_t bytes) {
+  if (!memoryBudget.tryAcquire(bytes)) {
+    return false;
+  }
+  memoryHeld = bytes;
+  return true;
+}
+
+void Chunk::releaseMemory() {
+  if (memoryHeld > 0) {
+    memoryBudget.release(memoryHeld);
+    memoryHeld = 0;
+  }
+}
+
+void Chunk::traceStage(const char *name, int64_t startUs) {
+  if (chunkTracer.isEnabled()) {
+    tracedUs = chunkTracer.now();
+    chunkTracer.stage(name, parentFileIndex, index, startUs, tracedUs);
+  }
+}
+
+void Chunk::traceWait(const char *name) {
+  if (chunkTracer.isEnabled()) {
+    const int64_t endUs = chunkTracer.now();
+    chunkTracer.wait(name, parentFileIndex, index, tracedUs, endUs);
+    tracedUs = endUs;
+  }
+}
+
+ChunkAttempt &Chunk::attempt() {
+  if (!inFlight) {
+    inFlight.reset(new ChunkAttempt());
+  }
+  return *inFlight;
 }
 
 void Chunk::clear() {
-  // A trick for forcing a vector's contents to be deallocated: swap the
-  // memory from data into v; v will be destroyed when this function exits.
-  vector<char> v;
-  data.swap(v);
-  respData.clear();
+  // Return the memory block to the pool (for use by another chunk)
+  data.release();
+  // Drop the state of the upload attempt (a new one is allocated, if the chunk is retried)
+  inFlight.reset();
 }
 
 // HACK! HACK! HACK!
@@ -494,28 +723,34 @@ static bool attemptExplicitDNSResolve(const string &host) {
 }
 
 pair<string, dx::JSON> Chunk::uploadURL(Options &opt) {
+  ChunkAttempt &a = attempt();
   dx::JSON params(dx::JSON_OBJECT);
   params["index"] = index + 1;  // minimum part index is 1
-  params["size"] = data.size();
-  params["md5"] = dx::getHexifiedMD5(data);
+  params["size"] = uploadSize();
+  if (a.expectedMD5.empty()) {
+    // Not computed by the stage which produced the data (should not happen, but cheap to handle)
+    computeMD5();
+  }
+  params["md5"] = a.expectedMD5;
   log("Generating Upload URL for index = " + boost::lexical_cast<string>(params["index"].get<int>()));
-  dx::JSON result = fileUpload(fileID, params);
+  dx::JSON result = fileUpload(fileID(), params);
   pair<string, dx::JSON> toReturn = make_pair(result["url"].get<string>(), result["headers"]);
+  a.uploadURLExpires = (result.has("expires")) ? result["expires"].get<int64_t>() : 0;
   const string &url = toReturn.first;
-  log("/" + fileID + "/upload call returned this url: " + url);
+  log("/" + fileID() + "/upload call returned this url: " + url);
 
   if (!opt.noRoundRobinDNS) {
     // Now, try to resolve the host name in url to an ip address (for explicit round robin DNS)
     // If we are unable to do so, just leave the resolvedIP variable an empty string
-    resolvedIP.clear();
-    hostName = extractHostFromURL(url);
-    log("Host name extracted from URL ('" + url + "'): '" + hostName + "'");
+    a.resolvedIP.clear();
+    a.hostName = extractHostFromURL(url);
+    log("Host name extracted from URL ('" + url + "'): '" + a.hostName + "'");
 
-    if (attemptExplicitDNSResolve(hostName)) {
-      resolvedIP = getRandomIP(hostName);
-      log("Call to getRandomIP() returned: '" + resolvedIP + "'", dx::logWARNING);
+    if (attemptExplicitDNSResolve(a.hostName)) {
+      a.resolvedIP = getRandomIP(a.hostName);
+      log("Call to getRandomIP() returned: '" + a.resolvedIP + "'", dx::logWARNING);
     } else {
-      log("Not attempting to resolve hostname '" + hostName + "'");
+      log("Not attempting to resolve hostname '" + a.hostName + "'");
     }
   } else {
     log("Flag --no-round-robin-dns was set, so won't try to explicitly resolve ip address");
@@ -531,8 +766,8 @@ void Chunk::log(const string &message, const enum dx::LogLevel level) const {
 }
 
 ostream &operator<<(ostream &out, const Chunk &chunk) {
-  out << "[" << chunk.localFile << ":" << chunk.start << "-" << chunk.end
-      << " -> " << chunk.fileID << "[" << chunk.index << "]"
+  out << "[" << chunk.localFile() << ":" << chunk.start << "-" << chunk.end
+      << " -> " << chunk.fileID() << "[" << chunk.index << "]"
       << ", tries=" << chunk.triesLeft << ", data.size=" << chunk.data.size()
       << ", compress="<< ((chunk.toCompress) ? "true": "false")
       << "]";
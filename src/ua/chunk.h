@@ -18,15 +18,35 @@
 #define UA_CHUNK_H
 
 #include <queue>
+#include <string>
+#include <vector>
 #include <ctime>
 
 #include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <curl/curl.h>
 
 #include "dxjson/dxjson.h"
 #include "dxcpp/dxlog.h"
 #include "dxcpp/bqueue.h"
+#include "dxcpp/file_reader.h"
+#include "dxcpp/stage_stats.h"
 
 #include "options.h"
+#include "buffer_pool.h"
+#include "compression_pool.h"
+#include "bgzf.h"
+#include "chunk_stream.h"
+#include "curl_handle_pool.h"
+#include "upload_concurrency.h"
+#include "rate_limiter.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "resume_journal.h"
 
 class Chunk; // forward declaration
 
@@ -54,74 +74,297 @@ extern std::string userAgentString;
  * in main.cpp).
  */
 extern unsigned int totalChunks;
-extern dx::BlockingQueue<Chunk*> chunksFinished;
+
+/*
+ * A chunk uploaded successfully: all check_for_complete_chunks() needs of
+ * it (the Chunk itself is deleted once uploaded, and created again, see
+ * File::createChunk(), if its part is found not to be complete).
+ */
+struct FinishedChunk {
+  FinishedChunk() : fileIndex(0), index(0) {
+  }
+  FinishedChunk(const unsigned fileIndex_, const unsigned index_) : fileIndex(fileIndex_), index(index_) {
+  }
+
+  unsigned fileIndex;
+  unsigned index;
+};
+
+extern dx::BlockingQueue<FinishedChunk> chunksFinished;
 extern dx::BlockingQueue<Chunk*> chunksFailed;
 
-class Chunk {
-public:
+/* Pool of memory blocks from which chunk data is allocated (definition in main.cpp) */
+extern BufferPool chunkBufferPool;
+
+/* Shared (cached) descriptors of the local files, for reading chunks (definition in main.cpp) */
+extern dx::FileReader chunkFileReader;
+
+/*
+ * Threads on which blocks of chunks are compressed in parallel, and size of
+ * these blocks (0 if each chunk is compressed as a whole, by a single
+ * thread; see --compress-block-size). Definition in main.cpp
+ */
+extern CompressionPool compressionPool;
+extern size_t compressBlockSize;
+
+/* If true, chunks are compressed as BGZF blocks (see --bgzf). Definition in main.cpp */
+extern bool bgzfCompression;
+
+/* Easy handles (and connections) used to upload parts. Definition in main.cpp */
+extern CurlHandlePool uploadHandles;
+
+/* Adjusts the number of concurrent uploads, if --upload-threads=auto. Definition in main.cpp */
+extern UploadConcurrency uploadConcurrency;
+
+/* Limits the aggregate upload rate (--throttle, --throttle-schedule). Definition in main.cpp */
+extern RateLimiter uploadRateLimiter;
+
+/* Bounds the memory held by chunks in flight (--max-memory). Definition in main.cpp */
+extern MemoryBudget memoryBudget;
+
+/* Counters and latencies of the pipeline (--metrics-file). Definition in main.cpp */
+extern Metrics uploadMetrics;
+
+/* Records the stages, and waits, of each chunk (--trace-file). Definition in main.cpp */
+extern Tracer chunkTracer;
+
+/* Records the parts uploaded of each file (--resume-journal). Definition in main.cpp */
+extern ResumeJournal resumeJournal;
+
+/* Busy time of the read stage (--stage-stats). Definition in main.cpp */
+extern dx::StageStats readStage;
+
+/* Maximum size of the compressed data of a chunk of sourceLen bytes (excluding padding) */
+size_t chunkCompressBound(size_t sourceLen);
+
+/* Replaces contents of "dest" with gzip of the empty string */
+void get_empty_string_gzip(std::vector<char> &dest);
+
+class Chunk;
+
+/*
+ * An HTTP request uploading a chunk: the libcurl handle, and everything it
+ * points to (which must outlive the request). Cleaned up on destruction.
+ */
+struct UploadRequest : boost::noncopyable {
+  UploadRequest();
+  ~UploadRequest();
+
+  CURL *curl;
+  struct curl_slist *resolveList;
+  struct curl_slist *headers;
+  char errorBuffer[CURL_ERROR_SIZE + 1];
+
+  /* Whether "curl" can be used for another request (see CurlHandlePool::release()) */
+  bool reuseHandle;
+
+  /* Number of bytes uploaded so far (as last reported to the progress callback) */
+  int64_t uploadedBytes;
+
+  /* For streamed chunks: produces the data from the local file, while uploading */
+  boost::scoped_ptr<ChunkStream> stream;
+
+  /* Whether the upload URL was prefetched, and when the transfer started (for logging) */
+  bool urlPrefetched;
+  boost::posix_time::ptime transferStart;
 
-  Chunk(const std::string &localFile_, const std::string &fileID_, const unsigned int index_,
+  /* The chunk being uploaded (data for the read callbacks) */
+  Chunk *chunk;
+
+  /*
+   * If true (requests performed by the event loop of the "multi" upload
+   * engine, which must not block), the read callback pauses the transfer,
+   * and sets "paused", when uploadRateLimiter has no data to grant, rather
+   * than wait for it; MultiUploader resumes the transfer later.
+   */
+  bool pauseWhenThrottled;
+  bool paused;
+};
+
+/*
+ * Names of a file, shared by all of its chunks (see File::nextChunk()),
+ * rather than copied into each of them.
+ */
+struct ChunkFileNames {
+  ChunkFileNames(const std::string &localFile_, const std::string &fileID_)
+    : localFile(localFile_), fileID(fileID_) {
+  }
+
+  const std::string localFile;
+  const std::string fileID;
+};
+
+/*
+ * State of a chunk which only matters while it is in flight (from the time
+ * it is read, until its upload attempt is over): allocated on first use (see
+ * Chunk::attempt()), and dropped by Chunk::clear().
+ */
+struct ChunkAttempt {
+  ChunkAttempt() : uploadURLExpires(0), uploadOffset(0), urlFetchMs(0), transferMs(0) {
+  }
+
+  /*
+   * This stores the md5 sum of chunk (computed by UA), as the data is
+   * produced: by read() for chunks uploaded as is, by compress() for
+   * compressed chunks, by prepareStream() for streamed chunks, or, for data
+   * not produced by any of these, by computeMD5() (in the compress stage).
+   */
+  std::string expectedMD5;
+
+  /* Sizes of the BGZF blocks of the compressed data (--bgzf only; padding excluded) */
+  std::vector<BgzfBlock> bgzfBlocks;
+
+  /* This stores the HTTP response body */
+  std::string respData;
+
+  /*
+   * These variables (hostName and resolvedIP) facilitate DNS round robin
+   * scheme in UA.
+   */
+  /* Host name, extracted from URL returned by /file-xxxx/upload call */
+  std::string hostName;
+
+  /* Resolved IP for the hostName (using a random IP selector function) */
+  std::string resolvedIP;
+
+  /*
+   * Upload URL (and headers to send) of this chunk, if requested ahead of
+   * its upload by prefetchUploadURL(); used (once) by the next upload
+   * attempt, unless it expires too soon (uploadURLExpires is its expiry
+   * time, in milliseconds since the epoch, or 0 if unknown).
+   */
+  std::string prefetchedURL;
+  dx::JSON prefetchedHeaders;
+  int64_t uploadURLExpires;
+
+  /*
+   * Why the upload attempt failed, for metrics: "upload_url" (the
+   * /file-xxxx/upload call), "setup", "curl_<CURLcode>", "http_<status>", or
+   * "stream_mismatch"
+   */
+  std::string failureCause;
+
+  /* While uploading, the offset of the next byte to give to libcurl */
+  uint64_t uploadOffset;
+
+  /* Time it took to get the upload URL used by the attempt, and duration of its transfer (ms) */
+  int64_t urlFetchMs;
+  int64_t transferMs;
+};
+
+/*
+ * A part of a file to be uploaded. Besides its data (while in flight), a
+ * chunk only holds offsets, counters and flags: the names of its file are
+ * shared with the other chunks of the file, and whatever an upload attempt
+ * needs is kept in a ChunkAttempt, which only exists while it is in flight.
+ */
+class Chunk : boost::noncopyable {
+public:
+  Chunk(const boost::shared_ptr<const ChunkFileNames> &names_, const unsigned int index_,
         const unsigned int triesLeft_, const int64_t start_, const int64_t end_, const bool toCompress_, const bool lastChunk_, const unsigned parentFileIndex_)
-    : localFile(localFile_), fileID(fileID_), index(index_),
-      triesLeft(triesLeft_), start(start_), end(end_), uploadOffset(0), toCompress(toCompress_), lastChunk(lastChunk_), parentFileIndex(parentFileIndex_)
+    : names(names_), start(start_), end(end_), streamSize(0), memoryHeld(0), tracedUs(0), index(index_), triesLeft(triesLeft_), parentFileIndex(parentFileIndex_),
+      toCompress(toCompress_), lastChunk(lastChunk_), streamed(false)
   {
   }
-  
-  /* Name of the local file of which this chunk is a part */
-  std::string localFile;
 
-  /* ID of file object being uploaded */
-  std::string fileID;
+  /* Names of the file of which this chunk is a part (see localFile() and fileID()) */
+  boost::shared_ptr<const ChunkFileNames> names;
 
-  /* Index of this chunk within the file */
-  unsigned int index;
+  /* Name of the local file of which this chunk is a part */
+  const std::string &localFile() const { return names->localFile; }
 
-  /* Number of times we should try to upload this chunk */
-  unsigned int triesLeft;
+  /* ID of file object being uploaded */
+  const std::string &fileID() const { return names->fileID; }
 
   // TODO: What is the proper type for offsets within a file?
-
   /* Offset of the beginning of this chunk within the file */
   uint64_t start;
 
   /* Offset of the end of this chunk within the file */
   uint64_t end;
 
-  /* Chunk data -- the bytes to be uploaded */
-  std::vector<char> data;
+  /* Chunk data -- the bytes to be uploaded (allocated from chunkBufferPool) */
+  PooledBuffer data;
+
+  /* Size of the data to stream (see "streamed") */
+  uint64_t streamSize;
+
+  /*
+   * Bytes of memoryBudget held by the chunk (see memoryNeeded()): acquired
+   * before it is read, and released once its upload attempt is over (by
+   * uploadAttemptDone(), in main.cpp), the share of its uncompressed data
+   * as soon as it is compressed.
+   */
+  int64_t memoryHeld;
+
+  /* For --trace-file: when the last traced stage, or wait, of the chunk ended (see chunkTracer) */
+  int64_t tracedUs;
+
+  /* Index of this chunk within the file */
+  unsigned int index;
+
+  /* Number of times we should try to upload this chunk */
+  unsigned int triesLeft;
+
+  /* Index of parent file in Files vector (in main.cpp) */
+  unsigned parentFileIndex;
 
-  /* While uploading, the offset of the next byte to give to libcurl */
-  uint64_t uploadOffset;
-  
   /* If true, then the chunk will be compressed, else not */
   bool toCompress;
 
   /* true, if this chunk will be uploaded to last part index in the file */
   bool lastChunk;
 
-  /* Index of parent file in Files vector (in main.cpp) */
-  unsigned parentFileIndex;
-  
-  /* This stores the HTTP response body */
-  std::string respData;
- 
-  /* This stores the md5 sum of chunk (computed by UA) */
-  std::string expectedMD5;
-  
   /*
-   * These variables (hostName and resolvedIP) facilitate DNS round robin
-   * scheme in UA.
+   * If true (--stream-compress), the chunk data is never held in memory:
+   * prepareStream() computes its size (streamSize) and md5, and upload()
+   * produces it again from the local file (see ChunkStream).
    */
+  bool streamed;
 
-  /* Host name, extracted from URL returned by /file-xxxx/upload call */
-  std::string hostName;
-  
-  /* Resolved IP for the hostName (using a random IP selector function) */
-  std::string resolvedIP;
+  /* State of the upload attempt in progress (allocated if needed) */
+  ChunkAttempt &attempt();
+
+  /*
+   * Memory the chunk holds while in flight: the pool blocks of its data (of
+   * its compressed data as well, if it is compressed), or, if streamed, the
+   * buffers of its ChunkStream
+   */
+  int64_t memoryNeeded() const;
+  void acquireMemory(int64_t bytes);
+  bool tryAcquireMemory(int64_t bytes);
+  void releaseMemory();
+
+  /*
+   * For --trace-file: records stage "name" of the chunk, performed by the
+   * calling thread from startUs (chunkTracer.now()) until now, or the wait
+   * "name" of the chunk, since its last traced stage (or wait) ended
+   */
+  void traceStage(const char *name, int64_t startUs);
+  void traceWait(const char *name);
 
   void read();
   void compress();
+  void prepareStream();
+  void computeMD5();
+
+  /* Requests the upload URL of the chunk, for its next upload attempt (see ChunkAttempt::prefetchedURL) */
+  void prefetchUploadURL(Options &opt);
+
+  /* Uploads the chunk (blocking); throws runtime_error on failure */
   void upload(Options &opt);
+
+  /*
+   * The two halves of upload(), for callers performing the request
+   * themselves (see MultiUploader): startUpload() gets the upload URL, and
+   * configures "req"; finishUpload() checks the outcome of the request
+   * ("code" is the result of the transfer). Both throw runtime_error on failure.
+   */
+  void startUpload(Options &opt, UploadRequest &req);
+  void finishUpload(UploadRequest &req, CURLcode code);
+
+  /* Size of the data to upload (which may differ from end - start, because of compression) */
+  uint64_t uploadSize() const;
   void clear();
 
   void log(const std::string &message, const dx::LogLevel level = dx::logINFO) const;
@@ -130,6 +373,8 @@ public:
 private:
 
   std::pair<std::string, dx::JSON> uploadURL(Options &opt);
+
+  boost::scoped_ptr<ChunkAttempt> inFlight;
 };
 
 #endif
@@ -0,0 +1,75 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "chunk_cursor.h"
+
+#include "chunk.h"
+#include "file.h"
+#include "file_setup.h"
+#include "dxcpp/dxlog.h"
+
+#include <stdexcept>
+
+using namespace std;
+using namespace dx;
+
+ChunkCursor::ChunkCursor() : files(NULL), setup(NULL), tries(0), streamed(false), fileIndex(0) {
+}
+
+void ChunkCursor::start(FileList &files_, const FileSetup *setup_, const int tries_, const bool streamed_) {
+  boost::mutex::scoped_lock lock(mut);
+  files = &files_;
+  setup = setup_;
+  tries = tries_;
+  streamed = streamed_;
+  fileIndex = 0;
+}
+
+Chunk * ChunkCursor::next() {
+  boost::mutex::scoped_lock lock(mut);
+  if (files == NULL) {
+    return NULL;
+  }
+  while (fileIndex < files->size()) {
+    if (setup != NULL && !setup->ready(fileIndex)) {
+      return NULL;
+    }
+    File &f = (*files)[fileIndex];
+    Chunk *c = NULL;
+    try {
+      c = f.nextChunk(tries, streamed);
+    } catch (exception &e) {
+      // The remote file could not be described: none of its chunks can be uploaded
+      DXLOG(logUSERINFO) << "ERROR: Unable to create the chunks of \"" << f.localFile << "\": " << e.what() << endl;
+      f.failed = true;
+    }
+    if (c != NULL) {
+      ++totalChunks;
+      return c;
+    }
+    ++fileIndex;
+    if (files->isClosed() && fileIndex == files->size()) {
+      DXLOG(logINFO) << "Created " << totalChunks << " chunks.";
+    }
+  }
+  return NULL;
+}
+
+bool ChunkCursor::exhausted() const {
+  boost::mutex::scoped_lock lock(mut);
+  // Once closed, the size of the list is final
+  return (files == NULL || (files->isClosed() && fileIndex == files->size()));
+}
@@ -0,0 +1,70 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_CHUNK_CURSOR_H
+#define UA_CHUNK_CURSOR_H
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+class Chunk;
+class FileList;
+class FileSetup;
+
+/*
+ * Creates the chunks of all files to be uploaded, in order, only as they are
+ * asked for by the read stage (see File::nextChunk()), rather than all of
+ * them before the upload starts: the number of chunks in memory stays small
+ * no matter how many files (and parts) there are, and the first ones are
+ * read as soon as the first file is set up (see FileSetup). Files added to
+ * the list after start() get their chunks created as well: the cursor is only
+ * exhausted once the list is closed.
+ *
+ * Each chunk returned is counted in totalChunks.
+ */
+class ChunkCursor : boost::noncopyable {
+public:
+
+  ChunkCursor();
+
+  /*
+   * Starts creating the chunks of "files_" (which, as well as "setup_", must
+   * outlive the cursor). If setup_ is not NULL, the chunks of a file are only
+   * created once setup_ is done with it.
+   */
+  void start(FileList &files_, const FileSetup *setup_, const int tries_, const bool streamed_);
+
+  /*
+   * Returns the next chunk to be read, or NULL if all chunks were created, or
+   * if the next file is not added, or set up, yet (see exhausted())
+   */
+  Chunk * next();
+
+  /* Whether all chunks were created (i.e., next() will only return NULL) */
+  bool exhausted() const;
+
+private:
+
+  FileList *files;
+  const FileSetup *setup;
+  int tries;
+  bool streamed;
+
+  mutable boost::mutex mut;
+  size_t fileIndex; // file whose chunks are being created
+};
+
+#endif
@@ -0,0 +1,167 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "chunk_stream.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+
+#include "dxcpp/utils.h"
+#include "chunk.h"
+
+using namespace std;
+
+// Size of the blocks in which the file is read (and fed to deflate)
+const size_t STREAM_INPUT_BLOCK_SIZE = 1024 * 1024;
+
+// Size of the blocks in which the output is produced
+const size_t STREAM_OUTPUT_BLOCK_SIZE = 256 * 1024;
+
+// Minimum size of every part, except the last one (see Chunk::compress())
+const uint64_t MIN_PART_SIZE = 5 * 1024 * 1024;
+
+ChunkStream::ChunkStream(const string &localFile_, const int64_t start_, const int64_t end_,
+                         const bool compress_, const bool lastChunk_, const bool keepCached_)
+  : localFile(localFile_), start(start_), end(end_), compress(compress_), lastChunk(lastChunk_), keepCached(keepCached_),
+    inOffset(start_), outPos(0), outLen(0), zInitialized(false), zFinished(false), paddingLeft(0), produced(0) {
+  MD5_Init(&md5Ctx);
+  // Just like Chunk::compress(), an empty chunk is uploaded as is (even if it should be compressed)
+  if (start >= end) {
+    compress = false;
+  }
+  if (compress) {
+    memset(&zs, 0, sizeof(zs));
+    // Same parameters as gzCompress() (see compress.c)
+    int ret = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+      throw runtime_error("compression failed: deflateInit2() returned " + boost::lexical_cast<string>(ret));
+    }
+    zInitialized = true;
+    in.resize(STREAM_INPUT_BLOCK_SIZE);
+    out.resize(STREAM_OUTPUT_BLOCK_SIZE);
+  } else {
+    out.resize(STREAM_INPUT_BLOCK_SIZE);
+  }
+}
+
+ChunkStream::~ChunkStream() {
+  if (zInitialized) {
+    deflateEnd(&zs);
+  }
+}
+
+size_t ChunkStream::read(char *dest, size_t n) {
+  size_t copied = 0;
+  while (copied < n) {
+    if (outPos == outLen && !fill()) {
+      break;
+    }
+    const size_t toCopy = min(n - copied, outLen - outPos);
+    memcpy(dest + copied, &out[outPos], toCopy);
+    outPos += toCopy;
+    copied += toCopy;
+  }
+  return copied;
+}
+
+void ChunkStream::drain() {
+  outPos = outLen;
+  while (fill()) {
+    outPos = outLen;
+  }
+}
+
+string ChunkStream::md5() {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5_CTX ctx = md5Ctx; // so that md5() can be called more than once
+  MD5_Final(digest, &ctx);
+  return dx::hexifyMD5Digest(digest);
+}
+
+/*
+ * Produces the next block of output into "out" (and adds it to the MD5).
+ * Returns false at the end of the output.
+ */
+bool ChunkStream::fill() {
+  outPos = outLen = 0;
+  if (!compress) {
+    if (inOffset >= end) {
+      return false;
+    }
+    outLen = (size_t) min<int64_t>(out.size(), end - inOffset);
+    chunkFileReader.read(localFile, inOffset, outLen, &out[0], 0, keepCached);
+    inOffset += outLen;
+  } else if (!zFinished) {
+    if (!fillDeflate()) {
+      return false;
+    }
+  } else if (paddingLeft > 0) {
+    fillPadding();
+  } else {
+    return false;
+  }
+  MD5_Update(&md5Ctx, &out[0], outLen);
+  produced += outLen;
+  return true;
+}
+
+bool ChunkStream::fillDeflate() {
+  while (!zFinished) {
+    if (zs.avail_in == 0 && inOffset < end) {
+      const size_t len = (size_t) min<int64_t>(in.size(), end - inOffset);
+      chunkFileReader.read(localFile, inOffset, len, &in[0], 0, keepCached);
+      inOffset += len;
+      zs.next_in = (Bytef *) &in[0];
+      zs.avail_in = (uInt) len;
+    }
+    zs.next_out = (Bytef *) &out[0];
+    zs.avail_out = (uInt) out.size();
+    int ret = deflate(&zs, (inOffset == end) ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      zFinished = true;
+      // Pad with gzips of the empty string, if the chunk compressed below the minimum part size
+      if (!lastChunk && zs.total_out < MIN_PART_SIZE) {
+        get_empty_string_gzip(emptyGzip);
+        if (emptyGzip.empty()) {
+          throw runtime_error("Size of empty string's gzip is 0 bytes .. unexpected");
+        }
+        paddingLeft = (MIN_PART_SIZE - zs.total_out + emptyGzip.size() - 1) / emptyGzip.size();
+      }
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      throw runtime_error("compression failed: " + boost::lexical_cast<string>(ret));
+    }
+    outLen = out.size() - zs.avail_out;
+    if (outLen > 0) {
+      return true;
+    }
+  }
+  if (paddingLeft > 0) {
+    fillPadding();
+    return true;
+  }
+  return false;
+}
+
+void ChunkStream::fillPadding() {
+  const uint64_t copies = min<uint64_t>(paddingLeft, out.size() / emptyGzip.size());
+  for (uint64_t i = 0; i < copies; ++i) {
+    memcpy(&out[outLen], &emptyGzip[0], emptyGzip.size());
+    outLen += emptyGzip.size();
+  }
+  paddingLeft -= copies;
+}
@@ -0,0 +1,98 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_CHUNK_STREAM_H
+#define UA_CHUNK_STREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/utility.hpp>
+#include <openssl/md5.h>
+#include <zlib.h>
+
+/*
+ * Produces the data to upload for a chunk (--stream-compress mode) directly
+ * from the local file, a small block at a time, rather than holding the
+ * whole chunk (and its compressed copy) in memory: either the bytes of the
+ * file as they are, or their gzip, followed by padding with gzips of the
+ * empty string if the chunk compresses below 5 MB (see Chunk::compress()).
+ *
+ * The output is deterministic: the input is always fed to deflate in the
+ * same blocks, and deflate output is always collected in the same blocks.
+ * So the size and MD5 of the data, which the /file-xxxx/upload call needs
+ * up front, are computed by a first pass (drain()), and the data itself is
+ * produced again by a second pass (read()), while uploading.
+ */
+class ChunkStream : boost::noncopyable {
+public:
+
+  /*
+   * If keepCached_ is true, the data read from the file is not dropped from
+   * the page cache (since it will be read again by the second pass).
+   */
+  ChunkStream(const std::string &localFile_, const int64_t start_, const int64_t end_,
+              const bool compress_, const bool lastChunk_, const bool keepCached_);
+  ~ChunkStream();
+
+  /* Copies at most "n" bytes of the output into "dest"; returns 0 at the end of the output. */
+  size_t read(char *dest, size_t n);
+
+  /* Consumes (and discards) the rest of the output. */
+  void drain();
+
+  /* Number of bytes of output produced so far */
+  uint64_t size() const { return produced; }
+
+  /* Hex MD5 of the whole output (only valid once all of it was consumed) */
+  std::string md5();
+
+private:
+
+  bool fill();
+  bool fillDeflate();
+  void fillPadding();
+
+  std::string localFile;
+  int64_t start;
+  int64_t end;
+  bool compress;
+  bool lastChunk;
+  bool keepCached;
+
+  /* Offset (in the file) of the next byte to read */
+  int64_t inOffset;
+
+  /* Block of output, and position of the next byte to hand out */
+  std::vector<char> out;
+  size_t outPos;
+  size_t outLen;
+
+  std::vector<char> in;
+  z_stream zs;
+  bool zInitialized;
+  bool zFinished;
+
+  /* Gzip of the empty string, and how many more copies of it to output */
+  std::vector<char> emptyGzip;
+  uint64_t paddingLeft;
+
+  uint64_t produced;
+  MD5_CTX md5Ctx;
+};
+
+#endif
@@ -88,3 +88,51 @@ int gzCompress(Bytef * dest, uLongf * destLen, const Bytef * source, uLong sourc
 uLong gzCompressBound(uLong sourceLen) {
   return compressBound(sourceLen) + 136;
 }
+
+/* ===========================================================================
+   Same as gzCompress(), except that the compressed data is produced in
+   windows of at most windowSize bytes, and that onOutput (if not NULL) is
+   called with each window, as soon as it is produced (while it is still
+   in the cache), e.g., to compute a checksum of the output incrementally.
+*/
+int gzCompressWindowed(Bytef * dest, uLongf * destLen, const Bytef * source, uLong sourceLen, int level,
+                       uLong windowSize, void (*onOutput)(void *opaque, const Bytef *data, uLong len), void *opaque) {
+  z_stream stream;
+  int err;
+  uLong left = *destLen;
+
+  stream.next_in = (Bytef *) source;
+  stream.avail_in = (uInt) sourceLen;
+  stream.next_out = dest;
+  stream.avail_out = 0;
+  stream.zalloc = (alloc_func) 0;
+  stream.zfree = (free_func) 0;
+  stream.opaque = (voidpf) 0;
+
+  if ((uLong) stream.avail_in != sourceLen || windowSize == 0) return Z_BUF_ERROR;
+
+  err = deflateInit2(&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+  if (err != Z_OK) return err;
+
+  do {
+    Bytef *window = stream.next_out;
+    if (left == 0) {
+      deflateEnd(&stream);
+      return Z_BUF_ERROR;
+    }
+    stream.avail_out = (uInt) ((left < windowSize) ? left : windowSize);
+    left -= stream.avail_out;
+    err = deflate(&stream, Z_FINISH);
+    if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+      deflateEnd(&stream);
+      return err;
+    }
+    left += stream.avail_out;
+    if (onOutput != 0 && stream.next_out > window) {
+      onOutput(opaque, window, (uLong) (stream.next_out - window));
+    }
+  } while (err != Z_STREAM_END);
+  *destLen = stream.total_out;
+
+  return deflateEnd(&stream);
+}
@@ -23,5 +23,7 @@
 
 uLong gzCompressBound(uLong sourceLen);
 int gzCompress(Bytef * dest, uLongf * destLen, const Bytef * source, uLong sourceLen, int level);
+int gzCompressWindowed(Bytef * dest, uLongf * destLen, const Bytef * source, uLong sourceLen, int level,
+                       uLong windowSize, void (*onOutput)(void *opaque, const Bytef *data, uLong len), void *opaque);
 
 #endif
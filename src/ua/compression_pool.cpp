@@ -0,0 +1,251 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "compression_pool.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <zlib.h>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+
+CompressionPool::CompressionPool() {
+}
+
+void CompressionPool::start(int numThreads_) {
+  DXLOG(logINFO) << "Starting " << numThreads_ << " block compression threads";
+  for (int i = 0; i < numThreads_; ++i) {
+    threads.push_back(new boost::thread(boost::bind(&CompressionPool::worker, this)));
+  }
+}
+
+void CompressionPool::stop() {
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->interrupt();
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  threads.clear();
+}
+
+void CompressionPool::run(const vector<boost::function<void ()> > &tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+  Batch batch;
+  batch.remaining = tasks.size();
+  vector<Task> queued(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    queued[i].work = tasks[i];
+    queued[i].batch = &batch;
+    queue.produce(&queued[i]);
+  }
+
+  // Help with whatever is queued, rather than sitting idle
+  Task *task;
+  while (queue.tryConsume(task)) {
+    execute(task);
+  }
+
+  // Wait for the tasks still being executed by other threads: "batch" and
+  // "queued" must outlive them. Not an interruption point, for that reason.
+  {
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(batch.mut);
+    while (batch.remaining > 0) {
+      batch.done.wait(lock);
+    }
+  }
+  boost::this_thread::interruption_point();
+  if (batch.failed) {
+    throw runtime_error(batch.error);
+  }
+}
+
+void CompressionPool::worker() {
+  try {
+    while (true) {
+      execute(queue.consume());
+    }
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
+
+void CompressionPool::execute(Task *task) {
+  bool failed = false;
+  string error;
+  try {
+    task->work();
+  } catch (exception &e) {
+    failed = true;
+    error = e.what();
+  }
+  Batch *batch = task->batch;
+  boost::unique_lock<boost::mutex> lock(batch->mut);
+  if (failed && !batch->failed) {
+    batch->failed = true;
+    batch->error = error;
+  }
+  if (--batch->remaining == 0) {
+    batch->done.notify_all();
+  }
+}
+
+/* Size of the deflate window, i.e., of the dictionary each block is primed with */
+static const size_t DICTIONARY_SIZE = 32 * 1024;
+
+static const size_t GZIP_HEADER_SIZE = 10;
+static const size_t GZIP_TRAILER_SIZE = 8;
+
+/*
+ * Room reserved for the compressed data of a block of "len" bytes: the
+ * bound of compress(), plus the few bytes of the (empty stored block)
+ * marker written by Z_SYNC_FLUSH.
+ */
+static size_t blockBound(size_t len) {
+  return compressBound((uLong) len) + 16;
+}
+
+size_t gzCompressBlocksBound(size_t sourceLen, size_t blockSize) {
+  const size_t numBlocks = max<size_t>(1, (sourceLen + blockSize - 1) / blockSize);
+  const size_t lastLen = sourceLen - (numBlocks - 1) * blockSize;
+  return GZIP_HEADER_SIZE + (numBlocks - 1) * blockBound(blockSize) + blockBound(lastLen) + GZIP_TRAILER_SIZE;
+}
+
+/* A block of input, and where its compressed data goes */
+struct DeflateBlock {
+  const char *in;
+  size_t inLen;
+  const char *dict;
+  size_t dictLen;
+  bool last;
+  int level;
+
+  char *out;
+  size_t outCapacity;
+  size_t outLen;
+  uLong crc;
+  int status;
+};
+
+/*
+ * Deflates a block as raw deflate data (no header), which ends on a byte
+ * boundary (Z_SYNC_FLUSH) so that it can be concatenated with the next
+ * block, or terminates the deflate stream (Z_FINISH) if it is the last one.
+ */
+static void deflateBlock(DeflateBlock *b) {
+  b->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *) b->in, (uInt) b->inLen);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  b->status = deflateInit2(&stream, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  if (b->status != Z_OK) {
+    return;
+  }
+  if (b->dictLen > 0) {
+    b->status = deflateSetDictionary(&stream, (const Bytef *) b->dict, (uInt) b->dictLen);
+    if (b->status != Z_OK) {
+      deflateEnd(&stream);
+      return;
+    }
+  }
+  stream.next_in = (Bytef *) b->in;
+  stream.avail_in = (uInt) b->inLen;
+  stream.next_out = (Bytef *) b->out;
+  stream.avail_out = (uInt) b->outCapacity;
+
+  int err = deflate(&stream, (b->last) ? Z_FINISH : Z_SYNC_FLUSH);
+  if (b->last) {
+    b->status = (err == Z_STREAM_END) ? Z_OK : ((err == Z_OK) ? Z_BUF_ERROR : err);
+  } else {
+    // The flush is complete only if deflate did not run out of room
+    b->status = (err != Z_OK) ? err : ((stream.avail_out == 0 || stream.avail_in != 0) ? Z_BUF_ERROR : Z_OK);
+  }
+  b->outLen = stream.total_out;
+  deflateEnd(&stream);
+}
+
+static void putLE32(char *p, uLong v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (char) ((v >> (8 * i)) & 0xff);
+  }
+}
+
+int gzCompressParallel(CompressionPool &pool, char *dest, size_t &destLen,
+                       const char *source, size_t sourceLen, size_t blockSize, int level, MD5_CTX *md5) {
+  if (destLen < gzCompressBlocksBound(sourceLen, blockSize)) {
+    return Z_BUF_ERROR;
+  }
+  const size_t numBlocks = max<size_t>(1, (sourceLen + blockSize - 1) / blockSize);
+  vector<DeflateBlock> blocks(numBlocks);
+  vector<boost::function<void ()> > tasks(numBlocks);
+  for (size_t i = 0; i < numBlocks; ++i) {
+    DeflateBlock &b = blocks[i];
+    const size_t offset = i * blockSize;
+    b.in = source + offset;
+    b.inLen = min(blockSize, sourceLen - offset);
+    b.dictLen = min(offset, DICTIONARY_SIZE);
+    b.dict = b.in - b.dictLen;
+    b.last = (i == numBlocks - 1);
+    b.level = level;
+    // Every block is compressed directly into its own region of "dest"; the
+    // regions are then moved back to back (see below)
+    b.out = dest + GZIP_HEADER_SIZE + i * blockBound(blockSize);
+    b.outCapacity = blockBound(b.inLen);
+    b.outLen = 0;
+    b.status = Z_OK;
+    tasks[i] = boost::bind(deflateBlock, &b);
+  }
+  pool.run(tasks);
+
+  // Header of a gzip member, as written by deflate (no file name, no mtime)
+  const char xfl = (level == 9) ? 2 : ((level == 1) ? 4 : 0);
+  const char header[GZIP_HEADER_SIZE] = {(char) 0x1f, (char) 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, xfl, 3};
+  memcpy(dest, header, GZIP_HEADER_SIZE);
+  if (md5 != NULL) {
+    MD5_Update(md5, dest, GZIP_HEADER_SIZE);
+  }
+
+  size_t pos = GZIP_HEADER_SIZE;
+  uLong crc = crc32(0L, Z_NULL, 0);
+  for (size_t i = 0; i < numBlocks; ++i) {
+    const DeflateBlock &b = blocks[i];
+    if (b.status != Z_OK) {
+      return b.status;
+    }
+    memmove(dest + pos, b.out, b.outLen);
+    if (md5 != NULL) {
+      MD5_Update(md5, dest + pos, b.outLen);
+    }
+    pos += b.outLen;
+    crc = crc32_combine(crc, b.crc, (z_off_t) b.inLen);
+  }
+  putLE32(dest + pos, crc);
+  putLE32(dest + pos + 4, (uLong) (sourceLen & 0xffffffffUL));
+  if (md5 != NULL) {
+    MD5_Update(md5, dest + pos, GZIP_TRAILER_SIZE);
+  }
+  destLen = pos + GZIP_TRAILER_SIZE;
+  return Z_OK;
+}
@@ -0,0 +1,103 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_COMPRESSION_POOL_H
+#define UA_COMPRESSION_POOL_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <openssl/md5.h>
+
+#include "dxcpp/bqueue.h"
+
+/*
+ * A pool of worker threads, shared by all the compress threads, on which
+ * the blocks of a chunk are compressed in parallel (so that even a single
+ * large file can keep every core busy).
+ *
+ * A caller of run() does not sit idle while its tasks are pending: it
+ * executes queued tasks (its own, or other callers') itself, and only
+ * waits once the queue is empty.
+ */
+class CompressionPool : boost::noncopyable {
+public:
+
+  CompressionPool();
+
+  /* Starts numThreads_ worker threads. */
+  void start(int numThreads_);
+
+  /* Interrupts, and joins, the worker threads. */
+  void stop();
+
+  bool isRunning() const { return !threads.empty(); }
+
+  /*
+   * Executes all the tasks, and returns once every one of them is done.
+   * If a task throws, the error is rethrown (as a runtime_error) once all
+   * the other tasks are done.
+   */
+  void run(const std::vector<boost::function<void ()> > &tasks);
+
+private:
+
+  /* Tasks submitted by one call to run() */
+  struct Batch {
+    Batch() : remaining(0), failed(false) {}
+    boost::mutex mut;
+    boost::condition_variable done;
+    size_t remaining;
+    bool failed;
+    std::string error;
+  };
+
+  struct Task {
+    boost::function<void ()> work;
+    Batch *batch;
+  };
+
+  void worker();
+  static void execute(Task *task);
+
+  dx::BlockingQueue<Task *> queue;
+  std::vector<boost::thread *> threads;
+};
+
+/*
+ * Compresses "source" into "dest" as a single gzip member (pigz-style):
+ * the input is split into blocks of blockSize bytes, which are deflated
+ * independently on "pool", each primed with the last 32 KB of the block
+ * preceding it as dictionary, and then concatenated between a single gzip
+ * header and trailer. The output does not depend on the number of threads.
+ *
+ * Same contract as gzCompress(): destLen is the size of "dest" on entry,
+ * and the size of the compressed data on exit; returns a zlib status code.
+ * "dest" must have room for at least gzCompressBlocksBound(sourceLen, blockSize) bytes.
+ * If md5 is not NULL, it is updated with the output, block by block, as
+ * the blocks are put together.
+ */
+int gzCompressParallel(CompressionPool &pool, char *dest, size_t &destLen,
+                       const char *source, size_t sourceLen, size_t blockSize, int level, MD5_CTX *md5);
+
+/* Upper bound on the size of the output of gzCompressParallel() */
+size_t gzCompressBlocksBound(size_t sourceLen, size_t blockSize);
+
+#endif
@@ -0,0 +1,123 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "curl_handle_pool.h"
+
+#include <stdexcept>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+
+CurlHandlePool::CurlHandlePool() : share(NULL), inUse(0), created(0), reused(0) {
+}
+
+CurlHandlePool::~CurlHandlePool() {
+  clear();
+}
+
+void CurlHandlePool::lockShare(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+  static_cast<CurlHandlePool *>(userptr)->shareMutexes[data].lock();
+}
+
+void CurlHandlePool::unlockShare(CURL *, curl_lock_data data, void *userptr) {
+  static_cast<CurlHandlePool *>(userptr)->shareMutexes[data].unlock();
+}
+
+CURL *CurlHandlePool::acquire() {
+  boost::mutex::scoped_lock lock(mut);
+  if (!idle.empty()) {
+    CURL *curl = idle.back();
+    idle.pop_back();
+    ++inUse;
+    return curl;
+  }
+
+  // The share object is created on first use (i.e., after curl_global_init())
+  if (share == NULL) {
+    share = curl_share_init();
+    if (share == NULL) {
+      throw runtime_error("An error occurred when initializing the HTTP library (curl_share_init)");
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // Not the connection cache: libcurl does not support sharing it between
+    // handles used by concurrent threads (the upload threads). Each handle
+    // keeps its own connection alive instead.
+  }
+
+  CURL *curl = curl_easy_init();
+  if (curl == NULL) {
+    throw runtime_error("An error occurred when initializing the HTTP connection");
+  }
+  curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  ++inUse;
+  return curl;
+}
+
+void CurlHandlePool::release(CURL *curl, bool reuse) {
+  boost::mutex::scoped_lock lock(mut);
+  --inUse;
+  if (reuse) {
+    // Forgets the options of the previous request (some of which point to
+    // memory that is about to be freed), but keeps its connection, and the
+    // share object (which curl_easy_reset() leaves alone)
+    curl_easy_reset(curl);
+    idle.push_back(curl);
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
+
+void CurlHandlePool::recordTransfer(CURL *curl) {
+  long numConnects = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &numConnects) != CURLE_OK) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(mut);
+  if (numConnects > 0) {
+    created += numConnects;
+  } else {
+    ++reused;
+  }
+}
+
+int64_t CurlHandlePool::connectionsCreated() const {
+  boost::mutex::scoped_lock lock(mut);
+  return created;
+}
+
+int64_t CurlHandlePool::connectionsReused() const {
+  boost::mutex::scoped_lock lock(mut);
+  return reused;
+}
+
+void CurlHandlePool::clear() {
+  boost::mutex::scoped_lock lock(mut);
+  for (unsigned i = 0; i < idle.size(); ++i) {
+    curl_easy_cleanup(idle[i]);
+  }
+  idle.clear();
+  // Handles still in use (by threads which were interrupted in the middle
+  // of an upload, say) would refer to a freed share object
+  if (inUse == 0 && share != NULL) {
+    curl_share_cleanup(share);
+    share = NULL;
+  }
+}
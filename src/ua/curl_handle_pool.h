@@ -0,0 +1,87 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_CURL_HANDLE_POOL_H
+#define UA_CURL_HANDLE_POOL_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <curl/curl.h>
+
+/*
+ * Easy handles used to upload parts, kept from one part to the next so
+ * that each part does not pay for a new TCP connection, TLS handshake and
+ * TCP slow start: a handle keeps its connection open once its request is
+ * over, and the next part uploaded with it (by the same upload thread,
+ * typically, since each thread releases its handle before acquiring one for
+ * its next part) reuses it.
+ *
+ * All handles also share their DNS cache and TLS session cache (through a
+ * curl_share object), so that a new connection of any of them resumes a TLS
+ * session opened by any other, rather than doing a full handshake.
+ */
+class CurlHandlePool : boost::noncopyable {
+public:
+
+  CurlHandlePool();
+  ~CurlHandlePool();
+
+  /*
+   * Returns an idle handle (or a new one, if there is none), with all its
+   * options at their default values. Throws runtime_error on failure.
+   */
+  CURL *acquire();
+
+  /*
+   * Gives back a handle obtained from acquire(). If "reuse" is false (e.g.,
+   * the request failed), the handle is closed rather than kept (libcurl
+   * itself closes the connection, rather than caching it, if it is no longer
+   * usable).
+   */
+  void release(CURL *curl, bool reuse);
+
+  /*
+   * Accounts for the connections used by the (successful) request just
+   * performed with "curl": either it reused a connection, or it created one.
+   */
+  void recordTransfer(CURL *curl);
+
+  int64_t connectionsCreated() const;
+  int64_t connectionsReused() const;
+
+  /* Closes the idle handles (and the share object, once no handle is in use) */
+  void clear();
+
+private:
+
+  static void lockShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+  static void unlockShare(CURL *handle, curl_lock_data data, void *userptr);
+
+  CURLSH *share;
+  boost::mutex shareMutexes[CURL_LOCK_DATA_LAST];
+
+  mutable boost::mutex mut;
+  std::vector<CURL *> idle;
+  int inUse;
+
+  int64_t created;
+  int64_t reused;
+};
+
+#endif
@@ -31,28 +31,21 @@ using namespace dx;
 
 #define MAX_UPLOAD_CHUNKS 10000 // Maximum number of chunks that amazon can process for a single file
 
-string File::createResumeInfoString(const uint64_t fileSize, const int64_t modifiedTimestamp, const bool toCompress, const uint64_t chunkSize, const string &path) {
+string File::createResumeInfoString(const uint64_t fileSize, const int64_t modifiedTimestamp, const bool toCompress, const bool bgzf, const uint64_t chunkSize, const string &path) {
   using namespace boost;
   string toReturn;
   toReturn += lexical_cast<string>(fileSize) + " ";
   toReturn += lexical_cast<string>(modifiedTimestamp) + " ";
   toReturn += lexical_cast<string>(toCompress) + " ";
+  // Only added for BGZF, so that signatures of regular uploads are unchanged
+  if (toCompress && bgzf) {
+    toReturn += "bgzf ";
+  }
   toReturn += lexical_cast<string>(chunkSize) + " ";
   toReturn += path;
   return toReturn;
 }
 
-void testLocalFileExists(const string &filename) {
-  DXLOG(logINFO) << "Testing existence of local file " << filename << "...";
-  fs::path p(filename);
-  if (fs::exists(p)) {
-    DXLOG(logINFO) << " success.";
-  } else {
-    DXLOG(logINFO) << " failure.";
-    throw runtime_error("Local file " + filename + " does not exist.");
-  }
-}
-
 int numberOfCompletedParts(const dx::JSON &parts) {
   int64_t numParts = 0;
   for (dx::JSON::const_object_iterator it = parts.object_begin(); it != parts.object_end(); ++it) {
@@ -79,25 +72,44 @@ double percentageComplete(const dx::JSON &parts, const int64_t size, const int64
   return (double(totalBytesUploaded) / size) * 100.0;
 }
 
-File::File(const string &localFile_, const string &projectSpec_, const string &folder_, const string &name_,
+File::File(const LocalFile &local, const string &projectSpec_,
 	   const std::string &visibility_, const dx::JSON &properties_, 
 	   const dx::JSON &type_, const dx::JSON &tags_, const dx::JSON &details_,
-           const bool toCompress_, const bool tryResuming, const string &mimeType_,
+           const bool toCompress_, const string &mimeType_,
            const int64_t chunkSize_, const unsigned fileIndex_, const bool standardInput_)
-  : localFile(localFile_), projectSpec(projectSpec_), folder(folder_), name(name_),
+  : localFile(local.path), projectSpec(projectSpec_), folder(local.folder), name(local.name),
     visibility(visibility_), properties(properties_), type(type_), tags(tags_), details(details_),
-    failed(false), waitOnClose(false), closed(false), toCompress(toCompress_), mimeType(mimeType_),
-    chunkSize(chunkSize_), bytesUploaded(0), fileIndex(fileIndex_), atleastOnePartDone(false), jobID(), standardInput(standardInput_) {
+    failed(false), waitOnClose(false), closed(false), toCompress(toCompress_), isRemoteFileOpen(false), mimeType(mimeType_),
+    chunkSize(chunkSize_), size(0), bytesUploaded(0), fileIndex(fileIndex_), atleastOnePartDone(false), jobID(), standardInput(standardInput_),
+    bgzfIndexComplete(true), chunksStarted(false), chunkCount(0), nextChunkIndex(0), journaled(false) {
 
-  if (!standardInput) {
-    init(tryResuming);
-  } else {
-    init();
+  if (standardInput) {
+    return;
   }
+  size = local.size;
+  if (size == 0) {
+    // Never try to compress empty file!
+    toCompress = false;
+  }
+
+  if ( chunkSize * MAX_UPLOAD_CHUNKS < size) {
+    chunkSize = size / MAX_UPLOAD_CHUNKS + ( (size % MAX_UPLOAD_CHUNKS) ? 1 : 0);
+    DXLOG(logWARNING) << "Chunk-size too small, will change to " << chunkSize;
+  }
+
+  //dx::JSON properties(dx::JSON_OBJECT);
+
+  // Add property {FILE_SIGNATURE_PROPERTY: "<size> <modified time stamp> <toCompress> <chunkSize> <name of file>"
+  signature = File::createResumeInfoString(size, local.modifiedTimestamp, toCompress, bgzfCompression, chunkSize, local.canonicalPath);
+  properties[FILE_SIGNATURE_PROPERTY] = signature;
+
+  DXLOG(logINFO) << "Resume info string: '" << properties[FILE_SIGNATURE_PROPERTY].get<string>() << "'"; 
 }
 
 void File::init(){
-  projectID = resolveProject(projectSpec);
+  if (projectID.empty()) {
+    projectID = resolveProject(projectSpec);
+  }
   string remoteFileName = name;
   if (toCompress)
     remoteFileName += ".gz";
@@ -106,21 +118,14 @@ void File::init(){
   DXLOG(logINFO) << "fileID is " << fileID << endl;
 }
 
-void File::init(const bool tryResuming) {
-  projectID = resolveProject(projectSpec);
-
-  testLocalFileExists(localFile);
-
-  fs::path p(localFile);
-  size = fs::file_size(p);
-  if (size == 0) {
-    // Never try to compress empty file!
-    toCompress = false;
+void File::init(ResumeIndex *resumeIndex) {
+  if (projectID.empty()) {
+    projectID = resolveProject(projectSpec);
   }
+  destination = dx::config::APISERVER() + " " + projectID + ":" + folder + (folder == "/" ? "" : "/") + name;
 
-  if ( chunkSize * MAX_UPLOAD_CHUNKS < size) {
-    chunkSize = size / MAX_UPLOAD_CHUNKS + ( (size % MAX_UPLOAD_CHUNKS) ? 1 : 0);
-    DXLOG(logWARNING) << "Chunk-size too small, will change to " << chunkSize;
+  if ((resumeIndex != NULL) && resumeFromJournal()) {
+    return;
   }
 
   string remoteFileName = name;
@@ -128,17 +133,10 @@ void File::init(const bool tryResuming) {
   if (toCompress)
     remoteFileName += ".gz";
 
-  const int64_t modifiedTimestamp = static_cast<int64_t>(fs::last_write_time(p));
-  //dx::JSON properties(dx::JSON_OBJECT);
-
-  // Add property {FILE_SIGNATURE_PROPERTY: "<size> <modified time stamp> <toCompress> <chunkSize> <name of file>"
-  properties[FILE_SIGNATURE_PROPERTY] = File::createResumeInfoString(size, modifiedTimestamp, toCompress, chunkSize, fs::canonical(p).generic_string());
-
-  DXLOG(logINFO) << "Resume info string: '" << properties[FILE_SIGNATURE_PROPERTY].get<string>() << "'"; 
   dx::JSON findResult;
-  if (tryResuming) {
+  if (resumeIndex != NULL) {
     // Now check if a resumable file already exist in the project
-    findResult = findResumableFileObject(projectID, properties[FILE_SIGNATURE_PROPERTY].get<string>());
+    findResult = resumeIndex->find(projectID, folder, signature);
     if (findResult.size() == 1) {
       fileID = findResult[0]["id"].get<string>();
       double completePercentage;
@@ -150,6 +148,9 @@ void File::init(const bool tryResuming) {
       } else {
         completePercentage = percentageComplete(findResult[0]["describe"]["parts"], size, chunkSize);
         isRemoteFileOpen = true;
+        if (findResult[0]["describe"].has("parts")) {
+          remoteParts = findResult[0]["describe"]["parts"];
+        }
       }
       DXLOG(logINFO) << "A resume target is found .. " << endl;
       if (isRemoteFileOpen) {
@@ -168,7 +169,7 @@ void File::init(const bool tryResuming) {
     }
     if (findResult.size() > 1) {
       ostringstream oss;
-      oss << endl << "More than one resumable targets for local file \"" << localFile << "\" found in the project '" + projectID + "', candidates: " << endl;
+      oss << endl << "More than one resumable targets for local file \"" << localFile << "\" found in the folder '" + folder + "' of project '" + projectID + "', candidates: " << endl;
       for (unsigned i = 0; i < findResult.size(); ++i) {
         oss << "\t" << (i + 1) << ". " << findResult[i]["describe"]["name"].get<string>() << " (" << findResult[i]["id"].get<string>() << ")" << endl;
       }
@@ -178,68 +179,142 @@ void File::init(const bool tryResuming) {
       failed = true;
     }
   }
-  if (!tryResuming || (findResult.size() == 0)) {
+  if ((resumeIndex == NULL) || (findResult.size() == 0)) {
     // Note: It's fine if mimeType is empty string "" (since default for /file/new is anyway empty media type)
     fileID = createFileObject(projectID, folder, remoteFileName, mimeType, properties, type, tags, visibility, details);
     isRemoteFileOpen = true;
+    // A new file has no parts yet (no need to describe it)
+    remoteParts = dx::JSON(dx::JSON_OBJECT);
     DXLOG(logINFO) << "fileID is " << fileID << endl;
 
     DXLOG(logUSERINFO) << "Uploading file " << localFile << " to file object " << fileID;
   }
+  if (isRemoteFileOpen && !failed) {
+    resumeJournal.begin(journalKey(), fileID, destination, chunkSize, toCompress);
+  }
+}
+
+/*
+ * Resumes the upload from the resume journal of the file, if any: the parts
+ * it shows as uploaded are taken to be complete (see missingJournaledChunks()).
+ */
+bool File::resumeFromJournal() {
+  JournaledFile journal;
+  if (!resumeJournal.read(journalKey(), journal)) {
+    return false;
+  }
+  if (journal.destination != destination) {
+    DXLOG(logWARNING) << "Ignoring the resume journal of " << localFile << ": it is of an upload to " << journal.destination
+                      << ", not " << destination;
+    return false;
+  }
+  if (journal.chunkSize != chunkSize || journal.toCompress != toCompress) {
+    DXLOG(logWARNING) << "Ignoring the resume journal of " << localFile << ": chunk size, or compression, differ";
+    return false;
+  }
+  fileID = journal.fileID;
+  isRemoteFileOpen = true;
+  journaled = true;
+  journaledParts = journal.parts;
+  remoteParts = dx::JSON(dx::JSON_OBJECT);
+  for (map<unsigned int, string>::const_iterator it = journaledParts.begin(); it != journaledParts.end(); ++it) {
+    dx::JSON part(dx::JSON_OBJECT);
+    part["state"] = "complete";
+    part["md5"] = it->second;
+    remoteParts[boost::lexical_cast<string>(it->first)] = part;
+  }
+  DXLOG(logUSERINFO)
+    << "Resume journal of file " << localFile << " shows remote file " << fileID << " is "
+    << percentageComplete(remoteParts, size, chunkSize) << "% complete. Will resume uploading to it." << endl;
+  return true;
 }
 
-unsigned int File::createChunks(dx::BlockingQueue<Chunk *> &queue, const int tries) {
+vector<unsigned int> File::missingJournaledChunks() const {
+  const dx::JSON desc = dx::fileDescribe(fileID);
+  if (desc["state"].get<string>() != "open") {
+    throw runtime_error("remote file " + fileID + " is in state \"" + desc["state"].get<string>() + "\"");
+  }
+  vector<unsigned int> missing;
+  for (map<unsigned int, string>::const_iterator it = journaledParts.begin(); it != journaledParts.end(); ++it) {
+    const string partIndex = boost::lexical_cast<string>(it->first);
+    if (!desc["parts"].has(partIndex) || desc["parts"][partIndex]["state"].get<string>() != "complete" ||
+        (desc["parts"][partIndex].has("md5") && desc["parts"][partIndex]["md5"].get<string>() != it->second)) {
+      DXLOG(logINFO) << "Part index " << partIndex << " of " << fileID << " is not complete (or differs), unlike in the resume journal";
+      missing.push_back(it->first - 1);
+    }
+  }
+  return missing;
+}
+
+void File::startChunks() {
+  chunksStarted = true;
+  chunkNames.reset(new ChunkFileNames(localFile, fileID));
   if (failed || (!isRemoteFileOpen)) {
     // This is the case when:
     // 1. Multiple resumable targets exist for a file (an do-not-resume is not set).
     // 2. OR, Remote resumable target is already in "closing" or "closed" state.
-    return 0;
+    return;
+  }
+  dx::JSON parts;
+  if (remoteParts.type() == dx::JSON_OBJECT) {
+    parts = remoteParts;
+    remoteParts = dx::JSON();
+  } else {
+    const dx::JSON desc = dx::fileDescribe(fileID);
+    // sanity check
+    assert(desc["state"].get<string>() == "open");
+    parts = desc["parts"];
   }
-  const dx::JSON desc = dx::fileDescribe(fileID);
-  // sanity check
-  assert(desc["state"].get<string>() == "open");
 
-  // Treat special case of empty file here
-  if (size == 0) {
-    if (desc["parts"].has("1") && desc["parts"]["1"]["state"].get<string>() == "complete") {
-      DXLOG(logINFO) << "Part index 1 for fileID " << fileID << " is in complete state. Will not create an upload chunk for it.";
+  DXLOG(logINFO) << "Creating chunks of " << localFile << ":";
+  // An empty file is uploaded as a single (empty) chunk
+  chunkCount = (size == 0) ? 1 : (unsigned int) ((size + chunkSize - 1) / chunkSize);
+  for (unsigned int i = 0; i < chunkCount; ++i) {
+    string partIndex = boost::lexical_cast<string>(i + 1); // minimum part index is 1
+    if (parts.has(partIndex) && parts[partIndex]["state"].get<string>() == "complete") {
+      DXLOG(logINFO) << "Part index " << partIndex << " for fileID " << fileID << " is in complete state. Will not create an upload chunk for it.";
+      const uint64_t start = i * chunkSize;
+      bytesUploaded += (min(start + chunkSize, size) - start);
       atleastOnePartDone = true;
-      return 0;
+      if (size > 0) {
+        // The BGZF blocks of this part are unknown
+        bgzfIndexComplete = false;
+      }
+      completeParts.insert(i);
+      if (!journaled && parts[partIndex].has("md5")) {
+        resumeJournal.partUploaded(journalKey(), i + 1, parts[partIndex]["md5"].get<string>());
+      }
     }
-    Chunk * c = new Chunk(localFile, fileID, 0, tries, 0, 0, toCompress, true, fileIndex);
-    c->log("created");
-    queue.produce(c);
-    return 1;
   }
+}
 
-  DXLOG(logINFO) << "Creating chunks:";
-  fs::path p(localFile);
-  unsigned int countChunks = 0; // to iterate over chunks
-  unsigned int actualChunksCreated = 0; // is not incremented for chunks which are already in "complete" state (when resuming)
-
-  for (uint64_t start = 0; start < size; start += chunkSize) {
-    string partIndex = boost::lexical_cast<string>(countChunks + 1); // minimum part index is 1
-    const uint64_t end = min(start + chunkSize, size);
-    if (desc["parts"].has(partIndex) && desc["parts"][partIndex]["state"].get<string>() == "complete") {
-      DXLOG(logINFO) << "Part index " << partIndex << " for fileID " << fileID << " is in complete state. Will not create an upload chunk for it.";
-      bytesUploaded += (end - start);
-      atleastOnePartDone = true;
-    } else { 
-      const bool lastChunk = ((start + chunkSize) >= size);
-      Chunk * c = new Chunk(localFile, fileID, countChunks, tries, start, end, toCompress, lastChunk, fileIndex);
-      c->log("created");
-      queue.produce(c);
-      actualChunksCreated++;
+Chunk * File::nextChunk(const int tries, const bool streamed) {
+  if (!chunksStarted) {
+    startChunks();
+  }
+  while (nextChunkIndex < chunkCount) {
+    const unsigned int index = nextChunkIndex++;
+    if (completeParts.count(index) > 0) {
+      continue;
     }
-    ++countChunks;
+    return createChunk(index, tries, streamed);
   }
-  return actualChunksCreated++;
+  completeParts.clear();
+  return NULL;
+}
+
+Chunk * File::createChunk(const unsigned int index, const int tries, const bool streamed) {
+  const uint64_t start = index * chunkSize;
+  const uint64_t end = min(start + chunkSize, size);
+  const bool lastChunk = (end == size);
+  Chunk * c = new Chunk(chunkNames, index, tries, start, end, toCompress, lastChunk, fileIndex);
+  c->streamed = streamed;
+  c->log("created");
+  return c;
 }
 
 unsigned int File::readStdin(dx::BlockingQueue<Chunk *> &chunksToCompress, const int tries) {
   // Read data from stdin into chunks and put those chunks into the compress queue.
-  std::vector<char> buffer;
-  buffer.resize(chunkSize);
   unsigned int countChunks = 0;
   unsigned int bytesRead = 0;
   unsigned int start = 0;
@@ -247,19 +322,34 @@ unsigned int File::readStdin(dx::BlockingQueue<Chunk *> &chunksToCompress, const
   size = 0;
 
   DXLOG(logINFO) << "Starting to read data from stdin.";
+  chunkNames.reset(new ChunkFileNames(localFile, fileID));
   while (std::cin.good()) {
-    std::cin.read(&buffer[0], chunkSize);
+    // Read directly into a block from the chunk buffer pool (start/end are filled in below,
+    // the memory is that of a full chunk)
+    Chunk * c = new Chunk(chunkNames, countChunks, tries, 0, chunkSize, toCompress, false, fileIndex);
+    c->acquireMemory(c->memoryNeeded());
+    c->data.allocate(chunkBufferPool, chunkSize);
+    const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+    {
+      dx::BusyTimer busy(readStage);
+      std::cin.read(c->data.data(), chunkSize);
+    }
     bytesRead = std::cin.gcount();
+    uploadMetrics.addRead(bytesRead, (boost::posix_time::microsec_clock::universal_time() - t0).total_milliseconds());
+    c->traceStage("read", chunkTracer.toUs(t0));
     const bool lastChunk = (std::cin.good() == false);
     if (lastChunk && bytesRead == 0) {
       // Last Chunk is empty
+      c->releaseMemory();
+      delete c;
       break;
     }
     start = size;
     end = size + bytesRead;
-    Chunk * c = new Chunk(localFile, fileID, countChunks, tries, start, end, toCompress, lastChunk, fileIndex);
+    c->start = start;
+    c->end = end;
+    c->lastChunk = lastChunk;
     c->data.resize(bytesRead);
-    c->data.assign(buffer.begin(), buffer.begin() + bytesRead);
     size += bytesRead;
     c->log("created");
     chunksToCompress.produce(c);
@@ -288,3 +378,47 @@ ostream &operator<<(ostream &out, const File &file) {
   out << file.localFile << " (" << file.fileID << ")";
   return out;
 }
+
+FileList::FileList() : closed(false) {
+}
+
+void FileList::add(const File &file) {
+  boost::mutex::scoped_lock lock(mut);
+  assert(!closed);
+  files.push_back(file);
+  changed.notify_all();
+}
+
+void FileList::close() {
+  boost::mutex::scoped_lock lock(mut);
+  closed = true;
+  changed.notify_all();
+}
+
+bool FileList::waitFor(const size_t fileIndex) const {
+  boost::mutex::scoped_lock lock(mut);
+  while (fileIndex >= files.size() && !closed) {
+    changed.wait(lock);
+  }
+  return (fileIndex < files.size());
+}
+
+size_t FileList::size() const {
+  boost::mutex::scoped_lock lock(mut);
+  return files.size();
+}
+
+bool FileList::isClosed() const {
+  boost::mutex::scoped_lock lock(mut);
+  return closed;
+}
+
+File &FileList::operator[](const size_t fileIndex) {
+  boost::mutex::scoped_lock lock(mut);
+  return files[fileIndex];
+}
+
+const File &FileList::operator[](const size_t fileIndex) const {
+  boost::mutex::scoped_lock lock(mut);
+  return files[fileIndex];
+}
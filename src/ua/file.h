@@ -17,26 +17,69 @@
 #ifndef UA_FILE_H
 #define UA_FILE_H
 
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
 
 #include "dxcpp/bqueue.h"
 #include "chunk.h"
+#include "file_walker.h"
+#include "resume_index.h"
 #include "dxjson/dxjson.h"
 
 class File {
 public:
 
-  File(const std::string &localFile_,
-       const std::string &projectSpec_, const std::string &folder_, const std::string &name_,
+  /*
+   * A file to be uploaded: "local" gives its path, destination folder and
+   * name, and (unless standardInput_) its size, modification time and
+   * canonical path, as found by FileWalker. No API call is made: the remote
+   * file object is only set up by init() (see FileSetup).
+   */
+  File(const LocalFile &local, const std::string &projectSpec_,
        const std::string &visibility, const dx::JSON &properties_, const dx::JSON &type_,
        const dx::JSON &tags_, const dx::JSON &details,
-       const bool toCompress_, const bool tryResuming, const std::string &mimeType_, 
+       const bool toCompress_, const std::string &mimeType_, 
        const int64_t chunkSize, const unsigned int fileIndex_, const bool standardInput_);
 
+  /*
+   * Set up the remote file object: init() creates a new one (for stdin),
+   * and init(resumeIndex) looks for one to resume uploading to in
+   * resumeIndex (unless NULL), or creates a new one. Both throw on failure.
+   */
   void init();
-  void init(const bool tryResuming);
+  void init(ResumeIndex *resumeIndex);
+
+  /*
+   * Finds the parts of the remote file which are already complete (when
+   * resuming), describing it unless they are known from init(). Called by
+   * FileSetup once the file object is set up, or else by the first call to
+   * nextChunk().
+   */
+  void startChunks();
+
+  /*
+   * For a file resumed from its resume journal: describes the remote file,
+   * and returns the indices of the chunks whose parts the journal shows as
+   * uploaded, but which are not complete (or have another MD5) on the
+   * server. Throws if the remote file cannot be described, or is not open.
+   */
+  std::vector<unsigned int> missingJournaledChunks() const;
+
+  /* Creates the chunk of the file with this index (see nextChunk()) */
+  Chunk * createChunk(const unsigned int index, const int tries, const bool streamed);
 
-  unsigned int createChunks(dx::BlockingQueue<Chunk *> &queue, const int tries);
+  /*
+   * Returns the next chunk of the file to be uploaded (creating it only now),
+   * or NULL once all of them were returned. Parts which are already complete
+   * are skipped. See ChunkCursor.
+   */
+  Chunk * nextChunk(const int tries, const bool streamed);
   unsigned int readStdin(dx::BlockingQueue<Chunk *> &queue, const int tries);
 
   void close(void);
@@ -52,7 +95,7 @@ public:
   /* Destination project specifier (name or ID). */
   std::string projectSpec;
 
-  /* Destination project ID. */
+  /* Destination project ID (resolved by init(), unless set before). */
   std::string projectID;
 
   /* Destination folder name. */
@@ -127,6 +170,42 @@ public:
   /* File content comes from stdin.*/
   bool standardInput;
 
+  /*
+   * With --bgzf: BGZF blocks of every chunk uploaded so far (by chunk index),
+   * from which the .gzi index is built. bgzfIndexComplete is false if some
+   * chunks were not compressed by this run (i.e., a resumed upload).
+   */
+  std::map<unsigned int, BgzfChunkIndex> bgzfChunks;
+  bool bgzfIndexComplete;
+
+  /*
+   * State of nextChunk(): the parts of the remote file, if known from init()
+   * (released by startChunks()), whether they were looked up yet, the number
+   * of chunks of the file, the index of the next one, and the indices of the
+   * parts which are already complete (cleared once all chunks were returned).
+   * chunkNames is shared by all chunks of the file.
+   */
+  dx::JSON remoteParts;
+  bool chunksStarted;
+  unsigned int chunkCount;
+  unsigned int nextChunkIndex;
+  std::set<unsigned int> completeParts;
+  boost::shared_ptr<const ChunkFileNames> chunkNames;
+
+  /*
+   * Signature of the file (see createResumeInfoString()), the remote file it
+   * is uploaded to (API server, project, folder and name, set by init()),
+   * and, if the upload was resumed from its resume journal (--resume-journal),
+   * the MD5 of each part which the journal shows as uploaded, by part index.
+   */
+  std::string signature;
+  std::string destination;
+  bool journaled;
+  std::map<unsigned int, std::string> journaledParts;
+
+  /* Key of the resume journal of the upload: the signature and the destination */
+  std::string journalKey() const { return signature + "\n" + destination; }
+
   friend std::ostream &operator<<(std::ostream &out, const File &file);
   
   /* 
@@ -135,8 +214,49 @@ public:
    * an upload can be resumed or not.
    */
   static std::string createResumeInfoString(const uint64_t fileSize, const int64_t modifiedTimestamp,
-                                            const bool toCompress, const uint64_t chunkSize, const std::string &path);
+                                            const bool toCompress, const bool bgzf, const uint64_t chunkSize,
+                                            const std::string &path);
+
+private:
+  bool resumeFromJournal();
+};
+
+/*
+ * The files to be uploaded, in order: they are added (by the main thread) as
+ * the local files are found, while the ones added before are already being
+ * set up and uploaded by other threads. A file is never moved once added
+ * (references to it stay valid), and no file is added once the list is closed.
+ */
+class FileList : boost::noncopyable {
+public:
+
+  FileList();
+
+  /* Adds a copy of "file" at the end of the list */
+  void add(const File &file);
+
+  /* Records that all files were added (see waitFor()) */
+  void close();
+
+  /*
+   * Waits until the file of index fileIndex was added (returns true), or the
+   * list was closed without it (returns false).
+   */
+  bool waitFor(const size_t fileIndex) const;
+
+  size_t size() const;
+  bool isClosed() const;
+
+  File &operator[](const size_t fileIndex);
+  const File &operator[](const size_t fileIndex) const;
+
+private:
+
+  std::deque<File> files;
+  bool closed;
 
+  mutable boost::mutex mut;
+  mutable boost::condition_variable changed;
 };
 
 #endif
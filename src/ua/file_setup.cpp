@@ -0,0 +1,107 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "file_setup.h"
+
+#include "file.h"
+#include "dxcpp/dxlog.h"
+
+#include <stdexcept>
+
+using namespace std;
+using namespace dx;
+
+FileSetup::FileSetup() : files(NULL), resumeIndex(NULL), nextIndex(0), numDone(0) {
+}
+
+FileSetup::~FileSetup() {
+  stop();
+}
+
+void FileSetup::start(FileList &files_, const int numThreads, ResumeIndex *resumeIndex_) {
+  {
+    boost::mutex::scoped_lock lock(mut);
+    files = &files_;
+    resumeIndex = resumeIndex_;
+    nextIndex = 0;
+    numDone = 0;
+    done.clear();
+  }
+  for (int i = 0; i < numThreads; ++i) {
+    threads.push_back(boost::thread(boost::bind(&FileSetup::run, this)));
+  }
+}
+
+bool FileSetup::ready(const size_t fileIndex) const {
+  boost::mutex::scoped_lock lock(mut);
+  return (fileIndex < done.size() && done[fileIndex]);
+}
+
+void FileSetup::waitForPending(const size_t maxPending) const {
+  boost::mutex::scoped_lock lock(mut);
+  while (files != NULL && files->size() >= numDone + maxPending) {
+    fileDone.wait(lock);
+  }
+}
+
+void FileSetup::stop() {
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    threads[i].interrupt();
+  }
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  threads.clear();
+}
+
+void FileSetup::run() {
+  try {
+    while (true) {
+      size_t i;
+      {
+        boost::mutex::scoped_lock lock(mut);
+        i = nextIndex++;
+      }
+      if (!files->waitFor(i)) {
+        // The list was closed: no more files
+        return;
+      }
+      boost::this_thread::interruption_point();
+
+      File &f = (*files)[i];
+      // A file added as failed (e.g., a duplicate) gets no remote file object
+      if (!f.failed) {
+        try {
+          f.init(resumeIndex);
+          f.startChunks();
+        } catch (exception &e) {
+          DXLOG(logUSERINFO) << "ERROR: Unable to set up the remote file of \"" << f.localFile << "\": " << e.what() << endl;
+          f.failed = true;
+        }
+      }
+
+      boost::mutex::scoped_lock lock(mut);
+      if (done.size() <= i) {
+        done.resize(i + 1, false);
+      }
+      done[i] = true;
+      ++numDone;
+      fileDone.notify_all();
+    }
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
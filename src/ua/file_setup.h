@@ -0,0 +1,76 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_FILE_SETUP_H
+#define UA_FILE_SETUP_H
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+class FileList;
+class ResumeIndex;
+
+/*
+ * Sets up the remote file objects of the files to be uploaded (see
+ * File::init(), and File::startChunks()) with a pool of threads, in the
+ * order of the files, while the chunks of the files already set up are being
+ * uploaded: the API calls for thousands of files are not all made before the
+ * first byte is uploaded, nor one at a time. Files added to the list after
+ * start() are set up as well, until the list is closed.
+ *
+ * A file which cannot be set up is marked as failed (and has no chunks). A
+ * file added to the list as failed already is not set up.
+ */
+class FileSetup : boost::noncopyable {
+public:
+
+  FileSetup();
+  ~FileSetup();
+
+  /*
+   * Starts numThreads threads setting up "files_" (which, as well as
+   * "resumeIndex_", must outlive them), resuming uploads found in
+   * resumeIndex_ unless it is NULL.
+   */
+  void start(FileList &files_, const int numThreads, ResumeIndex *resumeIndex_);
+
+  /* Whether the file of index fileIndex was set up (or failed to be) */
+  bool ready(const size_t fileIndex) const;
+
+  /* Waits until fewer than maxPending of the files added so far are not set up yet */
+  void waitForPending(const size_t maxPending) const;
+
+  /* Interrupts, and joins, the threads */
+  void stop();
+
+private:
+
+  void run();
+
+  FileList *files;
+  ResumeIndex *resumeIndex;
+  std::vector<boost::thread> threads;
+
+  mutable boost::mutex mut; // taken before the lock of "files"
+  mutable boost::condition_variable fileDone;
+  size_t nextIndex; // next file to be set up
+  size_t numDone;
+  std::vector<bool> done;
+};
+
+#endif
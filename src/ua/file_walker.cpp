@@ -0,0 +1,255 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "file_walker.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "mime.h"
+#include "dxcpp/dxlog.h"
+
+namespace fs = boost::filesystem;
+
+using namespace std;
+using namespace dx;
+
+// Number of files (found in a directory) examined by a single task
+const size_t FILES_PER_TASK = 64;
+
+FileWalker::FileWalker() : recursive(false), maxBuffered(0), pendingTasks(0), buffered(0), currentRoot(0) {
+}
+
+FileWalker::~FileWalker() {
+  stop();
+}
+
+void FileWalker::addRoot(const string &path, const string &folder, const string &name) {
+  Task task;
+  task.kind = ROOT;
+  task.root = rootTasks.size();
+  task.folder = folder;
+  task.paths.push_back(path);
+  task.names.push_back(name);
+  rootTasks.push_back(multiset<Position>());
+  boost::mutex::scoped_lock lock(mut);
+  addTask(task);
+}
+
+void FileWalker::start(const int numThreads, const bool recursive_, const size_t maxBuffered_) {
+  recursive = recursive_;
+  maxBuffered = maxBuffered_;
+  for (int i = 0; i < numThreads; ++i) {
+    threads.push_back(boost::thread(boost::bind(&FileWalker::run, this)));
+  }
+}
+
+void FileWalker::stop() {
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    threads[i].interrupt();
+  }
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  threads.clear();
+}
+
+bool FileWalker::next(LocalFile &file) {
+  boost::mutex::scoped_lock lock(mut);
+  while (currentRoot < rootTasks.size()) {
+    const multiset<Position> &pending = rootTasks[currentRoot];
+    map<unsigned int, FoundFiles>::iterator it = found.find(currentRoot);
+    if (it != found.end()) {
+      // The first files found can be returned once no task before them is pending
+      FoundFiles::iterator first = it->second.begin();
+      if (pending.empty() || first->first < *pending.begin()) {
+        file = first->second.front();
+        first->second.pop_front();
+        if (first->second.empty()) {
+          it->second.erase(first);
+          if (it->second.empty()) {
+            found.erase(it);
+          }
+        }
+        --buffered;
+        workAvailable.notify_all();
+        return true;
+      }
+    } else if (pending.empty()) {
+      ++currentRoot;
+      workAvailable.notify_all();
+      continue;
+    }
+    fileFound.wait(lock);
+  }
+  return false;
+}
+
+/*
+ * Whether a thread may take "task" now (called with "mut" locked): no task
+ * is taken while maxBuffered files are waiting to be returned, except those
+ * of the current root whose files are before all of its waiting ones (so
+ * that next() always makes progress).
+ */
+bool FileWalker::canTake(const Task &task) const {
+  if (buffered < maxBuffered) {
+    return true;
+  }
+  if (task.root != currentRoot) {
+    return false;
+  }
+  map<unsigned int, FoundFiles>::const_iterator it = found.find(currentRoot);
+  return (it == found.end() || task.pos < it->second.begin()->first);
+}
+
+/* Queues "task" (called with "mut" locked) */
+void FileWalker::addTask(Task &task) {
+  ++pendingTasks;
+  rootTasks[task.root].insert(task.pos);
+  tasks.push(task);
+  workAvailable.notify_one();
+}
+
+void FileWalker::run() {
+  try {
+    boost::mutex::scoped_lock lock(mut);
+    while (pendingTasks > 0) {
+      if (tasks.empty() || !canTake(tasks.top())) {
+        workAvailable.wait(lock);
+        continue;
+      }
+      const Task task = tasks.top();
+      tasks.pop();
+      lock.unlock();
+      deque<LocalFile> examined;
+      if (task.kind == DIRECTORY) {
+        listDirectory(task, examined);
+      } else {
+        examineFiles(task, examined);
+      }
+      lock.lock();
+      if (!examined.empty()) {
+        buffered += examined.size();
+        found[task.root][task.pos].swap(examined);
+      }
+      --pendingTasks;
+      rootTasks[task.root].erase(rootTasks[task.root].find(task.pos));
+      if (task.root == currentRoot) {
+        fileFound.notify_one();
+      }
+    }
+    // Wake up the other threads, so that they exit as well
+    workAvailable.notify_all();
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
+
+/*
+ * Lists the directory of "task", and queues its files, sorted by name, in
+ * batches, then its subdirectories (if recursive), sorted by name. If it
+ * cannot be listed, an error is added to "examined" instead.
+ */
+void FileWalker::listDirectory(const Task &task, deque<LocalFile> &examined) {
+  vector<fs::path> filePaths, dirPaths;
+  try {
+    fs::directory_iterator it(task.paths[0]), end;
+    for (; it != end; ++it) {
+      const fs::path currPath(it->path());
+      const fs::file_status status = it->status();
+      if (fs::is_directory(status)) {
+        if (recursive) {
+          dirPaths.push_back(currPath);
+        }
+      } else if (fs::is_regular_file(status)) {
+        filePaths.push_back(currPath);
+      } else {
+        DXLOG(logWARNING) << "Unable to upload non regular file \"" << currPath.string() << "\"";
+      }
+    }
+  } catch (exception &e) {
+    LocalFile file;
+    file.path = task.paths[0];
+    file.root = task.root;
+    file.error = e.what();
+    examined.push_back(file);
+    return;
+  }
+  sort(filePaths.begin(), filePaths.end());
+  sort(dirPaths.begin(), dirPaths.end());
+
+  boost::mutex::scoped_lock lock(mut);
+  for (size_t i = 0; i < filePaths.size(); i += FILES_PER_TASK) {
+    Task files;
+    files.kind = FILES;
+    files.root = task.root;
+    files.pos = task.pos;
+    files.pos.push_back(0);
+    files.pos.push_back(i / FILES_PER_TASK);
+    files.folder = task.folder;
+    for (size_t j = i; j < min(i + FILES_PER_TASK, filePaths.size()); ++j) {
+      files.paths.push_back(filePaths[j].generic_string());
+      files.names.push_back(filePaths[j].filename().generic_string());
+    }
+    addTask(files);
+  }
+  for (size_t i = 0; i < dirPaths.size(); ++i) {
+    Task dir;
+    dir.kind = DIRECTORY;
+    dir.root = task.root;
+    dir.pos = task.pos;
+    dir.pos.push_back(1 + i);
+    dir.folder = (fs::path(task.folder) / dirPaths[i].filename()).generic_string();
+    dir.paths.push_back(dirPaths[i].generic_string());
+    addTask(dir);
+  }
+}
+
+/* Examines the files of "task" (adding them to "examined", in order), or queues the directory of a root */
+void FileWalker::examineFiles(const Task &task, deque<LocalFile> &examined) {
+  for (unsigned i = 0; i < task.paths.size(); ++i) {
+    LocalFile file;
+    file.path = task.paths[i];
+    file.root = task.root;
+    file.folder = task.folder;
+    file.name = task.names[i];
+    try {
+      const fs::path p(file.path);
+      if (task.kind == ROOT && fs::is_directory(p)) {
+        // Files in the directory are uploaded to folder/name (or to folder, if name is ".")
+        Task dir;
+        dir.kind = DIRECTORY;
+        dir.root = task.root;
+        dir.pos = task.pos;
+        dir.folder = (file.name == ".") ? task.folder : (fs::path(task.folder) / file.name).generic_string();
+        dir.paths.push_back(file.path);
+        boost::mutex::scoped_lock lock(mut);
+        addTask(dir);
+        continue;
+      }
+      file.mimeType = getMimeType(file.path); // throws if the file does not exist
+      file.size = fs::file_size(p);
+      file.modifiedTimestamp = static_cast<int64_t>(fs::last_write_time(p));
+      file.canonicalPath = fs::canonical(p).generic_string();
+    } catch (exception &e) {
+      file.error = e.what();
+    }
+    examined.push_back(file);
+  }
+}
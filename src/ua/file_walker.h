@@ -0,0 +1,152 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_FILE_WALKER_H
+#define UA_FILE_WALKER_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/* A local file to be uploaded, as found by FileWalker */
+struct LocalFile {
+  LocalFile() : root(0), size(0), modifiedTimestamp(0) {
+  }
+
+  /* Path of the file, and index of the root (see FileWalker::addRoot()) it was found under */
+  std::string path;
+  unsigned int root;
+
+  /* Destination folder, and name, of the remote file */
+  std::string folder;
+  std::string name;
+
+  /* Size, modification time and canonical path of the file (its signature, see File::createResumeInfoString()) */
+  uint64_t size;
+  int64_t modifiedTimestamp;
+  std::string canonicalPath;
+
+  /* MIME type of the file (see getMimeType()) */
+  std::string mimeType;
+
+  /* If not empty, the file could not be examined (and the fields above are not set) */
+  std::string error;
+};
+
+/*
+ * Finds the local files to be uploaded: lists directories (recursively, if
+ * asked to), and gets the size, modification time, canonical path and MIME
+ * type of each file, with a pool of threads, so that a large directory tree
+ * is not examined one system call (or "file" command) at a time.
+ *
+ * Roots, directories, and batches of files found in a directory, are queued
+ * as tasks for the threads, those of earlier roots first. Files are returned
+ * by next() in a stable order, whichever thread examined them: roots in the
+ * order they were added, and, under a directory, the files in it sorted by
+ * name, then the files under each of its subdirectories (sorted by name).
+ * A file is returned as soon as all files before it were. Threads stop
+ * taking tasks while about maxBuffered files are waiting to be returned.
+ */
+class FileWalker : boost::noncopyable {
+public:
+
+  FileWalker();
+  ~FileWalker();
+
+  /*
+   * Adds a file, or directory, to be uploaded to "folder": a file is named
+   * "name"; files in a directory are uploaded to "folder/name" (or to
+   * "folder" if "name" is "."), and, if "recursive", files in its
+   * subdirectories to subfolders of the same name. Must be called before start().
+   */
+  void addRoot(const std::string &path, const std::string &folder, const std::string &name);
+
+  /* Starts numThreads threads examining the roots */
+  void start(const int numThreads, const bool recursive_, const size_t maxBuffered_);
+
+  /*
+   * Returns the next file found (blocking until it is), or false once all
+   * files were returned.
+   */
+  bool next(LocalFile &file);
+
+  /* Interrupts, and joins, the threads */
+  void stop();
+
+private:
+
+  enum TaskKind {
+    ROOT,      // a root: a file, or a directory to be listed
+    DIRECTORY, // a directory to be listed
+    FILES      // files (found in a directory) to be examined
+  };
+
+  /*
+   * Position of a task (and of the files it finds) in the order in which
+   * files are returned, compared lexicographically: a directory at position
+   * P has its batches of files at P + [0, batch], and its subdirectories at
+   * P + [1 + subdirectory]. The files found by a task are thus all after
+   * those of the tasks before it, and its own position is before them.
+   */
+  typedef std::vector<uint32_t> Position;
+
+  struct Task {
+    TaskKind kind;
+    unsigned int root;
+    Position pos; // tasks of the same root are taken in order
+    /* Remote folder of the files (or, for a directory, of the files in it) */
+    std::string folder;
+    /* Local paths (a single one, unless kind is FILES), and remote names (unused for DIRECTORY) */
+    std::vector<std::string> paths;
+    std::vector<std::string> names;
+
+    bool operator>(const Task &other) const {
+      return (root != other.root) ? (root > other.root) : (pos > other.pos);
+    }
+  };
+
+  /* Files found by the tasks of a root, not yet returned, by task position */
+  typedef std::map<Position, std::deque<LocalFile> > FoundFiles;
+
+  void run();
+  void listDirectory(const Task &task, std::deque<LocalFile> &examined);
+  void examineFiles(const Task &task, std::deque<LocalFile> &examined);
+  bool canTake(const Task &task) const;
+  void addTask(Task &task);
+
+  bool recursive;
+  size_t maxBuffered;
+  std::vector<boost::thread> threads;
+
+  mutable boost::mutex mut;
+  boost::condition_variable workAvailable;
+  boost::condition_variable fileFound;
+  std::priority_queue<Task, std::vector<Task>, std::greater<Task> > tasks;
+  unsigned int pendingTasks; // tasks queued, or in progress (of all roots)
+  std::vector<std::multiset<Position> > rootTasks; // positions of the same, for each root (a root is done with once empty)
+  std::map<unsigned int, FoundFiles> found; // files not yet returned, by root
+  size_t buffered; // number of files in "found"
+  unsigned int currentRoot; // root whose files are being returned by next()
+};
+
+#endif
@@ -97,7 +97,7 @@ inline JSON getDnanexusLinkFormat(const string &objID) {
   return JSON::parse("{\"$dnanexus_link\": \"" + objID + "\"}");
 }
 
-void runImportApps(const Options &opt, vector<File> &files) {
+void runImportApps(const Options &opt, FileList &files) {
   const char *const readsImporter = "app-reads_importer";
   const char *const mappingsImporter = "app-sam_importer";
   const char *const variantsImporter = "app-vcf_importer";
@@ -17,10 +17,9 @@
 #ifndef UA_IMPORT_APP_H
 #define UA_IMPORT_APP_H
 
-#include <vector>
 #include "file.h"
 #include "options.h"
 
-void runImportApps(const Options &opt, std::vector<File> &files);
+void runImportApps(const Options &opt, FileList &files);
 
 #endif
@@ -14,12 +14,16 @@
 //   License for the specific language governing permissions and limitations
 //   under the License.
 
+#include <cerrno>
+#include <cstring>
 #include <cstdint>
+#include <deque>
 #include <iostream>
 #include <queue>
 
 #include <curl/curl.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/version.hpp>
@@ -47,6 +51,18 @@
 #include "round_robin_dns.h"
 #include "common_utils.h"
 #include "ua_test.h"
+#include "buffer_pool.h"
+#include "uring_reader.h"
+#include "multi_uploader.h"
+#include "retry_scheduler.h"
+#include "chunk_cursor.h"
+#include "file_walker.h"
+#include "file_setup.h"
+#include "resume_index.h"
+
+extern "C" {
+#include "compress.h"
+}
 
 // http://www.boost.org/doc/libs/1_48_0/libs/config/doc/html/boost_config/boost_macro_reference.html
 #if ((BOOST_VERSION / 100000) < 1 || ((BOOST_VERSION/100000) == 1 && ((BOOST_VERSION / 100) % 1000) < 48))
@@ -97,7 +113,8 @@ bool keepShowingUploadProgress = true;
  * local file; the ID of the file object being created; and the start and
  * end of the chunk within the file.
  *
- * Chunks are initially added to the queue chunksToRead.
+ * Chunks are created lazily by chunkCursor, as the read threads ask for
+ * them; chunks to be read again (retries) are added to the queue chunksToRead.
  */
 
 unsigned int totalChunks = 0;
@@ -105,12 +122,65 @@ bool readStdinDone = false;
 
 BlockingQueue<Chunk*> chunksToRead;
 BlockingQueue<Chunk*> chunksToCompress;
+BlockingQueue<Chunk*> chunksToPrefetch;
 BlockingQueue<Chunk*> chunksToUpload;
-BlockingQueue<Chunk*> chunksFinished;
+BlockingQueue<FinishedChunk> chunksFinished;
 BlockingQueue<Chunk*> chunksFailed;
 
+// Busy time of the threads of each stage (--stage-stats)
+StageStats readStage("read"); // definition (declared in chunk.h)
+StageStats compressStage("compress");
+StageStats prefetchStage("prefetch");
+StageStats uploadStage("upload");
+
+BufferPool chunkBufferPool; // definition (declared in chunk.h)
+FileReader chunkFileReader; // definition (declared in chunk.h)
+CompressionPool compressionPool; // definition (declared in chunk.h)
+size_t compressBlockSize = 0; // definition (declared in chunk.h)
+bool bgzfCompression = false; // definition (declared in chunk.h)
+CurlHandlePool uploadHandles; // definition (declared in chunk.h)
+UploadConcurrency uploadConcurrency; // definition (declared in chunk.h)
+RateLimiter uploadRateLimiter; // definition (declared in chunk.h)
+MemoryBudget memoryBudget; // definition (declared in chunk.h)
+Metrics uploadMetrics; // definition (declared in chunk.h)
+Tracer chunkTracer; // definition (declared in chunk.h)
+ResumeJournal resumeJournal; // definition (declared in chunk.h)
+
+// Used by the (single) read thread, if --io-engine=io_uring (and io_uring is available)
+UringReader uringReader;
+
+// Performs the uploads, if --upload-engine=multi (upload threads only prepare them)
+MultiUploader multiUploader;
+
+// Holds the chunks whose upload failed until they are due to be retried
+RetryScheduler retryScheduler;
+
+// Creates the chunks of the files to be uploaded, as the read threads ask for them
+ChunkCursor chunkCursor;
+
+// Sets up the remote file objects, while the files set up before are uploaded
+FileSetup fileSetup;
+
+// Files which uploads can be resumed to (unless --do-not-resume), looked up by fileSetup
+ResumeIndex resumeIndex;
+
+// How often a read thread waiting for the next file to be set up checks again
+const boost::posix_time::time_duration FILE_SETUP_POLL_INTERVAL = boost::posix_time::milliseconds(20);
+
+// Maximum number of local files found by the walker ahead of their creation
+// (see FileWalker), and of files created ahead of their setup (see FileSetup)
+const size_t WALKER_MAX_BUFFERED_FILES = 4096;
+
+// Number of events kept by each thread for --trace-file (the oldest ones are overwritten)
+const size_t TRACE_EVENTS_PER_THREAD = 64 * 1024;
+
+// Maximum size of a single read issued by the io_uring read engine (chunks are
+// split into reads of at most this size, which are all kept in flight together)
+const size_t URING_MAX_READ_SIZE = 8 * 1024 * 1024;
+
 vector<boost::thread> readThreads;
 vector<boost::thread> compressThreads;
+vector<boost::thread> prefetchThreads;
 vector<boost::thread> uploadThreads;
 
 int NUMTRIES_g; // Number of max tries for a chunk (to be given by user)
@@ -124,10 +194,15 @@ bool finished() {
   if (opt.standardInput && !readStdinDone) {
     return false;
   }
+  if (!chunkCursor.exhausted()) {
+    // More chunks are yet to be created (totalChunks is not final)
+    return false;
+  }
   return (chunksFinished.size() + chunksFailed.size() == totalChunks);
 }
 
 void curlCleanup() {
+  uploadHandles.clear();
   // http://curl.haxx.se/libcurl/c/curl_global_cleanup.html
   for (;curlInit_call_count > 0; --curlInit_call_count) {
     curl_global_cleanup();
@@ -154,12 +229,19 @@ void handle_bad_alloc(const std::bad_alloc &e) {
 //
 // Memory footprint = [#read-threads + 2 * (#compress-threads + #upload-threads)] * chunk-size
 //
-// The approach to manage the memory usage is done is these steps:
-// 1. At the begining determine how much memeory is available in the system and set
-//    a resident set size (RSS) limit to 80% of that.
-// 2. Check the current RSS in the read threads before reading new data. If the RSS is larger
-//    than the limit, let the thread sleep for 2 seconds initially, and back-off exponentially
-//    up to a maximum of 16 seconds.
+// The memory held by chunks in flight is bounded by memoryBudget (--max-memory, or 80% of
+// the system's free memory at startup): read threads acquire the memory a chunk needs before
+// reading it (blocking until enough is available), and it is released once the upload attempt
+// of the chunk is over (see uploadAttemptDone()).
+//
+// Chunk data itself is held in blocks of chunkBufferPool (see initializeChunkBufferPool()),
+// which are recycled between chunks, and whose total size is capped at the budget as well. A
+// chunk is charged the blocks it holds, both input and output ones while it is compressed.
+//
+// With --stream-compress, chunk data is not held in memory at all: the compress threads only
+// compute the size and md5 of the (compressed) data, and the upload threads compress it again
+// while uploading, a block at a time (see ChunkStream). This costs twice the CPU for
+// compression, but the memory used per chunk in flight drops from ~2 * chunk-size to ~1.5 MB.
 
 long getAvailableSystemMemory()
 {
@@ -182,79 +264,60 @@ long getAvailableSystemMemory()
 #endif
 }
 
-// rssLimit is the maximum amount of memory the program may use.
-// It is set to be 80% of the system's free memory at program startup.
-// If the limit is reached, the read threads are delayed
-static long rssLimit = 0;
-
-// A mutex used to prevent the multiple read thread to check memory at the same time
-boost::mutex memCheckMutex;
-
-void initializeRSSLimit() {
-  long freeMemory = getAvailableSystemMemory();
-  rssLimit = freeMemory*8/10;
-  DXLOG(logINFO) << "Resident Set Size Limit (RSS): " << rssLimit;
-}
-
-// Get the current memory usage
-long getRSS() {
-#ifdef WINDOWS_BUILD
-  PROCESS_MEMORY_COUNTERS info;
-  GetProcessMemoryInfo( GetCurrentProcess( ), &info, sizeof(info) );
-  DWORD err = GetLastError();
-  if (err != 0 ) {
-    DXLOG(logWARNING) << "Unable to get process' memory usage, error code " << err;
-      return 0;
-  }
-  return (long)info.WorkingSetSize;
-#elif MAC_BUILD
-  task_basic_info_data_t info;
-  mach_msg_type_number_t infoCount = TASK_BASIC_INFO_COUNT;
-  if ( task_info( mach_task_self( ), TASK_BASIC_INFO, (task_info_t)&info, &infoCount ) != KERN_SUCCESS ) {
-    DXLOG(logWARNING) << "Unable to get process' memory usage";
-    return (long)0L;
-  }
-  return (long)info.resident_size;
-#else
-  ifstream statStream("/proc/self/statm",ios_base::in);
-  if (!statStream.good()) {
-    DXLOG(logWARNING) << "Unable to get process' memory usage";
-    return 0;
+/*
+ * Sets the memory budget: --max-memory, or, if not set, 80% of the
+ * system's free memory at startup.
+ */
+void initializeMemoryBudget() {
+  int64_t limit = opt.maxMemory;
+  if (limit <= 0) {
+    limit = (int64_t) getAvailableSystemMemory() * 8 / 10;
   }
-
-  long s = 0;
-  long rss = 0;
-  statStream >> s >> rss;
-  statStream.close();
-  return rss * sysconf(_SC_PAGE_SIZE);
-#endif
+  memoryBudget.init(limit);
+  DXLOG(logINFO) << "Memory budget for chunks in flight: " << limit << " bytes"
+                 << ((opt.maxMemory > 0) ? "" : " (80% of the free memory)");
 }
 
-
-bool isMemoryUseNormal() {
-  // if RSS limit is not set, don't check memory usage
-  if (rssLimit <= 0) {
-    return true;
-  }
-
-  boost::mutex::scoped_lock lock(memCheckMutex);
-
-  long residentSet = getRSS();
-  long freeMemory = getAvailableSystemMemory();
-  DXLOG(logDEBUG4) << "Free Memory: " << freeMemory << " rss " << residentSet ;
-
-  if(freeMemory*8/10 > rssLimit) {
-    rssLimit = freeMemory*8/10;
-    DXLOG(logDEBUG4) << "New RSS Limit: " << rssLimit;
+/*
+ * Sizes the chunk buffer pool, so that each block can hold a chunk (either
+ * compressed, or uncompressed; the files are not known yet, so the chunks
+ * of a file whose chunk size is raised, see File::File(), are served by
+ * dedicated allocations, which are not counted against the pool's cap, and
+ * are bounded by memoryBudget instead), and that the pool has
+ * enough blocks for the maximum number of chunks holding data at any time:
+ *  - one per read thread (or, with the io_uring read engine, one per read in flight),
+ *  - the ones waiting in chunksToCompress (capacity: #compress-threads),
+ *  - two per compress thread (uncompressed, and compressed data),
+ *  - the ones waiting in chunksToPrefetch (capacity: #prefetch-threads),
+ *  - one per prefetch thread,
+ *  - the ones waiting in chunksToUpload (capacity: #upload-threads, or the
+ *    initial number of concurrent uploads, with --upload-threads=auto),
+ *  - one per upload thread (or, with the "multi" upload engine, one per connection).
+ *
+ * Every block in use is charged to memoryBudget (see Chunk::memoryNeeded()),
+ * so the pool (including the blocks cached for reuse) is also capped at the
+ * budget, but never below the two blocks of a single chunk being compressed.
+ */
+void initializeChunkBufferPool() {
+  const uint64_t blockSize = max<uint64_t>(opt.chunkSize, chunkCompressBound(opt.chunkSize));
+  const uint64_t numReaderBlocks = (opt.standardInput) ? 1 : (uringReader.isInitialized() ? opt.ioDepth : opt.readThreads);
+  uint64_t numBlocks = numReaderBlocks + 3 * opt.compressThreads + 2 * opt.prefetchThreads + chunksToUpload.getCapacity() + opt.maxConcurrentUploads();
+  if (memoryBudget.getLimit() > 0) {
+    numBlocks = max<uint64_t>(2, min<uint64_t>(numBlocks, memoryBudget.getLimit() / blockSize));
   }
+  chunkBufferPool.init(blockSize, blockSize * numBlocks, opt.hugePages);
+}
 
-  if (residentSet > rssLimit) {
-    return false;
+void initializeReadEngine() {
+  if (opt.ioEngine == "io_uring" && !opt.standardInput) {
+    if (!uringReader.init(opt.ioDepth)) {
+      DXLOG(logUSERINFO) << "WARNING: io_uring is not available, falling back to the \"sync\" read engine (run with --verbose for details)";
+    }
   }
-  return true;
 }
 
-void readStdinChunks(vector<File> &files) {
+void readStdinChunks(FileList &files) {
+  chunkTracer.setThreadName("read (stdin)");
   try {
     totalChunks = files[0].readStdin(chunksToCompress, opt.tries);
     readStdinDone = true;
@@ -266,30 +329,220 @@ void readStdinChunks(vector<File> &files) {
   }
 }
 
+/* Milliseconds elapsed since t0 (for uploadMetrics) */
+static int64_t msSince(const boost::posix_time::ptime &t0) {
+  return (boost::posix_time::microsec_clock::universal_time() - t0).total_milliseconds();
+}
+
+/*
+ * Gets the next chunk to be read: a chunk to be read again (from
+ * chunksToRead) if any, else a new one from chunkCursor. If there is none
+ * (all chunks were created, or the next file is still being set up), waits
+ * for either if "wait" is true, and returns false otherwise.
+ */
+bool nextChunkToRead(Chunk * &c, const bool wait) {
+  while (true) {
+    if (chunksToRead.tryConsume(c)) {
+      return true;
+    }
+    if ((c = chunkCursor.next()) != NULL) {
+      return true;
+    }
+    if (!wait) {
+      return false;
+    }
+    if (chunkCursor.exhausted()) {
+      c = chunksToRead.consume();
+      return true;
+    }
+    if (chunksToRead.consumeFor(c, FILE_SETUP_POLL_INTERVAL)) {
+      return true;
+    }
+  }
+}
+
 void readChunks() {
+  chunkTracer.setThreadName("read");
   try {
-    int delay = 1;
     while (true) {
-      // If the upload  is using a lot of memory delay the read thread for a bit.
-      if (!isMemoryUseNormal()) {
-        delay = min(delay*2, 16);
-        DXLOG(logWARNING) << "RSS larger than limit. Delaying read thread by " << delay << "secs";
-        boost::this_thread::sleep(boost::posix_time::seconds(delay));
-        continue;
+      Chunk * c;
+      nextChunkToRead(c, true);
+      c->traceWait("queued for read");
+      if (!c->tryAcquireMemory(c->memoryNeeded())) {
+        c->acquireMemory(c->memoryNeeded());
+        c->traceWait("waiting for memory");
       }
-      delay = 1; //Reset the delay
-      Chunk * c = chunksToRead.consume();
 
       c->log("Reading...");
-      c->read();
+      const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+      {
+        BusyTimer busy(readStage);
+        c->read();
+      }
+      uploadMetrics.addRead(c->data.size(), msSince(t0));
+      c->traceStage("read", chunkTracer.toUs(t0));
 
       c->log("Finished reading");
       chunksToCompress.produce(c);
+    }
+  } catch(std::bad_alloc &e) {
+    boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
 
-      // Sleep for tiny amount of time, to make sure we yield to other threads.
-      // Note: boost::this_thread::yield() is not a valid interruption point,
-      //       so we have to use sleep()
-      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+/*
+ * A chunk being read by the io_uring read engine: it is split into one or
+ * more reads (UringRead), all of which must complete before the chunk is
+ * passed to the compress stage.
+ */
+struct UringChunk {
+  Chunk *c;
+  int fd;
+  unsigned outstanding;
+  bool failed;
+  boost::posix_time::ptime started;
+};
+
+struct UringRead {
+  UringChunk *uc;
+  char *buf;
+  size_t len;
+  int64_t offset;
+};
+
+// Starts reading a chunk with io_uring: queues its reads to "pending".
+// Chunks which need no reads (empty ones) are passed on immediately.
+void startUringChunk(Chunk *c, deque<UringRead *> &pending) {
+  c->log("Reading...");
+  const int64_t len = c->end - c->start;
+  c->data.release();
+  if (len == 0 || c->streamed) {
+    // Nothing to read (streamed chunks are read while uploading)
+    c->log("Finished reading");
+    chunksToCompress.produce(c);
+    return;
+  }
+  // Note: memory in the buffer is not initialized (we overwrite it right away)
+  c->data.allocate(chunkBufferPool, len);
+
+  UringChunk *uc = new UringChunk();
+  uc->c = c;
+  uc->fd = chunkFileReader.acquireFd(c->localFile());
+  uc->outstanding = 0;
+  uc->failed = false;
+  uc->started = boost::posix_time::microsec_clock::universal_time();
+  for (int64_t offset = 0; offset < len; offset += URING_MAX_READ_SIZE) {
+    UringRead *r = new UringRead();
+    r->uc = uc;
+    r->buf = c->data.data() + offset;
+    r->len = (size_t) min<int64_t>(URING_MAX_READ_SIZE, len - offset);
+    r->offset = c->start + offset;
+    pending.push_back(r);
+    uc->outstanding++;
+  }
+}
+
+void finishUringChunk(UringChunk *uc) {
+  Chunk *c = uc->c;
+  chunkFileReader.dropPageCache(uc->fd, c->start, c->end - c->start);
+  chunkFileReader.releaseFd(c->localFile());
+  const bool failed = uc->failed;
+  const boost::posix_time::ptime started = uc->started;
+  delete uc;
+  if (failed) {
+    // Retry with a regular read, which throws (just like in the "sync" engine),
+    // if the data really cannot be read
+    c->log("Asynchronous read failed, retrying with a regular read");
+    c->read();
+  }
+  uploadMetrics.addRead(c->data.size(), msSince(started));
+  c->traceStage("read", chunkTracer.toUs(started));
+  c->log("Finished reading");
+  chunksToCompress.produce(c);
+}
+
+/*
+ * Read stage for --io-engine=io_uring: a single thread keeps up to
+ * --io-depth reads (of at most URING_MAX_READ_SIZE bytes each, into the
+ * pooled chunk buffers) in flight, and passes each chunk to the compress
+ * stage as soon as all its reads are complete.
+ */
+void readChunksUring() {
+  chunkTracer.setThreadName("read (io_uring)");
+  try {
+    deque<UringRead *> pending; // reads not yet queued to the ring
+    Chunk *waiting = NULL; // next chunk to read, waiting for memory (see memoryBudget)
+    while (true) {
+      // Fill the ring, picking up new chunks only when all reads of the
+      // previous ones are queued
+      while (uringReader.inFlight() < uringReader.getDepth()) {
+        if (pending.empty()) {
+          // Wait for a chunk (and its memory) only when no read is in flight
+          const bool idle = (uringReader.inFlight() == 0);
+          Chunk *c = waiting;
+          bool waitedForMemory = (c != NULL);
+          waiting = NULL;
+          if (c == NULL) {
+            if (!nextChunkToRead(c, idle)) {
+              break;
+            }
+            c->traceWait("queued for read");
+          }
+          if (!c->tryAcquireMemory(c->memoryNeeded())) {
+            if (!idle) {
+              waiting = c;
+              break;
+            }
+            c->acquireMemory(c->memoryNeeded());
+            waitedForMemory = true;
+          }
+          if (waitedForMemory) {
+            c->traceWait("waiting for memory");
+          }
+          startUringChunk(c, pending);
+          continue;
+        }
+        UringRead *r = pending.front();
+        pending.pop_front();
+        uringReader.queueRead(r->uc->fd, r->buf, r->len, r->offset, r);
+      }
+      if (uringReader.inFlight() == 0) {
+        continue;
+      }
+
+      // The read stage is busy as long as reads are in flight
+      BusyTimer busy(readStage);
+      uringReader.submitAndWait(1);
+      void *userData;
+      int res;
+      while (uringReader.popCompletion(userData, res)) {
+        UringRead *r = static_cast<UringRead *>(userData);
+        if (res == -EINTR || res == -EAGAIN) {
+          pending.push_front(r);
+          continue;
+        }
+        if (res > 0 && size_t(res) < r->len) {
+          // Short read: queue the remainder
+          r->buf += res;
+          r->len -= res;
+          r->offset += res;
+          pending.push_front(r);
+          continue;
+        }
+        if (res < 0 || size_t(res) != r->len) {
+          DXLOG(logWARNING) << "Asynchronous read of " << r->len << " bytes at offset " << r->offset << " of chunk "
+                            << *(r->uc->c) << " failed (result=" << res << ")";
+          r->uc->failed = true;
+        }
+        UringChunk *uc = r->uc;
+        delete r;
+        if (--uc->outstanding == 0) {
+          finishUringChunk(uc);
+        }
+      }
+      boost::this_thread::interruption_point();
     }
   } catch(std::bad_alloc &e) {
     boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
@@ -299,24 +552,72 @@ void readChunks() {
 }
 
 void compressChunks() {
+  chunkTracer.setThreadName("compress");
   try {
     while (true) {
       Chunk * c = chunksToCompress.consume();
-
-      if (c->toCompress) {
+      c->traceWait("queued for compress");
+
+      const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+      if (c->streamed) {
+        c->log("Computing size and md5 of the data to stream...");
+        c->prepareStream();
+        uploadMetrics.addCompressed(c->end - c->start, c->uploadSize(), msSince(t0));
+        c->traceStage("compress", chunkTracer.toUs(t0));
+        c->log("Finished computing size and md5");
+      } else if (c->toCompress) {
         c->log("Compressing...");
+        const int64_t sourceLen = c->data.size();
         c->compress();
+        uploadMetrics.addCompressed(sourceLen, c->data.size(), msSince(t0));
+        c->traceStage("compress", chunkTracer.toUs(t0));
         c->log("Finished compressing");
       } else {
         c->log("Not compressing");
       }
+      if (!c->streamed && c->attempt().expectedMD5.empty()) {
+        // Data whose md5 was not computed while it was produced (e.g., chunks read
+        // by the io_uring read engine, or from stdin): compute it here, rather than
+        // in the upload threads
+        const boost::posix_time::ptime md5Start = boost::posix_time::microsec_clock::universal_time();
+        c->computeMD5();
+        uploadMetrics.observe(Metrics::MD5, msSince(md5Start));
+        c->traceStage("md5", chunkTracer.toUs(md5Start));
+      }
 
-      chunksToUpload.produce(c);
+      compressStage.addBusy((boost::posix_time::microsec_clock::universal_time() - t0).total_microseconds());
+      if (opt.prefetchThreads > 0) {
+        chunksToPrefetch.produce(c);
+      } else {
+        chunksToUpload.produce(c);
+      }
+    }
+  } catch(std::bad_alloc &e) {
+    boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
 
-      // Sleep for tiny amount of time, to make sure we yield to other threads.
-      // Note: boost::this_thread::yield() is not a valid interruption point,
-      //       so we have to use sleep()
-      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+/*
+ * Requests the upload URL of each chunk (see --prefetch-threads) before it
+ * is queued for upload, so that the upload threads do not wait on an API
+ * call between two transfers.
+ */
+void prefetchUploadURLs() {
+  chunkTracer.setThreadName("prefetch");
+  try {
+    while (true) {
+      Chunk * c = chunksToPrefetch.consume();
+      c->traceWait("queued for prefetch");
+      try {
+        BusyTimer busy(prefetchStage);
+        c->prefetchUploadURL(opt);
+      } catch (runtime_error &e) {
+        // The upload attempt requests it again
+        c->log(string("Unable to prefetch the upload URL: ") + e.what(), logWARNING);
+      }
+      chunksToUpload.produce(c);
     }
   } catch(std::bad_alloc &e) {
     boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
@@ -325,21 +626,93 @@ void compressChunks() {
   }
 }
 
-bool is_chunk_complete(Chunk *c, JSON &fileDescription) {
-    string partIndex = boost::lexical_cast<string>(c->index + 1); // minimum part index is 1
+bool is_part_complete(const unsigned int chunkIndex, JSON &fileDescription) {
+    string partIndex = boost::lexical_cast<string>(chunkIndex + 1); // minimum part index is 1
 
     return (fileDescription["parts"].has(partIndex) && fileDescription["parts"][partIndex]["state"].get<string>() == "complete");
 }
 
-void uploadChunks(vector<File> &files) {
+/*
+ * Bookkeeping once an attempt at uploading a chunk is over (by either upload
+ * engine): the chunk is either done with (uploaded, or failed for good), or
+ * handed over to retryScheduler, which produces it to chunksToRead again
+ * once it is due.
+ */
+void uploadAttemptDone(FileList &files, Chunk *c, bool uploaded) {
+  // The chunk's data is dropped below (and read again, if the upload is retried)
+  c->releaseMemory();
+  if (uploaded) {
+    c->log("Upload succeeded!");
+    int64_t size_of_chunk = c->uploadSize(); // this can be different than (c->end - c->start) because of compression
+    if (opt.bgzfIndex && c->toCompress) {
+      boost::mutex::scoped_lock indexLock(bytesUploadedMutex);
+      BgzfChunkIndex &chunkIndex = files[c->parentFileIndex].bgzfChunks[c->index];
+      chunkIndex.size = size_of_chunk;
+      chunkIndex.blocks.swap(c->attempt().bgzfBlocks);
+    }
+    resumeJournal.partUploaded(files[c->parentFileIndex].journalKey(), c->index + 1, c->attempt().expectedMD5);
+    // Update number of bytes uploaded in parent file object
+    boost::mutex::scoped_lock boLock(bytesUploadedMutex);
+    files[c->parentFileIndex].bytesUploaded += (c->end - c->start);
+    files[c->parentFileIndex].atleastOnePartDone = true;
+    bytesUploadedSinceStart += size_of_chunk;
+    boLock.unlock();
+    uploadMetrics.addUploaded(size_of_chunk);
+    // Only its file and part are kept (see check_for_complete_chunks())
+    const FinishedChunk finished(c->parentFileIndex, c->index);
+    delete c;
+    chunksFinished.produce(finished);
+  } else if (c->triesLeft > 0) {
+    int numTry = NUMTRIES_g - c->triesLeft + 1; // find out which try is it
+    int timeout = (numTry > 6) ? 256 : 4 << numTry; // timeout is always between [8, 256] seconds
+    c->log("Will retry reading and uploading this chunk in " + boost::lexical_cast<string>(timeout / 2) + " to "
+           + boost::lexical_cast<string>(timeout) + " seconds (try " + boost::lexical_cast<string>(numTry + 1)
+           + " of " + boost::lexical_cast<string>(NUMTRIES_g) + ")", logWARNING);
+    if (!opt.noRoundRobinDNS) {
+      boost::mutex::scoped_lock forceRefreshLock(forceRefreshDNSMutex);
+      c->log("Setting forceRefreshDNS = true in main.cpp:uploadAttemptDone()");
+      forceRefreshDNS = true; // refresh the DNS list in next call to getRandomIP()
+    }
+    --(c->triesLeft);
+    uploadMetrics.addFailure(c->attempt().failureCause, true);
+    c->clear(); // we will read & compress data again
+    retryScheduler.schedule(c, timeout);
+  } else {
+    c->log("Not retrying", logERROR);
+    // TODO: Should we print it on stderr or DXLOG (verbose only) ??
+    DXLOG(logUSERINFO) << "Failed to upload Chunk [" << c->start << " - " << c->end << "] for local file ("
+         << files[c->parentFileIndex].localFile << "). APIServer response for last try: '" << c->attempt().respData << "'" << endl;
+    uploadMetrics.addFailure(c->attempt().failureCause, false);
+    c->clear();
+    chunksFailed.produce(c);
+  }
+}
+
+void uploadChunks(FileList &files) {
+  chunkTracer.setThreadName("upload");
   try {
     while (true) {
-      Chunk * c = chunksToUpload.consume();
+      if (uploadConcurrency.isRunning()) {
+        // --upload-threads=auto: only the threads holding a slot take chunks
+        uploadConcurrency.acquire();
+      }
+      Chunk * c;
+      try {
+        c = chunksToUpload.consume();
+      } catch (boost::thread_interrupted &ti) {
+        // Stopped while idle: give the slot back, for the next pass (see check_for_complete_chunks())
+        if (uploadConcurrency.isRunning()) {
+          uploadConcurrency.cancel();
+        }
+        throw;
+      }
+      c->traceWait("queued for upload");
 
       c->log("Uploading...");
 
       bool uploaded = false;
       try {
+        BusyTimer busy(uploadStage);
         c->upload(opt);
         uploaded = true;
       } catch (runtime_error &e) {
@@ -347,46 +720,88 @@ void uploadChunks(vector<File> &files) {
         msg << "Upload failed: " << e.what();
         c->log(msg.str(), logERROR);
       }
+      if (uploadConcurrency.isRunning()) {
+        uploadConcurrency.release(uploaded, c->uploadSize(), c->attempt().transferMs);
+      }
 
-      if (uploaded) {
-        c->log("Upload succeeded!");
-        int64_t size_of_chunk = c->data.size(); // this can be different than (c->end - c->start) because of compression
-        c->clear();
-        chunksFinished.produce(c);
-        // Update number of bytes uploaded in parent file object
-        boost::mutex::scoped_lock boLock(bytesUploadedMutex);
-        files[c->parentFileIndex].bytesUploaded += (c->end - c->start);
-        files[c->parentFileIndex].atleastOnePartDone = true;
-        bytesUploadedSinceStart += size_of_chunk;
-        boLock.unlock();
-      } else if (c->triesLeft > 0) {
-        int numTry = NUMTRIES_g - c->triesLeft + 1; // find out which try is it
-        int timeout = (numTry > 6) ? 256 : 4 << numTry; // timeout is always between [8, 256] seconds
-        c->log("Will retry reading and uploading this chunks in " + boost::lexical_cast<string>(timeout) + " seconds", logWARNING);
-        if (!opt.noRoundRobinDNS) {
-          boost::mutex::scoped_lock forceRefreshLock(forceRefreshDNSMutex);
-          c->log("Setting forceRefreshDNS = true in main.cpp:uploadChunks()");
-          forceRefreshDNS = true; // refresh the DNS list in next call to getRandomIP()
+      uploadAttemptDone(files, c, uploaded);
+    }
+  } catch(std::bad_alloc &e) {
+    boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
+  } catch (boost::thread_interrupted &ti) {
+    return;
+  }
+}
+
+/* Called by retryScheduler once a chunk is due to be retried */
+void retryChunk(Chunk *c) {
+  c->traceWait("retry sleep");
+  chunksToRead.produce(c);
+}
+
+/* Called by the event loop of the "multi" upload engine, once an upload is over */
+void multiUploadDone(FileList &files, Chunk *c, const string &error) {
+  if (!error.empty()) {
+    c->log("Upload failed: " + error, logERROR);
+  }
+  if (uploadConcurrency.isRunning()) {
+    uploadConcurrency.release(error.empty(), c->uploadSize(), c->attempt().transferMs);
+  }
+  uploadStage.addBusy(c->attempt().transferMs * 1000);
+  uploadAttemptDone(files, c, error.empty());
+}
+
+/*
+ * Upload threads of the "multi" upload engine: get the upload URL of each
+ * chunk, and hand the request over to the event loop, which performs it.
+ */
+void startUploads(FileList &files) {
+  chunkTracer.setThreadName("upload (multi)");
+  try {
+    while (true) {
+      // Only take a chunk once it can be uploaded, so that chunks keep
+      // waiting in chunksToUpload (rather than in this thread) meanwhile
+      multiUploader.acquireConnection();
+      if (uploadConcurrency.isRunning()) {
+        try {
+          uploadConcurrency.acquire();
+        } catch (boost::thread_interrupted &ti) {
+          multiUploader.releaseConnection();
+          throw;
         }
-        --(c->triesLeft);
-        c->clear(); // we will read & compress data again
-        boost::this_thread::sleep(boost::posix_time::milliseconds(timeout * 1000));
-        // We push the chunk to retry to "chunksToRead" and not "chunksToUpload"
-        // Since chunksToUpload queue is bounded, and chunksToUpload.produce() can block,
-        // thus giving rise to deadlock
-        chunksToRead.produce(c);
-      } else {
-        c->log("Not retrying", logERROR);
-        // TODO: Should we print it on stderr or DXLOG (verbose only) ??
-        DXLOG(logUSERINFO) << "Failed to upload Chunk [" << c->start << " - " << c->end << "] for local file ("
-             << files[c->parentFileIndex].localFile << "). APIServer response for last try: '" << c->respData << "'" << endl;
-        c->clear();
-        chunksFailed.produce(c);
       }
-      // Sleep for tiny amount of time, to make sure we yield to other threads.
-      // Note: boost::this_thread::yield() is not a valid interruption point,
-      //       so we have to use sleep()
-      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+      Chunk *c;
+      try {
+        c = chunksToUpload.consume();
+      } catch (boost::thread_interrupted &ti) {
+        multiUploader.releaseConnection();
+        if (uploadConcurrency.isRunning()) {
+          uploadConcurrency.cancel();
+        }
+        throw;
+      }
+      c->traceWait("queued for upload");
+
+      c->log("Uploading...");
+
+      UploadRequest *req = new UploadRequest();
+      // The event loop must not block in the read callback
+      req->pauseWhenThrottled = true;
+      try {
+        // The transfer itself is accounted for by multiUploadDone()
+        BusyTimer busy(uploadStage);
+        c->startUpload(opt, *req);
+      } catch (runtime_error &e) {
+        delete req;
+        multiUploader.releaseConnection();
+        if (uploadConcurrency.isRunning()) {
+          uploadConcurrency.release(false, 0, 0);
+        }
+        c->log(string("Upload failed: ") + e.what(), logERROR);
+        uploadAttemptDone(files, c, false);
+        continue;
+      }
+      multiUploader.submit(c, req);
     }
   } catch(std::bad_alloc &e) {
     boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
@@ -395,16 +810,27 @@ void uploadChunks(vector<File> &files) {
   }
 }
 
+/* Whether chunks are waiting for an upload thread (see UploadConcurrency) */
+bool uploadBacklog() {
+  return !chunksToUpload.empty();
+}
+
 void monitor() {
   while (true) {
     boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
     {
+      const int64_t untilRetry = retryScheduler.msUntilNext();
+      const string nextRetry = (untilRetry >= 0) ? " (next in " + boost::lexical_cast<string>(untilRetry / 1000) + " s)" : "";
       DXLOG(logINFO) << "[monitor]"
           << "  to read: " << chunksToRead.size()
           << "  to compress: " << chunksToCompress.size()
+          << "  to prefetch: " << chunksToPrefetch.size()
           << "  to upload: " << chunksToUpload.size()
           << "  finished: " << chunksFinished.size()
-          << "  failed: " << chunksFailed.size();
+          << "  failed: " << chunksFailed.size()
+          << "  to retry: " << retryScheduler.size() << nextRetry
+          << "  retries: " << retryScheduler.getRetriesScheduled()
+          << "  memory: " << (memoryBudget.getInUse() >> 20) << "/" << (memoryBudget.getLimit() >> 20) << " MB";
 
       if (finished()) {
         return;
@@ -413,6 +839,69 @@ void monitor() {
   }
 }
 
+/* --stage-stats: starts measuring the busy time of each stage, and the waits on its queues */
+void startStageStats() {
+  chunksToRead.enableStats();
+  chunksToCompress.enableStats();
+  chunksToPrefetch.enableStats();
+  chunksToUpload.enableStats();
+  if (opt.standardInput || uringReader.isInitialized()) {
+    readStage.start(1, "");
+  } else {
+    readStage.start(opt.readThreads, "--read-threads");
+  }
+  compressStage.start(opt.compressThreads, "--compress-threads");
+  prefetchStage.start(opt.prefetchThreads, "--prefetch-threads");
+  if (opt.uploadEngine == "multi") {
+    uploadStage.start(opt.maxConnections, "--max-connections");
+  } else {
+    uploadStage.start(opt.uploadThreads, "--upload-threads");
+  }
+}
+
+/* --stage-stats: prints how busy each stage was, and which one limited the upload */
+void printStageStats() {
+  const BlockingQueueStats toRead = chunksToRead.getStats();
+  const BlockingQueueStats toCompress = chunksToCompress.getStats();
+  const BlockingQueueStats toPrefetch = chunksToPrefetch.getStats();
+  const BlockingQueueStats toUpload = chunksToUpload.getStats();
+  const bool prefetch = (opt.prefetchThreads > 0);
+  vector<StageReport> stages;
+  stages.push_back(StageReport(&readStage, &toRead, &toCompress));
+  stages.push_back(StageReport(&compressStage, &toCompress, (prefetch) ? &toPrefetch : &toUpload));
+  if (prefetch) {
+    stages.push_back(StageReport(&prefetchStage, &toPrefetch, &toUpload));
+  }
+  stages.push_back(StageReport(&uploadStage, &toUpload, NULL));
+  ostringstream report;
+  writeStageReport(report, stages);
+  DXLOG(logUSERINFO) << report.str();
+}
+
+/* Metrics of other components, for uploadMetrics (see --metrics-file) */
+void writeMetricsGauges(ostream &out) {
+  out << "# HELP ua_queue_depth Chunks waiting in each queue of the pipeline" << endl
+      << "# TYPE ua_queue_depth gauge" << endl
+      << "ua_queue_depth{queue=\"read\"} " << chunksToRead.size() << endl
+      << "ua_queue_depth{queue=\"compress\"} " << chunksToCompress.size() << endl
+      << "ua_queue_depth{queue=\"prefetch\"} " << chunksToPrefetch.size() << endl
+      << "ua_queue_depth{queue=\"upload\"} " << chunksToUpload.size() << endl
+      << "ua_queue_depth{queue=\"retry\"} " << retryScheduler.size() << endl
+      << "# HELP ua_upload_connections_total Upload connections, by whether they were newly created or reused" << endl
+      << "# TYPE ua_upload_connections_total counter" << endl
+      << "ua_upload_connections_total{state=\"created\"} " << uploadHandles.connectionsCreated() << endl
+      << "ua_upload_connections_total{state=\"reused\"} " << uploadHandles.connectionsReused() << endl
+      << "# HELP ua_memory_bytes Memory held by chunks in flight (state=\"in_use\"), and its limit" << endl
+      << "# TYPE ua_memory_bytes gauge" << endl
+      << "ua_memory_bytes{state=\"in_use\"} " << memoryBudget.getInUse() << endl
+      << "ua_memory_bytes{state=\"limit\"} " << memoryBudget.getLimit() << endl;
+  if (uploadConcurrency.isRunning()) {
+    out << "# HELP ua_upload_concurrency_limit Number of chunks uploaded at once (--upload-threads=auto)" << endl
+        << "# TYPE ua_upload_concurrency_limit gauge" << endl
+        << "ua_upload_concurrency_limit " << uploadConcurrency.getLimit() << endl;
+  }
+}
+
 bool fileDone(File &file) {
   if (file.failed)
     return true;
@@ -423,7 +912,7 @@ bool fileDone(File &file) {
   return false;
 }
 
-bool allFilesDone(vector<File> &files) {
+bool allFilesDone(FileList &files) {
   for (unsigned int i = 0; i < files.size(); ++i) {
     if (!fileDone(files[i])) {
       return false;
@@ -432,7 +921,7 @@ bool allFilesDone(vector<File> &files) {
   return true;
 }
 
-void updateFileState(vector<File> &files) {
+void updateFileState(FileList &files) {
   for (unsigned int i = 0; i < files.size(); ++i) {
     if (!files[i].failed) {
       files[i].updateState();
@@ -440,14 +929,14 @@ void updateFileState(vector<File> &files) {
   }
 }
 
-void waitOnClose(vector<File> &files) {
+void waitOnClose(FileList &files) {
   do {
     boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
     updateFileState(files);
   } while (!allFilesDone(files));
 }
 
-void uploadProgressHelper(vector<File> &files) {
+void uploadProgressHelper(FileList &files) {
   // Print individual file progress
   std::ostringstream oss;
   boost::mutex::scoped_lock boLock(bytesUploadedMutex);
@@ -494,12 +983,15 @@ void uploadProgressHelper(vector<File> &files) {
   queueLock.unlock();
   DXLOG(logUSERINFO) << " ... Instantaneous transfer speed = " << setw(6) << setprecision(2) << std::fixed << mbps2 << " MB/sec";
 
-  if (opt.throttle >= 0) {
-    DXLOG(logUSERINFO) << " (throttled to " << opt.throttle << " bytes/sec)";
+  if (uploadRateLimiter.isEnabled()) {
+    const int64_t rate = uploadRateLimiter.getRate();
+    if (rate > 0) {
+      DXLOG(logUSERINFO) << " (throttled to " << rate << " bytes/sec)";
+    }
   }
 }
 
-void uploadProgress(vector<File> &files) {
+void uploadProgress(FileList &files) {
   try {
     do {
       uploadProgressHelper(files);
@@ -515,16 +1007,59 @@ void uploadProgress(vector<File> &files) {
   }
 }
 
-void createWorkerThreads(vector<File> &files) {
+/*
+ * Uploads the .gzi index of a file compressed with --bgzf, as a new file
+ * object (next to the file, named after it with ".gzi" appended), and
+ * closes it.
+ */
+void uploadBgzfIndex(File &file) {
+  if (!file.bgzfIndexComplete) {
+    DXLOG(logUSERINFO) << "WARNING: Not uploading the BGZF index of \"" << file.localFile
+                       << "\", since some of its parts were uploaded by a previous run (resumed upload)" << endl;
+    return;
+  }
+  vector<char> index;
+  buildGziIndex(file.bgzfChunks, index);
+  const string indexName = file.name + ".gz.gzi";
+  const string indexID = createFileObject(file.projectID, file.folder, indexName, "application/octet-stream",
+                                          JSON(JSON_OBJECT), JSON(JSON_ARRAY), file.tags, file.visibility, JSON(JSON_OBJECT));
+  const boost::shared_ptr<const ChunkFileNames> indexNames(new ChunkFileNames(file.localFile, indexID));
+  Chunk c(indexNames, 0, opt.tries, 0, index.size(), false, true, file.fileIndex);
+  c.data.allocate(chunkBufferPool, index.size());
+  memcpy(c.data.data(), &index[0], index.size());
+  for (int numTry = 1; ; ++numTry) {
+    try {
+      c.upload(opt);
+      break;
+    } catch (runtime_error &e) {
+      if (numTry >= opt.tries) {
+        throw;
+      }
+      c.log(string("Upload of BGZF index failed, will retry: ") + e.what(), logWARNING);
+      boost::this_thread::sleep(boost::posix_time::milliseconds((4 << numTry) * 1000));
+    }
+  }
+  closeFileObject(indexID);
+  DXLOG(logUSERINFO) << "BGZF index of \"" << file.localFile << "\" was uploaded to file object " << indexID << endl;
+}
+
+void createWorkerThreads(FileList &files) {
+  uploadRateLimiter.init(max<int64_t>(opt.throttle, 0), opt.throttleSchedule, opt.throttleBurst);
+
   DXLOG(logINFO) << "Creating worker threads:";
 
   if (opt.standardInput) {
     DXLOG(logINFO) << " read stdin...";
     readThreads.push_back(boost::thread(readStdinChunks, boost::ref(files)));
   } else {
-    DXLOG(logINFO) << " read...";
-    for (int i = 0; i < opt.readThreads; ++i) {
-      readThreads.push_back(boost::thread(readChunks));
+    if (uringReader.isInitialized()) {
+      DXLOG(logINFO) << " read (io_uring)...";
+      readThreads.push_back(boost::thread(readChunksUring));
+    } else {
+      DXLOG(logINFO) << " read...";
+      for (int i = 0; i < opt.readThreads; ++i) {
+        readThreads.push_back(boost::thread(readChunks));
+      }
     }
   }
 
@@ -532,10 +1067,32 @@ void createWorkerThreads(vector<File> &files) {
   for (int i = 0; i < opt.compressThreads; ++i) {
     compressThreads.push_back(boost::thread(compressChunks));
   }
+  if (compressBlockSize > 0 || bgzfCompression) {
+    compressionPool.start(opt.compressThreads);
+  }
 
-  DXLOG(logINFO) << " upload...";
-  for (int i = 0; i < opt.uploadThreads; ++i) {
-    uploadThreads.push_back(boost::thread(uploadChunks, boost::ref(files)));
+  DXLOG(logINFO) << " prefetch...";
+  for (int i = 0; i < opt.prefetchThreads; ++i) {
+    prefetchThreads.push_back(boost::thread(prefetchUploadURLs));
+  }
+
+  // Retried chunks are produced to "chunksToRead", and not "chunksToUpload": since
+  // chunksToUpload is bounded, the scheduler thread could block on it indefinitely
+  retryScheduler.start(retryChunk);
+  if (opt.autoUploadThreads) {
+    uploadConcurrency.start(opt.minUploadThreads, opt.maxUploadThreads, opt.initialUploadThreads, uploadBacklog);
+  }
+  if (opt.uploadEngine == "multi") {
+    DXLOG(logINFO) << " upload (multi)...";
+    multiUploader.start(opt.maxConnections, boost::bind(multiUploadDone, boost::ref(files), _1, _2));
+    for (int i = 0; i < opt.uploadThreads; ++i) {
+      uploadThreads.push_back(boost::thread(startUploads, boost::ref(files)));
+    }
+  } else {
+    DXLOG(logINFO) << " upload...";
+    for (int i = 0; i < opt.uploadThreads; ++i) {
+      uploadThreads.push_back(boost::thread(uploadChunks, boost::ref(files)));
+    }
   }
 }
 
@@ -552,6 +1109,11 @@ void interruptWorkerThreads() {
     compressThreads[i].interrupt();
   }
 
+  DXLOG(logINFO) << " prefetch...";
+  for (int i = 0; i < (int) prefetchThreads.size(); ++i) {
+    prefetchThreads[i].interrupt();
+  }
+
   DXLOG(logINFO) << " upload...";
   for (int i = 0; i < (int) uploadThreads.size(); ++i) {
     uploadThreads[i].interrupt();
@@ -570,11 +1132,21 @@ void joinWorkerThreads() {
   for (int i = 0; i < (int) compressThreads.size(); ++i) {
     compressThreads[i].join();
   }
+  // Only once no compress thread can be waiting on its blocks
+  compressionPool.stop();
+
+  DXLOG(logINFO) << " prefetch...";
+  for (int i = 0; i < (int) prefetchThreads.size(); ++i) {
+    prefetchThreads[i].join();
+  }
 
   DXLOG(logINFO) << " upload...";
   for (int i = 0; i < (int) uploadThreads.size(); ++i) {
     uploadThreads[i].join();
   }
+  multiUploader.stop();
+  uploadConcurrency.stop();
+  retryScheduler.stop();
 }
 
 void curlInit() {
@@ -590,7 +1162,7 @@ void curlInit() {
 }
 
 
-void markFileAsFailed(vector<File> &files, const string &fileID) {
+void markFileAsFailed(FileList &files, const string &fileID) {
   for (unsigned int i = 0; i < files.size(); ++i) {
     if (files[i].fileID == fileID) {
       files[i].failed = true;
@@ -615,39 +1187,25 @@ void resolveProjects(const vector<string> &projects){
   }
 }
 /*
- * This function throws a runtime_error if two or more files have the same
+ * Returns false (and prints an error) if two or more files have the same
  * signature, and are being uploaded to the same project. The signature is
  * a <project, size, last_write_time, filename> tuple, like we use to
- * detect resumable uploads.
+ * detect resumable uploads. It is called for each file, as it is found:
+ * only the later of two such files is not uploaded.
  */
-void disallowDuplicateFiles(const vector<string> &files, const vector<string> &projects) {
-  for (unsigned i = 0; i < files.size(); ++i) {
-    string hash = projectTable[projects[i]] + " ";
-    fs::path p(files[i]);
-
-    if(fs::is_directory(p)) {
-      fs::directory_iterator end_itr;
-      vector<string> filesInDir, newProjects;
-      for(fs::directory_iterator itr(p); itr != end_itr; ++itr) {
-        filesInDir.push_back(itr->path().generic_string());
-        // For files in a directory, we assume they use the project that goes with
-        // the directory itself.
-        newProjects.push_back(projects[i]);
-      }
-      if (opt.recursive)
-        disallowDuplicateFiles(filesInDir, newProjects);
-      continue;
-    }
-    hash += boost::lexical_cast<string>(boost::filesystem::file_size(p)) + " ";
-    hash += boost::lexical_cast<string>(boost::filesystem::last_write_time(p)) + " ";
-    hash += fs::canonical(p).generic_string();
-    DXLOG(logDEBUG3) << "File hash: " << hash;
-    if (hashTable.count(hash) > 0) {
-      throw runtime_error("File \"" + files[i] + "\" and \"" + hashTable[hash].string() + "\" have same Signature. You cannot upload"
-                           " two files with same signature to same project without using '--do-not-resume' flag");
-    }
-    hashTable[hash] = p;
+bool checkDuplicateFile(const LocalFile &file) {
+  string hash = projectTable[opt.projects[file.root]] + " ";
+  hash += boost::lexical_cast<string>(file.size) + " ";
+  hash += boost::lexical_cast<string>(file.modifiedTimestamp) + " ";
+  hash += file.canonicalPath;
+  DXLOG(logDEBUG3) << "File hash: " << hash;
+  if (hashTable.count(hash) > 0) {
+    DXLOG(logUSERINFO) << "ERROR: File \"" << file.path << "\" and \"" << hashTable[hash].string() << "\" have same Signature. You cannot upload"
+                          " two files with same signature to same project without using '--do-not-resume' flag" << endl;
+    return false;
   }
+  hashTable[hash] = fs::path(file.path);
+  return true;
 }
 
 // This function sets two kind of user agent strings
@@ -682,27 +1240,59 @@ void setUserAgentString() {
   dx::config::USER_AGENT_STRING() = userAgentString;
 }
 
+// The parts which the resume journal of a file shows as uploaded were not
+// uploaded by this run, so check that they are complete on the server: any
+// which is not is queued to be uploaded again, by check_for_complete_chunks().
+void checkJournaledParts(FileList &files) {
+  for (unsigned int i = 0; i < files.size(); ++i) {
+    if (files[i].failed || !files[i].journaled) {
+      continue;
+    }
+    try {
+      const vector<unsigned int> missing = files[i].missingJournaledChunks();
+      if (missing.empty()) {
+        continue;
+      }
+      DXLOG(logUSERINFO) << missing.size() << " part(s) which the resume journal of \"" << files[i].localFile
+                         << "\" shows as uploaded are not complete in remote file " << files[i].fileID << ", uploading them again." << endl;
+      for (unsigned int j = 0; j < missing.size(); ++j) {
+        Chunk *c = files[i].createChunk(missing[j], opt.tries, opt.streamCompress);
+        boost::mutex::scoped_lock boLock(bytesUploadedMutex);
+        files[i].bytesUploaded -= (c->end - c->start);
+        boLock.unlock();
+        chunksToRead.produce(c);
+      }
+    } catch (exception &e) {
+      DXLOG(logUSERINFO) << "ERROR: Unable to check the parts which the resume journal of \"" << files[i].localFile
+                         << "\" shows as uploaded: " << e.what() << ". The journal was removed, please try to upload this file again." << endl;
+      files[i].failed = true;
+      resumeJournal.remove(files[i].journalKey());
+    }
+  }
+}
+
 // There is currently the possibility of a race condition if a chunk
 // upload timed-out.  It's possible that a second upload succeeds,
 // has the chunk marked as "complete" and then the first request makes
 // its way through the queue and marks the chunk as pending again.
 // Since we are just about to close the file, we'll check to see if any
 // chunks are marked as pending, and if so, we'll retry them.
-void check_for_complete_chunks(vector<File> &files) {
+void check_for_complete_chunks(FileList &files) {
   for (int currCheckNum=0; currCheckNum < NUM_CHUNK_CHECKS; ++currCheckNum){
     map<string, JSON> fileDescriptions;
     while (!chunksFinished.empty()) {
-      Chunk *c = chunksFinished.consume();
+      const FinishedChunk finished = chunksFinished.consume();
+      File &f = files[finished.fileIndex];
 
       // Cache file descriptions so we only have to do once per file,
       // not once per chunk.
-      if (fileDescriptions.find(c->fileID) == fileDescriptions.end())
-        fileDescriptions[c->fileID] = fileDescribe(c->fileID);
+      if (fileDescriptions.find(f.fileID) == fileDescriptions.end())
+        fileDescriptions[f.fileID] = fileDescribe(f.fileID);
 
-      if (!is_chunk_complete(c, fileDescriptions[c->fileID])) {
-        // After the chunk was uploaded, it was cleared, removing the data
-        // from the buffer.  We need to reload if we're going to upload again.
-        chunksToRead.produce(c);
+      if (!is_part_complete(finished.index, fileDescriptions[f.fileID])) {
+        // The chunk was deleted once uploaded: create it again, to be read
+        // and uploaded again.
+        chunksToRead.produce(f.createChunk(finished.index, opt.tries, opt.streamCompress));
       }
     }
     // All of the chunks were marked as complete, so let's exit and we
@@ -731,34 +1321,26 @@ void check_for_complete_chunks(vector<File> &files) {
   // print warning.
   map<string, JSON> fileDescriptions;
   while (!chunksFinished.empty()) {
-    Chunk *c = chunksFinished.consume();
+    const FinishedChunk finished = chunksFinished.consume();
+    const File &f = files[finished.fileIndex];
 
     // Cache file descriptions so we only have to do once per file,
     // not once per chunk.
-    if (fileDescriptions.find(c->fileID) == fileDescriptions.end())
-        fileDescriptions[c->fileID] = fileDescribe(c->fileID);
+    if (fileDescriptions.find(f.fileID) == fileDescriptions.end())
+        fileDescriptions[f.fileID] = fileDescribe(f.fileID);
 
-    if (!is_chunk_complete(c, fileDescriptions[c->fileID])) {
-        DXLOG(logUSERINFO) << "Chunk " << c->index << " of file " << c->fileID << " did not complete.  This file will not be accessible.  PLease try to upload this file again." << endl;
+    if (!is_part_complete(finished.index, fileDescriptions[f.fileID])) {
+        DXLOG(logUSERINFO) << "Chunk " << finished.index << " of file " << f.fileID << " did not complete.  This file will not be accessible.  PLease try to upload this file again." << endl;
     }
   }
 }
 
-File createFile(const std::string &filePath,
+File createFile(const LocalFile &local,
                 const std::string &project,
-                const std::string &folders,
-                const std::string &name,
                 const unsigned int &fileIndex) {
-  string mimeType = "";
-  if (!opt.standardInput) {
-    DXLOG(logINFO) << "Getting MIME type for local file " << filePath << "...";
-    mimeType = getMimeType(filePath);
-    DXLOG(logINFO) << "MIME type for local file " << filePath << " is '" << mimeType << "'.";
-  } else {
-    // For stdin input, use the extension of the filename
-    mimeType = fs::path(name).extension().string();
-  }
-
+  const string &filePath = local.path;
+  string mimeType = local.mimeType;
+  DXLOG(logINFO) << "MIME type for local file " << filePath << " is '" << mimeType << "'.";
 
   bool toCompress;
   if (!opt.doNotCompress) {
@@ -774,38 +1356,13 @@ File createFile(const std::string &filePath,
   if (toCompress) {
     mimeType = "application/x-gzip";
   }
-  return File(filePath, project, folders, name, opt.visibility,
-         opt.properties, opt.type, opt.tags, opt.details,
-         toCompress, !opt.doNotResume, mimeType, opt.chunkSize, fileIndex, opt.standardInput);
-}
-
-void traverseDirectory(const fs::path &localDirPath,
-                       const std::string &project,
-                       const fs::path &_folders,
-                       const fs::path &dirName,
-                       std::vector<File> &files) {
-  fs::path remoteFolders(_folders);
-
-  if (dirName != ".") {
-    remoteFolders /= dirName;
-  }
-
-  fs::directory_iterator it(localDirPath), end;
-  for (; it != end; ++it) {
-    fs::path currPath(it->path());
-    if (fs::is_directory(currPath)) {
-      if (opt.recursive) {
-        traverseDirectory(currPath, project, remoteFolders, currPath.filename(), files);
-      }
-    } else if (fs::is_regular_file(currPath)) {
-      unsigned int fileIndex = files.size();
-      files.push_back(createFile(currPath.generic_string(), project, remoteFolders.generic_string(), currPath.filename().generic_string(), fileIndex));
-      totalChunks += files[fileIndex].createChunks(chunksToRead, opt.tries);
-      cerr << endl;
-    } else {
-      DXLOG(logWARNING) << "Unable to upload non regular file \"" << currPath.string() << "\"";
-    }
-  }
+  File file(local, project, opt.visibility,
+            opt.properties, opt.type, opt.tags, opt.details,
+            toCompress, mimeType, opt.chunkSize, fileIndex, opt.standardInput);
+  // Resolved once for all files (see resolveProjects())
+  file.projectID = projectTable[project];
+  file.waitOnClose = opt.waitOnClose;
+  return file;
 }
 
 int main(int argc, char * argv[]) {
@@ -879,10 +1436,8 @@ int main(int argc, char * argv[]) {
       DXLOG(logUSERINFO) << "ERROR: " << e.what() << endl;
       return 3;
     }
-    if (!opt.doNotResume && !opt.standardInput) {
-      resolveProjects(opt.projects);
-      disallowDuplicateFiles(opt.files, opt.projects);
-    }
+    // The files are created in the projects resolved here (see createFile())
+    resolveProjects(opt.projects);
   } catch (exception &e) {
     DXLOG(logUSERINFO) << "ERROR: " << e.what() << endl;
     return 1;
@@ -891,42 +1446,83 @@ int main(int argc, char * argv[]) {
   const bool anyImportAppToBeCalled = (opt.reads || opt.pairedReads || opt.mappings || opt.variants);
 
   chunksToCompress.setCapacity(opt.compressThreads);
-  chunksToUpload.setCapacity(opt.uploadThreads);
+  chunksToPrefetch.setCapacity(opt.prefetchThreads);
+  chunksToUpload.setCapacity(opt.initialUploadThreads);
   int exitCode = 0;
+  // Outlives the threads stopped on error (see below), which may be using it
+  FileList files;
   try {
     curlInit(); // for curl requests to be made by upload chunk request
 
     NUMTRIES_g = opt.tries;
-
-    vector<File> files;
-
-    for (unsigned int i = 0; i < opt.files.size(); ++i) {
-      if (fs::is_directory(opt.files[i])) {
-        traverseDirectory(fs::path(opt.files[i]), opt.projects[i], fs::path(opt.folders[i]), fs::path(opt.names[i]), files);
-      } else {
-        unsigned int fileIndex = files.size();
-        files.push_back(createFile(opt.files[i], opt.projects[i], opt.folders[i], opt.names[i], fileIndex));
-        if (!opt.standardInput) {
-          totalChunks += files[fileIndex].createChunks(chunksToRead, opt.tries);
-        }
-      }
-    }
-
-    if (opt.waitOnClose) {
-      for (unsigned int i = 0; i < files.size(); ++i) {
-        files[i].waitOnClose = true;
-      }
+    compressBlockSize = (size_t) opt.compressBlockSize;
+    bgzfCompression = opt.bgzf;
+
+    if (opt.standardInput) {
+      LocalFile input;
+      input.path = opt.files[0];
+      input.folder = opt.folders[0];
+      input.name = opt.names[0];
+      // For stdin input, use the extension of the filename
+      input.mimeType = fs::path(input.name).extension().string();
+      files.add(createFile(input, opt.projects[0], 0));
+      files.close();
+      files[0].init();
     }
 
     // Take this point as the starting time for program operation
     // (to calculate average transfer speed)
     startTime = std::time(0);
 
-    DXLOG(logINFO) << "Created " << totalChunks << " chunks.";
+    if (!opt.standardInput) {
+      if (opt.resumeJournal && !opt.doNotResume) {
+        resumeJournal.start(joinPath(getUserHomeDirectory(), ".dnanexus_config", "ua-journal"));
+      }
+      fileSetup.start(files, opt.metadataThreads, opt.doNotResume ? NULL : &resumeIndex);
+      chunkCursor.start(files, &fileSetup, opt.tries, opt.streamCompress);
+    }
 
-    initializeRSSLimit();
+    initializeMemoryBudget();
+    initializeReadEngine();
+    initializeChunkBufferPool();
+    if (!opt.traceFile.empty()) {
+      chunkTracer.start(TRACE_EVENTS_PER_THREAD);
+    }
+    if (opt.stageStats) {
+      startStageStats();
+    }
+    if (!opt.metricsFile.empty()) {
+      uploadMetrics.start(opt.metricsFile, opt.metricsInterval, writeMetricsGauges);
+    }
     createWorkerThreads(files);
 
+    if (!opt.standardInput) {
+      // Files are created as the walker finds them, and uploaded while the
+      // walk goes on (their remote file objects are set up by fileSetup),
+      // in the order in which the walker returns them (see FileWalker).
+      FileWalker walker;
+      for (unsigned int i = 0; i < opt.files.size(); ++i) {
+        walker.addRoot(opt.files[i], opt.folders[i], opt.names[i]);
+      }
+      walker.start(opt.scanThreads, opt.recursive, WALKER_MAX_BUFFERED_FILES);
+      LocalFile found;
+      while (walker.next(found)) {
+        // The walker stops finding files once its own buffer is full
+        fileSetup.waitForPending(WALKER_MAX_BUFFERED_FILES);
+        File file = createFile(found, opt.projects[found.root], files.size());
+        // A file (or directory) which could not be examined, or a duplicate, is not
+        // set up (see FileSetup), nor uploaded: its ID is printed as "failed"
+        if (!found.error.empty()) {
+          DXLOG(logUSERINFO) << "ERROR: Unable to upload \"" << found.path << "\": " << found.error << endl;
+          file.failed = true;
+        } else if (!opt.doNotResume && !checkDuplicateFile(found)) {
+          file.failed = true;
+        }
+        files.add(file);
+      }
+      files.close();
+    }
+
     DXLOG(logINFO) << "Creating monitor thread..";
     boost::thread monitorThread(monitor);
 
@@ -951,13 +1547,28 @@ int main(int argc, char * argv[]) {
 
     interruptWorkerThreads();
     joinWorkerThreads();
+    fileSetup.stop();
+    DXLOG(logINFO) << "Upload connections: " << uploadHandles.connectionsCreated() << " created, "
+                   << uploadHandles.connectionsReused() << " reused";
+    if (opt.stageStats) {
+      printStageStats();
+    }
 
+    checkJournaledParts(files);
     check_for_complete_chunks(files);
+    uploadMetrics.stop();
+    if (!opt.traceFile.empty()) {
+      try {
+        chunkTracer.write(opt.traceFile);
+      } catch (runtime_error &e) {
+        DXLOG(logUSERINFO) << "WARNING: " << e.what() << endl;
+      }
+    }
 
     while (!chunksFailed.empty()) {
       Chunk * c = chunksFailed.consume();
       c->log("Chunk failed", logERROR);
-      markFileAsFailed(files, c->fileID);
+      markFileAsFailed(files, c->fileID());
     }
 
     for (unsigned int i = 0; i < files.size(); ++i) {
@@ -967,12 +1578,22 @@ int main(int argc, char * argv[]) {
         DXLOG(logUSERINFO) << "File \"" << files[i].localFile << "\" was uploaded successfully. Closing..." << endl;
         if (files[i].isRemoteFileOpen) {
           files[i].close();
+          resumeJournal.remove(files[i].journalKey());
+          if (opt.bgzfIndex && files[i].toCompress) {
+            try {
+              uploadBgzfIndex(files[i]);
+            } catch (runtime_error &e) {
+              DXLOG(logUSERINFO) << "ERROR: Unable to upload the BGZF index of \"" << files[i].localFile << "\": " << e.what() << endl;
+            }
+          }
         }
       }
       if (files[i].failed)
         files[i].fileID = "failed";
     }
 
+    resumeJournal.stop();
+
     DXLOG(logINFO) << "Waiting for files to be closed...";
     boost::thread waitOnCloseThread(waitOnClose, boost::ref(files));
     DXLOG(logINFO) << "Joining wait-on-close thread...";
@@ -998,6 +1619,11 @@ int main(int argc, char * argv[]) {
   } catch (bad_alloc &e) {
     boost::call_once(bad_alloc_once, boost::bind(&handle_bad_alloc, e));
   } catch (exception &e) {
+    interruptWorkerThreads();
+    joinWorkerThreads();
+    fileSetup.stop();
+    resumeJournal.stop();
+    uploadMetrics.stop();
     curlCleanup();
     DXLOG(logUSERINFO) << endl << "ERROR: " << e.what() << endl;
     return 1;
@@ -0,0 +1,138 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+// Benchmark of where the md5 of a part is computed (build with "make md5_bench").
+//
+// Processes a local file in chunks, the way UA does (read, and optionally
+// compress), and compares:
+//  - "upload-thread": the md5 is computed over the whole part by the upload
+//    stage, before it can request the upload URL (what UA used to do), and
+//  - "incremental": the md5 is computed by the producing stage, a slice at a
+//    time as the data is read (or compressed), while it is still in the cache.
+// For each, it reports the wall time of the producing stage, and of the upload
+// stage before any network I/O can start (i.e., how long an upload slot sits
+// idle for every part).
+//
+// Usage: md5_bench <file> [chunk-size-MB (75)] [compress (0|1, default 0)]
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <openssl/md5.h>
+
+#include "dxcpp/dxlog.h"
+#include "dxcpp/file_reader.h"
+
+extern "C" {
+#include "compress.h"
+}
+
+using namespace std;
+using namespace boost::posix_time;
+
+const size_t MD5_SLICE_SIZE = 4 * 1024 * 1024;
+
+dx::FileReader fileReader;
+
+static void updateMD5(void *md5, const Bytef *data, uLong len) {
+  MD5_Update(static_cast<MD5_CTX *>(md5), data, len);
+}
+
+/* Produces a part (into "part"); if md5 is not NULL, it is computed incrementally. Returns the size of the part. */
+size_t producePart(const string &path, int64_t start, int64_t len, bool compress,
+                   vector<char> &buf, vector<char> &part, MD5_CTX *md5) {
+  char *dest = (compress) ? &buf[0] : &part[0];
+  for (int64_t offset = 0; offset < len; offset += MD5_SLICE_SIZE) {
+    const int64_t sliceLen = min<int64_t>(MD5_SLICE_SIZE, len - offset);
+    fileReader.read(path, start + offset, sliceLen, dest + offset, 0, true);
+    if (md5 != NULL && !compress) {
+      MD5_Update(md5, dest + offset, sliceLen);
+    }
+  }
+  if (!compress) {
+    return len;
+  }
+  uLongf destLen = part.size();
+  int ret = (md5 != NULL)
+    ? gzCompressWindowed((Bytef *) &part[0], &destLen, (const Bytef *) &buf[0], len, Z_DEFAULT_COMPRESSION, MD5_SLICE_SIZE, updateMD5, md5)
+    : gzCompress((Bytef *) &part[0], &destLen, (const Bytef *) &buf[0], len, Z_DEFAULT_COMPRESSION);
+  if (ret != Z_OK) {
+    cerr << "Compression failed: " << ret << endl;
+    exit(1);
+  }
+  return destLen;
+}
+
+void run(const string &mode, const string &path, int64_t fileSize, int64_t chunkSize, bool compress) {
+  vector<char> buf(chunkSize), part(gzCompressBound(chunkSize));
+  time_duration produceTime, uploadTime;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  int chunks = 0;
+  for (int64_t start = 0; start < fileSize; start += chunkSize, ++chunks) {
+    const int64_t len = min(chunkSize, fileSize - start);
+    const bool incremental = (mode == "incremental");
+    MD5_CTX md5;
+    MD5_Init(&md5);
+
+    ptime t0 = microsec_clock::universal_time();
+    const size_t partSize = producePart(path, start, len, compress, buf, part, (incremental) ? &md5 : NULL);
+    if (incremental) {
+      MD5_Final(digest, &md5);
+    }
+    ptime t1 = microsec_clock::universal_time();
+    if (!incremental) {
+      MD5(reinterpret_cast<const unsigned char *>(&part[0]), partSize, digest);
+    }
+    ptime t2 = microsec_clock::universal_time();
+    produceTime += t1 - t0;
+    uploadTime += t2 - t1;
+  }
+  cout << mode << ": produce stage " << produceTime.total_milliseconds() << " ms, "
+       << "upload stage before network I/O " << uploadTime.total_milliseconds() << " ms "
+       << "(" << (uploadTime.total_microseconds() / 1000.0 / chunks) << " ms per part)" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <file> [chunk-size-MB (75)] [compress (0|1, default 0)]" << endl;
+    return 1;
+  }
+  const string path = argv[1];
+  const int64_t chunkSize = ((argc > 2) ? boost::lexical_cast<int64_t>(argv[2]) : 75) * 1024 * 1024;
+  const bool compress = (argc > 3) && (string(argv[3]) == "1");
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    cerr << "Unable to stat '" << path << "'" << endl;
+    return 1;
+  }
+  dx::Log::ReportingLevel() = dx::logWARNING;
+  cout << "File: " << path << " (" << st.st_size << " bytes), chunk size: " << chunkSize
+       << ", compress: " << compress << endl;
+
+  // The file is kept in the page cache (and read once beforehand), so that
+  // the numbers reflect CPU and memory bandwidth, rather than the storage
+  run("warm-up", path, st.st_size, chunkSize, compress);
+  for (int i = 0; i < 2; ++i) {
+    run("upload-thread", path, st.st_size, chunkSize, compress);
+    run("incremental", path, st.st_size, chunkSize, compress);
+  }
+  return 0;
+}
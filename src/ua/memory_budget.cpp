@@ -0,0 +1,61 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "memory_budget.h"
+
+MemoryBudget::MemoryBudget() : limit(0), inUse(0) {
+}
+
+void MemoryBudget::init(int64_t limit_) {
+  boost::unique_lock<boost::mutex> lock(mut);
+  limit = limit_;
+}
+
+void MemoryBudget::acquire(int64_t bytes) {
+  boost::unique_lock<boost::mutex> lock(mut);
+  while (!fits(bytes)) {
+    released.wait(lock);
+  }
+  inUse += bytes;
+}
+
+bool MemoryBudget::tryAcquire(int64_t bytes) {
+  boost::unique_lock<boost::mutex> lock(mut);
+  if (!fits(bytes)) {
+    return false;
+  }
+  inUse += bytes;
+  return true;
+}
+
+void MemoryBudget::release(int64_t bytes) {
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    inUse -= bytes;
+  }
+  // Waiting read threads may need different amounts: let each of them check
+  released.notify_all();
+}
+
+int64_t MemoryBudget::getLimit() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  return limit;
+}
+
+int64_t MemoryBudget::getInUse() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  return inUse;
+}
@@ -0,0 +1,67 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_MEMORY_BUDGET_H
+#define UA_MEMORY_BUDGET_H
+
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * A counting semaphore over bytes, bounding the amount of chunk data in
+ * flight (--max-memory): read threads acquire the memory a chunk needs
+ * before reading it, and the upload stage releases it once the upload
+ * attempt is over. A read thread waiting for memory wakes up as soon as
+ * enough has been released.
+ *
+ * A request made while nothing at all is held is always granted (otherwise
+ * a chunk larger than the budget could never be read).
+ */
+class MemoryBudget : boost::noncopyable {
+public:
+
+  MemoryBudget();
+
+  /* Sets the budget, in bytes (0 means "no limit") */
+  void init(int64_t limit_);
+
+  /* Blocks until "bytes" fit in the budget, and takes them. An interruption point */
+  void acquire(int64_t bytes);
+
+  /* Same as acquire(), but returns false, rather than wait, if "bytes" do not fit */
+  bool tryAcquire(int64_t bytes);
+
+  void release(int64_t bytes);
+
+  int64_t getLimit() const;
+  int64_t getInUse() const;
+
+private:
+
+  /* Called with "mut" locked */
+  bool fits(int64_t bytes) const {
+    return (limit <= 0 || inUse == 0 || inUse + bytes <= limit);
+  }
+
+  mutable boost::mutex mut;
+  boost::condition_variable released;
+  int64_t limit;
+  int64_t inUse;
+};
+
+#endif
@@ -0,0 +1,190 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "metrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+
+/* Upper bounds of the latency histogram buckets, in milliseconds (followed by +Inf) */
+static const int64_t BUCKET_BOUNDS_MS[] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 120000, 300000};
+static const int NUM_BUCKETS = sizeof(BUCKET_BOUNDS_MS) / sizeof(BUCKET_BOUNDS_MS[0]) + 1;
+
+static const char *STAGE_NAMES[Metrics::NUM_STAGES] = {"read", "compress", "md5", "url_fetch", "put"};
+
+Metrics::Metrics() : intervalSeconds(0), writer(NULL), bytesRead(0), bytesCompressedIn(0), bytesCompressedOut(0), bytesUploaded(0) {
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    histograms[i].counts.assign(NUM_BUCKETS, 0);
+    histograms[i].count = 0;
+    histograms[i].sumMs = 0;
+  }
+}
+
+void Metrics::start(const string &fileName_, int intervalSeconds_, const GaugesFunction &gauges_) {
+  fileName = fileName_;
+  intervalSeconds = intervalSeconds_;
+  gauges = gauges_;
+  DXLOG(logINFO) << "Writing metrics to " << fileName << " every " << intervalSeconds << " seconds";
+  writer = new boost::thread(boost::bind(&Metrics::run, this));
+}
+
+void Metrics::stop() {
+  if (writer == NULL) {
+    return;
+  }
+  writer->interrupt();
+  writer->join();
+  delete writer;
+  writer = NULL;
+  write();
+}
+
+void Metrics::observe(Stage stage, int64_t ms) {
+  if (!isEnabled()) {
+    return;
+  }
+  int bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && ms > BUCKET_BOUNDS_MS[bucket]) {
+    ++bucket;
+  }
+  boost::unique_lock<boost::mutex> lock(mut);
+  Histogram &h = histograms[stage];
+  ++h.counts[bucket];
+  ++h.count;
+  h.sumMs += ms;
+}
+
+void Metrics::addRead(int64_t bytes, int64_t ms) {
+  if (!isEnabled()) {
+    return;
+  }
+  observe(READ, ms);
+  boost::unique_lock<boost::mutex> lock(mut);
+  bytesRead += bytes;
+}
+
+void Metrics::addCompressed(int64_t bytesIn, int64_t bytesOut, int64_t ms) {
+  if (!isEnabled()) {
+    return;
+  }
+  observe(COMPRESS, ms);
+  boost::unique_lock<boost::mutex> lock(mut);
+  bytesCompressedIn += bytesIn;
+  bytesCompressedOut += bytesOut;
+}
+
+void Metrics::addUploaded(int64_t bytes) {
+  if (!isEnabled()) {
+    return;
+  }
+  boost::unique_lock<boost::mutex> lock(mut);
+  bytesUploaded += bytes;
+}
+
+void Metrics::addFailure(const string &cause, bool retried) {
+  if (!isEnabled()) {
+    return;
+  }
+  boost::unique_lock<boost::mutex> lock(mut);
+  ++((retried) ? retries : failures)[cause];
+}
+
+void Metrics::run() {
+  try {
+    while (true) {
+      boost::this_thread::sleep(boost::posix_time::seconds(intervalSeconds));
+      write();
+    }
+  } catch (boost::thread_interrupted &ti) {
+  }
+}
+
+void Metrics::writeTo(ostream &out) {
+  boost::unique_lock<boost::mutex> lock(mut);
+  out << "# HELP ua_bytes_read_total Bytes read from local files (or stdin)" << endl
+      << "# TYPE ua_bytes_read_total counter" << endl
+      << "ua_bytes_read_total " << bytesRead << endl
+      << "# HELP ua_bytes_compressed_total Bytes compressed, before (direction=\"in\") and after (direction=\"out\") compression" << endl
+      << "# TYPE ua_bytes_compressed_total counter" << endl
+      << "ua_bytes_compressed_total{direction=\"in\"} " << bytesCompressedIn << endl
+      << "ua_bytes_compressed_total{direction=\"out\"} " << bytesCompressedOut << endl
+      << "# HELP ua_compression_ratio Compressed size over uncompressed size, of the data compressed so far" << endl
+      << "# TYPE ua_compression_ratio gauge" << endl
+      << "ua_compression_ratio " << ((bytesCompressedIn > 0) ? (double) bytesCompressedOut / bytesCompressedIn : 1.0) << endl
+      << "# HELP ua_bytes_uploaded_total Bytes of the chunks uploaded successfully" << endl
+      << "# TYPE ua_bytes_uploaded_total counter" << endl
+      << "ua_bytes_uploaded_total " << bytesUploaded << endl;
+
+  out << "# HELP ua_upload_retries_total Failed upload attempts which will be retried, by cause" << endl
+      << "# TYPE ua_upload_retries_total counter" << endl;
+  for (map<string, int64_t>::const_iterator it = retries.begin(); it != retries.end(); ++it) {
+    out << "ua_upload_retries_total{cause=\"" << it->first << "\"} " << it->second << endl;
+  }
+  out << "# HELP ua_upload_failures_total Chunks which failed for good (no tries left), by cause of the last failure" << endl
+      << "# TYPE ua_upload_failures_total counter" << endl;
+  for (map<string, int64_t>::const_iterator it = failures.begin(); it != failures.end(); ++it) {
+    out << "ua_upload_failures_total{cause=\"" << it->first << "\"} " << it->second << endl;
+  }
+
+  out << "# HELP ua_stage_duration_seconds Time spent by each stage on a chunk" << endl
+      << "# TYPE ua_stage_duration_seconds histogram" << endl;
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    const Histogram &h = histograms[s];
+    int64_t cumulative = 0;
+    for (int b = 0; b < NUM_BUCKETS; ++b) {
+      cumulative += h.counts[b];
+      out << "ua_stage_duration_seconds_bucket{stage=\"" << STAGE_NAMES[s] << "\",le=\"";
+      if (b < NUM_BUCKETS - 1) {
+        out << (BUCKET_BOUNDS_MS[b] / 1000.0);
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << cumulative << endl;
+    }
+    out << "ua_stage_duration_seconds_sum{stage=\"" << STAGE_NAMES[s] << "\"} " << (h.sumMs / 1000.0) << endl
+        << "ua_stage_duration_seconds_count{stage=\"" << STAGE_NAMES[s] << "\"} " << h.count << endl;
+  }
+}
+
+void Metrics::write() {
+  ostringstream out;
+  writeTo(out);
+  if (gauges) {
+    gauges(out);
+  }
+  const string tmpName = fileName + ".tmp";
+  {
+    ofstream file(tmpName.c_str(), ios::out | ios::trunc);
+    file << out.str();
+    file.close();
+    if (!file) {
+      DXLOG(logWARNING) << "Unable to write metrics to " << tmpName;
+      return;
+    }
+  }
+  if (rename(tmpName.c_str(), fileName.c_str()) != 0) {
+    DXLOG(logWARNING) << "Unable to rename " << tmpName << " to " << fileName;
+  }
+}
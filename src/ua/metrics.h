@@ -0,0 +1,106 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_METRICS_H
+#define UA_METRICS_H
+
+#include <stdint.h>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * Counters and latency histograms of the upload pipeline, periodically
+ * written to a file (--metrics-file) in the Prometheus text exposition
+ * format, e.g., for the "textfile" collector of the node exporter.
+ *
+ * The stages record what they do (add*(), observe()) from any thread; the
+ * writer thread rewrites the whole file every interval (to a temporary
+ * file, renamed over the previous one, so that readers never see a partial
+ * one), and once more when stopped. All the methods are cheap no-ops
+ * unless start() was called.
+ */
+class Metrics : boost::noncopyable {
+public:
+
+  /* Stages whose latency is measured (one histogram each) */
+  enum Stage {
+    READ,
+    COMPRESS,
+    MD5,
+    URL_FETCH,
+    PUT,
+    NUM_STAGES
+  };
+
+  /*
+   * Writes metrics owned by other components (queue depths, connections,
+   * ...), in the exposition format
+   */
+  typedef boost::function<void (std::ostream &)> GaugesFunction;
+
+  Metrics();
+
+  /* Starts the writer thread, which rewrites "fileName" every intervalSeconds seconds */
+  void start(const std::string &fileName_, int intervalSeconds_, const GaugesFunction &gauges_);
+
+  /* Interrupts, and joins, the writer thread, and writes the file a last time */
+  void stop();
+
+  bool isEnabled() const { return (writer != NULL); }
+
+  void observe(Stage stage, int64_t ms);
+
+  void addRead(int64_t bytes, int64_t ms);
+  void addCompressed(int64_t bytesIn, int64_t bytesOut, int64_t ms);
+  void addUploaded(int64_t bytes);
+
+  /* An upload attempt failed (cause: e.g., "curl_28", or "http_503"), and will be retried, or not */
+  void addFailure(const std::string &cause, bool retried);
+
+private:
+
+  struct Histogram {
+    std::vector<int64_t> counts; // one per bucket (see BUCKET_BOUNDS_MS), the last one is +Inf
+    int64_t count;
+    int64_t sumMs;
+  };
+
+  void run();
+  void write();
+  void writeTo(std::ostream &out);
+
+  std::string fileName;
+  int intervalSeconds;
+  GaugesFunction gauges;
+  boost::thread *writer;
+
+  boost::mutex mut;
+  Histogram histograms[NUM_STAGES];
+  int64_t bytesRead;
+  int64_t bytesCompressedIn;
+  int64_t bytesCompressedOut;
+  int64_t bytesUploaded;
+  std::map<std::string, int64_t> retries;
+  std::map<std::string, int64_t> failures;
+};
+
+#endif
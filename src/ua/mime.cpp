@@ -26,6 +26,7 @@
 #include <locale>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 #include <magic.h>
 
 #include "dxcpp/dxlog.h"
@@ -150,20 +151,43 @@ void setMagicDBPath() {
 }
 #endif
 
-/* 
- * - Returns the MIME type for a file (of this format: "type/subType")
- * - We do not try to uncompress an archive, rather return the mime type for compressed file.
- * - Throw runtime_error if the file path (fpath) is invalid, or if some other
- *   internal error occurs.
+/*
+ * A libmagic cookie with the magic database loaded, for the calling thread:
+ * a cookie cannot be used by several threads at once, so each thread
+ * detecting MIME types (e.g., the FileWalker threads) has its own, loaded on
+ * first use (see getMagicHandle()). If the database could not be loaded,
+ * "error" tells why, and loading is not attempted again by that thread.
  */
-// Note: This function is NOT thread-safe (since it redirects "stderr" to /dev/null temporarily)
-//       At most one instance of this function should run at any time (else "stderr" might point to /dev/null forever)
-string getMimeTypeUsingLibmagic(const string& filePath) {
-  string magic_output;
-  magic_t magic_cookie;
-  magic_cookie = magic_open(MAGIC_MIME | MAGIC_NO_CHECK_COMPRESS | MAGIC_SYMLINK | MAGIC_ERROR);
-  if (magic_cookie == NULL) {
-    throw runtime_error("error allocating magic cookie (libmagic)");
+struct MagicHandle {
+  MagicHandle() : cookie(NULL) {
+  }
+
+  ~MagicHandle() {
+    if (cookie != NULL) {
+      magic_close(cookie);
+    }
+  }
+
+  magic_t cookie;
+  string error;
+};
+
+static boost::thread_specific_ptr<MagicHandle> threadMagicHandle;
+
+// Loading the magic database temporarily redirects "stderr" (see below), so
+// at most one thread may be loading it at any time
+static boost::mutex magicLoadMutex;
+
+static MagicHandle *getMagicHandle() {
+  if (threadMagicHandle.get() != NULL) {
+    return threadMagicHandle.get();
+  }
+  MagicHandle *handle = new MagicHandle();
+  threadMagicHandle.reset(handle);
+  handle->cookie = magic_open(MAGIC_MIME | MAGIC_NO_CHECK_COMPRESS | MAGIC_SYMLINK | MAGIC_ERROR);
+  if (handle->cookie == NULL) {
+    handle->error = "error allocating magic cookie (libmagic)";
+    return handle;
   }
 
 #if !WINDOWS_BUILD
@@ -173,37 +197,55 @@ string getMimeTypeUsingLibmagic(const string& filePath) {
 	const char *ptr_to_db = MAGIC_DATABASE_PATH.c_str();
 #endif
 
+  boost::mutex::scoped_lock lock(magicLoadMutex);
 #if POSIX_BUILD
   // We redirect stderr momentarily, because "libmagic" prints bunch of warning (which we don't care about much)
   // on stderr, and the easiest way to get rid of them is to redirect stderr to /dev/null (see PTFM-4636)
   FILE *stderr_backup = stderr; // store original stderr FILE pointer
   FILE *devnull = fopen("/dev/null", "w");
   if (devnull == NULL) {
-    throw runtime_error("Unable to open either: '/dev/null': Unexpected");
+    handle->error = "Unable to open either: '/dev/null': Unexpected";
+    return handle;
   }
   stderr = devnull; // redirect stderr to /dev/null, so that warning by magic_load() are not printed.
 #endif
-  int errorCode = magic_load(magic_cookie, ptr_to_db);
+  int errorCode = magic_load(handle->cookie, ptr_to_db);
 #if POSIX_BUILD
   stderr = stderr_backup; // restore original value of stderr
   fclose(devnull);
 #endif
 
   if (errorCode) {
-    string errMsg = magic_error(magic_cookie);
-    magic_close(magic_cookie);
+    string errMsg = magic_error(handle->cookie);
 #if !WINDOWS_BUILD
-    throw runtime_error("cannot load magic database - '" + errMsg + "'");
+    handle->error = "cannot load magic database - '" + errMsg + "'";
 #else
-    throw runtime_error("cannot load magic database - '" + errMsg + "'" + " Magic DB path = '" + MAGIC_DATABASE_PATH + "'");
+    handle->error = "cannot load magic database - '" + errMsg + "'" + " Magic DB path = '" + MAGIC_DATABASE_PATH + "'";
 #endif
-  } 
-  magic_output = magic_file(magic_cookie, filePath.c_str());
-  magic_close(magic_cookie);
+  }
+  return handle;
+}
+
+/* 
+ * - Returns the MIME type for a file (of this format: "type/subType")
+ * - We do not try to uncompress an archive, rather return the mime type for compressed file.
+ * - Throw runtime_error if the file path (fpath) is invalid, or if some other
+ *   internal error occurs.
+ */
+string getMimeTypeUsingLibmagic(const string& filePath) {
+  MagicHandle *handle = getMagicHandle();
+  if (!handle->error.empty()) {
+    throw runtime_error(handle->error);
+  }
+  const char *magic_output = magic_file(handle->cookie, filePath.c_str());
+  if (magic_output == NULL) {
+    throw runtime_error(string("libmagic failed - '") + magic_error(handle->cookie) + "'");
+  }
 
   // magic_output will be of this format: "type/subType; charset=.."
   // we just want to return "type/subType"
-  return magic_output.substr(0, magic_output.find(';'));
+  const string mimeType = magic_output;
+  return mimeType.substr(0, mimeType.find(';'));
 }
 
 #if POSIX_BUILD
@@ -249,8 +291,8 @@ string getMimeTypeUsingLibmagic(const string& filePath) {
   // This function returns mime type of the given local file
   // (internally executes the "file" command)
   // If "file" command execution fails for some reason, we try and get mime type from
-  // libmagic, and if that fails as well we match extension of the file to a few known compressed
-  // types.
+  // libmagic (with a cookie per thread, see getMagicHandle()), and if that fails as
+  // well we match extension of the file to a few known compressed types.
   // Note: - We assume that existence of file has beem already checked
   //       - Since we use "file" command, this function only make sense for
   //         POSIX platforms
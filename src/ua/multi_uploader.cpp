@@ -0,0 +1,220 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "multi_uploader.h"
+
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+// curl_multi_poll() (which waits even when there is nothing to wait on), and
+// curl_multi_wakeup() appeared in libcurl 7.68.0; with older versions, the
+// event loop polls for newly submitted transfers every MAX_WAIT_MS_NO_WAKEUP ms.
+#if LIBCURL_VERSION_NUM >= 0x074400
+  #define HAVE_CURL_MULTI_POLL 1
+#endif
+
+/* Maximum time the event loop waits on transfers before checking for new ones */
+static const long MAX_WAIT_MS = 1000;
+static const long MAX_WAIT_MS_NO_WAKEUP = 50;
+
+MultiUploader::MultiUploader() : multi(NULL), loop(NULL), maxConnections(0), connectionsInUse(0) {
+}
+
+void MultiUploader::start(int maxConnections_, const DoneFunction &done_) {
+  {
+    // Connections left taken by threads interrupted in a previous pass are free again
+    boost::unique_lock<boost::mutex> lock(connectionsMutex);
+    maxConnections = maxConnections_;
+    connectionsInUse = 0;
+  }
+  done = done_;
+  multi = curl_multi_init();
+  if (multi == NULL) {
+    throw runtime_error("An error occurred when initializing the HTTP library (curl_multi_init)");
+  }
+  DXLOG(logINFO) << "Starting the upload event loop (up to " << maxConnections << " connections)";
+  loop = new boost::thread(boost::bind(&MultiUploader::run, this));
+}
+
+void MultiUploader::stop() {
+  if (loop == NULL) {
+    return;
+  }
+  loop->interrupt();
+  wakeUp();
+  loop->join();
+  delete loop;
+  loop = NULL;
+  curl_multi_cleanup(multi);
+  multi = NULL;
+}
+
+void MultiUploader::acquireConnection() {
+  boost::unique_lock<boost::mutex> lock(connectionsMutex);
+  while (connectionsInUse >= maxConnections) {
+    connectionReleased.wait(lock);
+  }
+  ++connectionsInUse;
+}
+
+void MultiUploader::releaseConnection() {
+  {
+    boost::unique_lock<boost::mutex> lock(connectionsMutex);
+    --connectionsInUse;
+  }
+  connectionReleased.notify_one();
+}
+
+void MultiUploader::submit(Chunk *c, UploadRequest *req) {
+  Transfer t;
+  t.chunk = c;
+  t.req = req;
+  submitted.produce(t);
+  wakeUp();
+}
+
+void MultiUploader::wakeUp() {
+#if HAVE_CURL_MULTI_POLL
+  if (multi != NULL) {
+    curl_multi_wakeup(multi);
+  }
+#endif
+}
+
+/*
+ * Resumes the transfers paused by their read callback (for want of data
+ * from uploadRateLimiter) if it can grant data again. Returns the number of
+ * milliseconds until it can, if transfers are still paused, or -1.
+ */
+long MultiUploader::resumePausedTransfers() {
+  bool anyPaused = false;
+  for (map<CURL *, Transfer>::iterator it = active.begin(); it != active.end(); ++it) {
+    if (it->second.req->paused) {
+      anyPaused = true;
+      break;
+    }
+  }
+  if (!anyPaused) {
+    return -1;
+  }
+  const long untilAvailable = (long) uploadRateLimiter.msUntilAvailable();
+  if (untilAvailable > 0) {
+    return untilAvailable;
+  }
+  for (map<CURL *, Transfer>::iterator it = active.begin(); it != active.end(); ++it) {
+    UploadRequest *req = it->second.req;
+    if (req->paused) {
+      // The read callback may be called (and pause the transfer again) right away
+      req->paused = false;
+      curl_easy_pause(req->curl, CURLPAUSE_CONT);
+    }
+  }
+  // Check again shortly, in case the resumed transfers used up the bucket again
+  return 1;
+}
+
+void MultiUploader::finish(const Transfer &t, CURLcode code) {
+  string error;
+  try {
+    t.chunk->finishUpload(*t.req, code);
+  } catch (runtime_error &e) {
+    error = e.what();
+    if (error.empty()) {
+      error = "Unknown error";
+    }
+  }
+  delete t.req;
+  releaseConnection();
+  done(t.chunk, error);
+}
+
+void MultiUploader::add(const Transfer &t) {
+  CURLMcode code = curl_multi_add_handle(multi, t.req->curl);
+  if (code != CURLM_OK) {
+    t.chunk->log(string("curl_multi_add_handle() failed: ") + curl_multi_strerror(code), logERROR);
+    finish(t, CURLE_FAILED_INIT);
+    return;
+  }
+  active[t.req->curl] = t;
+  t.chunk->log("Starting transfer (" + boost::lexical_cast<string>(active.size()) + " in progress)");
+}
+
+void MultiUploader::run() {
+  chunkTracer.setThreadName("upload event loop");
+  try {
+    while (true) {
+      Transfer t;
+      if (active.empty()) {
+        // Nothing to do until a transfer is submitted
+        add(submitted.consume());
+      }
+      while (submitted.tryConsume(t)) {
+        add(t);
+      }
+
+      int running = 0;
+      curl_multi_perform(multi, &running);
+
+      CURLMsg *msg;
+      int msgsLeft;
+      while ((msg = curl_multi_info_read(multi, &msgsLeft)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+          continue;
+        }
+        // "msg" does not survive curl_multi_remove_handle()
+        CURL *easy = msg->easy_handle;
+        const CURLcode result = msg->data.result;
+        map<CURL *, Transfer>::iterator it = active.find(easy);
+        assert(it != active.end());
+        const Transfer finished = it->second;
+        active.erase(it);
+        curl_multi_remove_handle(multi, easy);
+        finish(finished, result);
+      }
+
+      long timeout = resumePausedTransfers();
+#if HAVE_CURL_MULTI_POLL
+      timeout = (timeout < 0) ? MAX_WAIT_MS : min(timeout, MAX_WAIT_MS);
+      curl_multi_poll(multi, NULL, 0, (int) timeout, NULL);
+#else
+      timeout = (timeout < 0) ? MAX_WAIT_MS_NO_WAKEUP : min(timeout, MAX_WAIT_MS_NO_WAKEUP);
+      int numfds = 0;
+      curl_multi_wait(multi, NULL, 0, (int) timeout, &numfds);
+      if (numfds == 0) {
+        // curl_multi_wait() returns at once if there is no socket to wait on
+        boost::this_thread::sleep(milliseconds(timeout));
+      }
+#endif
+      boost::this_thread::interruption_point();
+    }
+  } catch (boost::thread_interrupted &ti) {
+  }
+
+  // Abandon the transfers in progress (UA is exiting)
+  for (map<CURL *, Transfer>::iterator it = active.begin(); it != active.end(); ++it) {
+    curl_multi_remove_handle(multi, it->first);
+    delete it->second.req;
+  }
+  active.clear();
+}
@@ -0,0 +1,108 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_MULTI_UPLOADER_H
+#define UA_MULTI_UPLOADER_H
+
+#include <map>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <curl/curl.h>
+
+#include "dxcpp/bqueue.h"
+
+#include "chunk.h"
+
+/*
+ * The "multi" upload engine (see --upload-engine): a single thread drives
+ * the uploads of many chunks at once, with the libcurl multi interface,
+ * rather than every upload occupying a thread of its own (blocked in
+ * curl_easy_perform()) for its whole duration.
+ *
+ * Upload threads prepare the requests (Chunk::startUpload(), which makes
+ * the /file-xxxx/upload API call), on one of maxConnections "connections"
+ * (see acquireConnection()), and submit() them; the event loop performs
+ * them, and calls "done" once each one is over.
+ */
+class MultiUploader : boost::noncopyable {
+public:
+
+  /*
+   * Called by the event loop once the upload of a chunk is over (whether
+   * it succeeded or not); error is empty if it succeeded.
+   */
+  typedef boost::function<void (Chunk *, const std::string &error)> DoneFunction;
+
+  MultiUploader();
+
+  /* Starts the event loop */
+  void start(int maxConnections_, const DoneFunction &done_);
+
+  /* Interrupts, and joins, the event loop (uploads in progress are abandoned) */
+  void stop();
+
+  bool isRunning() const { return (loop != NULL); }
+
+  /*
+   * Blocks until less than maxConnections uploads are in progress (or being
+   * prepared), and reserves a connection for one more; the connection is
+   * released once the upload submitted on it is over (or by releaseConnection()).
+   * An interruption point.
+   */
+  void acquireConnection();
+  void releaseConnection();
+
+  /*
+   * Hands the upload of "c" (prepared by c->startUpload(*req)) over to the
+   * event loop, which takes ownership of "req".
+   */
+  void submit(Chunk *c, UploadRequest *req);
+
+private:
+
+  struct Transfer {
+    Chunk *chunk;
+    UploadRequest *req;
+  };
+
+  void run();
+  void add(const Transfer &t);
+  void finish(const Transfer &t, CURLcode code);
+  long resumePausedTransfers();
+  void wakeUp();
+
+  DoneFunction done;
+
+  CURLM *multi;
+  boost::thread *loop;
+
+  /* Transfers submitted, not yet added to the multi handle */
+  dx::BlockingQueue<Transfer> submitted;
+
+  /* Transfers in progress (only accessed by the event loop) */
+  std::map<CURL *, Transfer> active;
+
+  int maxConnections;
+  int connectionsInUse;
+  boost::mutex connectionsMutex;
+  boost::condition_variable connectionReleased;
+};
+
+#endif
@@ -16,6 +16,7 @@
 
 #include "options.h"
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
 
@@ -41,13 +42,20 @@ using namespace dx;
 const int64_t DEFAULT_CHUNK_SIZE = 30 * 1024 * 1024;
 const char * DEFAULT_RAW_CHUNK_SIZE = "30M";
 const int DEFAULT_UPLOAD_THREADS = 6;
+const char * DEFAULT_RAW_UPLOAD_THREADS = "6";
 #else
 const int64_t DEFAULT_CHUNK_SIZE = 75 * 1024 * 1024;
 const char * DEFAULT_RAW_CHUNK_SIZE = "75M";
 const int DEFAULT_UPLOAD_THREADS = 8;
+const char * DEFAULT_RAW_UPLOAD_THREADS = "8";
 #endif
 
+const int DEFAULT_SCAN_THREADS = 8;
+const int DEFAULT_METADATA_THREADS = 4;
 const int DEFAULT_READ_THREADS = 2;
+const int DEFAULT_IO_DEPTH = 8;
+const int DEFAULT_PREFETCH_THREADS = 2;
+const int DEFAULT_MAX_UPLOAD_THREADS = 32;
 const int MAX_FILE_UPLOAD = 1000;
 
 
@@ -77,17 +85,38 @@ Options::Options():
     ("tag", po::value<vector<string> >(&tagsInput), "Tag of the data object; repeat as necessary, e.g. \"--tag tag1 --tag tag2\"")
     ("details", po::value<string>(&detailsInput), "JSON to store as details")
     ("recursive", po::bool_switch(&recursive)->default_value(false), "Recursively upload the directories")
+    ("scan-threads", po::value<int>(&scanThreads)->default_value(DEFAULT_SCAN_THREADS), "Number of threads listing the directories to upload, and examining the files found (size, modification time, MIME type)")
+    ("metadata-threads", po::value<int>(&metadataThreads)->default_value(DEFAULT_METADATA_THREADS), "Number of threads creating (or finding, to resume uploading to) the remote file objects, while the files already set up are uploaded")
     ("read-threads", po::value<int>(&readThreads)->default_value(DEFAULT_READ_THREADS), "Number of parallel disk read threads")
+    ("io-engine", po::value<string>(&ioEngine)->default_value("sync"), "Disk read engine: \"sync\" (each read thread does one read at a time), or \"io_uring\" (Linux only: a single read thread keeps --io-depth reads in flight; falls back to \"sync\" if io_uring is not available)")
+    ("io-depth", po::value<int>(&ioDepth)->default_value(DEFAULT_IO_DEPTH), "Number of reads kept in flight by the io_uring read engine")
     ("compress-threads,c", po::value<int>(&compressThreads)->default_value(defaultCompressThreads), "Number of parallel compression threads")
-    ("upload-threads,u", po::value<int>(&uploadThreads)->default_value(DEFAULT_UPLOAD_THREADS), "Number of parallel upload threads")
+    ("compress-block-size", po::value<string>(&rawCompressBlockSize), "Split each chunk into blocks of this size, which are compressed in parallel (by #compress-threads additional threads), so that even a single file can use every core; the chunk is still uploaded as a single gzip stream. Specify an integer size in bytes or append optional units (B, K, M, G); must be at least 32K. E.g., '128K'. If not set, each chunk is compressed by a single thread.")
+    ("upload-threads,u", po::value<string>(&rawUploadThreads)->default_value(DEFAULT_RAW_UPLOAD_THREADS), "Number of parallel upload threads, or \"auto\" to adjust the number of chunks uploaded at once (between --min-upload-threads and --max-upload-threads) to the measured throughput and errors")
+    ("min-upload-threads", po::value<int>(&minUploadThreads)->default_value(1), "With --upload-threads=auto, minimum number of chunks uploaded at once")
+    ("max-upload-threads", po::value<int>(&maxUploadThreads)->default_value(DEFAULT_MAX_UPLOAD_THREADS), "With --upload-threads=auto, maximum number of chunks uploaded at once")
+    ("upload-engine", po::value<string>(&uploadEngine)->default_value("threads"), "Upload engine: \"threads\" (each upload thread uploads one chunk at a time), or \"multi\" (upload threads only request the upload URLs, and a single event loop uploads up to --max-connections chunks at once). Cannot be used with --stream-compress")
+    ("max-connections", po::value<int>(&maxConnections)->default_value(0), "Maximum number of chunks uploaded at once by the \"multi\" upload engine (default: #upload-threads)")
+    ("prefetch-threads", po::value<int>(&prefetchThreads)->default_value(DEFAULT_PREFETCH_THREADS), "Number of threads requesting the upload URLs of chunks ahead of their upload, while earlier chunks are being uploaded. If 0, the URL of each chunk is requested right before it is uploaded")
     ("chunk-size,s", po::value<string>(&rawChunkSize)->default_value(DEFAULT_RAW_CHUNK_SIZE), "Size of chunks in which the file should be uploaded. Specify an integer size in bytes or append optional units (B, K, M, G). E.g., '50M' sets chunk size to 50 megabytes.")
     ("throttle", po::value<string>(&rawThrottle), "Limit maximum upload speed. Specify an integer to set speed in bytes/second or append optional units (B, K, M, G). E.g., '3M' limits upload speed to 3 megabytes/second. If not set, uploads are not throttled.")
+    ("throttle-schedule", po::value<string>(&rawThrottleSchedule), "Limit maximum upload speed depending on the (local) time of day: comma-separated HH:MM=SPEED entries, each setting the speed (as in --throttle, or \"unlimited\") from that time until the next entry. E.g., '08:00=2M,20:00=unlimited' limits upload speed to 2 megabytes/second from 8 am to 8 pm. Cannot be used with --throttle")
+    ("throttle-burst", po::value<string>(&rawThrottleBurst), "With --throttle or --throttle-schedule, maximum amount of data sent at once above the speed limit (after a pause). Specify an integer size in bytes or append optional units (B, K, M, G). If not set, a tenth of a second's worth of data at the speed limit")
+    ("max-memory", po::value<string>(&rawMaxMemory), "Maximum amount of memory held by chunks in flight (read, but not yet uploaded): read threads wait for earlier chunks to be uploaded when it is reached. Specify an integer size in bytes or append optional units (B, K, M, G). If not set, 80% of the memory available when the upload starts")
+    ("metrics-file", po::value<string>(&metricsFile), "Periodically write metrics of the upload (bytes read, compressed and uploaded, latency of each stage, retries by cause, queue depths, ...) to this file, in the Prometheus text format (e.g., for the textfile collector of the node exporter)")
+    ("metrics-interval", po::value<int>(&metricsInterval)->default_value(10), "Interval, in seconds, at which --metrics-file is rewritten")
+    ("trace-file", po::value<string>(&traceFile), "Record the stages (read, compress, md5, url, put) and waits (in queues, for memory, before retries) of each chunk, and write them to this file at exit, in the Chrome trace event format (JSON), which can be opened in chrome://tracing or https://ui.perfetto.dev. Only the latest events of each thread are kept")
+    ("stage-stats", po::bool_switch(&stageStats), "Measure how busy the threads of each stage (read, compress, prefetch, upload) are, and how long they wait on their queues, and print a summary at exit, naming the stage which limited the upload, and suggesting numbers of threads")
     ("tries,r", po::value<int>(&tries)->default_value(3), "Number of tries to upload each chunk")
     ("do-not-compress", po::bool_switch(&doNotCompress), "Do not compress file(s) before upload")
+    ("stream-compress", po::bool_switch(&streamCompress), "Do not hold chunks in memory: compute the size and MD5 of each chunk in a first pass over the file, and compress it again while uploading. Uses about twice the CPU for compression, but only ~1.5 MB of memory per chunk in flight (allowing many more upload threads). Cannot be used with --read-from-stdin")
+    ("bgzf", po::bool_switch(&bgzf), "Compress file(s) as BGZF (blocked gzip, as produced by bgzip), rather than plain gzip, so that they can be accessed randomly, and decompressed in parallel. Blocks are compressed in parallel (by #compress-threads additional threads)")
+    ("bgzf-index", po::bool_switch(&bgzfIndex), "With --bgzf, also upload the .gzi index of each compressed file (as produced by \"bgzip -i\"), as a file object named after it, with \".gzi\" appended")
     ("progress,g", po::bool_switch(&progress), "Report upload progress")
     ("verbose,v", po::bool_switch(&verbose), "Verbose logging")
     ("wait-on-close", po::bool_switch(&waitOnClose), "Wait for file objects to be closed before exiting")
     ("do-not-resume", po::bool_switch(&doNotResume), "Do not attempt to resume any incomplete uploads")
+    ("resume-journal", po::bool_switch(&resumeJournal), "Record the parts uploaded in a local journal (in ~/.dnanexus_config/ua-journal), from which an interrupted upload is resumed without looking for the remote file first (its parts are checked once uploading is done). Ignored with --do-not-resume, or --read-from-stdin")
     ("test", "Test upload agent settings")
     ("read-from-stdin,i", po::bool_switch(&standardInput), "Read file content from stdin")
     ;
@@ -99,8 +128,9 @@ Options::Options():
     ("apiserver-host", po::value<string>(&apiserverHost), "API server host")
     ("apiserver-port", po::value<int>(&apiserverPort)->default_value(-1), "API server port")
     ("certificate-file", po::value<string>(&certificateFile)->default_value(""), "Certificate file (for verifying peer). Set to NOVERIFY for no check.")
-    ("no-round-robin-dns", po::bool_switch(&noRoundRobinDNS), "Disable explicit resolution of ip address by /UPLOAD calls (for round robin DNS)")
+    ("no-round-robin-dns", po::bool_switch(&noRoundRobinDNS), "Disable explicit resolution of ip address by /UPLOAD calls (for round robin DNS, which only applies to new connections: reused ones stay connected to the same host)")
     ("override-file-limit", po::bool_switch(&overrideFileLimit), "Override the file number limit")
+    ("huge-pages", po::bool_switch(&hugePages), "Back chunk buffers with transparent huge pages (Linux only)")
     // Options for running import apps
     ("reads", po::bool_switch(&reads), "After uploading is complete, run import app to convert file(s) to Reads object(s)")
     ("paired-reads", po::bool_switch(&pairedReads), "Same as --reads option, but assumes file sequence to be pairs of left, and right reads (e.g., L1 R1 L2 R2 L3 R3 ...)")
@@ -150,6 +180,43 @@ size_t parseSize(const string &sizeStr) {
   }
 }
 
+static bool scheduleEntryBefore(const RateScheduleEntry &a, const RateScheduleEntry &b) {
+  return a.minuteOfDay < b.minuteOfDay;
+}
+
+/*
+ * Parses a --throttle-schedule (comma-separated HH:MM=SPEED entries); the
+ * entries are returned sorted by time of day.
+ */
+vector<RateScheduleEntry> parseThrottleSchedule(const string &schedule) {
+  static const boost::regex entryExpr("(\\d{1,2}):(\\d{2})=(\\w+)");
+  vector<string> items;
+  boost::split(items, schedule, boost::is_any_of(","));
+  vector<RateScheduleEntry> entries;
+  for (unsigned i = 0; i < items.size(); ++i) {
+    boost::smatch match;
+    if (!regex_match(items[i], match, entryExpr)) {
+      throw runtime_error("Invalid --throttle-schedule entry: '" + items[i] + "'; provide HH:MM=SPEED, e.g. '08:00=2M'");
+    }
+    const int hours = boost::lexical_cast<int>(match[1]);
+    const int minutes = boost::lexical_cast<int>(match[2]);
+    if (hours > 23 || minutes > 59) {
+      throw runtime_error("Invalid time of day in --throttle-schedule entry: '" + items[i] + "'");
+    }
+    RateScheduleEntry entry;
+    entry.minuteOfDay = hours * 60 + minutes;
+    entry.rate = (match[3] == "unlimited") ? 0 : parseSize(match[3]);
+    entries.push_back(entry);
+  }
+  sort(entries.begin(), entries.end(), scheduleEntryBefore);
+  for (unsigned i = 1; i < entries.size(); ++i) {
+    if (entries[i].minuteOfDay == entries[i - 1].minuteOfDay) {
+      throw runtime_error("Several --throttle-schedule entries for the same time of day: '" + schedule + "'");
+    }
+  }
+  return entries;
+}
+
 void parseKeyValuePairs(const vector<string> &items, dx::JSON &result) {
   for (vector<string>::const_iterator it = items.begin(); it != items.end(); ++it) {
     DXLOG(logINFO) << "Parsing property: " << *it;
@@ -182,6 +249,32 @@ void Options::parse(int argc, char * argv[]) {
     DXLOG(logINFO) << "Setting chunk size to " << chunkSize << " bytes." << endl;
   }
 
+  if (rawCompressBlockSize.empty()) {
+    compressBlockSize = 0;
+  } else {
+    compressBlockSize = parseSize(rawCompressBlockSize);
+    DXLOG(logINFO) << "Setting compression block size to " << compressBlockSize << " bytes." << endl;
+  }
+
+  if (!rawThrottleSchedule.empty()) {
+    throttleSchedule = parseThrottleSchedule(rawThrottleSchedule);
+  }
+  throttleBurst = (rawThrottleBurst.empty()) ? 0 : parseSize(rawThrottleBurst);
+  maxMemory = (rawMaxMemory.empty()) ? 0 : parseSize(rawMaxMemory);
+
+  autoUploadThreads = (rawUploadThreads == "auto");
+  if (autoUploadThreads) {
+    // As many threads as chunks can be uploaded at once (most of them idle, below the maximum)
+    uploadThreads = maxUploadThreads;
+    DXLOG(logINFO) << "Number of concurrent uploads will be adjusted between " << minUploadThreads << " and " << maxUploadThreads << "." << endl;
+  } else {
+    try {
+      uploadThreads = boost::lexical_cast<int>(rawUploadThreads);
+    } catch (boost::bad_lexical_cast &e) {
+      throw runtime_error("Invalid value for --upload-threads: '" + rawUploadThreads + "'; must be an integer, or \"auto\"");
+    }
+  }
+
   if (rawThrottle.empty()) {
     throttle = -1;
     DXLOG(logINFO) << "Throttling is disabled." << endl;
@@ -196,6 +289,22 @@ void Options::parse(int argc, char * argv[]) {
     } else {
       DXLOG(logINFO) << "Number of upload threads is " << uploadThreads << "." << endl;
     }
+    if (maxConnections > 0) {
+      maxConnections = min(maxConnections, static_cast<int>(ceil(throttle / (1024.0 * 1024.0) + numeric_limits<double>::epsilon())));
+    }
+  }
+  if (autoUploadThreads) {
+    if (uploadThreads < maxUploadThreads) {
+      // Capped by --throttle
+      maxUploadThreads = uploadThreads;
+      minUploadThreads = min(minUploadThreads, maxUploadThreads);
+    }
+    initialUploadThreads = max(minUploadThreads, min(maxUploadThreads, DEFAULT_UPLOAD_THREADS));
+  } else {
+    initialUploadThreads = uploadThreads;
+  }
+  if (maxConnections == 0) {
+    maxConnections = uploadThreads;
   }
 
   try {
@@ -389,6 +498,10 @@ unsigned int Options::getNumberOfFilesInDirectory(const fs::path &dir) {
   return fileCount;
 }
 
+int Options::maxConcurrentUploads() const {
+  return (uploadEngine == "multi") ? maxConnections : uploadThreads;
+}
+
 void Options::validate() {
   if (files.empty()) {
     throw runtime_error("Must specify at least one file to upload");
@@ -414,7 +527,11 @@ void Options::validate() {
         throw runtime_error("File \"" + files[i] + "\" does not exist");
       }
       if (fs::is_directory(p)) {
-        totalNumberOfFiles += getNumberOfFilesInDirectory(fs::path(files[i]));
+        // Counting the files is only needed to enforce the limit (and can take a
+        // while for a large directory tree)
+        if (!overrideFileLimit) {
+          totalNumberOfFiles += getNumberOfFilesInDirectory(fs::path(files[i]));
+        }
       } else if (fs::is_regular_file(p)) {
         totalNumberOfFiles++;
       }
@@ -496,26 +613,94 @@ void Options::validate() {
   assert(folders.size() == files.size());
   assert(projects.size() == files.size());
 
+  if (scanThreads < 1) {
+    ostringstream msg;
+    msg << "Number of scan threads must be positive: " << scanThreads;
+    throw runtime_error(msg.str());
+  }
+  if (metadataThreads < 1) {
+    ostringstream msg;
+    msg << "Number of metadata threads must be positive: " << metadataThreads;
+    throw runtime_error(msg.str());
+  }
   if (readThreads < 1) {
     ostringstream msg;
     msg << "Number of read threads must be positive: " << readThreads;
     throw runtime_error(msg.str());
   }
+  if (streamCompress && standardInput) {
+    throw runtime_error("--stream-compress cannot be used with --read-from-stdin (the input must be read twice)");
+  }
+  if (ioEngine != "sync" && ioEngine != "io_uring") {
+    throw runtime_error("Invalid value for --io-engine: '" + ioEngine + "'; must be either \"sync\", or \"io_uring\"");
+  }
+  if (ioDepth < 1) {
+    ostringstream msg;
+    msg << "I/O depth must be positive: " << ioDepth;
+    throw runtime_error(msg.str());
+  }
   if (compressThreads < 1) {
     ostringstream msg;
     msg << "Number of compression threads must be positive: " << compressThreads;
     throw runtime_error(msg.str());
   }
+  if (!rawCompressBlockSize.empty() && compressBlockSize < 32 * 1024) {
+    ostringstream msg;
+    msg << "Minimum compression block size is " << (32 * 1024) << " (32 KB): " << compressBlockSize;
+    throw runtime_error(msg.str());
+  }
+  if (compressBlockSize > 0 && streamCompress) {
+    throw runtime_error("--compress-block-size cannot be used with --stream-compress");
+  }
+  if (bgzf && (streamCompress || doNotCompress || compressBlockSize > 0)) {
+    throw runtime_error("--bgzf cannot be used with --stream-compress, --do-not-compress, or --compress-block-size");
+  }
+  if (bgzfIndex && !bgzf) {
+    throw runtime_error("--bgzf-index can only be used with --bgzf");
+  }
   if (uploadThreads < 1) {
     ostringstream msg;
     msg << "Number of upload threads must be positive: " << uploadThreads;
     throw runtime_error(msg.str());
   }
+  if (autoUploadThreads && (minUploadThreads < 1 || maxUploadThreads < minUploadThreads)) {
+    ostringstream msg;
+    msg << "Invalid bounds for --upload-threads=auto: must have 1 <= --min-upload-threads (" << minUploadThreads
+        << ") <= --max-upload-threads (" << maxUploadThreads << ")";
+    throw runtime_error(msg.str());
+  }
+  if (uploadEngine != "threads" && uploadEngine != "multi") {
+    throw runtime_error("Invalid value for --upload-engine: '" + uploadEngine + "'; must be either \"threads\", or \"multi\"");
+  }
+  if (maxConnections < 1) {
+    ostringstream msg;
+    msg << "Maximum number of connections must be positive: " << maxConnections;
+    throw runtime_error(msg.str());
+  }
+  if (prefetchThreads < 0) {
+    ostringstream msg;
+    msg << "Number of prefetch threads cannot be negative: " << prefetchThreads;
+    throw runtime_error(msg.str());
+  }
+  if (uploadEngine == "multi" && streamCompress) {
+    // Streamed chunks are compressed while being uploaded, i.e., all of them by the event loop
+    throw runtime_error("--upload-engine multi cannot be used with --stream-compress");
+  }
   if (chunkSize < 5 * 1024 * 1024) {
     ostringstream msg;
     msg << "Minimum chunk size is " << (5 * 1024 * 1024) << " (5 MB): " << chunkSize;
     throw runtime_error(msg.str());
   }
+  if (!rawMaxMemory.empty() && maxMemory <= 0) {
+    ostringstream msg;
+    msg << "Maximum amount of memory must be positive: " << rawMaxMemory;
+    throw runtime_error(msg.str());
+  }
+  if (metricsInterval < 1) {
+    ostringstream msg;
+    msg << "Metrics interval must be positive: " << metricsInterval;
+    throw runtime_error(msg.str());
+  }
   if (tries < 1) {
     ostringstream msg;
     msg << "Number of tries per chunk must be positive: " << tries;
@@ -534,6 +719,14 @@ void Options::validate() {
   } else {
     DXLOG(logUSERINFO) << "Uploads are throttled to " << throttle << " bytes/sec." << endl;
   }
+  if (!throttleSchedule.empty() && throttle >= 0) {
+    throw runtime_error("--throttle-schedule cannot be used with --throttle");
+  }
+  for (unsigned i = 0; i < throttleSchedule.size(); ++i) {
+    if (throttleSchedule[i].rate > 0 && throttleSchedule[i].rate < 4 * 1024) {
+      throw runtime_error("--throttle-schedule throttles uploads to " + boost::lexical_cast<string>(throttleSchedule[i].rate) + " bytes/sec, which is less than 4 Kbytes/sec. Choose a larger value.");
+    }
+  }
 
   // Check that at most one import flag is present.
   int countImportFlags = 0;
@@ -593,16 +786,37 @@ ostream &operator<<(ostream &out, const Options &opt) {
     out << endl;
 
     out << "  recursive directory upload: " << opt.recursive << endl
+        << "  scan-threads: " << opt.scanThreads << endl
+        << "  metadata-threads: " << opt.metadataThreads << endl
         << "  read-threads: " << opt.readThreads << endl
+        << "  io-engine: " << opt.ioEngine << endl
+        << "  io-depth: " << opt.ioDepth << endl
         << "  compress-threads: " << opt.compressThreads << endl
-        << "  upload-threads: " << opt.uploadThreads << endl
+        << "  compress-block-size: " << opt.compressBlockSize << endl
+        << "  upload-threads: " << ((opt.autoUploadThreads) ? "auto" : boost::lexical_cast<string>(opt.uploadThreads)) << endl
+        << "  min-upload-threads: " << opt.minUploadThreads << endl
+        << "  max-upload-threads: " << opt.maxUploadThreads << endl
+        << "  upload-engine: " << opt.uploadEngine << endl
+        << "  max-connections: " << opt.maxConnections << endl
+        << "  prefetch-threads: " << opt.prefetchThreads << endl
         << "  chunk-size: " << opt.chunkSize << endl
         << "  tries: " << opt.tries << endl
+        << "  throttle-schedule: " << opt.rawThrottleSchedule << endl
+        << "  throttle-burst: " << opt.throttleBurst << endl
+        << "  max-memory: " << opt.maxMemory << endl
+        << "  metrics-file: " << opt.metricsFile << endl
+        << "  metrics-interval: " << opt.metricsInterval << endl
+        << "  trace-file: " << opt.traceFile << endl
+        << "  stage-stats: " << opt.stageStats << endl
         << "  do-not-compress: " << opt.doNotCompress << endl
+        << "  stream-compress: " << opt.streamCompress << endl
+        << "  bgzf: " << opt.bgzf << endl
+        << "  bgzf-index: " << opt.bgzfIndex << endl
         << "  progress: " << opt.progress << endl
         << "  verbose: " << opt.verbose << endl
         << "  wait on close: " << opt.waitOnClose << endl
         << "  do-not-resume: " << opt.doNotResume << endl
+        << "  resume-journal: " << opt.resumeJournal << endl
         << "  read-from-stdin: " << opt.standardInput << endl
         << "  reads: " << opt.reads << endl
         << "  paired-reads: " << opt.pairedReads << endl
@@ -610,7 +824,8 @@ ostream &operator<<(ostream &out, const Options &opt) {
         << "  variants: " << opt.variants << endl
         << "  ref-genome: " << opt.refGenome << endl
         << "  certificate-file" << opt.certificateFile << endl
-        << "  no-round-robin-dns" << opt.noRoundRobinDNS << endl;
+        << "  no-round-robin-dns" << opt.noRoundRobinDNS << endl
+        << "  huge-pages: " << opt.hugePages << endl;
   }
   return out;
 }
@@ -27,6 +27,8 @@
 #include "SimpleHttp.h"
 #include "dxjson/dxjson.h"
 
+#include "rate_limiter.h"
+
 namespace po = boost::program_options;
 
 #if MAC_BUILD
@@ -49,6 +51,9 @@ public:
   void validate();
   unsigned int getNumberOfFilesInDirectory(const boost::filesystem::path &dir);
 
+  // Maximum number of chunks uploaded at once (by the selected upload engine)
+  int maxConcurrentUploads() const;
+
   friend std::ostream &operator<<(std::ostream &out, const Options &opt);
 
   std::vector<std::string> projects;
@@ -60,13 +65,29 @@ public:
   std::vector<std::string> typeInput;
   std::vector<std::string> tagsInput;
     
+  int scanThreads;
+  int metadataThreads;
   int readThreads;
+  std::string ioEngine;
+  int ioDepth;
   int compressThreads;
+  int64_t compressBlockSize;
   int uploadThreads;
+  bool autoUploadThreads;
+  int minUploadThreads;
+  int maxUploadThreads;
+  int initialUploadThreads;
+  std::string uploadEngine;
+  int maxConnections;
+  int prefetchThreads;
   int chunkSize;
   int tries;
   bool doNotCompress;
+  bool streamCompress;
+  bool bgzf;
+  bool bgzfIndex;
   bool doNotResume;
+  bool resumeJournal;
   bool progress;
   bool verbose;
   bool waitOnClose;
@@ -83,7 +104,20 @@ public:
 
   bool noRoundRobinDNS;
 
+  bool hugePages;
+
   int64_t throttle;
+  std::vector<RateScheduleEntry> throttleSchedule;
+  int64_t throttleBurst;
+
+  int64_t maxMemory;
+
+  std::string metricsFile;
+  int metricsInterval;
+
+  std::string traceFile;
+
+  bool stageStats;
   
   std::string detailsInput;
   dx::JSON properties;
@@ -93,8 +127,13 @@ public:
 
 private:
 
+  std::string rawUploadThreads;
   std::string rawChunkSize;
+  std::string rawCompressBlockSize;
   std::string rawThrottle;
+  std::string rawThrottleSchedule;
+  std::string rawThrottleBurst;
+  std::string rawMaxMemory;
 
   // These params (if provided) are used for overriding the relevant dx::config::* values
   std::string apiserverProtocol;
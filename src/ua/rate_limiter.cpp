@@ -0,0 +1,140 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/date_time/c_local_time_adjustor.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+/* Smallest piece of data granted at once (unless less is requested) */
+static const int64_t MIN_GRANT = 16 * 1024;
+
+/* With a schedule, how often the current rate is looked up */
+static const long SCHEDULE_CHECK_MS = 1000;
+
+RateLimiter::RateLimiter() : enabled(false), fixedRate(0), burst(0), rate(0), tokens(0) {
+}
+
+void RateLimiter::init(int64_t bytesPerSecond, const vector<RateScheduleEntry> &schedule_, int64_t burst_) {
+  boost::mutex::scoped_lock lock(mut);
+  fixedRate = bytesPerSecond;
+  schedule = schedule_;
+  burst = burst_;
+  enabled = (fixedRate > 0 || !schedule.empty());
+
+  const ptime now = microsec_clock::universal_time();
+  rate = scheduledRate(now);
+  tokens = bucketSize();
+  lastRefill = now;
+  nextScheduleCheck = now + milliseconds(SCHEDULE_CHECK_MS);
+  if (enabled) {
+    DXLOG(logINFO) << "Upload rate limiter: rate = " << rate << " bytes/sec, bucket size = " << bucketSize() << " bytes"
+                   << ((schedule.empty()) ? "" : " (following a schedule)");
+  }
+}
+
+int64_t RateLimiter::scheduledRate(const ptime &now) const {
+  if (schedule.empty()) {
+    return fixedRate;
+  }
+  typedef boost::date_time::c_local_adjustor<ptime> localAdjustor;
+  const time_duration timeOfDay = localAdjustor::utc_to_local(now).time_of_day();
+  const int minute = timeOfDay.hours() * 60 + timeOfDay.minutes();
+  // The entry in effect is the last one starting at, or before, this minute
+  // (or the last of the day, if none does: it started the day before)
+  int64_t current = schedule.back().rate;
+  for (unsigned i = 0; i < schedule.size() && schedule[i].minuteOfDay <= minute; ++i) {
+    current = schedule[i].rate;
+  }
+  return current;
+}
+
+int64_t RateLimiter::bucketSize() const {
+  if (burst > 0) {
+    return burst;
+  }
+  return max<int64_t>(MIN_GRANT, rate / 10);
+}
+
+double RateLimiter::minGrant(size_t wanted) const {
+  return (double) min<int64_t>((int64_t) wanted, min<int64_t>(MIN_GRANT, bucketSize()));
+}
+
+/* Called with "mut" locked */
+void RateLimiter::refill(const ptime &now) {
+  if (now >= nextScheduleCheck) {
+    const int64_t newRate = scheduledRate(now);
+    if (newRate != rate) {
+      DXLOG(logINFO) << "Upload rate limiter: rate changed from " << rate << " to " << newRate << " bytes/sec (schedule)";
+      rate = newRate;
+      tokens = min(tokens, (double) bucketSize());
+    }
+    nextScheduleCheck = now + milliseconds(SCHEDULE_CHECK_MS);
+  }
+  if (rate > 0) {
+    const double elapsed = (now - lastRefill).total_microseconds() / 1e6;
+    tokens = min((double) bucketSize(), tokens + elapsed * rate);
+  }
+  lastRefill = now;
+}
+
+size_t RateLimiter::take(size_t wanted, bool wait) {
+  boost::this_thread::disable_interruption noInterruption;
+  boost::mutex::scoped_lock lock(mut);
+  while (true) {
+    refill(microsec_clock::universal_time());
+    if (rate <= 0) {
+      return wanted;
+    }
+    const double needed = minGrant(wanted);
+    if (tokens >= needed) {
+      const size_t granted = min(wanted, (size_t) floor(tokens));
+      tokens -= granted;
+      return granted;
+    }
+    if (!wait) {
+      return 0;
+    }
+    const int64_t sleepUs = (int64_t) ceil((needed - tokens) * 1e6 / rate);
+    lock.unlock();
+    boost::this_thread::sleep(microseconds(max<int64_t>(sleepUs, 1000)));
+    lock.lock();
+  }
+}
+
+int64_t RateLimiter::msUntilAvailable() {
+  boost::mutex::scoped_lock lock(mut);
+  refill(microsec_clock::universal_time());
+  const double needed = minGrant(MIN_GRANT);
+  if (rate <= 0 || tokens >= needed) {
+    return 0;
+  }
+  return (int64_t) ceil((needed - tokens) * 1000.0 / rate);
+}
+
+int64_t RateLimiter::getRate() {
+  boost::mutex::scoped_lock lock(mut);
+  refill(microsec_clock::universal_time());
+  return rate;
+}
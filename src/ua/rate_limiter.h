@@ -0,0 +1,96 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_RATE_LIMITER_H
+#define UA_RATE_LIMITER_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * Rate at which uploads may send data from a given time of day on (until
+ * the next entry of the schedule); a rate <= 0 means unlimited.
+ */
+struct RateScheduleEntry {
+  int minuteOfDay;
+  int64_t rate;
+};
+
+/*
+ * Token bucket limiting the aggregate rate at which all the uploads send
+ * data (--throttle, --throttle-schedule): every read callback takes the
+ * bytes it is about to hand over to libcurl from a single, process-wide
+ * bucket, which fills up at the configured rate, up to "burst" bytes.
+ *
+ * Data is granted in pieces of at least min(burst, 16 KB) (or the amount
+ * requested, if smaller), so that the uploads do not send a few bytes at a
+ * time when competing for tokens.
+ */
+class RateLimiter : boost::noncopyable {
+public:
+
+  RateLimiter();
+
+  /*
+   * Limits the rate to bytesPerSecond (or a rate following "schedule", in
+   * local time, if not empty). If burst is 0, it is a tenth of a second's
+   * worth of data at the current rate (and at least 16 KB).
+   * Must be called before any upload starts.
+   */
+  void init(int64_t bytesPerSecond, const std::vector<RateScheduleEntry> &schedule, int64_t burst_);
+
+  /* False if uploads are never limited (then take() need not be called) */
+  bool isEnabled() const { return enabled; }
+
+  /*
+   * Takes up to "wanted" bytes from the bucket; returns how many the caller
+   * may send now. If none are available, waits for them if "wait" is true,
+   * and returns 0 otherwise. Not an interruption point (the callers are
+   * libcurl callbacks).
+   */
+  size_t take(size_t wanted, bool wait);
+
+  /* Milliseconds until take() can grant data again (0 if it can now) */
+  int64_t msUntilAvailable();
+
+  /* Current rate, in bytes/second (<= 0 if unlimited) */
+  int64_t getRate();
+
+private:
+
+  void refill(const boost::posix_time::ptime &now);
+  int64_t scheduledRate(const boost::posix_time::ptime &now) const;
+  int64_t bucketSize() const;
+  double minGrant(size_t wanted) const;
+
+  bool enabled;
+  int64_t fixedRate;
+  std::vector<RateScheduleEntry> schedule;
+  int64_t burst;
+
+  boost::mutex mut;
+  int64_t rate;
+  double tokens;
+  boost::posix_time::ptime lastRefill;
+  boost::posix_time::ptime nextScheduleCheck;
+};
+
+#endif
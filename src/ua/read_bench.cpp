@@ -0,0 +1,171 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+// Benchmark of the Upload Agent read engines (build with "make read_bench").
+//
+// Reads a local file in chunks, the way the read stage of UA does, with:
+//  - "sync": #read-threads threads, each doing one (pread) read of a whole
+//    chunk at a time, through dx::FileReader, and
+//  - "io_uring": a single thread, keeping #io-depth reads of at most 8 MB
+//    in flight,
+// and reports the throughput of each. The file is dropped from the page cache
+// before every run (this has no effect on pages which are dirty), so that
+// the numbers reflect the storage, rather than memory bandwidth.
+//
+// Usage: read_bench <file> [chunk-size-MB (75)] [read-threads (2)] [io-depth (8)] [repetitions (3)]
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dxcpp/dxlog.h"
+#include "dxcpp/file_reader.h"
+#include "uring_reader.h"
+
+using namespace std;
+
+const int64_t URING_MAX_READ_SIZE = 8 * 1024 * 1024;
+
+string path;
+int64_t fileSize, chunkSize;
+
+dx::FileReader fileReader;
+
+boost::mutex nextChunkMutex;
+int64_t nextChunk;
+
+void dropFromPageCache() {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+  }
+}
+
+void syncReader() {
+  vector<char> buf(chunkSize);
+  while (true) {
+    int64_t start;
+    {
+      boost::mutex::scoped_lock lock(nextChunkMutex);
+      start = nextChunk;
+      nextChunk += chunkSize;
+    }
+    if (start >= fileSize) {
+      return;
+    }
+    fileReader.read(path, start, min(chunkSize, fileSize - start), &buf[0], chunkSize);
+  }
+}
+
+void runSync(int threads) {
+  nextChunk = 0;
+  vector<boost::thread *> t;
+  for (int i = 0; i < threads; ++i) {
+    t.push_back(new boost::thread(syncReader));
+  }
+  for (int i = 0; i < threads; ++i) {
+    t[i]->join();
+    delete t[i];
+  }
+}
+
+void runUring(UringReader &ring) {
+  const unsigned depth = ring.getDepth();
+  vector<vector<char> > bufs(depth, vector<char>(URING_MAX_READ_SIZE));
+  vector<unsigned> freeBufs;
+  for (unsigned i = 0; i < depth; ++i) {
+    freeBufs.push_back(i);
+  }
+  const int fd = fileReader.acquireFd(path);
+  int64_t offset = 0;
+  while (offset < fileSize || ring.inFlight() > 0) {
+    while (offset < fileSize && !freeBufs.empty()) {
+      // Reads never cross chunk boundaries (as in UA)
+      const int64_t len = min(min(URING_MAX_READ_SIZE, chunkSize - (offset % chunkSize)), fileSize - offset);
+      const unsigned b = freeBufs.back();
+      freeBufs.pop_back();
+      ring.queueRead(fd, &bufs[b][0], len, offset, reinterpret_cast<void *>(uintptr_t(b)));
+      offset += len;
+    }
+    ring.submitAndWait(1);
+    void *userData;
+    int res;
+    while (ring.popCompletion(userData, res)) {
+      if (res < 0) {
+        cerr << "Read failed (result=" << res << ")" << endl;
+        exit(1);
+      }
+      freeBufs.push_back(unsigned(uintptr_t(userData)));
+    }
+  }
+  fileReader.releaseFd(path);
+}
+
+void report(const string &engine, const boost::posix_time::time_duration &d) {
+  const double secs = d.total_microseconds() / 1e6;
+  cout << engine << ": " << secs << " s, " << (fileSize / (1024.0 * 1024.0)) / secs << " MB/s" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <file> [chunk-size-MB (75)] [read-threads (2)] [io-depth (8)] [repetitions (3)]" << endl;
+    return 1;
+  }
+  path = argv[1];
+  chunkSize = ((argc > 2) ? boost::lexical_cast<int64_t>(argv[2]) : 75) * 1024 * 1024;
+  const int threads = (argc > 3) ? boost::lexical_cast<int>(argv[3]) : 2;
+  const unsigned depth = (argc > 4) ? boost::lexical_cast<unsigned>(argv[4]) : 8;
+  const int repetitions = (argc > 5) ? boost::lexical_cast<int>(argv[5]) : 3;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    cerr << "Unable to stat '" << path << "'" << endl;
+    return 1;
+  }
+  fileSize = st.st_size;
+  cout << "File: " << path << " (" << fileSize << " bytes), chunk size: " << chunkSize
+       << ", read threads: " << threads << ", io depth: " << depth << endl;
+
+  dx::Log::ReportingLevel() = dx::logWARNING;
+  UringReader ring;
+  const bool haveUring = ring.init(depth);
+
+  for (int i = 0; i < repetitions; ++i) {
+    dropFromPageCache();
+    boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+    runSync(threads);
+    report("sync", boost::posix_time::microsec_clock::universal_time() - t0);
+
+    if (haveUring) {
+      dropFromPageCache();
+      t0 = boost::posix_time::microsec_clock::universal_time();
+      runUring(ring);
+      report("io_uring", boost::posix_time::microsec_clock::universal_time() - t0);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "resume_index.h"
+
+#include "api_helper.h"
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+
+// Number of files looked up in a folder one query each, before its files are all found at once
+static const unsigned int LOOKUPS_BEFORE_LOADING = 8;
+
+JSON ResumeIndex::find(const string &projectID, const string &folder, const string &signature) {
+  boost::mutex::scoped_lock lock(mut);
+  Folder &f = folders[make_pair(projectID, folder)];
+  if (!f.loaded && !f.loading) {
+    if (f.lookups < LOOKUPS_BEFORE_LOADING) {
+      ++f.lookups;
+      lock.unlock();
+      return findResumableFileObject(projectID, folder, signature);
+    }
+    f.loading = true;
+    lock.unlock();
+    try {
+      load(projectID, folder, f);
+    } catch (...) {
+      lock.lock();
+      f.loading = false;
+      folderLoaded.notify_all();
+      throw;
+    }
+    lock.lock();
+    f.loading = false;
+    f.loaded = true;
+    folderLoaded.notify_all();
+  }
+  while (f.loading) {
+    folderLoaded.wait(lock);
+  }
+  if (!f.loaded) {
+    // Loading failed (in another thread): look up this file alone
+    lock.unlock();
+    return findResumableFileObject(projectID, folder, signature);
+  }
+  map<string, JSON>::iterator it = f.files.find(signature);
+  if (it == f.files.end()) {
+    return JSON(JSON_ARRAY);
+  }
+  const JSON result = it->second;
+  f.files.erase(it);
+  return result;
+}
+
+/* Called with "f.loading" set (and "mut" unlocked): f.files is only used by this thread */
+void ResumeIndex::load(const string &projectID, const string &folder, Folder &f) {
+  DXLOG(logINFO) << "Looking for files to resume uploading to in folder " << folder << " of project " << projectID << "...";
+  const JSON results = findResumableFileObjects(projectID, folder);
+  for (unsigned i = 0; i < results.size(); ++i) {
+    const JSON &desc = results[i]["describe"];
+    if (!desc.has("properties") || !desc["properties"].has(FILE_SIGNATURE_PROPERTY)) {
+      continue;
+    }
+    const string signature = desc["properties"][FILE_SIGNATURE_PROPERTY].get<string>();
+    map<string, JSON>::iterator it = f.files.find(signature);
+    if (it == f.files.end()) {
+      it = f.files.insert(make_pair(signature, JSON(JSON_ARRAY))).first;
+    }
+    it->second.push_back(results[i]);
+  }
+  DXLOG(logINFO) << "Found " << results.size() << " files with a signature in folder " << folder << " of project " << projectID;
+}
@@ -0,0 +1,76 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_RESUME_INDEX_H
+#define UA_RESUME_INDEX_H
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include "dxjson/dxjson.h"
+
+/*
+ * Finds the remote files an upload can be resumed to, by file signature (see
+ * File::createResumeInfoString()), in the destination folder of each file.
+ *
+ * The first few files looked up in a folder are looked up one query each
+ * (indexed by signature on the server). Once more files are looked up in the
+ * same folder, all the files of the folder which have a signature are found
+ * (and described, with their parts) by a single paginated /findDataObjects
+ * query, and indexed by signature, instead of one query per file: uploading
+ * a few files to a folder with many earlier uploads stays cheap, and
+ * uploading many files does not take one query each.
+ *
+ * Can be used by several threads (see FileSetup): a thread looking up a file
+ * in a folder being loaded waits for it, while the other folders are
+ * looked up.
+ */
+class ResumeIndex : boost::noncopyable {
+public:
+
+  /*
+   * Returns the files in "folder" of project projectID with the given
+   * signature, as /findDataObjects results (with describe output), see
+   * findResumableFileObject(). Each signature is to be looked up once: it
+   * is then dropped from the index.
+   */
+  dx::JSON find(const std::string &projectID, const std::string &folder, const std::string &signature);
+
+private:
+
+  /* Files of a folder */
+  struct Folder {
+    Folder() : lookups(0), loading(false), loaded(false) {
+    }
+
+    unsigned int lookups; // files looked up (one query each) before loading
+    bool loading;
+    bool loaded;
+    std::map<std::string, dx::JSON> files; // by signature, once loaded
+  };
+
+  void load(const std::string &projectID, const std::string &folder, Folder &f);
+
+  boost::mutex mut;
+  boost::condition_variable folderLoaded;
+  std::map<std::pair<std::string, std::string>, Folder> folders; // by project, and folder
+};
+
+#endif
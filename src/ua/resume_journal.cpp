@@ -0,0 +1,195 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "resume_journal.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#if WINDOWS_BUILD
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+
+#include "dxcpp/dxlog.h"
+#include "dxcpp/utils.h"
+
+using namespace std;
+using namespace dx;
+
+namespace fs = boost::filesystem;
+
+// How often the records are written (and synced), unless SYNC_RECORDS of them are waiting before
+static const boost::posix_time::time_duration SYNC_INTERVAL = boost::posix_time::seconds(1);
+static const size_t SYNC_RECORDS = 256;
+
+ResumeJournal::ResumeJournal() : writer(NULL), pendingRecords(0) {
+}
+
+void ResumeJournal::start(const string &dir_) {
+  dir = dir_;
+  boost::system::error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec) {
+    throw runtime_error("Unable to create the resume journal directory \"" + dir + "\": " + ec.message());
+  }
+  DXLOG(logINFO) << "Writing resume journals to " << dir;
+  writer = new boost::thread(boost::bind(&ResumeJournal::run, this));
+}
+
+void ResumeJournal::stop() {
+  if (writer == NULL) {
+    return;
+  }
+  writer->interrupt();
+  writer->join();
+  delete writer;
+  writer = NULL;
+  write();
+}
+
+string ResumeJournal::path(const string &key) const {
+  return (fs::path(dir) / (getHexifiedMD5(key) + ".log")).string();
+}
+
+bool ResumeJournal::read(const string &key, JournaledFile &file) const {
+  if (!isEnabled()) {
+    return false;
+  }
+  ifstream in(path(key).c_str());
+  string line, kind;
+  if (!in || !getline(in, line)) {
+    return false;
+  }
+  istringstream header(line);
+  if (!(header >> kind >> file.fileID >> file.chunkSize >> file.toCompress) || kind != "file") {
+    DXLOG(logWARNING) << "Ignoring the resume journal " << path(key) << ": invalid first line '" << line << "'";
+    return false;
+  }
+  const string destinationTag = "destination ";
+  if (!getline(in, line) || line.compare(0, destinationTag.size(), destinationTag) != 0) {
+    DXLOG(logWARNING) << "Ignoring the resume journal " << path(key) << ": no destination";
+    return false;
+  }
+  file.destination = line.substr(destinationTag.size());
+  file.parts.clear();
+  while (getline(in, line)) {
+    istringstream record(line);
+    unsigned int partIndex;
+    string md5;
+    if (!(record >> kind >> partIndex >> md5) || kind != "part" || md5.size() != 32) {
+      // The last line may have been written only partly
+      DXLOG(logWARNING) << "Ignoring the end of the resume journal " << path(key) << ", from line '" << line << "'";
+      break;
+    }
+    file.parts[partIndex] = md5;
+  }
+  return true;
+}
+
+void ResumeJournal::begin(const string &key, const string &fileID, const string &destination,
+                          uint64_t chunkSize, bool toCompress) {
+  ostringstream record;
+  record << "file " << fileID << " " << chunkSize << " " << (toCompress ? 1 : 0) << "\n"
+         << "destination " << destination << "\n";
+  append(key, record.str(), true);
+}
+
+void ResumeJournal::partUploaded(const string &key, unsigned int partIndex, const string &md5) {
+  ostringstream record;
+  record << "part " << partIndex << " " << md5 << "\n";
+  append(key, record.str(), false);
+}
+
+void ResumeJournal::remove(const string &key) {
+  if (!isEnabled()) {
+    return;
+  }
+  const string p = path(key);
+  boost::mutex::scoped_lock writeLock(writeMut);
+  {
+    boost::mutex::scoped_lock lock(mut);
+    pending.erase(p);
+  }
+  boost::system::error_code ec;
+  fs::remove(p, ec);
+}
+
+void ResumeJournal::append(const string &key, const string &record, bool truncate) {
+  if (!isEnabled()) {
+    return;
+  }
+  const string p = path(key);
+  boost::mutex::scoped_lock lock(mut);
+  Batch &batch = pending[p];
+  if (truncate) {
+    batch.truncate = true;
+    batch.records.clear();
+  }
+  batch.records += record;
+  if (++pendingRecords >= SYNC_RECORDS) {
+    syncNeeded.notify_one();
+  }
+}
+
+void ResumeJournal::run() {
+  try {
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(mut);
+        if (pendingRecords < SYNC_RECORDS) {
+          syncNeeded.timed_wait(lock, SYNC_INTERVAL);
+        }
+      }
+      write();
+    }
+  } catch (boost::thread_interrupted &ti) {
+  }
+}
+
+void ResumeJournal::write() {
+  boost::mutex::scoped_lock writeLock(writeMut);
+  map<string, Batch> batches;
+  {
+    boost::mutex::scoped_lock lock(mut);
+    batches.swap(pending);
+    pendingRecords = 0;
+  }
+  for (map<string, Batch>::const_iterator it = batches.begin(); it != batches.end(); ++it) {
+    FILE *f = fopen(it->first.c_str(), it->second.truncate ? "wb" : "ab");
+    if (f == NULL) {
+      DXLOG(logWARNING) << "Unable to open the resume journal " << it->first;
+      continue;
+    }
+    const string &records = it->second.records;
+    bool ok = (fwrite(records.data(), 1, records.size(), f) == records.size()) && (fflush(f) == 0);
+#if WINDOWS_BUILD
+    ok = ok && (_commit(_fileno(f)) == 0);
+#else
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    if ((fclose(f) != 0) || !ok) {
+      DXLOG(logWARNING) << "Unable to write the resume journal " << it->first;
+    }
+  }
+}
@@ -0,0 +1,108 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_RESUME_JOURNAL_H
+#define UA_RESUME_JOURNAL_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/* The state of an upload, as recorded in the resume journal */
+struct JournaledFile {
+  JournaledFile() : chunkSize(0), toCompress(false) {
+  }
+
+  std::string fileID;
+  std::string destination;
+  uint64_t chunkSize;
+  bool toCompress;
+
+  /* MD5 of each part uploaded, by part index (starting at 1) */
+  std::map<unsigned int, std::string> parts;
+};
+
+/*
+ * Local, append-only journal of the uploads (--resume-journal): one file per
+ * upload (named after the MD5 of its key, see File::journalKey()), made of a
+ * line "file <fileID> <chunk size> <compressed>", a line "destination <remote
+ * file>" (see File::destination), followed by a line "part <index> <MD5>" for
+ * each part uploaded. An interrupted upload is then
+ * resumed from its journal, without looking for (and describing) the remote
+ * file first.
+ *
+ * Records are written, and synced to disk, in batches by the writer thread:
+ * every SYNC_INTERVAL, or as soon as SYNC_RECORDS records are waiting, and
+ * once more when stopped (the parts of the last batch may not be recorded if
+ * the process is killed, they are then uploaded again). All the methods are
+ * no-ops unless start() was called.
+ */
+class ResumeJournal : boost::noncopyable {
+public:
+
+  ResumeJournal();
+
+  /* Starts the writer thread, with the journals in directory dir_ (created if needed) */
+  void start(const std::string &dir_);
+
+  /* Interrupts, and joins, the writer thread, and writes the last records */
+  void stop();
+
+  bool isEnabled() const { return (writer != NULL); }
+
+  /* Reads the journal of a file, returns false if there is none (or it cannot be read) */
+  bool read(const std::string &key, JournaledFile &file) const;
+
+  /* Starts a new journal of a file (replacing any previous one) */
+  void begin(const std::string &key, const std::string &fileID, const std::string &destination,
+             uint64_t chunkSize, bool toCompress);
+
+  /* Records that a part was uploaded */
+  void partUploaded(const std::string &key, unsigned int partIndex, const std::string &md5);
+
+  /* Removes the journal of a file (e.g., once it is closed) */
+  void remove(const std::string &key);
+
+private:
+
+  /* Records to be appended to a journal (which is truncated first if "truncate") */
+  struct Batch {
+    Batch() : truncate(false) {
+    }
+
+    bool truncate;
+    std::string records;
+  };
+
+  std::string path(const std::string &key) const;
+  void append(const std::string &key, const std::string &record, bool truncate);
+  void run();
+  void write();
+
+  std::string dir;
+  boost::thread *writer;
+
+  boost::mutex writeMut; // held while writing (or removing) journals, before "mut"
+  boost::mutex mut;
+  boost::condition_variable syncNeeded;
+  std::map<std::string, Batch> pending; // by journal path
+  size_t pendingRecords;
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "retry_scheduler.h"
+
+#include <ctime>
+
+#include <boost/bind.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+RetryScheduler::RetryScheduler() : scheduler(NULL), nextSeq(0), retriesScheduled(0), rng((uint32_t) time(NULL)) {
+}
+
+void RetryScheduler::start(const RetryFunction &retry_) {
+  retry = retry_;
+  scheduler = new boost::thread(boost::bind(&RetryScheduler::run, this));
+}
+
+void RetryScheduler::stop() {
+  if (scheduler == NULL) {
+    return;
+  }
+  scheduler->interrupt();
+  scheduler->join();
+  delete scheduler;
+  scheduler = NULL;
+}
+
+void RetryScheduler::schedule(Chunk *c, int seconds) {
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    const int64_t maxMs = (int64_t) seconds * 1000;
+    boost::random::uniform_int_distribution<int64_t> jitter(maxMs / 2, maxMs);
+    Entry e;
+    e.due = microsec_clock::universal_time() + milliseconds(jitter(rng));
+    e.seq = nextSeq++;
+    e.chunk = c;
+    waiting.push(e);
+    ++retriesScheduled;
+  }
+  // The new chunk may be due before the one the scheduler thread waits for
+  scheduled.notify_one();
+}
+
+size_t RetryScheduler::size() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  return waiting.size();
+}
+
+int64_t RetryScheduler::msUntilNext() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  if (waiting.empty()) {
+    return -1;
+  }
+  return max<int64_t>(0, (waiting.top().due - microsec_clock::universal_time()).total_milliseconds());
+}
+
+int64_t RetryScheduler::getRetriesScheduled() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  return retriesScheduled;
+}
+
+void RetryScheduler::run() {
+  try {
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (true) {
+      if (waiting.empty()) {
+        scheduled.wait(lock);
+        continue;
+      }
+      const ptime due = waiting.top().due;
+      if (microsec_clock::universal_time() < due) {
+        scheduled.timed_wait(lock, due);
+        continue;
+      }
+      Chunk *c = waiting.top().chunk;
+      waiting.pop();
+      // The retry function may block (e.g., on a bounded queue)
+      lock.unlock();
+      retry(c);
+      lock.lock();
+    }
+  } catch (boost::thread_interrupted &ti) {
+  }
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_RETRY_SCHEDULER_H
+#define UA_RETRY_SCHEDULER_H
+
+#include <stdint.h>
+#include <queue>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+class Chunk;
+
+/*
+ * Holds the chunks whose upload failed until they are due to be retried,
+ * so that upload threads (or the event loop of the "multi" upload engine)
+ * go on uploading other chunks meanwhile, rather than sleep until then.
+ *
+ * The chunks are kept in a min-heap ordered by due time; a thread of its
+ * own sleeps until the earliest one is due, and passes it to the retry
+ * function (which produces it to chunksToRead). Each delay is jittered
+ * (see schedule()), so that chunks which failed together, e.g., because of
+ * a network outage, are not all retried at the same instant.
+ */
+class RetryScheduler : boost::noncopyable {
+public:
+
+  /* Called by the scheduler thread once a chunk is due */
+  typedef boost::function<void (Chunk *)> RetryFunction;
+
+  RetryScheduler();
+
+  /* Starts the scheduler thread */
+  void start(const RetryFunction &retry_);
+
+  /* Interrupts, and joins, the scheduler thread (chunks still waiting are kept) */
+  void stop();
+
+  /*
+   * Passes "c" to the retry function after a random delay between half of
+   * "seconds", and "seconds". Does not block.
+   */
+  void schedule(Chunk *c, int seconds);
+
+  /* Number of chunks waiting to be retried */
+  size_t size() const;
+
+  /* Milliseconds until the next chunk is due, or -1 if none is waiting */
+  int64_t msUntilNext() const;
+
+  /* Number of retries scheduled since the program started */
+  int64_t getRetriesScheduled() const;
+
+private:
+
+  struct Entry {
+    boost::posix_time::ptime due;
+    uint64_t seq; // chunks due at the same time are retried in order
+    Chunk *chunk;
+
+    bool operator>(const Entry &other) const {
+      return (due != other.due) ? (due > other.due) : (seq > other.seq);
+    }
+  };
+
+  void run();
+
+  RetryFunction retry;
+  boost::thread *scheduler;
+
+  mutable boost::mutex mut;
+  boost::condition_variable scheduled;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > waiting;
+  uint64_t nextSeq;
+  int64_t retriesScheduled;
+  boost::random::mt19937 rng;
+};
+
+#endif
@@ -0,0 +1,197 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+// Unit tests of the BGZF compression, and .gzi index, of the Upload Agent
+// (run with "make test").
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "bgzf.h"
+#include "compression_pool.h"
+
+using namespace std;
+
+/* Inflates the single gzip member at the start of "in" (of at most inLen bytes) */
+static string gunzipMember(const char *in, size_t inLen) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, inflateInit2(&stream, 16 + 15));
+  stream.next_in = (Bytef *) in;
+  stream.avail_in = (uInt) inLen;
+  string out;
+  char buf[16384];
+  int err;
+  do {
+    stream.next_out = (Bytef *) buf;
+    stream.avail_out = sizeof(buf);
+    err = inflate(&stream, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - stream.avail_out);
+  } while (err == Z_OK);
+  EXPECT_EQ(Z_STREAM_END, err);
+  inflateEnd(&stream);
+  return out;
+}
+
+static uint16_t getLE16(const char *p) {
+  return (uint16_t) ((unsigned char) p[0] | ((unsigned char) p[1] << 8));
+}
+
+static uint64_t getLE64(const char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | (unsigned char) p[i];
+  }
+  return v;
+}
+
+/* Input made of compressible text, followed by incompressible (random) bytes */
+static string testInput(size_t textLen, size_t randomLen) {
+  string in;
+  while (in.size() < textLen) {
+    in += "The quick brown fox jumps over the lazy dog. ";
+  }
+  in.resize(textLen);
+  srand(42);
+  for (size_t i = 0; i < randomLen; ++i) {
+    in += (char) (rand() & 0xff);
+  }
+  return in;
+}
+
+class BgzfTest : public testing::Test {
+protected:
+  virtual void SetUp() {
+    pool.start(2);
+  }
+
+  virtual void TearDown() {
+    pool.stop();
+  }
+
+  /* Compresses "in" into "out", checking the result */
+  void compress(const string &in, vector<char> &out, vector<BgzfBlock> &blocks) {
+    size_t outLen = bgzfCompressBound(in.size());
+    out.resize(outLen);
+    ASSERT_EQ(Z_OK, bgzfCompress(pool, &out[0], outLen, in.data(), in.size(), Z_DEFAULT_COMPRESSION, blocks, NULL));
+    out.resize(outLen);
+  }
+
+  CompressionPool pool;
+};
+
+TEST_F(BgzfTest, CompressRoundTrip) {
+  const string in = testInput(3 * BGZF_BLOCK_INPUT_SIZE + 1000, 2 * BGZF_BLOCK_INPUT_SIZE);
+  vector<char> out;
+  vector<BgzfBlock> blocks;
+  compress(in, out, blocks);
+  ASSERT_EQ((in.size() + BGZF_BLOCK_INPUT_SIZE - 1) / BGZF_BLOCK_INPUT_SIZE, blocks.size());
+
+  // Every block is a gzip member with the "BC" extra field, holding the block size minus 1
+  size_t pos = 0, inPos = 0;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    ASSERT_LE(pos + 18, out.size());
+    const char *b = &out[pos];
+    EXPECT_EQ(0x1f, (unsigned char) b[0]);
+    EXPECT_EQ(0x8b, (unsigned char) b[1]);
+    EXPECT_EQ(4, b[3]); // FEXTRA
+    EXPECT_EQ(6, getLE16(b + 10)); // XLEN
+    EXPECT_EQ('B', b[12]);
+    EXPECT_EQ('C', b[13]);
+    EXPECT_EQ(2, getLE16(b + 14));
+    EXPECT_EQ(blocks[i].compressedSize - 1, getLE16(b + 16));
+    EXPECT_LE(blocks[i].compressedSize, BGZF_MAX_BLOCK_SIZE);
+
+    const string block = gunzipMember(b, blocks[i].compressedSize);
+    ASSERT_EQ(blocks[i].uncompressedSize, block.size());
+    EXPECT_TRUE(block == in.substr(inPos, block.size())) << "block " << i;
+    pos += blocks[i].compressedSize;
+    inPos += block.size();
+  }
+  EXPECT_EQ(out.size(), pos);
+  EXPECT_EQ(in.size(), inPos);
+}
+
+TEST_F(BgzfTest, EmptyBlock) {
+  vector<char> eof;
+  getBgzfEmptyBlock(eof);
+  ASSERT_EQ(BGZF_EMPTY_BLOCK_SIZE, eof.size());
+  EXPECT_EQ(BGZF_EMPTY_BLOCK_SIZE - 1, getLE16(&eof[16]));
+  EXPECT_EQ("", gunzipMember(&eof[0], eof.size()));
+}
+
+TEST_F(BgzfTest, GziIndex) {
+  // Two chunks, each followed by padding (here, the empty block), as uploaded
+  const string in1 = testInput(2 * BGZF_BLOCK_INPUT_SIZE + 10, BGZF_BLOCK_INPUT_SIZE);
+  const string in2 = testInput(BGZF_BLOCK_INPUT_SIZE / 2, 0);
+  map<unsigned int, BgzfChunkIndex> chunks;
+  vector<char> file, out, eof;
+  getBgzfEmptyBlock(eof);
+  const string *inputs[] = {&in1, &in2};
+  for (unsigned int c = 0; c < 2; ++c) {
+    compress(*inputs[c], out, chunks[c].blocks);
+    file.insert(file.end(), out.begin(), out.end());
+    file.insert(file.end(), eof.begin(), eof.end());
+    chunks[c].size = out.size() + eof.size();
+  }
+  const string in = in1 + in2;
+
+  vector<char> gzi;
+  buildGziIndex(chunks, gzi);
+  const size_t numBlocks = chunks[0].blocks.size() + chunks[1].blocks.size();
+  ASSERT_EQ(8 + 16 * (numBlocks - 1), gzi.size());
+  ASSERT_EQ(numBlocks - 1, getLE64(&gzi[0]));
+
+  // Every entry (but the first block, at 0, 0) points to the start of a block
+  uint64_t lastCompressed = 0, lastUncompressed = 0;
+  for (size_t i = 0; i < numBlocks - 1; ++i) {
+    const uint64_t compressedOffset = getLE64(&gzi[8 + 16 * i]);
+    const uint64_t uncompressedOffset = getLE64(&gzi[16 + 16 * i]);
+    EXPECT_GT(compressedOffset, lastCompressed);
+    EXPECT_GT(uncompressedOffset, lastUncompressed);
+    ASSERT_LT(compressedOffset, file.size());
+    ASSERT_LT(uncompressedOffset, in.size());
+    const string block = gunzipMember(&file[compressedOffset], file.size() - compressedOffset);
+    EXPECT_TRUE(block == in.substr(uncompressedOffset, block.size())) << "entry " << i;
+    lastCompressed = compressedOffset;
+    lastUncompressed = uncompressedOffset;
+  }
+  // The second chunk starts after the padding of the first one
+  const size_t firstOfChunk2 = chunks[0].blocks.size() - 1;
+  EXPECT_EQ(chunks[0].size, getLE64(&gzi[8 + 16 * firstOfChunk2]));
+  EXPECT_EQ(in1.size(), getLE64(&gzi[16 + 16 * firstOfChunk2]));
+}
+
+TEST_F(BgzfTest, GziIndexOfEmptyFile) {
+  map<unsigned int, BgzfChunkIndex> chunks;
+  chunks[0].size = BGZF_EMPTY_BLOCK_SIZE;
+  vector<char> gzi;
+  buildGziIndex(chunks, gzi);
+  ASSERT_EQ(8u, gzi.size());
+  EXPECT_EQ(0u, getLE64(&gzi[0]));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,147 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "tracer.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+Tracer::Tracer() : enabled(false), eventsPerThread(0), threadBuffer(keepBuffer) {
+}
+
+void Tracer::start(size_t eventsPerThread_) {
+  eventsPerThread = max<size_t>(eventsPerThread_, 1);
+  epoch = microsec_clock::universal_time();
+  enabled = true;
+}
+
+int64_t Tracer::now() const {
+  return (enabled) ? toUs(microsec_clock::universal_time()) : 0;
+}
+
+int64_t Tracer::toUs(const ptime &t) const {
+  return (enabled) ? (t - epoch).total_microseconds() : 0;
+}
+
+Tracer::ThreadBuffer *Tracer::buffer() {
+  ThreadBuffer *b = threadBuffer.get();
+  if (b == NULL) {
+    boost::shared_ptr<ThreadBuffer> newBuffer(new ThreadBuffer());
+    newBuffer->events.resize(eventsPerThread);
+    newBuffer->recorded = 0;
+    {
+      boost::mutex::scoped_lock lock(buffersMutex);
+      buffers.push_back(newBuffer);
+    }
+    b = newBuffer.get();
+    threadBuffer.reset(b);
+  }
+  return b;
+}
+
+void Tracer::record(const Event &e) {
+  ThreadBuffer *b = buffer();
+  b->events[b->recorded % b->events.size()] = e;
+  ++b->recorded;
+}
+
+void Tracer::setThreadName(const string &name) {
+  if (enabled) {
+    buffer()->threadName = name;
+  }
+}
+
+void Tracer::stage(const char *name, int file, int chunk, int64_t startUs, int64_t endUs) {
+  if (!enabled) {
+    return;
+  }
+  Event e;
+  e.name = name;
+  e.phase = 'X';
+  e.file = file;
+  e.chunk = chunk;
+  e.ts = startUs;
+  e.dur = endUs - startUs;
+  record(e);
+}
+
+void Tracer::wait(const char *name, int file, int chunk, int64_t startUs, int64_t endUs) {
+  if (!enabled) {
+    return;
+  }
+  Event e;
+  e.name = name;
+  e.phase = 'b';
+  e.file = file;
+  e.chunk = chunk;
+  e.ts = startUs;
+  e.dur = endUs - startUs;
+  record(e);
+}
+
+void Tracer::write(const string &fileName) {
+  if (!enabled) {
+    return;
+  }
+  ofstream out(fileName.c_str(), ios::out | ios::trunc);
+  if (!out) {
+    throw runtime_error("Unable to open the trace file " + fileName);
+  }
+  boost::mutex::scoped_lock lock(buffersMutex);
+  uint64_t total = 0, dropped = 0;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+  out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"ua\"}}";
+  for (size_t tid = 0; tid < buffers.size(); ++tid) {
+    const ThreadBuffer &b = *buffers[tid];
+    if (!b.threadName.empty()) {
+      out << "," << endl << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (tid + 1)
+          << ",\"args\":{\"name\":\"" << b.threadName << "\"}}";
+    }
+    const uint64_t n = min<uint64_t>(b.recorded, b.events.size());
+    total += b.recorded;
+    dropped += b.recorded - n;
+    for (uint64_t i = b.recorded - n; i < b.recorded; ++i) {
+      const Event &e = b.events[i % b.events.size()];
+      const string args = ",\"args\":{\"file\":" + boost::lexical_cast<string>(e.file) + ",\"chunk\":" + boost::lexical_cast<string>(e.chunk) + "}";
+      if (e.phase == 'X') {
+        out << "," << endl << "{\"name\":\"" << e.name << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (tid + 1)
+            << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur << args << "}";
+      } else {
+        // A pair of async events, identified by the chunk
+        const string id = boost::lexical_cast<string>(((int64_t) e.file << 32) | (uint32_t) e.chunk);
+        out << "," << endl << "{\"name\":\"" << e.name << "\",\"cat\":\"wait\",\"ph\":\"b\",\"id\":" << id << ",\"pid\":1,\"tid\":" << (tid + 1)
+            << ",\"ts\":" << e.ts << args << "}"
+            << "," << endl << "{\"name\":\"" << e.name << "\",\"cat\":\"wait\",\"ph\":\"e\",\"id\":" << id << ",\"pid\":1,\"tid\":" << (tid + 1)
+            << ",\"ts\":" << (e.ts + e.dur) << "}";
+      }
+    }
+  }
+  out << endl << "]}" << endl;
+  out.close();
+  if (!out) {
+    throw runtime_error("Unable to write the trace file " + fileName);
+  }
+  DXLOG(logINFO) << "Wrote " << (total - dropped) << " trace events to " << fileName
+                 << " (" << dropped << " older ones were overwritten)";
+}
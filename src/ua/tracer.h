@@ -0,0 +1,105 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_TRACER_H
+#define UA_TRACER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * Records what happens to each chunk (--trace-file): stages performed by
+ * worker threads (read, compress, ...), and waits (in queues, or before a
+ * retry), and writes them at exit in the Chrome trace event format (JSON),
+ * which can be opened in chrome://tracing, or https://ui.perfetto.dev.
+ *
+ * Each thread records its events in a ring buffer of its own, without any
+ * locking (only its first event registers the buffer); when a buffer is
+ * full, the oldest events are overwritten. Stages are "complete" events on
+ * the track of the thread which performed them; waits are asynchronous
+ * events, shown on a track of their own per kind of wait. All the methods
+ * are cheap no-ops unless start() was called.
+ */
+class Tracer : boost::noncopyable {
+public:
+
+  Tracer();
+
+  /* Starts recording, keeping up to eventsPerThread events per thread */
+  void start(size_t eventsPerThread_);
+
+  bool isEnabled() const { return enabled; }
+
+  /* Current time, in microseconds since start() (0 if not enabled) */
+  int64_t now() const;
+
+  /* Same as now(), for time "t" */
+  int64_t toUs(const boost::posix_time::ptime &t) const;
+
+  /* Names the calling thread in the trace (e.g., "read") */
+  void setThreadName(const std::string &name);
+
+  /* Stage "name" of chunk (file, chunk), performed by the calling thread from startUs to endUs */
+  void stage(const char *name, int file, int chunk, int64_t startUs, int64_t endUs);
+
+  /* Chunk (file, chunk) waited for "name" (e.g., in a queue) from startUs to endUs */
+  void wait(const char *name, int file, int chunk, int64_t startUs, int64_t endUs);
+
+  /* Writes the events recorded so far (once the threads recording them are done with) */
+  void write(const std::string &fileName);
+
+private:
+
+  struct Event {
+    const char *name;
+    char phase; // 'X' for stages, 'b' for waits
+    int32_t file;
+    int32_t chunk;
+    int64_t ts;
+    int64_t dur;
+  };
+
+  struct ThreadBuffer {
+    std::string threadName;
+    std::vector<Event> events; // ring buffer
+    uint64_t recorded;         // events[recorded % size] is the next one to overwrite
+  };
+
+  /* Cleanup function of threadBuffer: buffers are owned by "buffers", and outlive their thread */
+  static void keepBuffer(ThreadBuffer *) {
+  }
+
+  ThreadBuffer *buffer();
+  void record(const Event &e);
+
+  bool enabled;
+  size_t eventsPerThread;
+  boost::posix_time::ptime epoch;
+
+  /* Buffer of the calling thread (owned by "buffers") */
+  boost::thread_specific_ptr<ThreadBuffer> threadBuffer;
+
+  boost::mutex buffersMutex;
+  std::vector<boost::shared_ptr<ThreadBuffer> > buffers;
+};
+
+#endif
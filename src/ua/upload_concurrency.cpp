@@ -0,0 +1,189 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "upload_concurrency.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+using namespace boost::posix_time;
+
+/* The backlog is sampled every SAMPLE_MS ms; an interval lasts at least INTERVAL_SAMPLES samples */
+static const long SAMPLE_MS = 1000;
+static const int INTERVAL_SAMPLES = 10;
+
+/* Minimum relative increase of the goodput for an increase of the limit to be kept */
+static const double MIN_GAIN = 0.05;
+
+/* Number of intervals during which the limit is not increased after a decrease */
+static const int HOLD_INTERVALS = 3;
+
+UploadConcurrency::UploadConcurrency()
+  : controller(NULL), minLimit(1), maxLimit(1), limit(1), active(0),
+    bytes(0), succeeded(0), failed(0), totalTransferMs(0), samples(0), backlogSamples(0),
+    lastGoodput(0), lastAction(HOLD), lastIncrease(0), holdIntervals(0), slowStart(true), settling(false) {
+}
+
+void UploadConcurrency::start(int minLimit_, int maxLimit_, int initialLimit, const BacklogFunction &backlog_) {
+  minLimit = minLimit_;
+  maxLimit = maxLimit_;
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    limit = max(minLimit, min(maxLimit, initialLimit));
+    active = 0;
+  }
+  backlog = backlog_;
+  DXLOG(logINFO) << "Adjusting the number of concurrent uploads between " << minLimit << " and " << maxLimit
+                 << " (starting with " << limit << ")";
+  controller = new boost::thread(boost::bind(&UploadConcurrency::run, this));
+}
+
+void UploadConcurrency::stop() {
+  if (controller == NULL) {
+    return;
+  }
+  controller->interrupt();
+  controller->join();
+  delete controller;
+  controller = NULL;
+}
+
+void UploadConcurrency::acquire() {
+  boost::unique_lock<boost::mutex> lock(mut);
+  while (active >= limit) {
+    slotReleased.wait(lock);
+  }
+  ++active;
+}
+
+void UploadConcurrency::release(bool succeeded_, int64_t bytes_, int64_t transferMs) {
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    --active;
+    if (succeeded_) {
+      ++succeeded;
+      bytes += bytes_;
+      totalTransferMs += transferMs;
+    } else {
+      ++failed;
+    }
+  }
+  slotReleased.notify_one();
+}
+
+void UploadConcurrency::cancel() {
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    --active;
+  }
+  slotReleased.notify_one();
+}
+
+int UploadConcurrency::getLimit() const {
+  boost::unique_lock<boost::mutex> lock(mut);
+  return limit;
+}
+
+void UploadConcurrency::run() {
+  try {
+    ptime intervalStart = microsec_clock::universal_time();
+    while (true) {
+      boost::this_thread::sleep(milliseconds(SAMPLE_MS));
+      const bool waiting = backlog();
+      boost::unique_lock<boost::mutex> lock(mut);
+      ++samples;
+      if (waiting) {
+        ++backlogSamples;
+      }
+      if (samples >= INTERVAL_SAMPLES && succeeded + failed >= limit) {
+        const ptime now = microsec_clock::universal_time();
+        adjust((now - intervalStart).total_milliseconds() / 1000.0);
+        intervalStart = now;
+      }
+    }
+  } catch (boost::thread_interrupted &ti) {
+  }
+}
+
+/* Called with "mut" locked, at the end of an interval of "seconds" seconds */
+void UploadConcurrency::adjust(double seconds) {
+  const double goodput = bytes / max(seconds, 0.001);
+  int newLimit = limit;
+  string reason;
+  bool measured = true;
+  if (failed > 0) {
+    newLimit = max(minLimit, limit / 2);
+    reason = "uploads failed";
+    holdIntervals = HOLD_INTERVALS;
+  } else if (settling) {
+    // Chunks started before the increase are still being uploaded: the
+    // goodput of this interval says little about the new limit
+    reason = "settling after the last increase";
+    measured = false;
+  } else if (lastAction == INCREASE && goodput < lastGoodput * (1 + MIN_GAIN)) {
+    newLimit = max(minLimit, limit - lastIncrease);
+    reason = "the last increase did not raise the goodput";
+    holdIntervals = HOLD_INTERVALS;
+  } else if (holdIntervals > 0) {
+    --holdIntervals;
+    reason = "holding after a decrease";
+  } else if (backlogSamples * 2 < samples) {
+    reason = "no chunks waiting for upload";
+  } else if (limit >= maxLimit) {
+    reason = "at the maximum";
+  } else {
+    newLimit = min(maxLimit, limit + ((slowStart) ? limit : 1));
+    reason = "chunks waiting for upload";
+  }
+
+  ostringstream msg;
+  msg << "[upload concurrency] goodput " << fixed << setprecision(2) << (goodput / (1024 * 1024)) << " MB/s, "
+      << succeeded << " uploads succeeded";
+  if (succeeded > 0) {
+    msg << " (mean transfer time " << (totalTransferMs / succeeded) << " ms)";
+  }
+  msg << ", " << failed << " failed; limit " << limit << " -> " << newLimit << ": " << reason;
+  DXLOG(logINFO) << msg.str();
+
+  settling = false;
+  if (measured) {
+    lastAction = (newLimit > limit) ? INCREASE : ((newLimit < limit) ? DECREASE : HOLD);
+    lastGoodput = goodput;
+    if (lastAction == INCREASE) {
+      lastIncrease = newLimit - limit;
+      settling = true;
+    } else if (lastAction == DECREASE) {
+      slowStart = false;
+    }
+  }
+  limit = newLimit;
+  if (lastAction == INCREASE) {
+    slotReleased.notify_all();
+  }
+
+  bytes = 0;
+  succeeded = failed = 0;
+  totalTransferMs = 0;
+  samples = backlogSamples = 0;
+}
@@ -0,0 +1,120 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_UPLOAD_CONCURRENCY_H
+#define UA_UPLOAD_CONCURRENCY_H
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+/*
+ * Adjusts the number of chunks uploaded at once (--upload-threads=auto),
+ * between a minimum and a maximum, with an AIMD controller: every
+ * interval, it compares the goodput (bytes of the chunks uploaded
+ * successfully, per second) with the previous interval's, and
+ *  - halves the limit if any upload failed (multiplicative decrease),
+ *  - takes back its last increase if that did not raise the goodput (as
+ *    measured over the second interval after it, once the chunks started
+ *    before it are done with),
+ *  - otherwise, adds one upload (additive increase), if chunks were left
+ *    waiting for one.
+ * Until the first decrease, increases double the limit rather than add one
+ * (as in TCP slow start), so that fat pipes are filled quickly. After a
+ * decrease, the limit is held for a few intervals before probing again.
+ *
+ * An interval lasts at least 10 seconds, and until as many upload attempts
+ * as the limit are over (i.e., about one per upload in progress), so that
+ * the goodput of large chunks is not measured over a handful of them.
+ *
+ * Upload threads call acquire() before taking a chunk to upload, and
+ * release() once the attempt is over.
+ */
+class UploadConcurrency : boost::noncopyable {
+public:
+
+  /* Returns true if chunks are waiting to be uploaded */
+  typedef boost::function<bool ()> BacklogFunction;
+
+  UploadConcurrency();
+
+  /* Starts the controller thread (no upload may be in progress: all slots are free) */
+  void start(int minLimit_, int maxLimit_, int initialLimit, const BacklogFunction &backlog_);
+
+  /* Interrupts, and joins, the controller thread */
+  void stop();
+
+  bool isRunning() const { return (controller != NULL); }
+
+  /* Blocks until less uploads than the current limit are in progress. An interruption point */
+  void acquire();
+
+  /*
+   * Ends an upload attempt started with acquire(), of "bytes" bytes;
+   * transferMs is the duration of its transfer
+   */
+  void release(bool succeeded, int64_t bytes, int64_t transferMs);
+
+  /* Gives back a slot taken by acquire(), without an upload attempt (e.g., when interrupted) */
+  void cancel();
+
+  int getLimit() const;
+
+private:
+
+  void run();
+  void adjust(double seconds);
+
+  enum Action {
+    HOLD,
+    INCREASE,
+    DECREASE
+  };
+
+  BacklogFunction backlog;
+  boost::thread *controller;
+
+  mutable boost::mutex mut;
+  boost::condition_variable slotReleased;
+  int minLimit;
+  int maxLimit;
+  int limit;
+  int active;
+
+  /* Measurements over the current interval */
+  int64_t bytes;
+  int succeeded;
+  int failed;
+  int64_t totalTransferMs;
+  int samples;
+  int backlogSamples;
+
+  /* Outcome of the previous interval */
+  double lastGoodput;
+  Action lastAction;
+  int lastIncrease;
+  int holdIntervals;
+
+  /* Until the first decrease, the limit is doubled rather than increased by one */
+  bool slowStart;
+
+  /* True during the interval following an increase (not measured) */
+  bool settling;
+};
+
+#endif
@@ -0,0 +1,206 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#include "uring_reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#if HAVE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "dxcpp/dxlog.h"
+
+using namespace std;
+using namespace dx;
+
+#if HAVE_IO_URING
+static int sysIoUringSetup(unsigned entries, io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysIoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+#endif
+
+UringReader::UringReader()
+  : ringFd(-1), depth(0), numInFlight(0), numToSubmit(0),
+    sqRing(NULL), sqRingSize(0), sqHead(NULL), sqTail(NULL), sqMask(NULL), sqArray(NULL), sqes(NULL), sqesSize(0),
+    cqRing(NULL), cqRingSize(0), cqHead(NULL), cqTail(NULL), cqMask(NULL), cqes(NULL), slotIov(NULL) {
+}
+
+UringReader::~UringReader() {
+  cleanup();
+}
+
+void UringReader::cleanup() {
+#if HAVE_IO_URING
+  if (sqes != NULL) munmap(sqes, sqesSize);
+  if (cqRing != NULL) munmap(cqRing, cqRingSize);
+  if (sqRing != NULL) munmap(sqRing, sqRingSize);
+  if (ringFd >= 0) close(ringFd);
+  delete [] slotIov;
+#endif
+  slotIov = NULL;
+  sqes = NULL;
+  cqRing = sqRing = NULL;
+  ringFd = -1;
+}
+
+bool UringReader::init(unsigned depth_) {
+#if HAVE_IO_URING
+  cleanup();
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = sysIoUringSetup(depth_, &p);
+  if (fd < 0) {
+    DXLOG(logWARNING) << "io_uring is not available (io_uring_setup() failed with errno=" << errno << ")";
+    return false;
+  }
+  ringFd = fd;
+
+  // The rings are mapped separately (rather than relying on IORING_FEAT_SINGLE_MMAP),
+  // which works on every kernel supporting io_uring
+  sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+  void *sq = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  void *cq = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *s = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  sqRing = (sq == MAP_FAILED) ? NULL : sq;
+  cqRing = (cq == MAP_FAILED) ? NULL : cq;
+  sqes = (s == MAP_FAILED) ? NULL : static_cast<io_uring_sqe *>(s);
+  if (sqRing == NULL || cqRing == NULL || sqes == NULL) {
+    DXLOG(logWARNING) << "io_uring is not available (mmap() of the rings failed with errno=" << errno << ")";
+    cleanup();
+    return false;
+  }
+
+  char *sqBase = static_cast<char *>(sqRing);
+  sqHead = reinterpret_cast<unsigned *>(sqBase + p.sq_off.head);
+  sqTail = reinterpret_cast<unsigned *>(sqBase + p.sq_off.tail);
+  sqMask = reinterpret_cast<unsigned *>(sqBase + p.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned *>(sqBase + p.sq_off.array);
+  char *cqBase = static_cast<char *>(cqRing);
+  cqHead = reinterpret_cast<unsigned *>(cqBase + p.cq_off.head);
+  cqTail = reinterpret_cast<unsigned *>(cqBase + p.cq_off.tail);
+  cqMask = reinterpret_cast<unsigned *>(cqBase + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cqBase + p.cq_off.cqes);
+
+  depth = depth_;
+  numInFlight = numToSubmit = 0;
+  slotIov = new iovec[depth];
+  slotUserData.assign(depth, (void *) NULL);
+  freeSlots.clear();
+  for (unsigned i = depth; i > 0; --i) {
+    freeSlots.push_back(i - 1);
+  }
+  DXLOG(logINFO) << "io_uring read engine initialized (depth = " << depth << ", sq entries = " << p.sq_entries << ")";
+  return true;
+#else
+  (void) depth_;
+  DXLOG(logWARNING) << "io_uring is not available (this build of UA does not support it)";
+  return false;
+#endif
+}
+
+void UringReader::queueRead(int fd, char *buf, size_t len, int64_t offset, void *userData) {
+#if HAVE_IO_URING
+  if (freeSlots.empty()) {
+    throw runtime_error("UringReader::queueRead(): too many reads in flight");
+  }
+  const unsigned slot = freeSlots.back();
+  freeSlots.pop_back();
+  slotIov[slot].iov_base = buf;
+  slotIov[slot].iov_len = len;
+  slotUserData[slot] = userData;
+
+  // We are the only producer of SQEs, so the tail can be read without synchronization
+  const unsigned tail = *sqTail;
+  const unsigned idx = tail & *sqMask;
+  io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  // IORING_OP_READV is used (rather than IORING_OP_READ) since it is supported since 5.1
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = (uint64_t) offset;
+  sqe->addr = (uint64_t) (uintptr_t) &slotIov[slot];
+  sqe->len = 1;
+  sqe->user_data = slot;
+  sqArray[idx] = idx;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++numToSubmit;
+  ++numInFlight;
+#else
+  (void) fd; (void) buf; (void) len; (void) offset; (void) userData;
+  throw runtime_error("UringReader::queueRead(): io_uring is not available");
+#endif
+}
+
+void UringReader::submitAndWait(unsigned minComplete) {
+#if HAVE_IO_URING
+  while (true) {
+    int ret = sysIoUringEnter(ringFd, numToSubmit, minComplete, (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+      numToSubmit -= min((unsigned) ret, numToSubmit);
+      if (numToSubmit == 0) {
+        return;
+      }
+      // Not everything was consumed by the kernel (e.g., out of memory): try again
+      continue;
+    }
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+      continue;
+    }
+    ostringstream msg;
+    msg << "io_uring_enter() failed (errno=" << errno << ")";
+    throw runtime_error(msg.str());
+  }
+#else
+  (void) minComplete;
+  throw runtime_error("UringReader::submitAndWait(): io_uring is not available");
+#endif
+}
+
+bool UringReader::popCompletion(void *&userData, int &res) {
+#if HAVE_IO_URING
+  const unsigned head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const io_uring_cqe *cqe = &cqes[head & *cqMask];
+  const unsigned slot = (unsigned) cqe->user_data;
+  res = cqe->res;
+  __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+  userData = slotUserData[slot];
+  freeSlots.push_back(slot);
+  --numInFlight;
+  return true;
+#else
+  (void) userData; (void) res;
+  return false;
+#endif
+}
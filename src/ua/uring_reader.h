@@ -0,0 +1,112 @@
+// Copyright (C) 2013-2016 DNAnexus, Inc.
+//
+// This file is part of dx-toolkit (DNAnexus platform client libraries).
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may
+//   not use this file except in compliance with the License. You may obtain a
+//   copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//   WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+//   License for the specific language governing permissions and limitations
+//   under the License.
+
+#ifndef UA_URING_READER_H
+#define UA_URING_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+/*
+ * A minimal io_uring instance (driven with raw system calls, so that we do
+ * not depend on liburing), used for keeping several reads of local files
+ * in flight from a single thread (--io-engine=io_uring).
+ *
+ * io_uring is only available if UA was built with -DHAVE_IO_URING=1 (i.e.,
+ * against Linux headers which define it), and the running kernel supports
+ * it (5.1+, and not disabled by, e.g., a seccomp profile); otherwise init()
+ * returns false, and callers are expected to use regular reads instead.
+ *
+ * An instance must only be used by one thread at a time.
+ */
+class UringReader : boost::noncopyable {
+public:
+
+  UringReader();
+  ~UringReader();
+
+  /*
+   * Sets up the ring, with room for "depth_" reads in flight. Returns false
+   * (after logging the reason) if io_uring is not available.
+   */
+  bool init(unsigned depth_);
+
+  bool isInitialized() const { return (ringFd >= 0); }
+  unsigned getDepth() const { return depth; }
+
+  /* Number of reads queued (or submitted), whose completion was not popped yet */
+  unsigned inFlight() const { return numInFlight; }
+
+  /*
+   * Queues a read of "len" bytes at "offset" of the descriptor "fd" into
+   * "buf"; "userData" is returned along with the completion. There must be
+   * room for it (i.e., inFlight() < getDepth()).
+   */
+  void queueRead(int fd, char *buf, size_t len, int64_t offset, void *userData);
+
+  /*
+   * Submits all the queued reads to the kernel, and waits until at least
+   * "minComplete" completions are available. Throws runtime_error on failure.
+   */
+  void submitAndWait(unsigned minComplete);
+
+  /*
+   * Pops a completion, if one is available: "res" is the number of bytes
+   * read (which may be less than requested), or -errno.
+   */
+  bool popCompletion(void *&userData, int &res);
+
+private:
+
+  void cleanup();
+
+  int ringFd;
+  unsigned depth;
+  unsigned numInFlight;
+
+  /* Number of SQEs queued, but not yet submitted with io_uring_enter() */
+  unsigned numToSubmit;
+
+  /* Pointers into the mmap()ed submission queue ring */
+  void *sqRing;
+  size_t sqRingSize;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  /* Pointers into the mmap()ed completion queue ring */
+  void *cqRing;
+  size_t cqRingSize;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_cqe *cqes;
+
+  /*
+   * State of each read in flight (indexed by the "user_data" of its SQE):
+   * the iovec must stay valid until the read completes on older kernels.
+   */
+  iovec *slotIov;
+  std::vector<void *> slotUserData;
+  std::vector<unsigned> freeSlots;
+};
+
+#endif